@@ -0,0 +1,469 @@
+/* Precise action engine
+ *
+ * Rather than writing the event time into a gateway schedule, the daemon
+ * switches the configured lights and groups itself. Every event with
+ * actions has an absolute CLOCK_REALTIME timerfd armed at its next
+ * occurrence, so what is left is the timer wake-up and the request to the
+ * gateway, and both are recorded.
+ *
+ * The time of each occurrence comes from the local solar calculator for
+ * that day, corrected by its difference to the time the sun source reported
+ * at the last poll, so the engine does not depend on the poll period.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <glib.h>
+#include <glib-unix.h>
+#include <gio/gio.h>
+#include <jansson.h>
+
+#include "action.h"
+#include "phoscon_client.h"
+#include "sun_client.h"
+#include "debug.h"
+
+#define SECS_PER_DAY          86400
+#define UNIX_EPOCH_JULIAN     719163     /* GDate Julian day of 1970-01-01 */
+#define MAX_CORRECTION_SECS   (30 * 60)  /* A larger difference is a bug */
+#define MAX_LOOKAHEAD_DAYS    7
+
+struct action_timer;
+
+struct action {
+  struct action_timer *timer;
+  gchar *resource;         /* e.g. "groups/1/action" */
+  gchar *body;             /* JSON state */
+};
+
+/* Timer of one sun event, shared by all of its actions */
+struct action_timer {
+  action_engine_t *ae;
+  enum sun_event ev;
+  GPtrArray *actions;
+  gint fd;
+  guint src_id;
+  gint64 due;              /* UNIX time (usecs) armed for, 0 if none */
+  gint64 last;             /* Last occurrence fired */
+  gdouble corr_secs;       /* Sun source time minus local calculation */
+};
+
+/* Action request in flight */
+struct action_fire {
+  action_engine_t *ae;
+  struct action *act;
+  gint64 due;
+};
+
+struct action_engine {
+  phoscon_client_t *pc;    /* Gateway the actions are sent to, not owned */
+  gdouble lat;
+  gdouble lon;
+  GTimeZone *tz;           /* Zone the armed times are logged in */
+  GCancellable *cancellable;
+  struct action_timer timers[SUN_EVENT_COUNT];
+  guint n_actions;
+  guint n_inflight;
+  guint fired;             /* Timer expirations */
+  gint64 wake_sum;         /* Timer latency after the event (usecs) */
+  gint64 wake_max;
+  guint acked;             /* Actions confirmed by the gateway */
+  guint failed;
+  gint64 ack_sum;          /* Confirmation latency after the event (usecs) */
+  gint64 ack_max;
+};
+
+DEFINE_GQUARK("action_engine");
+
+static void
+free_action(gpointer data)
+{
+  struct action *act = (struct action *) data;
+
+  g_free(act->resource);
+  g_free(act->body);
+  g_free(act);
+}
+
+/* Time of an event on a UTC date in seconds since the epoch */
+static gboolean
+calc_event_time(action_engine_t *ae, const GDate *date, enum sun_event ev,
+                gdouble *t)
+{
+  gdouble mins;
+
+  if (!solar_calc_sun_event(date, ae->lat, ae->lon, ev, &mins)) {
+    return FALSE;
+  }
+
+  *t = ((gdouble) g_date_get_julian(date) - UNIX_EPOCH_JULIAN) *
+       SECS_PER_DAY + mins * 60.0;
+
+  return TRUE;
+}
+
+static void
+unix_to_date(gint64 secs, GDate *date)
+{
+  g_date_clear(date, 1);
+  g_date_set_julian(date, UNIX_EPOCH_JULIAN + secs / SECS_PER_DAY);
+}
+
+/* Difference between the reported time of the event and the closest local
+ * calculation, which may be for the UTC day before or after
+ */
+static void
+update_correction(struct action_timer *at, GDateTime *reported)
+{
+  gdouble t = g_date_time_to_unix(reported) +
+              g_date_time_get_microsecond(reported) / (gdouble) G_USEC_PER_SEC;
+  gdouble corr = G_MAXDOUBLE;
+  GDate date;
+  gint i;
+
+  unix_to_date((gint64) t, &date);
+  g_date_subtract_days(&date, 1);
+  for (i = 0; i < 3; i++, g_date_add_days(&date, 1)) {
+    gdouble local;
+
+    if (calc_event_time(at->ae, &date, at->ev, &local) &&
+        fabs(t - local) < fabs(corr)) {
+      corr = t - local;
+    }
+  }
+
+  if (fabs(corr) > MAX_CORRECTION_SECS) {
+    g_warning("%s reported at a time the local calculation does not "
+              "match, not correcting", sun_client_event_name(at->ev));
+    corr = 0.0;
+  }
+  at->corr_secs = corr;
+}
+
+/* Arm the timer at the next occurrence of the event */
+static void
+arm_timer(struct action_timer *at)
+{
+  struct itimerspec its;
+  gint64 now = g_get_real_time();
+  GDate date;
+  GDateTime *utc;
+  GDateTime *dt;
+  gchar *str;
+  gint i;
+
+  memset(&its, 0, sizeof(its));
+  at->due = 0;
+  unix_to_date(now / G_USEC_PER_SEC, &date);
+  g_date_subtract_days(&date, 1);
+  for (i = 0; i <= MAX_LOOKAHEAD_DAYS; i++, g_date_add_days(&date, 1)) {
+    gdouble t;
+    gint64 due;
+
+    if (!calc_event_time(at->ae, &date, at->ev, &t)) {
+      continue;
+    }
+
+    /* An occurrence fired must not come back with a new correction */
+    due = (gint64) llround((t + at->corr_secs) * G_USEC_PER_SEC);
+    if (due > now &&
+        due - at->last > (gint64) SECS_PER_DAY / 2 * G_USEC_PER_SEC) {
+      at->due = due;
+      break;
+    }
+  }
+
+  if (!at->due) {
+    g_message("No %s within %d days, its actions wait for the next poll",
+              sun_client_event_name(at->ev), MAX_LOOKAHEAD_DAYS);
+  } else {
+    its.it_value.tv_sec = at->due / G_USEC_PER_SEC;
+    its.it_value.tv_nsec = at->due % G_USEC_PER_SEC * 1000;
+  }
+
+  if (timerfd_settime(at->fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+                      &its, NULL) < 0) {
+    g_warning("Could not arm %s timer: %s", sun_client_event_name(at->ev),
+              g_strerror(errno));
+    at->due = 0;
+    return;
+  }
+
+  if (at->due) {
+    utc = g_date_time_new_from_unix_utc(at->due / G_USEC_PER_SEC);
+    dt = g_date_time_to_timezone(utc, at->ae->tz);
+    str = g_date_time_format(dt, "%F %T");
+    g_date_time_unref(utc);
+    g_message("%u %s action(s) armed for %s.%03d %s", at->actions->len,
+              sun_client_event_name(at->ev), str,
+              (gint) (at->due % G_USEC_PER_SEC / 1000),
+              g_date_time_get_timezone_abbreviation(dt));
+    g_free(str);
+    g_date_time_unref(dt);
+  }
+}
+
+static void
+action_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  struct action_fire *af = (struct action_fire *) user_data;
+  action_engine_t *ae = af->ae;
+  gint64 late = g_get_real_time() - af->due;
+  GError *err = NULL;
+
+  ae->n_inflight--;
+  if (!phoscon_client_put_state_finish(res, &err)) {
+    ae->failed++;
+    g_warning("%s action '%s' failed: %s",
+              sun_client_event_name(af->act->timer->ev), af->act->resource,
+              GERROR_MSG(err));
+    g_clear_error(&err);
+  } else {
+    ae->acked++;
+    ae->ack_sum += late;
+    ae->ack_max = MAX(ae->ack_max, late);
+    g_message("%s action '%s' confirmed %.1f ms after the event",
+              sun_client_event_name(af->act->timer->ev), af->act->resource,
+              late / 1000.0);
+  }
+  g_free(af);
+}
+
+static gboolean
+handle_timer(gint fd, GIOCondition condition, gpointer user_data)
+{
+  struct action_timer *at = (struct action_timer *) user_data;
+  action_engine_t *ae = at->ae;
+  gint64 now = g_get_real_time();
+  guint64 n_exp;
+  guint i;
+
+  if (read(fd, &n_exp, sizeof(n_exp)) < 0) {
+    if (errno == ECANCELED) {
+      g_message("System clock changed, re-arming %s actions",
+                sun_client_event_name(at->ev));
+      arm_timer(at);
+    } else if (errno != EAGAIN) {
+      g_warning("Read %s timer failed: %s", sun_client_event_name(at->ev),
+                g_strerror(errno));
+    }
+    return G_SOURCE_CONTINUE;
+  } else if (!at->due) {
+    return G_SOURCE_CONTINUE;
+  }
+
+  ae->fired++;
+  ae->wake_sum += now - at->due;
+  ae->wake_max = MAX(ae->wake_max, now - at->due);
+  g_message("%s: firing %u action(s), %.3f ms after the event",
+            sun_client_event_name(at->ev), at->actions->len,
+            (now - at->due) / 1000.0);
+
+  for (i = 0; i < at->actions->len; i++) {
+    struct action_fire *af = g_malloc0(sizeof(*af));
+
+    af->ae = ae;
+    af->act = g_ptr_array_index(at->actions, i);
+    af->due = at->due;
+    ae->n_inflight++;
+    phoscon_client_put_state_async(ae->pc, af->act->resource, af->act->body,
+                                   ae->cancellable, action_done, af);
+  }
+
+  at->last = at->due;
+  arm_timer(at);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/**** Exposed functions begin here **************************************/
+
+action_engine_t *
+action_engine_new(phoscon_client_t *pc, gdouble lat, gdouble lon,
+                  GTimeZone *tz, GCancellable *cancellable)
+{
+  action_engine_t *ae;
+  gint ev;
+
+  ae = g_malloc0(sizeof(*ae));
+  ae->pc = pc;
+  ae->lat = lat;
+  ae->lon = lon;
+  ae->tz = g_time_zone_ref(tz);
+  ae->cancellable = cancellable ? g_object_ref(cancellable) : NULL;
+  for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+    ae->timers[ev].ae = ae;
+    ae->timers[ev].ev = ev;
+    ae->timers[ev].fd = -1;
+  }
+
+  return ae;
+}
+
+void
+action_engine_free(action_engine_t *ae)
+{
+  gint ev;
+
+  if (!ae) {
+    return;
+  }
+
+  g_assert(ae->n_inflight == 0);
+  for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+    struct action_timer *at = &ae->timers[ev];
+
+    if (at->src_id) {
+      g_source_remove(at->src_id);
+    }
+    if (at->fd >= 0) {
+      close(at->fd);
+    }
+    g_clear_pointer(&at->actions, g_ptr_array_unref);
+  }
+  g_time_zone_unref(ae->tz);
+  g_clear_object(&ae->cancellable);
+  g_free(ae);
+}
+
+/*
+ * Split an action, the resource relative to the API root followed by the
+ * JSON state to set, e.g. 'groups/1/action {"on":true}'
+ */
+gboolean
+action_parse_spec(const gchar *spec, gchar **resource, gchar **body,
+                  GError **err)
+{
+  json_error_t jerr;
+  json_t *jbody;
+  gchar *str;
+  gchar **parts;
+  gboolean ret = FALSE;
+
+  g_return_val_if_fail(spec != NULL, FALSE);
+  g_return_val_if_fail(resource != NULL && body != NULL, FALSE);
+
+  str = g_strstrip(g_strdup(spec));
+  parts = g_strsplit_set(str, " \t", 2);
+  if (!parts[0] || !*parts[0] || *parts[0] == '/' || !parts[1]) {
+    SET_GERROR(err, -1, "'%s' is not '<resource> <JSON state>'", spec);
+    goto out;
+  }
+
+  g_strstrip(parts[1]);
+  if ((jbody = json_loads(parts[1], 0, &jerr)) == NULL) {
+    SET_GERROR(err, -1, "invalid state of '%s': %s", parts[0], jerr.text);
+    goto out;
+  }
+  json_decref(jbody);
+
+  *resource = g_strdup(parts[0]);
+  *body = g_strdup(parts[1]);
+  ret = TRUE;
+  /* fall through */
+out:
+  g_strfreev(parts);
+  g_free(str);
+
+  return ret;
+}
+
+/* Add an action for an event, see action_parse_spec() for the format */
+gboolean
+action_engine_add(action_engine_t *ae, enum sun_event ev, const gchar *spec,
+                  GError **err)
+{
+  struct action_timer *at;
+  struct action *act;
+  gchar *resource;
+  gchar *body;
+
+  g_return_val_if_fail(ae != NULL, FALSE);
+  g_return_val_if_fail(ev < SUN_EVENT_COUNT, FALSE);
+  g_return_val_if_fail(spec != NULL, FALSE);
+
+  if (!action_parse_spec(spec, &resource, &body, err)) {
+    return FALSE;
+  }
+
+  at = &ae->timers[ev];
+  if (at->fd < 0) {
+    if ((at->fd = timerfd_create(CLOCK_REALTIME,
+                                 TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+      SET_GERROR(err, -1, "timerfd_create failed: %s", g_strerror(errno));
+      g_free(resource);
+      g_free(body);
+      return FALSE;
+    }
+    at->actions = g_ptr_array_new_with_free_func(free_action);
+    at->src_id = g_unix_fd_add(at->fd, G_IO_IN, handle_timer, at);
+  }
+
+  act = g_malloc0(sizeof(*act));
+  act->timer = at;
+  act->resource = resource;
+  act->body = body;
+  g_ptr_array_add(at->actions, act);
+  ae->n_actions++;
+
+  return TRUE;
+}
+
+guint
+action_engine_count(action_engine_t *ae)
+{
+  g_return_val_if_fail(ae != NULL, 0);
+
+  return ae->n_actions;
+}
+
+/* Actions still waiting for the gateway */
+gboolean
+action_engine_busy(action_engine_t *ae)
+{
+  return ae && ae->n_inflight > 0;
+}
+
+/*
+ * Take the event times of a poll, correct the local calculation with them
+ * and (re-)arm the timers of all events with actions
+ */
+void
+action_engine_update(action_engine_t *ae, GDateTime *times[SUN_EVENT_COUNT])
+{
+  gint ev;
+
+  g_return_if_fail(ae != NULL);
+
+  for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+    struct action_timer *at = &ae->timers[ev];
+
+    if (!at->actions) {
+      continue;
+    }
+
+    if (times[ev]) {
+      update_correction(at, times[ev]);
+    }
+    arm_timer(at);
+  }
+}
+
+void
+action_engine_log_stats(action_engine_t *ae)
+{
+  if (!ae || !ae->fired) {
+    return;
+  }
+
+  g_message("Actions: %u timer(s) fired, %.3f ms late on average "
+            "(max %.3f ms)", ae->fired, ae->wake_sum / 1000.0 / ae->fired,
+            ae->wake_max / 1000.0);
+  g_message("Actions: %u confirmed, %.1f ms after the event on average "
+            "(max %.1f ms), %u failed", ae->acked,
+            ae->acked ? ae->ack_sum / 1000.0 / ae->acked : 0.0,
+            ae->ack_max / 1000.0, ae->failed);
+}
@@ -0,0 +1,41 @@
+/* Switching lights and groups directly at the sun events */
+
+#ifndef ACTION_H__
+#define ACTION_H__
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "solar.h"
+#include "phoscon_client.h"
+
+typedef struct action_engine action_engine_t;
+
+gboolean
+action_parse_spec(const gchar *spec, gchar **resource, gchar **body,
+                  GError **err);
+
+action_engine_t *
+action_engine_new(phoscon_client_t *pc, gdouble lat, gdouble lon,
+                  GTimeZone *tz, GCancellable *cancellable);
+
+void
+action_engine_free(action_engine_t *ae);
+
+gboolean
+action_engine_add(action_engine_t *ae, enum sun_event ev, const gchar *spec,
+                  GError **err);
+
+guint
+action_engine_count(action_engine_t *ae);
+
+gboolean
+action_engine_busy(action_engine_t *ae);
+
+void
+action_engine_update(action_engine_t *ae, GDateTime *times[SUN_EVENT_COUNT]);
+
+void
+action_engine_log_stats(action_engine_t *ae);
+
+#endif /* ACTION_H__ */
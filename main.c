@@ -1,41 +1,113 @@
+#include <errno.h>
 #include <getopt.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
 #include <glib.h>
 #include <glib-unix.h>
+#include <gio/gio.h>
 
 #include "sun_client.h"
 #include "phoscon_client.h"
 #include "debug.h"
 #include "cfg.h"
+#include "util.h"
+#include "wake_plan.h"
+#include "tz_index.h"
+#include "action.h"
+#include "snapshot.h"
+#include "service.h"
 
 #define DEFAULT_POLL_PERIOD_SEC   3600
 #define MIN_POLL_PERIOD_SEC       10 * 60
 
-#define MAX_SUNX_IDS  10   /* Maximum number of sunset/sunrise entries */
+#define PREWARM_LEAD_SECS   15   /* Gateway connections opened before a poll */
+
+#define MAX_WAKE_DAYS       7    /* Longest sleep with an accuracy budget */
+#define WAKE_TIMELINE_LEN   5    /* Planned wake-ups shown in the log */
+#define WAKE_RETRY_SECS     5    /* Wake-up delay while another update runs */
+
+#define DEFAULT_RESYNC_PERIOD_SEC 3600   /* Schedule resync period */
+
+#define RULE_PREFIX           "sunmon "     /* Names of the managed rules */
+#define RULE_CHECK_PERIOD_SEC (6 * 3600)  /* Rule drift check period */
+
+#define IDLE_CHECK_PERIOD_SEC 10    /* Idle exit check period */
+
 
 static gchar *prog_name;
 
 struct prog_cfg {
   struct phoscon_client_cfg phoscon;
-  gdouble latitude;
-  gdouble longitude;
+  struct sun_client_cfg sun;
   guint poll_period_secs;
-  gchar *sunset_id_strs;
-  gchar *sunrise_id_strs;
-  gint sunset_ids[MAX_SUNX_IDS];
-  gint sunrise_ids[MAX_SUNX_IDS];
+  guint accuracy_secs;     /* Wake-ups planned from the events if non-zero */
+  gint resync_period_secs; /* Schedule resync period, negative disables */
+  gchar *tz_index_file;    /* Resolves the site time zone if not given */
+  gchar *state_file;       /* Snapshot restored at startup, NULL for none */
+  guint idle_exit_secs;    /* Socket activated exit when idle, 0 never */
+  gchar *event_id_strs[SUN_EVENT_COUNT];
+  GArray *event_ids[SUN_EVENT_COUNT];   /* Schedule IDs (gint) per event */
+  gchar *action_strs[SUN_EVENT_COUNT];  /* Direct actions per event */
+  gchar *action_mode;      /* "timer" (default) or "rules" */
 };
 
 struct prog_state {
   struct prog_cfg cfg;
+  phoscon_client_t *pc;
+  sun_client_t *sc;
   GMainLoop *loop;
-  GDateTime *sunset;
-  GDateTime *sunrise;
+  GCancellable *cancellable;
+  GDateTime *times[SUN_EVENT_COUNT];
+  GTimeZone *tz;           /* Time zone of the site */
+  action_engine_t *actions;
+  GArray *rules;           /* Actions as gateway rules (phoscon_rule) */
+  guint rule_src_id;
+  gboolean rule_sync_busy;
   guint poll_src_id;
+  guint prewarm_src_id;
+  guint tz_src_id;
+  gint tz_fd;              /* Timer of tz_transition, if tz_src_id */
+  guint resync_src_id;
+  gboolean resync_busy;
+  gboolean revalidating;   /* Restored schedules checked before the poll */
+  gint64 tz_transition;    /* UNIX time of the next UTC offset change */
   gulong poll_cntr;
+  gboolean poll_busy;
+  gboolean initialised;    /* Initial update done */
+  gboolean one_shot;
+  gint64 start_time;       /* Monotonic time the process started at */
+  gint64 update_start;     /* Monotonic time the initial update started */
+  guint idle_src_id;
+  gint retval;
+};
+
+struct poll_op;
+
+/* Outcome of a single schedule update */
+struct sched_update {
+  struct poll_op *op;
+  enum sun_event ev;
+  gint id;
+  GError *err;
+};
+
+/* Poll in progress, all schedule updates are issued at once and the poll
+ * completes when the last one is done
+ */
+struct poll_op {
+  struct prog_state *state;
+  GDateTime *times[SUN_EVENT_COUNT];
+  struct sched_update *updates;
+  guint n_updates;
+  guint n_pending;
+  gboolean tz_refresh;     /* Only the local times change */
 };
 
 #define POFFS(m) (offsetof(struct phoscon_client_cfg, m))
 #define GOFFS(m) (offsetof(struct prog_cfg, m))
+#define EOFFS(e) (offsetof(struct prog_cfg, event_id_strs[e]))
+#define AOFFS(e) (offsetof(struct prog_cfg, action_strs[e]))
 #define ARRAY_SIZE(a)  (sizeof(a) / sizeof(struct cfg_ent_descr))
 
 DEFINE_GQUARK("phoscon_sunmon_main");
@@ -43,78 +115,825 @@ DEFINE_GQUARK("phoscon_sunmon_main");
 const struct cfg_ent_descr phoscon_cfg_ents[] = {
   { "hostname",  CFG_TYPE_STRING, POFFS(host),        TRUE,  "Hostname of phoscon gateway" },
   { "port",      CFG_TYPE_INT,    POFFS(port),        FALSE, "Port of phoscon gateway"     },
-  { "apiKey",    CFG_TYPE_STRING, POFFS(api_key),     TRUE,  "Phoscon API key"             }
+  { "apiKey",    CFG_TYPE_STRING, POFFS(api_key),     TRUE,  "Phoscon API key"             },
+  { "maxParallel", CFG_TYPE_INT,  POFFS(max_parallel), FALSE, "Concurrent gateway requests" },
+  { "websocketPort", CFG_TYPE_INT, POFFS(ws_port),     FALSE, "Gateway event websocket port" },
+  { "websocketHost", CFG_TYPE_STRING, POFFS(ws_host),  FALSE, "Gateway event websocket host" }
 };
 
 const struct cfg_ent_descr general_cfg_ents[] = {
-  { "pollPeriod", CFG_TYPE_INT,    GOFFS(poll_period_secs), TRUE,  "Sunrise/set poll period" },
-  { "latitude",   CFG_TYPE_DOUBLE, GOFFS(latitude),         TRUE,  "Location latitude"  },
-  { "longitude",  CFG_TYPE_DOUBLE, GOFFS(longitude),        TRUE,  "Location longitude" }
+  { "pollPeriod", CFG_TYPE_INT,    GOFFS(poll_period_secs), FALSE, "Sunrise/set poll period" },
+  { "accuracyBudget", CFG_TYPE_INT, GOFFS(accuracy_secs),   FALSE, "Allowed schedule drift in seconds" },
+  { "resyncPeriod", CFG_TYPE_INT,  GOFFS(resync_period_secs), FALSE, "Schedule resync period" },
+  { "latitude",   CFG_TYPE_DOUBLE, GOFFS(sun.lat),          TRUE,  "Location latitude"  },
+  { "longitude",  CFG_TYPE_DOUBLE, GOFFS(sun.lon),          TRUE,  "Location longitude" },
+  { "timezone",   CFG_TYPE_STRING, GOFFS(phoscon.timezone), FALSE, "IANA time zone of the location" },
+  { "tzIndexFile", CFG_TYPE_STRING, GOFFS(tz_index_file),   FALSE, "Time zone index resolving the location's zone" },
+  { "stateFile",  CFG_TYPE_STRING, GOFFS(state_file),       FALSE, "State snapshot for a network free startup" },
+  { "idleExit",   CFG_TYPE_INT,    GOFFS(idle_exit_secs),   FALSE, "Seconds without control requests before a socket activated exit" },
+  { "sunSource",  CFG_TYPE_STRING, GOFFS(sun.source),       FALSE, "Sun times source (remote/local/table/gateway)" },
+  { "sunTableFile", CFG_TYPE_STRING, GOFFS(sun.table_file), FALSE, "Precomputed sun table file" },
+  { "prefetchDays", CFG_TYPE_INT,  GOFFS(sun.prefetch_days), FALSE, "Days of sun times fetched ahead" },
+  { "prefetchRefresh", CFG_TYPE_INT, GOFFS(sun.prefetch_refresh), FALSE, "Days left before refetching" },
+  { "sunProviders", CFG_TYPE_STRING, GOFFS(sun.providers), FALSE, "Sun time API servers in order of preference" },
+  { "hedgeDelay",   CFG_TYPE_INT,    GOFFS(sun.hedge_delay_ms), FALSE, "Milliseconds before asking the next server" }
 };
 
 const struct cfg_ent_descr sched_cfg_ents[] = {
-  { "sunsetID",  CFG_TYPE_VALUE, GOFFS(sunset_id_strs),  FALSE,  "Sunset schedule IDs"  },
-  { "sunriseID", CFG_TYPE_VALUE, GOFFS(sunrise_id_strs), FALSE,  "Sunrise schedule IDs" }
+  { "sunsetID",           CFG_TYPE_VALUE, EOFFS(SUN_EVENT_SUNSET),        FALSE, "Sunset schedule IDs"  },
+  { "sunriseID",          CFG_TYPE_VALUE, EOFFS(SUN_EVENT_SUNRISE),       FALSE, "Sunrise schedule IDs" },
+  { "solarNoonID",        CFG_TYPE_VALUE, EOFFS(SUN_EVENT_SOLAR_NOON),    FALSE, "Solar noon schedule IDs" },
+  { "civilDawnID",        CFG_TYPE_VALUE, EOFFS(SUN_EVENT_CIVIL_DAWN),    FALSE, "Civil dawn schedule IDs" },
+  { "civilDuskID",        CFG_TYPE_VALUE, EOFFS(SUN_EVENT_CIVIL_DUSK),    FALSE, "Civil dusk schedule IDs" },
+  { "nauticalDawnID",     CFG_TYPE_VALUE, EOFFS(SUN_EVENT_NAUTICAL_DAWN), FALSE, "Nautical dawn schedule IDs" },
+  { "nauticalDuskID",     CFG_TYPE_VALUE, EOFFS(SUN_EVENT_NAUTICAL_DUSK), FALSE, "Nautical dusk schedule IDs" },
+  { "astronomicalDawnID", CFG_TYPE_VALUE, EOFFS(SUN_EVENT_ASTRO_DAWN),    FALSE, "Astronomical dawn schedule IDs" },
+  { "astronomicalDuskID", CFG_TYPE_VALUE, EOFFS(SUN_EVENT_ASTRO_DUSK),    FALSE, "Astronomical dusk schedule IDs" }
+};
+
+const struct cfg_ent_descr action_cfg_ents[] = {
+  { "mode",                   CFG_TYPE_STRING, GOFFS(action_mode),             FALSE, "Action mode (timer/rules)" },
+  { "sunsetAction",           CFG_TYPE_STRING, AOFFS(SUN_EVENT_SUNSET),        FALSE, "Sunset actions"  },
+  { "sunriseAction",          CFG_TYPE_STRING, AOFFS(SUN_EVENT_SUNRISE),       FALSE, "Sunrise actions" },
+  { "solarNoonAction",        CFG_TYPE_STRING, AOFFS(SUN_EVENT_SOLAR_NOON),    FALSE, "Solar noon actions" },
+  { "civilDawnAction",        CFG_TYPE_STRING, AOFFS(SUN_EVENT_CIVIL_DAWN),    FALSE, "Civil dawn actions" },
+  { "civilDuskAction",        CFG_TYPE_STRING, AOFFS(SUN_EVENT_CIVIL_DUSK),    FALSE, "Civil dusk actions" },
+  { "nauticalDawnAction",     CFG_TYPE_STRING, AOFFS(SUN_EVENT_NAUTICAL_DAWN), FALSE, "Nautical dawn actions" },
+  { "nauticalDuskAction",     CFG_TYPE_STRING, AOFFS(SUN_EVENT_NAUTICAL_DUSK), FALSE, "Nautical dusk actions" },
+  { "astronomicalDawnAction", CFG_TYPE_STRING, AOFFS(SUN_EVENT_ASTRO_DAWN),    FALSE, "Astronomical dawn actions" },
+  { "astronomicalDuskAction", CFG_TYPE_STRING, AOFFS(SUN_EVENT_ASTRO_DUSK),    FALSE, "Astronomical dusk actions" }
 };
 
 static gboolean
-fetch_and_update_sun_times(struct prog_state *state, GError **err)
+event_is_bound(const struct prog_cfg *cfg, enum sun_event ev)
 {
-  struct prog_cfg *cfg;
-  GDateTime *srt = NULL;
-  GDateTime *sst = NULL;
-  gboolean ret = FALSE;
-  gint i;
+  return cfg->event_ids[ev] && cfg->event_ids[ev]->len > 0;
+}
 
-  g_assert(state);
+static gboolean handle_poll_timeout(gpointer data);
+static void start_poll(struct prog_state *state);
+static void schedule_tz_refresh(struct prog_state *state);
+static gboolean handle_resync_timeout(gpointer data);
+static void save_snapshot(struct prog_state *state);
 
-  cfg = &state->cfg;
+/* Log how long a startup phase took, returns the time the next one starts */
+static gint64
+log_phase(const gchar *phase, gint64 since)
+{
+  gint64 now = g_get_monotonic_time();
 
-  /* Fetch the times */
-  if (!sun_client_lookup(&srt, &sst, err)) {
+  g_message("Startup: %s took %.1f ms", phase, (now - since) / 1000.0);
+
+  return now;
+}
+
+static guint
+count_bound_schedules(const struct prog_cfg *cfg)
+{
+  guint n = 0;
+  gint ev;
+
+  for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+    if (event_is_bound(cfg, ev)) {
+      n += cfg->event_ids[ev]->len;
+    }
+  }
+
+  return n;
+}
+
+static gboolean
+handle_prewarm_timeout(gpointer data)
+{
+  struct prog_state *state = (struct prog_state *) data;
+
+  state->prewarm_src_id = 0;
+  phoscon_client_prewarm(state->pc,
+                         MAX(count_bound_schedules(&state->cfg), 1));
+
+  return FALSE;
+}
+
+/* Open the gateway connections shortly before the next poll, due in secs
+ * seconds, so the updates do not pay for connection setup
+ */
+static void
+schedule_prewarm(struct prog_state *state, guint secs)
+{
+  if (state->prewarm_src_id) {
+    g_source_remove(state->prewarm_src_id);
+    state->prewarm_src_id = 0;
+  }
+  if (secs > PREWARM_LEAD_SECS) {
+    state->prewarm_src_id = g_timeout_add_seconds(secs - PREWARM_LEAD_SECS,
+                                                  handle_prewarm_timeout,
+                                                  state);
+  }
+}
+
+static gboolean
+handle_wake_timeout(gpointer data)
+{
+  struct prog_state *state = (struct prog_state *) data;
+
+  if (state->poll_busy) {
+    /* A local time refresh is still running, poll once it is done */
+    state->poll_src_id = g_timeout_add_seconds(WAKE_RETRY_SECS,
+                                               handle_wake_timeout, state);
     return FALSE;
   }
 
-  if (state->sunrise) {
-    sun_client_print_tdiff(state->sunrise, srt, "sunrise");
+  state->poll_src_id = 0;
+  start_poll(state);
+
+  return FALSE;
+}
+
+/* Arm the next poll for the first day the schedules drift beyond the
+ * accuracy budget, a failed poll is retried after the minimum poll period
+ */
+static void
+schedule_wake(struct prog_state *state, gboolean failed)
+{
+  struct prog_cfg *cfg = &state->cfg;
+  struct wake_plan_cfg wcfg = {
+    .lat = cfg->sun.lat,
+    .lon = cfg->sun.lon,
+    .accuracy_secs = cfg->accuracy_secs,
+    .max_days = MAX_WAKE_DAYS,
+    .tz = state->tz,
+  };
+  GDateTime *now;
+  GDateTime *wake;
+  gchar *timeline;
+  GTimeSpan delay;
+  guint secs;
+  gint ev;
+
+  if (state->poll_src_id) {
+    g_source_remove(state->poll_src_id);
   }
-  if (state->sunset) {
-    sun_client_print_tdiff(state->sunset, sst, "sunset");
+
+  if (failed) {
+    secs = MIN_POLL_PERIOD_SEC;
+    g_message("Retrying poll in %u seconds", secs);
+  } else {
+    for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+      wcfg.events[ev] = event_is_bound(cfg, ev);
+    }
+
+    now = g_date_time_new_now_local();
+    wake = wake_plan_next(&wcfg, now, NULL);
+    delay = g_date_time_difference(wake, now);
+    secs = (guint) ((delay + G_TIME_SPAN_SECOND - 1) / G_TIME_SPAN_SECOND);
+
+    timeline = wake_plan_timeline(&wcfg, now, WAKE_TIMELINE_LEN);
+    g_message("Planned wake-ups (accuracy %u seconds): %s",
+              cfg->accuracy_secs, timeline);
+    g_free(timeline);
+    g_date_time_unref(wake);
+    g_date_time_unref(now);
+  }
+
+  state->poll_src_id = g_timeout_add_seconds(secs, handle_wake_timeout,
+                                             state);
+  schedule_prewarm(state, secs);
+}
+
+static void
+free_poll_op(struct poll_op *op)
+{
+  guint i;
+  gint ev;
+
+  for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+    g_clear_pointer(&op->times[ev], g_date_time_unref);
+  }
+  for (i = 0; i < op->n_updates; i++) {
+    g_clear_error(&op->updates[i].err);
+  }
+  g_free(op->updates);
+  g_free(op);
+}
+
+static void
+poll_finish(struct prog_state *state, struct poll_op *op, GError *err)
+{
+  struct prog_cfg *cfg = &state->cfg;
+  gboolean tz_refresh = op->tz_refresh;
+  gint ev;
+
+  if (!err && !tz_refresh) {
+    for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+      g_clear_pointer(&state->times[ev], g_date_time_unref);
+      state->times[ev] = g_steal_pointer(&op->times[ev]);
+    }
+    if (state->actions) {
+      action_engine_update(state->actions, state->times);
+    }
+  }
+  free_poll_op(op);
+  state->poll_busy = FALSE;
+  if (!err) {
+    save_snapshot(state);
   }
 
-  for (i = 0; i < MAX_SUNX_IDS; i++) {
-    if (cfg->sunrise_ids[i] < 0) {
+  if (tz_refresh) {
+    if (err) {
+      g_warning("Local time refresh failed: %s", GERROR_MSG(err));
+    }
+    schedule_tz_refresh(state);
+  } else if (state->initialised) {
+    if (err) {
+      g_warning("Poll update #%lu failed: %s",
+                state->poll_cntr, GERROR_MSG(err));
+      service_notify_status("Last update failed");
+    } else {
+      service_notify_status("Schedules up to date");
+    }
+    state->poll_cntr++;
+    if (cfg->accuracy_secs) {
+      schedule_wake(state, err != NULL);
+    }
+  } else if (err) {
+    g_printerr("Perform initial update failed: %s\n", GERROR_MSG(err));
+    g_main_loop_quit(state->loop);
+  } else if (state->one_shot) {
+    /* We are doneskys */
+    log_phase("initial update", state->update_start);
+    g_message("One-shot mode, exit with success code");
+    state->retval = EXIT_SUCCESS;
+    g_main_loop_quit(state->loop);
+  } else {
+    log_phase("initial update", state->update_start);
+    state->initialised = TRUE;
+    state->retval = EXIT_SUCCESS;
+    service_notify_ready(state->start_time, "Schedules up to date");
+    schedule_tz_refresh(state);
+    if (cfg->resync_period_secs > 0 && count_bound_schedules(cfg)) {
+      state->resync_src_id = g_timeout_add_seconds(cfg->resync_period_secs,
+                                                   handle_resync_timeout,
+                                                   state);
+    }
+    if (cfg->accuracy_secs) {
+      schedule_wake(state, FALSE);
+    } else {
+      g_message("Sunrise/sunset poll period is %u seconds",
+                cfg->poll_period_secs);
+      state->poll_src_id = g_timeout_add_seconds(cfg->poll_period_secs,
+                                                 handle_poll_timeout, state);
+      schedule_prewarm(state, cfg->poll_period_secs);
+    }
+  }
+
+  g_clear_error(&err);
+}
+
+/* Report every schedule update, the poll fails if any of them did */
+static void
+poll_updates_done(struct poll_op *op)
+{
+  GError *err = NULL;
+  guint n_failed = 0;
+  guint i;
+
+  for (i = 0; i < op->n_updates; i++) {
+    struct sched_update *upd = &op->updates[i];
+
+    if (upd->err) {
+      g_warning("Update %s schedule ID=%d failed: %s",
+                sun_client_event_name(upd->ev), upd->id,
+                GERROR_MSG(upd->err));
+      n_failed++;
+    } else {
+      g_debug("Update %s schedule ID=%d done",
+              sun_client_event_name(upd->ev), upd->id);
+    }
+  }
+
+  g_message("Updated %u of %u schedule(s)", op->n_updates - n_failed,
+            op->n_updates);
+  if (n_failed) {
+    SET_GERROR(&err, -1, "%u of %u schedule update(s) failed", n_failed,
+               op->n_updates);
+  }
+
+  poll_finish(op->state, op, err);
+}
+
+static void
+poll_update_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  struct sched_update *upd = (struct sched_update *) user_data;
+  struct poll_op *op = upd->op;
+
+  phoscon_client_update_schedule_time_finish(res, &upd->err);
+
+  g_assert(op->n_pending > 0);
+  if (--op->n_pending == 0) {
+    poll_updates_done(op);
+  }
+}
+
+/* Issue the updates of all bound schedules concurrently, the phoscon
+ * client bounds how many are in flight. Events falling on the same instant
+ * form one group whose time is formatted only once.
+ */
+static void
+poll_update_all(struct poll_op *op)
+{
+  struct prog_cfg *cfg = &op->state->cfg;
+  struct phoscon_sched_time fmts[SUN_EVENT_COUNT];
+  gint group[SUN_EVENT_COUNT];
+  guint n = 0;
+  guint i;
+  gint ev;
+  gint g;
+
+  for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+    if (!op->times[ev] || !event_is_bound(cfg, ev)) {
       continue;
-    } else if (!phoscon_client_update_schedule_time(cfg->sunrise_ids[i],
-                                                    srt, err)) {
-      g_prefix_error(err, "update sunrise schedule ID=%d: ",
-                     cfg->sunrise_ids[i]);
-      goto out;
     }
+
+    group[ev] = ev;
+    for (g = 0; g < ev; g++) {
+      if (op->times[g] && event_is_bound(cfg, g) &&
+          g_date_time_equal(op->times[g], op->times[ev])) {
+        group[ev] = group[g];
+        break;
+      }
+    }
+    if (group[ev] == ev) {
+      phoscon_client_format_time(op->state->pc, op->times[ev], &fmts[ev]);
+    }
+    n += cfg->event_ids[ev]->len;
   }
 
-  for (i = 0; i < MAX_SUNX_IDS; i++) {
-    if (cfg->sunset_ids[i] < 0) {
+  if (n == 0) {
+    poll_finish(op->state, op, NULL);
+    return;
+  }
+
+  op->updates = g_new0(struct sched_update, n);
+  for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+    if (!op->times[ev] || !event_is_bound(cfg, ev)) {
       continue;
-    } else if (!phoscon_client_update_schedule_time(cfg->sunset_ids[i],
-                                                    sst, err)) {
-      g_prefix_error(err, "update sunset schedule ID=%d: ",
-                     cfg->sunset_ids[i]);
-      goto out;
+    }
+
+    for (i = 0; i < cfg->event_ids[ev]->len; i++) {
+      struct sched_update *upd = &op->updates[op->n_updates++];
+
+      upd->op = op;
+      upd->ev = ev;
+      upd->id = g_array_index(cfg->event_ids[ev], gint, i);
     }
   }
 
-  ret = TRUE;
-  g_clear_pointer(&state->sunrise, g_date_time_unref);
-  g_clear_pointer(&state->sunset, g_date_time_unref);
-  state->sunrise = g_date_time_ref(srt);
-  state->sunset = g_date_time_ref(sst);
+  /* Count them all first, a completion must not finish the poll early */
+  op->n_pending = op->n_updates;
+  for (i = 0; i < op->n_updates; i++) {
+    struct sched_update *upd = &op->updates[i];
 
-out:
-  g_date_time_unref(srt);
-  g_date_time_unref(sst);
+    phoscon_client_update_schedule_time_async(op->state->pc, upd->id,
+                                              &fmts[group[upd->ev]],
+                                              op->state->cancellable,
+                                              poll_update_done, upd);
+  }
+}
 
-  return ret;
+static void
+poll_lookup_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  struct prog_state *state = (struct prog_state *) user_data;
+  struct prog_cfg *cfg = &state->cfg;
+  struct poll_op *op;
+  GError *err = NULL;
+  gint ev;
+
+  op = g_malloc0(sizeof(*op));
+  op->state = state;
+
+  /* Fetch the times */
+  if (!sun_client_lookup_events_finish(state->sc, res, op->times, &err)) {
+    poll_finish(state, op, err);
+    return;
+  }
+
+  for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+    if (!event_is_bound(cfg, ev)) {
+      continue;
+    } else if (!op->times[ev]) {
+      g_warning("No %s today, its schedules will not be updated",
+                sun_client_event_name(ev));
+    } else if (state->times[ev]) {
+      sun_client_print_tdiff(state->times[ev], op->times[ev],
+                             sun_client_event_name(ev));
+    }
+  }
+
+  poll_update_all(op);
+}
+
+/* Fetch the sun times and update the schedules without blocking the main
+ * loop, the outcome is handled by poll_finish()
+ */
+static void
+start_poll(struct prog_state *state)
+{
+  g_assert(state);
+
+  if (state->poll_busy) {
+    g_warning("Previous poll still in progress, skipping poll");
+    return;
+  }
+
+  state->poll_busy = TRUE;
+  sun_client_lookup_events_async(state->sc, state->cancellable,
+                                 poll_lookup_done, state);
+}
+
+/* Push the local times of all schedules once the UTC offset changed, the
+ * last times are moved to their first occurrence after the change
+ */
+static void
+start_tz_refresh(struct prog_state *state)
+{
+  struct prog_cfg *cfg = &state->cfg;
+  struct poll_op *op;
+  gint ev;
+
+  if (state->poll_busy) {
+    g_message("Poll in progress, it will update the local times");
+    schedule_tz_refresh(state);
+    return;
+  }
+
+  op = g_malloc0(sizeof(*op));
+  op->state = state;
+  op->tz_refresh = TRUE;
+
+  for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+    GDateTime *t;
+
+    if (!state->times[ev] || !event_is_bound(cfg, ev)) {
+      continue;
+    }
+
+    t = g_date_time_to_utc(state->times[ev]);
+    while (g_date_time_to_unix(t) < state->tz_transition) {
+      GDateTime *next = g_date_time_add_days(t, 1);
+
+      g_date_time_unref(t);
+      t = next;
+    }
+    op->times[ev] = t;
+  }
+
+  state->poll_busy = TRUE;
+  poll_update_all(op);
+}
+
+static gboolean
+handle_tz_timer(gint fd, GIOCondition condition, gpointer user_data)
+{
+  struct prog_state *state = (struct prog_state *) user_data;
+  guint64 n_exp;
+
+  if (read(fd, &n_exp, sizeof(n_exp)) < 0) {
+    if (errno == ECANCELED) {
+      g_message("System clock changed, re-arming the UTC offset change");
+      schedule_tz_refresh(state);
+    } else if (errno != EAGAIN) {
+      g_warning("Read UTC offset timer failed: %s", g_strerror(errno));
+    }
+    return G_SOURCE_CONTINUE;
+  }
+
+  g_message("UTC offset changed, refreshing local schedule times");
+  start_tz_refresh(state);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Wake up at the next UTC offset change (DST switch), so the local times of
+ * the schedules are right from that moment on rather than from the next poll.
+ * The timer is absolute on the system clock, like the ones of the actions,
+ * so neither a suspend nor a clock step moves the wake-up off the change.
+ */
+static void
+schedule_tz_refresh(struct prog_state *state)
+{
+  gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+  struct itimerspec its;
+  GDateTime *utc;
+  GDateTime *dt;
+  gchar *str;
+
+  if (!state->tz_src_id) {
+    if ((state->tz_fd = timerfd_create(CLOCK_REALTIME,
+                                       TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+      g_warning("Could not create UTC offset timer: %s", g_strerror(errno));
+      return;
+    }
+    state->tz_src_id = g_unix_fd_add(state->tz_fd, G_IO_IN, handle_tz_timer,
+                                     state);
+  }
+
+  memset(&its, 0, sizeof(its));
+  if (!phoscon_client_next_tz_transition(state->pc, now,
+                                         &state->tz_transition)) {
+    g_debug("No UTC offset change within a year");
+    state->tz_transition = 0;
+    timerfd_settime(state->tz_fd, TFD_TIMER_ABSTIME, &its, NULL);
+    return;
+  }
+
+  utc = g_date_time_new_from_unix_utc(state->tz_transition);
+  dt = g_date_time_to_timezone(utc, state->tz);
+  str = g_date_time_format(dt, "%F %T %Z");
+  g_message("Next UTC offset change at %s", str);
+  g_free(str);
+  g_date_time_unref(dt);
+  g_date_time_unref(utc);
+
+  its.it_value.tv_sec = state->tz_transition;
+  if (timerfd_settime(state->tz_fd,
+                      TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its,
+                      NULL) < 0) {
+    g_warning("Could not arm UTC offset timer: %s", g_strerror(errno));
+  }
+}
+
+static void
+resync_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  struct prog_state *state = (struct prog_state *) user_data;
+  struct phoscon_resync_stats stats = { 0, };
+  GError *err = NULL;
+
+  state->resync_busy = FALSE;
+  if (!phoscon_client_resync_schedules_finish(res, &stats, &err)) {
+    g_warning("Schedule resync failed: %s", GERROR_MSG(err));
+    g_clear_error(&err);
+  }
+
+  g_message("Schedule resync: %u fetched, %u skipped, %u updated, "
+            "%u deferred, %u failed", stats.fetched, stats.skipped,
+            stats.updated, stats.deferred, stats.failed);
+  if (state->revalidating) {
+    /* The poll writes only what the gateway disagrees with */
+    state->revalidating = FALSE;
+    if (!g_cancellable_is_cancelled(state->cancellable)) {
+      start_poll(state);
+    }
+  } else if (stats.updated) {
+    save_snapshot(state);
+  }
+}
+
+/* Read the bound schedules again, so edits made in the Phoscon app do not
+ * leave the cached times (and the no update needed check) stale
+ */
+static void
+start_resync(struct prog_state *state)
+{
+  struct prog_cfg *cfg = &state->cfg;
+  GArray *ids;
+  guint i;
+  guint j;
+  gint ev;
+
+  /* A schedule may be bound to several events, fetch it once */
+  ids = g_array_new(FALSE, FALSE, sizeof(gint));
+  for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+    if (!event_is_bound(cfg, ev)) {
+      continue;
+    }
+
+    for (i = 0; i < cfg->event_ids[ev]->len; i++) {
+      gint id = g_array_index(cfg->event_ids[ev], gint, i);
+
+      for (j = 0; j < ids->len; j++) {
+        if (g_array_index(ids, gint, j) == id) {
+          break;
+        }
+      }
+      if (j == ids->len) {
+        g_array_append_val(ids, id);
+      }
+    }
+  }
+
+  state->resync_busy = TRUE;
+  phoscon_client_resync_schedules_async(state->pc, (const gint *) ids->data,
+                                        ids->len, state->cancellable,
+                                        resync_done, state);
+  g_array_unref(ids);
+}
+
+static gboolean
+handle_resync_timeout(gpointer data)
+{
+  struct prog_state *state = (struct prog_state *) data;
+
+  if (state->resync_busy) {
+    g_warning("Previous schedule resync still in progress, skipping");
+  } else {
+    start_resync(state);
+  }
+
+  return TRUE;
+}
+
+static gchar *
+gateway_ident(const struct prog_cfg *cfg)
+{
+  return g_strdup_printf("%s:%u", cfg->phoscon.host, cfg->phoscon.port);
+}
+
+/* Save what a restart needs to skip the gateway and sun time lookups */
+static void
+save_snapshot(struct prog_state *state)
+{
+  struct prog_cfg *cfg = &state->cfg;
+  struct snapshot snap = { 0, };
+  gchar *gateway;
+  GError *err = NULL;
+  GList *res = NULL;
+  GList *node;
+
+  if (!cfg->state_file) {
+    return;
+  }
+
+  gateway = gateway_ident(cfg);
+  snap.saved = g_get_real_time() / G_USEC_PER_SEC;
+  snap.lat = cfg->sun.lat;
+  snap.lon = cfg->sun.lon;
+  snap.gateway = gateway;
+  snap.days = sun_client_get_days(state->sc);
+  snap.scheds = g_array_new(FALSE, FALSE,
+                            sizeof(struct phoscon_schedule_ent));
+  phoscon_client_list_all_schedules(state->pc, &res);
+  for (node = res; node; node = node->next) {
+    g_array_append_vals(snap.scheds, node->data, 1);
+  }
+
+  if (!snapshot_save(cfg->state_file, &snap, &err)) {
+    g_warning("Could not save the state snapshot: %s", GERROR_MSG(err));
+    g_clear_error(&err);
+  }
+
+  g_list_free(res);
+  g_array_unref(snap.scheds);
+  g_array_unref(snap.days);
+  g_free(gateway);
+}
+
+/* Load the snapshot and restore the schedules from it if it was saved for
+ * this site and gateway. Returns the snapshot if they were restored, its
+ * sun days are restored later.
+ */
+static struct snapshot *
+restore_schedules(struct prog_state *state)
+{
+  struct prog_cfg *cfg = &state->cfg;
+  struct snapshot *snap;
+  GError *err = NULL;
+  gchar *gateway;
+
+  if ((snap = snapshot_load(cfg->state_file, &err)) == NULL) {
+    g_message("No usable state snapshot: %s", GERROR_MSG(err));
+    g_clear_error(&err);
+    return NULL;
+  }
+
+  gateway = gateway_ident(cfg);
+  if (snap->lat != cfg->sun.lat || snap->lon != cfg->sun.lon ||
+      g_strcmp0(snap->gateway, gateway) != 0) {
+    g_message("State snapshot is for another site or gateway, ignoring");
+    g_clear_pointer(&snap, snapshot_free);
+  } else if ((state->pc = phoscon_client_restore(&cfg->phoscon,
+                                     (const struct phoscon_schedule_ent *)
+                                     snap->scheds->data, snap->scheds->len,
+                                     &err)) == NULL) {
+    g_message("Could not restore from state snapshot: %s", GERROR_MSG(err));
+    g_clear_error(&err);
+    g_clear_pointer(&snap, snapshot_free);
+  }
+  g_free(gateway);
+
+  return snap;
+}
+
+/* Client initialisation in progress, the first failure is kept */
+struct init_op {
+  struct prog_state *state;
+  struct snapshot *snap;
+  gboolean sun_deferred;   /* Sun client waits for the phoscon client */
+  guint pending;
+  gint64 start;
+  GError *err;
+};
+
+static void
+init_failed(struct init_op *op, GError *err, const gchar *client)
+{
+  g_prefix_error(&err, "%s client: ", client);
+  if (op->err) {
+    g_warning("Could not initialise %s", GERROR_MSG(err));
+    g_error_free(err);
+  } else {
+    op->err = err;
+  }
+}
+
+static void
+sun_init_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  struct init_op *op = (struct init_op *) user_data;
+  GError *err = NULL;
+
+  op->pending--;
+  if ((op->state->sc = sun_client_restore_finish(res, &err)) == NULL) {
+    init_failed(op, err, "sunrise/set");
+  } else {
+    g_message("Startup: sun client ready after %.1f ms",
+              (g_get_monotonic_time() - op->start) / 1000.0);
+  }
+}
+
+static void
+start_sun_init(struct init_op *op)
+{
+  struct prog_cfg *cfg = &op->state->cfg;
+  struct snapshot *snap = op->snap;
+
+  op->pending++;
+  cfg->sun.gateway = op->state->pc;
+  cfg->sun.tz = op->state->tz;
+  sun_client_restore_async(&cfg->sun,
+                           snap ? (const struct sun_day *) snap->days->data :
+                                  NULL,
+                           snap ? snap->days->len : 0,
+                           NULL, sun_init_done, op);
+}
+
+static void
+phoscon_init_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  struct init_op *op = (struct init_op *) user_data;
+  GError *err = NULL;
+
+  op->pending--;
+  if ((op->state->pc = phoscon_client_new_finish(res, &err)) == NULL) {
+    init_failed(op, err, "phoscon");
+    return;
+  }
+
+  g_message("Startup: phoscon client ready after %.1f ms",
+            (g_get_monotonic_time() - op->start) / 1000.0);
+  if (op->sun_deferred) {
+    start_sun_init(op);
+  }
+}
+
+/*
+ * Initialise the phoscon client (unless restored from the snapshot) and
+ * the sun client at the same time, both lookups run on the main context
+ * and are joined here. Only a sun source reading the gateway has to wait
+ * for the phoscon client.
+ */
+static gboolean
+init_clients(struct prog_state *state, struct snapshot *snap,
+             gboolean need_sun, GError **err)
+{
+  struct prog_cfg *cfg = &state->cfg;
+  struct init_op op = { 0, };
+
+  op.state = state;
+  op.snap = snap;
+  op.start = g_get_monotonic_time();
+
+  if (!snap) {
+    op.pending++;
+    op.sun_deferred = need_sun && sun_client_needs_gateway(&cfg->sun);
+    phoscon_client_new_async(&cfg->phoscon, NULL, phoscon_init_done, &op);
+  }
+  if (need_sun && !op.sun_deferred) {
+    start_sun_init(&op);
+  }
+
+  while (op.pending) {
+    g_main_context_iteration(NULL, TRUE);
+  }
+
+  if (op.err) {
+    g_propagate_error(err, op.err);
+    return FALSE;
+  }
+
+  return TRUE;
 }
 
 static gboolean
@@ -123,6 +942,7 @@ handle_sigint(gpointer data)
   struct prog_state *state = (struct prog_state *) data;
 
   g_message("Caught signal, shutting down");
+  g_cancellable_cancel(state->cancellable);
   g_main_loop_quit(state->loop);
 
   return FALSE;
@@ -131,33 +951,130 @@ handle_sigint(gpointer data)
 static gboolean
 handle_poll_timeout(gpointer data)
 {
-  GError *err = NULL;
   struct prog_state *state = (struct prog_state *) data;
 
-  if (!fetch_and_update_sun_times(state, &err)) {
-    g_warning("Poll update #%lu failed: %s",
-              state->poll_cntr, GERROR_MSG(err));
-    g_clear_error(&err);
-  }
-
-  state->poll_cntr++;
+  start_poll(state);
+  schedule_prewarm(state, state->cfg.poll_period_secs);
 
   /* As this is glib callback, always return TRUE */
   return TRUE;
 }
 
+/* Control socket command, "status" or "poll" */
+static gchar *
+handle_control_cmd(const gchar *cmd, gpointer user_data)
+{
+  struct prog_state *state = (struct prog_state *) user_data;
+  GString *reply;
+  gint ev;
+
+  if (g_strcmp0(cmd, "poll") == 0) {
+    if (!state->initialised || state->poll_busy) {
+      return g_strdup("busy");
+    }
+    start_poll(state);
+    return g_strdup("ok");
+  } else if (g_strcmp0(cmd, "status") != 0) {
+    return g_strdup_printf("error: unknown command '%s'", cmd);
+  }
+
+  reply = g_string_new(NULL);
+  g_string_append_printf(reply, "initialised: %s\npolls: %lu\n",
+                         state->initialised ? "yes" : "no", state->poll_cntr);
+  for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+    gchar *str;
+
+    if (!state->times[ev]) {
+      continue;
+    }
+    str = g_date_time_format(state->times[ev], "%F %T %Z");
+    g_string_append_printf(reply, "%s: %s\n", sun_client_event_name(ev), str);
+    g_free(str);
+  }
+  g_string_truncate(reply, reply->len - 1);
+
+  return g_string_free(reply, FALSE);
+}
+
+/* Seconds until the first of the poll, resync, rule check and UTC offset
+ * refresh timers is due, G_MAXINT64 if none is armed
+ */
+static gint64
+next_timer_secs(struct prog_state *state)
+{
+  guint src_ids[] = {
+    state->poll_src_id, state->resync_src_id, state->rule_src_id,
+  };
+  gint64 mono = g_get_monotonic_time();
+  gint64 next = G_MAXINT64;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS(src_ids); i++) {
+    GSource *src;
+    gint64 ready;
+
+    if (!src_ids[i] ||
+        !(src = g_main_context_find_source_by_id(NULL, src_ids[i])) ||
+        (ready = g_source_get_ready_time(src)) < 0) {
+      continue;
+    }
+    next = MIN(next, (ready - mono) / G_USEC_PER_SEC);
+  }
+  if (state->tz_src_id && state->tz_transition) {
+    next = MIN(next, state->tz_transition - g_get_real_time() / G_USEC_PER_SEC);
+  }
+
+  return next;
+}
+
+/* systemd holds the control socket, the next request starts us again. A
+ * timer due within the idle period keeps us running, later ones are left
+ * to the restart, which polls and arms them anew.
+ */
+static gboolean
+handle_idle_check(gpointer data)
+{
+  struct prog_state *state = (struct prog_state *) data;
+
+  if (!state->initialised || state->poll_busy || state->resync_busy ||
+      state->rule_sync_busy ||
+      !service_control_idle(state->cfg.idle_exit_secs) ||
+      next_timer_secs(state) <= state->cfg.idle_exit_secs) {
+    return TRUE;
+  }
+
+  g_message("Control socket idle for %u seconds, exiting",
+            state->cfg.idle_exit_secs);
+  state->idle_src_id = 0;
+  g_main_loop_quit(state->loop);
+
+  return FALSE;
+}
+
 static void
 clear_prog_cfg(struct prog_cfg *cfg)
 {
   struct phoscon_client_cfg *pclient;
+  gint ev;
 
   g_assert(cfg);
 
   pclient = &cfg->phoscon;
   g_free(pclient->host);
   g_free(pclient->api_key);
-  g_free(cfg->sunrise_id_strs);
-  g_free(cfg->sunset_id_strs);
+  g_free(pclient->timezone);
+  g_free(pclient->ws_host);
+  g_free(cfg->tz_index_file);
+  g_free(cfg->state_file);
+  g_free(cfg->sun.source);
+  g_free(cfg->sun.table_file);
+  g_free(cfg->sun.providers);
+  for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+    g_free(cfg->event_id_strs[ev]);
+    g_free(cfg->action_strs[ev]);
+    g_clear_pointer(&cfg->event_ids[ev], g_array_unref);
+  }
+  g_free(cfg->action_mode);
 
   memset(cfg, 0, sizeof(*cfg));
 }
@@ -165,21 +1082,53 @@ clear_prog_cfg(struct prog_cfg *cfg)
 static void
 clear_prog_state(struct prog_state *state)
 {
+  gint ev;
+
   g_assert(state);
 
   if (state->poll_src_id) {
     g_source_remove(state->poll_src_id);
     state->poll_src_id = 0;
   }
+  if (state->prewarm_src_id) {
+    g_source_remove(state->prewarm_src_id);
+    state->prewarm_src_id = 0;
+  }
+  if (state->tz_src_id) {
+    g_source_remove(state->tz_src_id);
+    state->tz_src_id = 0;
+    close(state->tz_fd);
+  }
+  if (state->rule_src_id) {
+    g_source_remove(state->rule_src_id);
+    state->rule_src_id = 0;
+  }
+  if (state->resync_src_id) {
+    g_source_remove(state->resync_src_id);
+    state->resync_src_id = 0;
+  }
+  if (state->idle_src_id) {
+    g_source_remove(state->idle_src_id);
+    state->idle_src_id = 0;
+  }
 
   clear_prog_cfg(&state->cfg);
-  g_clear_pointer(&state->sunrise, g_date_time_unref);
-  g_clear_pointer(&state->sunset, g_date_time_unref);
+  for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+    g_clear_pointer(&state->times[ev], g_date_time_unref);
+  }
+  g_clear_pointer(&state->actions, action_engine_free);
+  g_clear_pointer(&state->rules, g_array_unref);
+  /* The sun client may read the gateway through the phoscon client */
+  g_clear_pointer(&state->sc, sun_client_free);
+  g_clear_pointer(&state->pc, phoscon_client_free);
+  g_clear_pointer(&state->tz, g_time_zone_unref);
+  g_clear_object(&state->cancellable);
   g_clear_pointer(&state->loop, g_main_loop_unref);
 }
 
 static gboolean
-parse_sunx_ids(const gchar *str, const gchar *actstr, gint *ids, GError **err)
+parse_sunx_ids(const gchar *str, const gchar *actstr, GArray *ids,
+               GError **err)
 {
   gboolean ret = FALSE;
   gchar **splits = FALSE;
@@ -189,13 +1138,8 @@ parse_sunx_ids(const gchar *str, const gchar *actstr, gint *ids, GError **err)
     return TRUE;
   }
 
-  splits = g_strsplit(str, ",", MAX_SUNX_IDS + 1);
-  if (g_strv_length(splits) > MAX_SUNX_IDS) {
-    g_warning("Too many %s IDs specified, only first %d will be used",
-              actstr, MAX_SUNX_IDS);
-  }
-
-  for (i = 0; splits[i] && i < MAX_SUNX_IDS; i++) {
+  splits = g_strsplit(str, ",", -1);
+  for (i = 0; splits[i]; i++) {
     gchar *eptr = NULL;
     gint val;
 
@@ -209,7 +1153,7 @@ parse_sunx_ids(const gchar *str, const gchar *actstr, gint *ids, GError **err)
       goto out;
     }
 
-    ids[i] = val;
+    g_array_append_val(ids, val);
   }
 
   ret = TRUE;
@@ -226,18 +1170,18 @@ parse_config(const gchar *cfgfile, struct prog_cfg *cfg, GError **err)
 {
   GList *grp_list = NULL;
   gboolean ret = FALSE;
+  gint ev;
   gint i;
   struct cfg_group grps[] = {
     { "phoscon",  TRUE,   &cfg->phoscon, ARRAY_SIZE(phoscon_cfg_ents), phoscon_cfg_ents },
     { "general",  TRUE,   cfg,           ARRAY_SIZE(general_cfg_ents), general_cfg_ents },
     { "schedules", FALSE, cfg,           ARRAY_SIZE(sched_cfg_ents),   sched_cfg_ents },
+    { "actions",   FALSE, cfg,           ARRAY_SIZE(action_cfg_ents),  action_cfg_ents },
     { NULL, },
   };
 
-  /* Initialise all IDs to -1 (uninitialised) */
-  for (i = 0; i < MAX_SUNX_IDS; i++) {
-    cfg->sunset_ids[i] =  -1;
-    cfg->sunrise_ids[i] =  -1;
+  for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+    cfg->event_ids[ev] = g_array_new(FALSE, FALSE, sizeof(gint));
   }
 
   for (i = 0; grps[i].grp_name; i++) {
@@ -248,12 +1192,25 @@ parse_config(const gchar *cfgfile, struct prog_cfg *cfg, GError **err)
     goto out;
   }
 
-  if (!parse_sunx_ids(cfg->sunrise_id_strs, "sunrise", cfg->sunrise_ids, err) ||
-      !parse_sunx_ids(cfg->sunset_id_strs,  "sunset",  cfg->sunset_ids, err)) {
-    goto out;
+  for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+    if (!parse_sunx_ids(cfg->event_id_strs[ev], sun_client_event_name(ev),
+                        cfg->event_ids[ev], err)) {
+      goto out;
+    }
+  }
+
+  if (cfg->resync_period_secs == 0) {
+    cfg->resync_period_secs = DEFAULT_RESYNC_PERIOD_SEC;
+  } else if (cfg->resync_period_secs > 0 &&
+             cfg->resync_period_secs < MIN_POLL_PERIOD_SEC) {
+    g_warning("Invalid schedule resync period, using default");
+    cfg->resync_period_secs = DEFAULT_RESYNC_PERIOD_SEC;
   }
 
-  if (cfg->poll_period_secs < MIN_POLL_PERIOD_SEC) {
+  if (cfg->accuracy_secs) {
+    g_debug("Wake-ups planned with %u seconds accuracy, pollPeriod unused",
+            cfg->accuracy_secs);
+  } else if (cfg->poll_period_secs < MIN_POLL_PERIOD_SEC) {
     g_warning("Invalid sun service poll period, using default");
     cfg->poll_period_secs = DEFAULT_POLL_PERIOD_SEC;
   }
@@ -266,14 +1223,214 @@ out:
   return ret;
 }
 
+/* Find the time zone of the configured location in the index, unless it
+ * was given explicitly. The host's zone is used if neither is available.
+ */
 static gboolean
-dump_schedule_list(struct prog_cfg *cfg, GError **err)
+resolve_site_timezone(struct prog_cfg *cfg, GError **err)
+{
+  tz_index_t *idx;
+  const gchar *name;
+  gint64 start;
+
+  if (cfg->phoscon.timezone) {
+    g_message("Site time zone is %s", cfg->phoscon.timezone);
+    return TRUE;
+  } else if (!cfg->tz_index_file) {
+    g_debug("No time zone configured, using the local one");
+    return TRUE;
+  }
+
+  start = g_get_monotonic_time();
+  if ((idx = tz_index_open(cfg->tz_index_file, err)) == NULL) {
+    return FALSE;
+  }
+
+  if ((name = tz_index_lookup(idx, cfg->sun.lat, cfg->sun.lon)) != NULL) {
+    cfg->phoscon.timezone = g_strdup(name);
+    g_message("Site time zone is %s (resolved in %" G_GINT64_FORMAT " us)",
+              name, g_get_monotonic_time() - start);
+  } else {
+    g_warning("No time zone at lat=%.6f long=%.6f, using the local one",
+              cfg->sun.lat, cfg->sun.lon);
+  }
+  tz_index_close(idx);
+
+  return TRUE;
+}
+
+static void
+clear_phoscon_rule(gpointer data)
+{
+  struct phoscon_rule *rule = (struct phoscon_rule *) data;
+
+  g_free(rule->name);
+  g_free(rule->resource);
+  g_free(rule->body);
+}
+
+static void
+rule_sync_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  struct prog_state *state = (struct prog_state *) user_data;
+  struct phoscon_rule_stats stats = { 0, };
+  GError *err = NULL;
+
+  state->rule_sync_busy = FALSE;
+  if (!phoscon_client_sync_rules_finish(res, &stats, &err)) {
+    g_warning("Rule sync failed: %s", GERROR_MSG(err));
+    g_clear_error(&err);
+    return;
+  }
+
+  g_message("Rules: %u unchanged, %u created, %u updated, %u deleted",
+            stats.unchanged, stats.created, stats.updated, stats.deleted);
+}
+
+/* Check the gateway rules against the configured actions, the gateway is
+ * only written to if they drifted apart
+ */
+static void
+start_rule_sync(struct prog_state *state)
+{
+  if (state->rule_sync_busy) {
+    g_warning("Previous rule sync still in progress, skipping");
+    return;
+  }
+
+  state->rule_sync_busy = TRUE;
+  phoscon_client_sync_rules_async(state->pc, RULE_PREFIX,
+                                  (struct phoscon_rule *) state->rules->data,
+                                  state->rules->len, state->cancellable,
+                                  rule_sync_done, state);
+}
+
+/* The rules fire on the Daylight sensor status, so a change is checked
+ * for rules deleted or edited in the Phoscon app before the next one
+ */
+static void
+handle_daylight_change(gint status, gpointer user_data)
+{
+  struct prog_state *state = (struct prog_state *) user_data;
+
+  if (state->rules && !state->rule_sync_busy) {
+    start_rule_sync(state);
+  }
+}
+
+static gboolean
+handle_rule_check_timeout(gpointer data)
+{
+  struct prog_state *state = (struct prog_state *) data;
+
+  start_rule_sync(state);
+
+  return TRUE;
+}
+
+static gboolean
+add_action(struct prog_state *state, enum sun_event ev, const gchar *spec,
+           guint n, GError **err)
+{
+  struct phoscon_rule rule = { 0, };
+
+  if (state->actions) {
+    return action_engine_add(state->actions, ev, spec, err);
+  } else if (!action_parse_spec(spec, &rule.resource, &rule.body, err)) {
+    return FALSE;
+  }
+
+  rule.name = g_strdup_printf(RULE_PREFIX "%s %u", sun_client_event_name(ev),
+                              n);
+  rule.ev = ev;
+  g_array_append_val(state->rules, rule);
+
+  return TRUE;
+}
+
+/*
+ * Set up the actions, each event may list several separated by ';'. They
+ * are either switched by timers in this process or handed to the gateway
+ * as rules triggered by its Daylight sensor. Timers are not used in
+ * one-shot mode.
+ */
+static gboolean
+setup_actions(struct prog_state *state, GError **err)
+{
+  struct prog_cfg *cfg = &state->cfg;
+  gboolean use_rules;
+  gint ev;
+  gint i;
+
+  if (!cfg->action_mode || g_strcmp0(cfg->action_mode, "timer") == 0) {
+    use_rules = FALSE;
+  } else if (g_strcmp0(cfg->action_mode, "rules") == 0) {
+    use_rules = TRUE;
+  } else {
+    SET_GERROR(err, -1, "unknown action mode '%s'", cfg->action_mode);
+    return FALSE;
+  }
+
+  if (use_rules) {
+    state->rules = g_array_new(FALSE, FALSE, sizeof(struct phoscon_rule));
+    g_array_set_clear_func(state->rules, clear_phoscon_rule);
+  } else if (state->one_shot) {
+    return TRUE;
+  }
+
+  for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+    gchar **specs;
+    guint n = 0;
+
+    if (!cfg->action_strs[ev]) {
+      continue;
+    }
+
+    if (!use_rules && !state->actions) {
+      state->actions = action_engine_new(state->pc, cfg->sun.lat,
+                                         cfg->sun.lon, state->tz,
+                                         state->cancellable);
+    }
+
+    specs = g_strsplit(cfg->action_strs[ev], ";", -1);
+    for (i = 0; specs[i]; i++) {
+      if (*g_strstrip(specs[i]) == '\0') {
+        continue;
+      } else if (!add_action(state, ev, specs[i], ++n, err)) {
+        g_prefix_error(err, "%s action: ", sun_client_event_name(ev));
+        g_strfreev(specs);
+        return FALSE;
+      }
+    }
+    g_strfreev(specs);
+  }
+
+  if (state->actions) {
+    g_message("%u action(s) are switched directly at their event",
+              action_engine_count(state->actions));
+  } else if (state->rules) {
+    /* Also removes the managed rules once no actions are left */
+    g_message("%u action(s) are handed to the gateway as rules",
+              state->rules->len);
+    start_rule_sync(state);
+    if (!state->one_shot) {
+      state->rule_src_id = g_timeout_add_seconds(RULE_CHECK_PERIOD_SEC,
+                                                 handle_rule_check_timeout,
+                                                 state);
+    }
+  }
+
+  return TRUE;
+}
+
+static gboolean
+dump_schedule_list(struct prog_state *state, GError **err)
 {
   GList *res = NULL;
   GList *node;
   gint rc;
 
-  if ((rc = phoscon_client_list_all_schedules(&res)) < 0) {
+  if ((rc = phoscon_client_list_all_schedules(state->pc, &res)) < 0) {
     SET_GERROR(err, -1, "schedule fetch failed");
     return FALSE;
   }
@@ -286,9 +1443,11 @@ dump_schedule_list(struct prog_cfg *cfg, GError **err)
 
   for (node = res; node; node = node->next) {
     const struct phoscon_schedule_ent *ent = node->data;
-    gchar *cstr = ent->created ? g_date_time_format(ent->created, "%F %T") :
-                                 g_strdup("invalid");
+    GDateTime *created = g_date_time_new_from_unix_utc(ent->created);
+    gchar *cstr = created ? g_date_time_format(created, "%F %T") :
+                            g_strdup("invalid");
 
+    g_clear_pointer(&created, g_date_time_unref);
     g_print("| %03d | %-18s | %-10s | %-19s | %-17s |\n",
             ent->id, ent->name, ent->status, cstr, ent->local_timestr);
     g_free(cstr);
@@ -313,6 +1472,7 @@ usage(const gchar *errstr, gint exit_code)
              "  --config          -c    Configuration file to parse\n"
              "  --once            -o    Fetch and update once, then exit\n"
              "  --list-schedules  -l    List all Phoscon schedules then exit\n"
+             "  --build-tz-index  -z    Build tzIndexFile from a time zone GeoJSON then exit\n"
              "  --help            -h    Show help options\n\n",
              prog_name);
   exit(exit_code);
@@ -327,6 +1487,9 @@ main(gint argc, gchar **argv)
   gchar *cfgfile = NULL;
   gboolean one_shot = FALSE;
   gboolean do_list = FALSE;
+  gchar *tz_geojson = NULL;
+  struct snapshot *snap = NULL;
+  gint64 phase;
   gint retval = EXIT_FAILURE;
   gint opt;
 
@@ -335,12 +1498,15 @@ main(gint argc, gchar **argv)
     { "config",         required_argument,  NULL, 'c' },
     { "once",           no_argument,        NULL, 'o' },
     { "list-schedules", no_argument,        NULL, 'l' },
+    { "build-tz-index", required_argument,  NULL, 'z' },
     { NULL, 0, NULL,  0  }
   };
 
   prog_name = argv[0];
+  state.start_time = g_get_monotonic_time();
+  phase = state.start_time;
 
-  while ((opt = getopt_long(argc, argv, "hc:ol", opts, NULL)) != -1) {
+  while ((opt = getopt_long(argc, argv, "hc:olz:", opts, NULL)) != -1) {
     switch (opt) {
     case 'h':
       usage(NULL, EXIT_SUCCESS);
@@ -354,6 +1520,9 @@ main(gint argc, gchar **argv)
     case 'o':
       one_shot = TRUE;
       break;
+    case 'z':
+      tz_geojson = optarg;
+      break;
     default:
       usage("Illegal argument", EXIT_FAILURE);
     }
@@ -372,55 +1541,130 @@ main(gint argc, gchar **argv)
     goto out;
   }
 
-  /* Initialise the phoscon client */
-  if (!phoscon_client_init(&cfg->phoscon, &err)) {
-    g_printerr("Could initialise phoscon client: %s\n",
-               GERROR_MSG(err));
-    goto out;
-  }
-
-  if (do_list) {
-    if (!dump_schedule_list(cfg, &err)) {
-      g_printerr("Could not list schedules: %s\n", GERROR_MSG(err));
+  if (tz_geojson) {
+    if (!cfg->tz_index_file) {
+      g_printerr("No tzIndexFile configured to build\n");
+    } else if (!tz_index_build(tz_geojson, cfg->tz_index_file,
+                               TZ_INDEX_CELLS_PER_DEG, &err)) {
+      g_printerr("Could not build time zone index: %s\n", GERROR_MSG(err));
+    } else {
+      retval = EXIT_SUCCESS;
     }
     goto out;
   }
 
-  /* Initialise the sunrise client */
-  if (!sun_client_init(cfg->latitude, cfg->longitude, &err)) {
-    g_printerr("Could initialise sunrise/set client: %s\n",
+  if (!resolve_site_timezone(cfg, &err)) {
+    g_printerr("Could not resolve the site time zone: %s\n",
                GERROR_MSG(err));
     goto out;
   }
+  phase = log_phase("configuration", phase);
 
-  /* Perform initial update before doing the periodic ones */
-  if (!fetch_and_update_sun_times(&state, &err)) {
-    g_printerr("Perform initial update failed: %s\n", GERROR_MSG(err));
+  /* Start from the snapshot if there is one, the gateway is asked for the
+   * schedules only without it
+   */
+  if (!do_list && cfg->state_file) {
+    snap = restore_schedules(&state);
+  }
+
+  if (snap) {
+    phase = log_phase("state snapshot", phase);
+  }
+
+  /* Initialise the clients, today's sun times may be in the snapshot. The
+   * day of the sun times is the one of the site, as for the wake-ups.
+   */
+  state.tz = cfg->phoscon.timezone ?
+             g_time_zone_new_identifier(cfg->phoscon.timezone) :
+             g_time_zone_new_local();
+  if (!init_clients(&state, snap, !do_list, &err)) {
+    g_printerr("Could initialise %s\n", GERROR_MSG(err));
     goto out;
   }
+  phase = log_phase("client initialisation", phase);
 
-  if (one_shot) {
-    /* We are doneskys */
-    g_message("One-shot mode, exit with success code");
-    retval = EXIT_SUCCESS;
+  if (do_list) {
+    if (!dump_schedule_list(&state, &err)) {
+      g_printerr("Could not list schedules: %s\n", GERROR_MSG(err));
+    }
     goto out;
   }
 
-  g_message("Sunrise/sunset poll period is %u seconds",
-            cfg->poll_period_secs);
-  state.poll_src_id = g_timeout_add_seconds(cfg->poll_period_secs,
-                                            handle_poll_timeout, &state);
+  state.one_shot = one_shot;
+  state.retval = EXIT_FAILURE;
+  state.cancellable = g_cancellable_new();
+  state.loop = g_main_loop_new(NULL, FALSE);
   g_unix_signal_add(SIGINT, handle_sigint, &state);
   g_unix_signal_add(SIGTERM, handle_sigint, &state);
-  state.loop = g_main_loop_new(NULL, FALSE);
+
+  if (!setup_actions(&state, &err)) {
+    g_printerr("Could not set up actions: %s\n", GERROR_MSG(err));
+    goto out;
+  }
+  if (!one_shot) {
+    phoscon_client_listen_events(state.pc, handle_daylight_change, &state,
+                                 state.cancellable);
+    service_watchdog_start();
+    if (service_control_start(handle_control_cmd, &state, &err)) {
+      if (cfg->idle_exit_secs && state.actions) {
+        /* Nothing would start us again in time for the next action */
+        g_warning("idleExit is ignored with actions in timer mode");
+      } else if (cfg->idle_exit_secs) {
+        state.idle_src_id = g_timeout_add_seconds(IDLE_CHECK_PERIOD_SEC,
+                                                  handle_idle_check, &state);
+      }
+    } else if (err) {
+      g_warning("Could not serve the control socket: %s", GERROR_MSG(err));
+      g_clear_error(&err);
+    }
+  }
+
+  /* Perform initial update before doing the periodic ones, the poll timer
+   * is started once it succeeded. Restored schedules are read again first,
+   * so the update does not rewrite what is already on the gateway nor miss
+   * what was changed while we were down.
+   */
+  state.update_start = g_get_monotonic_time();
+  if (snap && count_bound_schedules(cfg)) {
+    state.revalidating = TRUE;
+    start_resync(&state);
+  } else {
+    start_poll(&state);
+  }
 
   /* Start the main loop */
-  g_message("Entering main loop...");
+  g_message("Entering main loop after %.1f ms%s...",
+            (g_get_monotonic_time() - state.start_time) / 1000.0,
+            snap ? " (from state snapshot)" : "");
   g_main_loop_run(state.loop);
-  g_message("Shutting down after %lu poll(s)", state.poll_cntr);
+  service_notify_stopping();
+  service_control_stop();
+
+  /* Let a cancelled poll unwind before tearing down the state */
+  phoscon_client_cancel(state.pc);
+  while (state.poll_busy || state.rule_sync_busy || state.resync_busy ||
+         action_engine_busy(state.actions) ||
+         phoscon_client_busy(state.pc)) {
+    g_main_context_iteration(NULL, TRUE);
+  }
+  if (state.initialised) {
+    struct util_http_stats stats;
+
+    util_http_get_stats(&stats);
+    g_message("Shutting down after %lu poll(s)", state.poll_cntr);
+    g_message("HTTP: %u request(s), %u over a reused connection (%u%%), "
+              "%u connection(s) opened", stats.requests, stats.reused,
+              stats.requests ? stats.reused * 100 / stats.requests : 0,
+              stats.connects);
+    action_engine_log_stats(state.actions);
+    phoscon_client_log_event_stats(state.pc);
+    save_snapshot(&state);
+  }
+  service_watchdog_stop();
 
-  retval = EXIT_SUCCESS;
+  retval = state.retval;
 out:
+  g_clear_pointer(&snap, snapshot_free);
   clear_prog_state(&state);
   g_clear_error(&err);
 
@@ -1,429 +1,2540 @@
+#include <stdio.h>
 #include <glib.h>
+#include <gio/gio.h>
 #include <jansson.h>
 
 #include "phoscon_client.h"
 #include "debug.h"
 #include "util.h"
+#include "ws_client.h"
 
 #define DEFAULT_PHOSCON_PORT  8080
-
-typedef struct phoscon_client {
+#define DEFAULT_MAX_PARALLEL  8
+
+#define SECS_PER_DAY          86400
+#define MAX_TZ_SPANS          8    /* UTC offsets cached per year */
+
+struct schedule_store;
+
+/* UTC offsets of the local time zone during one year, so formatting a local
+ * time is a table lookup rather than a time zone database query
+ */
+struct tz_table {
+  GTimeZone *tz;
+  gint year;               /* 0 until built */
+  gint64 start;            /* UNIX time of the year start (UTC) */
+  gint64 end;              /* UNIX time of the next year start (UTC) */
+  guint n_spans;
+  struct tz_span {
+    gint64 start;          /* UNIX time the offset takes effect */
+    gint32 offset;         /* Seconds east of UTC */
+  } spans[MAX_TZ_SPANS];
+};
+
+struct phoscon_client {
   struct phoscon_client_cfg cfg;
-  conn_handle_t *handle;
+  GQueue idle_handles;     /* Connections not used by a request */
+  guint n_handles;
+  GQueue waiting;          /* Requests waiting for a free connection */
   gchar *base_url;
-  GHashTable *schedules;
-} phoscon_client_t;
+  struct schedule_store *schedules;
+  gint daylight_id;        /* ID of the Daylight sensor, -1 if unknown */
+  struct tz_table tzt;
+  ws_client_t *ws;         /* Event listener, NULL if not started */
+  GCancellable *ev_cancellable;   /* Of the event listener's requests */
+  GCancellable *ev_parent;     /* Cancels ev_cancellable, NULL if none */
+  gulong ev_parent_id;
+  phoscon_daylight_func daylight_func;
+  gpointer daylight_data;
+  GCancellable *cancellable;   /* Of the requests the client starts itself */
+  guint n_own;             /* Own requests in flight */
+  struct {
+    guint received;
+    guint patched;         /* Schedules changed by an event */
+    guint unchanged;       /* Schedule events not changing the entry */
+    gint64 latency_sum;    /* Event receipt to table update (usecs) */
+    gint64 latency_max;
+    gint daylight_status;
+  } ev_stats;
+};
 
 DEFINE_GQUARK("phoscon_client");
 
-static phoscon_client_t *pclient;
+#define MAX_SCHEDULE_ID   0xffff
+#define TIME_OF_DAY_LEN   8    /* "HH:MM:SS" */
+
+/* Schedule entry with its prebuilt update request. The request body is
+ * {"time":"<prefix>/THH:MM:SS","localtime":"<prefix>/THH:MM:SS"} with the
+ * time of day patched in place for every update.
+ */
+struct schedule_rec {
+  struct phoscon_schedule_ent ent;   /* ent.timestr is NULL if unused */
+  gchar *req;              /* NULL if the time string can't be updated */
+  guint16 time_pos;        /* Offset of the "time" value in req */
+  guint16 ltime_pos;       /* Offset of the "localtime" value, 0 if none */
+  guint16 time_len;        /* Length of both values */
+  gboolean busy;           /* req is being uploaded */
+  guint64 digest;          /* Of the fields read from the gateway */
+  guint own;               /* REC_OWN_* strings not in the store's chunk */
+};
+
+/* Strings first set when the store is filled live in its chunk. Those
+ * replaced later are allocated on their own and freed when replaced
+ * again, so updates and resyncs do not grow the chunk.
+ */
+enum {
+  REC_OWN_NAME          = 1 << 0,
+  REC_OWN_DESCR         = 1 << 1,
+  REC_OWN_STATUS        = 1 << 2,
+  REC_OWN_TIMESTR       = 1 << 3,
+  REC_OWN_LOCAL_TIMESTR = 1 << 4,
+  REC_OWN_REQ           = 1 << 5,
+};
+
+static void
+free_rec_strs(struct schedule_rec *rec)
+{
+  if (rec->own & REC_OWN_NAME) {
+    g_free(rec->ent.name);
+  }
+  if (rec->own & REC_OWN_DESCR) {
+    g_free(rec->ent.descr);
+  }
+  if (rec->own & REC_OWN_STATUS) {
+    g_free(rec->ent.status);
+  }
+  if (rec->own & REC_OWN_TIMESTR) {
+    g_free(rec->ent.timestr);
+  }
+  if (rec->own & REC_OWN_LOCAL_TIMESTR) {
+    g_free(rec->ent.local_timestr);
+  }
+  if (rec->own & REC_OWN_REQ) {
+    g_free(rec->req);
+  }
+  rec->own = 0;
+}
+
+/* All schedules of one fetch. The records are indexed by schedule ID and
+ * their strings as fetched live in a single string chunk, so the whole
+ * fetch is released with one schedule_store_free() call.
+ */
+struct schedule_store {
+  GArray *recs;            /* struct schedule_rec, indexed by ID */
+  GStringChunk *strings;
+  guint count;
+};
+
+static struct schedule_store *
+schedule_store_new(void)
+{
+  struct schedule_store *store;
+
+  store = g_malloc0(sizeof(*store));
+  store->recs = g_array_new(FALSE, TRUE, sizeof(struct schedule_rec));
+  store->strings = g_string_chunk_new(1024);
+
+  return store;
+}
+
+static void
+schedule_store_free(struct schedule_store *store)
+{
+  guint i;
+
+  for (i = 0; i < store->recs->len; i++) {
+    free_rec_strs(&g_array_index(store->recs, struct schedule_rec, i));
+  }
+  g_array_free(store->recs, TRUE);
+  g_string_chunk_free(store->strings);
+  g_free(store);
+}
+
+static struct schedule_rec *
+schedule_store_lookup(struct schedule_store *store, gint id)
+{
+  struct schedule_rec *rec;
+
+  if (id < 0 || (guint) id >= store->recs->len) {
+    return NULL;
+  }
+  rec = &g_array_index(store->recs, struct schedule_rec, id);
+
+  return rec->ent.timestr ? rec : NULL;
+}
+
+/* Records are only stable once the store is complete, as adding one may
+ * move all of them
+ */
+static struct schedule_rec *
+schedule_store_add(struct schedule_store *store, gint id, GError **err)
+{
+  struct schedule_rec *rec;
+
+  if (id < 0 || id > MAX_SCHEDULE_ID) {
+    SET_GERROR(err, -1, "schedule ID %d out of range", id);
+    return NULL;
+  } else if ((guint) id >= store->recs->len) {
+    g_array_set_size(store->recs, id + 1);
+  }
+
+  rec = &g_array_index(store->recs, struct schedule_rec, id);
+  if (rec->ent.timestr) {
+    SET_GERROR(err, -1, "duplicate schedule ID %d", id);
+    return NULL;
+  }
+  rec->ent.id = id;
+  store->count++;
+
+  return rec;
+}
+
+/* Strings of a record filled for the first time go to the chunk */
+static gchar *
+rec_strdup(struct schedule_store *store, struct schedule_rec *rec,
+           gboolean refill, guint own, const gchar *str)
+{
+  if (!str) {
+    return NULL;
+  } else if (!refill) {
+    return g_string_chunk_insert(store->strings, str);
+  }
+  rec->own |= own;
+
+  return g_strdup(str);
+}
+
+/* Replace a string of a filled record with len bytes of val */
+static void
+replace_rec_str(struct schedule_rec *rec, guint own, gchar **str,
+                const gchar *val, gsize len)
+{
+  if (rec->own & own) {
+    g_free(*str);
+  }
+  *str = g_strndup(val, len);
+  rec->own |= own;
+}
+
+/* Returns FALSE if the time string is not in a format that can be updated */
+static gboolean
+build_update_request(struct schedule_store *store, struct schedule_rec *rec,
+                     gboolean refill)
+{
+  const gchar *timestr = rec->ent.timestr;
+  const gchar *tstr;
+  gchar *req;
+  gint plen;
+  gint i;
+
+  if ((tstr = g_strstr_len(timestr, -1, "/T")) == NULL ||
+      (plen = tstr - timestr) > G_MAXUINT8) {
+    return FALSE;
+  }
+
+  /* The prefix is copied verbatim, so it must not need JSON escaping */
+  for (i = 0; i < plen; i++) {
+    if (timestr[i] == '"' || timestr[i] == '\\' || (guchar) timestr[i] < 0x20) {
+      return FALSE;
+    }
+  }
+
+  rec->time_len = plen + 2 + TIME_OF_DAY_LEN;
+  rec->time_pos = strlen("{\"time\":\"");
+  if (rec->ent.local_timestr) {
+    rec->ltime_pos = rec->time_pos + rec->time_len +
+                     strlen("\",\"localtime\":\"");
+    req = g_strdup_printf("{\"time\":\"%.*s/T00:00:00\","
+                          "\"localtime\":\"%.*s/T00:00:00\"}",
+                          plen, timestr, plen, timestr);
+  } else {
+    req = g_strdup_printf("{\"time\":\"%.*s/T00:00:00\"}", plen, timestr);
+  }
+  rec->req = rec_strdup(store, rec, refill, REC_OWN_REQ, req);
+  g_free(req);
+
+  return TRUE;
+}
+
+static void
+free_phoscon_client(phoscon_client_t *pc)
+{
+  g_assert(pc);
+
+  g_free(pc->cfg.api_key);
+  g_free(pc->cfg.host);
+  g_free(pc->cfg.timezone);
+  g_free(pc->cfg.ws_host);
+  g_free(pc->base_url);
+  g_assert(pc->n_own == 0);
+  g_assert(g_queue_is_empty(&pc->waiting));
+  g_queue_clear_full(&pc->idle_handles, (GDestroyNotify) util_cleanup_handle);
+  g_clear_pointer(&pc->ws, ws_client_free);
+  if (pc->ev_parent) {
+    g_cancellable_disconnect(pc->ev_parent, pc->ev_parent_id);
+    g_clear_object(&pc->ev_parent);
+  }
+  g_clear_object(&pc->ev_cancellable);
+  g_clear_object(&pc->cancellable);
+  g_clear_pointer(&pc->schedules, schedule_store_free);
+  g_clear_pointer(&pc->tzt.tz, g_time_zone_unref);
+  g_free(pc);
+}
+
+static gchar *
+build_phoscon_base_url(const struct phoscon_client_cfg *cfg, gboolean use_https)
+{
+  g_assert(cfg);
+
+  return g_strdup_printf("http%s://%s:%u/api/%s",
+                         use_https ? "s" : "",
+                         cfg->host, cfg->port, cfg->api_key);
+}
+
+/* Phoscon timestamps are UTC "YYYY-MM-DDTHH:MM:SS", optionally with
+ * fractional seconds but without the zone designator
+ */
+static GDateTime *
+parse_phoscon_timestamp(const gchar *str)
+{
+  gint year, month, day, hour, min;
+  gdouble secs;
+  gint n = 0;
+
+  g_assert(str);
+
+  if (sscanf(str, "%4d-%2d-%2dT%2d:%2d:%lf%n", &year, &month, &day,
+             &hour, &min, &secs, &n) != 6 || str[n] != '\0') {
+    return NULL;
+  }
+
+  return g_date_time_new_utc(year, month, day, hour, min, secs);
+}
+
+/* FNV-1a over a string including its terminator, NULL hashes as "" */
+static guint64
+digest_str(guint64 h, const gchar *str)
+{
+  const guchar *p = (const guchar *) (str ? str : "");
+
+  do {
+    h = (h ^ *p) * G_GUINT64_CONSTANT(0x100000001b3);
+  } while (*p++);
+
+  return h;
+}
+
+/* Digest of the schedule fields this client depends on, the others (e.g.
+ * the command) may change without the entry being parsed again
+ */
+static guint64
+schedule_digest(const gchar *name, const gchar *descr, const gchar *status,
+                const gchar *timestr, const gchar *local_timestr)
+{
+  guint64 h = G_GUINT64_CONSTANT(0xcbf29ce484222325);
+
+  h = digest_str(h, name);
+  h = digest_str(h, descr);
+  h = digest_str(h, status);
+  h = digest_str(h, timestr);
+
+  return digest_str(h, local_timestr);
+}
+
+static guint64
+schedule_rec_digest(const struct schedule_rec *rec)
+{
+  return schedule_digest(rec->ent.name, rec->ent.descr, rec->ent.status,
+                         rec->ent.timestr, rec->ent.local_timestr);
+}
+
+/* Digest of a schedule as sent by the gateway, 0 if it is malformed */
+static guint64
+schedule_json_digest(json_t *jobj)
+{
+  const gchar *status;
+  const gchar *name;
+  const gchar *timestr;
+  const gchar *local_timestr = NULL;
+
+  if (json_unpack(jobj, "{s:s,s:s,s:s,s?:s}",
+                  "status",    &status,
+                  "name",      &name,
+                  "time",      &timestr,
+                  "localtime", &local_timestr) != 0) {
+    return 0;
+  }
+
+  return schedule_digest(name,
+                         json_string_value(json_object_get(jobj,
+                                                           "description")),
+                         status, timestr, local_timestr);
+}
+
+/* Replaces the strings of the record, the update request is built from
+ * the new ones
+ */
+static void
+set_schedule_rec(struct schedule_store *store, struct schedule_rec *rec,
+                 const gchar *name, const gchar *descr, const gchar *status,
+                 gint64 created, const gchar *timestr,
+                 const gchar *local_timestr)
+{
+  struct phoscon_schedule_ent *nsched = &rec->ent;
+  gboolean refill = nsched->timestr != NULL;
+
+  free_rec_strs(rec);
+  nsched->name = rec_strdup(store, rec, refill, REC_OWN_NAME, name);
+  nsched->descr = rec_strdup(store, rec, refill, REC_OWN_DESCR, descr);
+  nsched->status = rec_strdup(store, rec, refill, REC_OWN_STATUS, status);
+  nsched->created = created;
+  nsched->timestr = rec_strdup(store, rec, refill, REC_OWN_TIMESTR, timestr);
+  nsched->local_timestr = rec_strdup(store, rec, refill,
+                                     REC_OWN_LOCAL_TIMESTR, local_timestr);
+  rec->digest = schedule_rec_digest(rec);
+  rec->req = NULL;
+  rec->ltime_pos = 0;
+  if (!build_update_request(store, rec, refill)) {
+    g_warning("Time string '%s' of schedule [%d] can not be updated",
+              nsched->timestr, nsched->id);
+  }
+}
+
+/*
+ * Fill a schedule record from its JSON, the record is left as it was if
+ * the JSON is not valid. Refilling a record frees its old strings.
+ */
+static gboolean
+fill_schedule_rec(struct schedule_store *store, struct schedule_rec *rec,
+                  json_t *jobj, GError **err)
+{
+  struct phoscon_schedule_ent *nsched = &rec->ent;
+  json_error_t jerr = { 0, };
+  const gchar *created_str;
+  const gchar *status;
+  const gchar *name;
+  const gchar *timestr;
+  const gchar *local_timestr = NULL;
+  gchar dtbuf[UTIL_DT_STR_LEN];
+  GDateTime *created;
+
+  g_assert(jobj);
+
+  if (!json_is_object(jobj)) {
+    SET_GERROR(err, -1, "invalid phoscon schedule");
+    return FALSE;
+  }
+
+  /* TODO: Add proper parsing of time strings into structs */
+  if (json_unpack_ex(jobj, &jerr, 0, "{s:s,s:s,s:s,s:s,s?:s}",
+                     "created",     &created_str,
+                     "status",      &status,
+                     "name",        &name,
+                     "time",        &timestr,
+                     "localtime",   &local_timestr) != 0) {
+    SET_GERROR(err, -1, "invalid JSON response (%s)", jerr.text);
+    return FALSE;
+  }
+
+  if ((created = parse_phoscon_timestamp(created_str)) == NULL) {
+    SET_GERROR(err, -1, "could not parse creation timestamp");
+    return FALSE;
+  }
+
+  /* The description can be NULL, so it is not part of the unpack above */
+  set_schedule_rec(store, rec, name,
+                   json_string_value(json_object_get(jobj, "description")),
+                   status, g_date_time_to_unix(created), timestr,
+                   local_timestr);
+
+  g_message("Schedule [%d] '%s' Created: %s Status: %s Time: %s (Local: %s)",
+            nsched->id, nsched->name,
+            util_dt_format(created, dtbuf),
+            nsched->status, nsched->timestr,
+            nsched->local_timestr);
+  g_date_time_unref(created);
+
+  return TRUE;
+}
+
+static gboolean
+parse_phoscon_schedule(struct schedule_store *store, const gchar *id,
+                       json_t *jobj, GError **err)
+{
+  struct schedule_rec *rec;
+
+  g_assert(id);
+
+  /* A failed fill leaves the ID taken, but the whole store is discarded */
+  if ((rec = schedule_store_add(store, g_ascii_strtoll(id, NULL, 10),
+                                err)) == NULL) {
+    return FALSE;
+  }
+
+  return fill_schedule_rec(store, rec, jobj, err);
+}
+
+/*
+ * Incremental parser of the /schedules response. The body is a JSON object
+ * with one member per schedule, each member is cut out of the stream as it
+ * arrives and parsed on its own. Memory use is bounded by the largest
+ * schedule rather than by the whole response.
+ */
+struct schedule_stream {
+  struct schedule_store *store;
+  GString *key;
+  GString *value;          /* Member being received */
+  gint depth;
+  gboolean in_str;
+  gboolean escape;
+  gboolean started;
+  GError *err;
+};
+
+static void
+schedule_stream_member(struct schedule_stream *ss)
+{
+  json_error_t jerr = { 0, };
+  json_t *jent;
+
+  if ((jent = json_loadb(ss->value->str, ss->value->len, 0, &jerr)) == NULL) {
+    SET_GERROR(&ss->err, -1, "could not parse schedule '%s' (%s)",
+               ss->key->str, jerr.text);
+    return;
+  }
+
+  if (!parse_phoscon_schedule(ss->store, ss->key->str, jent, &ss->err)) {
+    g_prefix_error(&ss->err, "parse schedule '%s': ", ss->key->str);
+  }
+  json_decref(jent);
+}
+
+/* Parse errors are kept until the transfer is done so a failing HTTP
+ * status is reported rather than an aborted transfer
+ */
+static gboolean
+schedule_stream_feed(const gchar *data, gsize len, gpointer user_data)
+{
+  struct schedule_stream *ss = (struct schedule_stream *) user_data;
+  gsize i;
+
+  for (i = 0; i < len && !ss->err; i++) {
+    gchar c = data[i];
+
+    if (ss->depth >= 2) {
+      g_string_append_c(ss->value, c);
+    }
+
+    if (ss->in_str) {
+      if (ss->escape) {
+        ss->escape = FALSE;
+      } else if (c == '\\') {
+        ss->escape = TRUE;
+      } else if (c == '"') {
+        ss->in_str = FALSE;
+      } else if (ss->depth == 1) {
+        g_string_append_c(ss->key, c);
+      }
+      continue;
+    }
+
+    switch (c) {
+    case '"':
+      ss->in_str = TRUE;
+      if (ss->depth == 1) {
+        g_string_truncate(ss->key, 0);
+      }
+      break;
+    case '{':
+    case '[':
+      if (ss->depth == 0) {
+        if (c != '{' || ss->started) {
+          SET_GERROR(&ss->err, -1, "unexpected response, not an object");
+          break;
+        }
+        ss->started = TRUE;
+      } else if (ss->depth == 1) {
+        g_string_truncate(ss->value, 0);
+        g_string_append_c(ss->value, c);
+      }
+      ss->depth++;
+      break;
+    case '}':
+    case ']':
+      if (--ss->depth < 0) {
+        SET_GERROR(&ss->err, -1, "malformed JSON response");
+      } else if (ss->depth == 1) {
+        schedule_stream_member(ss);
+      }
+      break;
+    default:
+      break;
+    }
+  }
+
+  return TRUE;
+}
+
+static gboolean
+schedule_stream_end(struct schedule_stream *ss, GError **err)
+{
+  if (ss->err) {
+    g_propagate_error(err, g_steal_pointer(&ss->err));
+    return FALSE;
+  } else if (!ss->started || ss->depth != 0 || ss->in_str) {
+    SET_GERROR(err, -1, "truncated phoscon JSON response");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Gateway request, started once a connection is free */
+struct phoscon_req {
+  phoscon_client_t *pc;
+  conn_handle_t *handle;
+  gchar *url;
+  const gchar *method;     /* NULL for a PUT with data, else a GET */
+  const gchar *data;       /* Body of a PUT or POST */
+  GAsyncReadyCallback done;
+  gpointer priv;           /* Request specific data */
+  GDestroyNotify priv_free;
+};
+
+static void
+free_phoscon_req(gpointer data)
+{
+  struct phoscon_req *req = (struct phoscon_req *) data;
+
+  g_assert(req->handle == NULL);
+
+  g_free(req->url);
+  if (req->priv_free) {
+    req->priv_free(req->priv);
+  }
+  g_free(req);
+}
+
+/*
+ * Take an idle connection, a new one is set up as long as the configured
+ * number of parallel connections is not reached. Returns NULL without
+ * setting err if the caller has to wait for a connection to be released.
+ */
+static conn_handle_t *
+acquire_handle(phoscon_client_t *pc, GError **err)
+{
+  conn_handle_t *handle;
+
+  if (!g_queue_is_empty(&pc->idle_handles)) {
+    return g_queue_pop_head(&pc->idle_handles);
+  } else if (pc->n_handles >= pc->cfg.max_parallel) {
+    return NULL;
+  }
+
+  if ((handle = util_init_handle(err)) != NULL) {
+    pc->n_handles++;
+  }
+
+  return handle;
+}
+
+/* Takes ownership of url, data is sent from the callers buffer which must
+ * outlive the request
+ */
+static GTask *
+new_request(phoscon_client_t *pc, gchar *url, const gchar *data,
+            GAsyncReadyCallback done, GCancellable *cancellable,
+            GAsyncReadyCallback callback, gpointer user_data)
+{
+  struct phoscon_req *req;
+  GTask *task;
+
+  req = g_malloc0(sizeof(*req));
+  req->pc = pc;
+  req->url = url;
+  req->data = data;
+  req->done = done;
+
+  task = g_task_new(NULL, cancellable, callback, user_data);
+  g_task_set_task_data(task, req, free_phoscon_req);
+
+  return task;
+}
+
+/* Consumes the task reference, it is passed on to the done callback */
+static void
+submit_request(GTask *task)
+{
+  struct phoscon_req *req = g_task_get_task_data(task);
+  GError *err = NULL;
+
+  if ((req->handle = acquire_handle(req->pc, &err)) == NULL) {
+    if (err) {
+      g_task_return_error(task, err);
+      g_object_unref(task);
+    } else {
+      g_queue_push_tail(&req->pc->waiting, task);
+    }
+    return;
+  }
+
+  g_debug("URL: %s", req->url);
+  if (g_strcmp0(req->method, "POST") == 0) {
+    util_http_post_async(req->handle, req->url, req->data,
+                         g_task_get_cancellable(task), req->done, task);
+  } else if (g_strcmp0(req->method, "DELETE") == 0) {
+    util_http_delete_async(req->handle, req->url,
+                           g_task_get_cancellable(task), req->done, task);
+  } else if (req->data) {
+    util_http_put_async(req->handle, req->url, req->data,
+                        g_task_get_cancellable(task), req->done, task);
+  } else {
+    util_http_get_async(req->handle, req->url,
+                        g_task_get_cancellable(task), req->done, task);
+  }
+}
+
+/*
+ * Give the connection of a finished request back to the pool and start the
+ * next waiting request on it. Call once the response buffer is consumed.
+ */
+static void
+release_request(struct phoscon_req *req)
+{
+  phoscon_client_t *pc = req->pc;
+
+  g_queue_push_head(&pc->idle_handles, g_steal_pointer(&req->handle));
+  if (!g_queue_is_empty(&pc->waiting)) {
+    submit_request(g_queue_pop_head(&pc->waiting));
+  }
+}
+
+/* Initial schedule fetch, streamed into a fresh store */
+struct schedule_fetch {
+  phoscon_client_t *pc;
+  conn_handle_t *handle;
+  struct schedule_stream ss;
+};
+
+static void
+free_schedule_fetch(struct schedule_fetch *sf)
+{
+  g_clear_pointer(&sf->ss.store, schedule_store_free);
+  util_set_handle_sink(sf->handle, NULL, NULL);
+  g_queue_push_head(&sf->pc->idle_handles, sf->handle);
+  g_clear_error(&sf->ss.err);
+  g_string_free(sf->ss.key, TRUE);
+  g_string_free(sf->ss.value, TRUE);
+  g_free(sf);
+}
+
+static void
+fetch_all_schedules_done(GObject *source, GAsyncResult *res,
+                         gpointer user_data)
+{
+  GTask *task = G_TASK(user_data);
+  struct schedule_fetch *sf = g_task_get_task_data(task);
+  phoscon_client_t *pc = sf->pc;
+  GError *err = NULL;
+
+  if (!util_http_finish(sf->handle, res, &err)) {
+    g_prefix_error(&err, "connection to phoscon failed: ");
+  } else if (schedule_stream_end(&sf->ss, &err)) {
+    /* Replaces the current store on success only */
+    g_clear_pointer(&pc->schedules, schedule_store_free);
+    pc->schedules = g_steal_pointer(&sf->ss.store);
+  }
+
+  /* The connection goes back before the caller may free the client */
+  free_schedule_fetch(sf);
+  if (err) {
+    g_task_return_error(task, err);
+  } else {
+    g_task_return_boolean(task, TRUE);
+  }
+  g_object_unref(task);
+}
+
+static void
+fetch_all_schedules_async(phoscon_client_t *pc, GCancellable *cancellable,
+                          GAsyncReadyCallback callback, gpointer user_data)
+{
+  struct schedule_fetch *sf;
+  conn_handle_t *handle;
+  GError *err = NULL;
+  GTask *task;
+  gchar *url;
+
+  g_assert(pc);
+  g_assert(pc->base_url);
+
+  task = g_task_new(NULL, cancellable, callback, user_data);
+
+  /* Only used before any other request, a connection is free */
+  if ((handle = acquire_handle(pc, &err)) == NULL) {
+    g_task_return_error(task, err);
+    g_object_unref(task);
+    return;
+  }
+
+  sf = g_malloc0(sizeof(*sf));
+  sf->pc = pc;
+  sf->handle = handle;
+  sf->ss.store = schedule_store_new();
+  sf->ss.key = g_string_new(NULL);
+  sf->ss.value = g_string_new(NULL);
+  util_set_handle_sink(handle, schedule_stream_feed, &sf->ss);
+  g_task_set_task_data(task, sf, NULL);
+
+  url = g_strdup_printf("%s/schedules", pc->base_url);
+  util_http_get_async(handle, url, cancellable, fetch_all_schedules_done,
+                      task);
+  g_free(url);
+}
+
+static gboolean
+fetch_all_schedules_finish(GAsyncResult *res, GError **err)
+{
+  g_return_val_if_fail(g_task_is_valid(res, NULL), FALSE);
+
+  return g_task_propagate_boolean(G_TASK(res), err);
+}
+
+static gint
+find_daylight_sensor(json_t *jsensors, json_t **jsensor)
+{
+  const gchar *key = NULL;
+  json_t *jent = NULL;
+
+  json_object_foreach(jsensors, key, jent) {
+    json_t *jtype = json_object_get(jent, "type");
+
+    if (g_strcmp0(json_string_value(jtype), "Daylight") == 0) {
+      *jsensor = jent;
+      return g_ascii_strtoll(key, NULL, 10);
+    }
+  }
+
+  return -1;
+}
+
+/* Sunrise and sunset read from the Daylight sensor */
+struct daylight_times {
+  GDateTime *sunrise;
+  GDateTime *sunset;
+};
+
+static void
+free_daylight_times(gpointer data)
+{
+  struct daylight_times *dt = (struct daylight_times *) data;
+
+  g_clear_pointer(&dt->sunrise, g_date_time_unref);
+  g_clear_pointer(&dt->sunset, g_date_time_unref);
+  g_free(dt);
+}
+
+static gboolean
+parse_daylight_sensor(phoscon_client_t *pc, GString *buff,
+                      struct daylight_times *times, GError **err)
+{
+  json_t *jobj = NULL;
+  json_t *jsensor = NULL;
+  json_error_t jerr = { 0, };
+  const gchar *srise_str = NULL;
+  const gchar *sset_str = NULL;
+  gboolean configured = FALSE;
+  gboolean ret = FALSE;
+
+  g_assert(pc);
+  g_debug("buffer: %s", buff->str);
+
+  if ((jobj = json_loads(buff->str, 0, &jerr)) == NULL) {
+    SET_GERROR(err, -1, "could not parse phoscon JSON response");
+    goto out;
+  }
+
+  if (pc->daylight_id < 0) {
+    if ((pc->daylight_id = find_daylight_sensor(jobj, &jsensor)) < 0) {
+      SET_GERROR(err, -1, "gateway has no Daylight sensor");
+      goto out;
+    }
+    g_message("Using Daylight sensor ID=%d", pc->daylight_id);
+  } else {
+    jsensor = jobj;
+  }
+
+  if (json_unpack_ex(jsensor, &jerr, 0, "{s:{s:b},s:{s:s,s:s}}",
+                     "config", "configured", &configured,
+                     "state",  "sunrise",    &srise_str,
+                               "sunset",     &sset_str) != 0) {
+    SET_GERROR(err, -1, "unexpected Daylight sensor response (%s)",
+               jerr.text);
+    goto out;
+  } else if (!configured) {
+    SET_GERROR(err, -1, "Daylight sensor location is not configured");
+    goto out;
+  }
+
+  if ((times->sunrise = parse_phoscon_timestamp(srise_str)) == NULL) {
+    SET_GERROR(err, -1, "could not parse sunrise timestamp '%s'", srise_str);
+    goto out;
+  } else if ((times->sunset = parse_phoscon_timestamp(sset_str)) == NULL) {
+    SET_GERROR(err, -1, "could not parse sunset timestamp '%s'", sset_str);
+    goto out;
+  }
+
+  ret = TRUE;
+
+out:
+  if (jobj) {
+    json_decref(jobj);
+  }
+
+  return ret;
+}
+
+static void
+daylight_sensor_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  GTask *task = G_TASK(user_data);
+  struct phoscon_req *req = g_task_get_task_data(task);
+  struct daylight_times *times = NULL;
+  GError *err = NULL;
+
+  if (!util_http_finish(req->handle, res, &err)) {
+    g_prefix_error(&err, "connection to phoscon failed: ");
+  } else {
+    times = g_malloc0(sizeof(*times));
+    if (!parse_daylight_sensor(req->pc, util_get_handle_buffer(req->handle),
+                               times, &err)) {
+      g_clear_pointer(&times, free_daylight_times);
+    }
+  }
+  release_request(req);
+
+  if (times) {
+    g_task_return_pointer(task, times, free_daylight_times);
+  } else {
+    g_task_return_error(task, err);
+  }
+  g_object_unref(task);
+}
+
+static void
+patch_time_of_day(struct schedule_rec *rec, guint pos, const gchar *hms)
+{
+  memcpy(rec->req + pos + rec->time_len - TIME_OF_DAY_LEN, hms,
+         TIME_OF_DAY_LEN);
+}
+
+/* Time of day of a UNIX time shifted by offset seconds */
+static void
+format_time_of_day(gint64 t, gint32 offset, gchar hms[TIME_OF_DAY_LEN + 1])
+{
+  gint secs = (gint) (((t + offset) % SECS_PER_DAY + SECS_PER_DAY) %
+                      SECS_PER_DAY);
+
+  g_snprintf(hms, TIME_OF_DAY_LEN + 1, "%02d:%02d:%02d", secs / 3600,
+             secs / 60 % 60, secs % 60);
+}
+
+static gboolean
+time_str_unchanged(const struct schedule_rec *rec, guint pos,
+                   const gchar *str)
+{
+  return str && strlen(str) == rec->time_len &&
+         memcmp(str, rec->req + pos, rec->time_len) == 0;
+}
+
+static gint32
+tz_offset_at(GTimeZone *tz, gint64 t)
+{
+  return g_time_zone_get_offset(tz, g_time_zone_find_interval(tz,
+                                G_TIME_TYPE_UNIVERSAL, t));
+}
+
+/* Find the offset changes of a year, day by day and then bisected down to
+ * the second. Two changes within the same day are not detected.
+ */
+static void
+tz_table_build(struct tz_table *tt, gint year)
+{
+  GDateTime *dt;
+  gint64 t;
+
+  dt = g_date_time_new_utc(year, 1, 1, 0, 0, 0);
+  tt->start = g_date_time_to_unix(dt);
+  g_date_time_unref(dt);
+  dt = g_date_time_new_utc(year + 1, 1, 1, 0, 0, 0);
+  tt->end = g_date_time_to_unix(dt);
+  g_date_time_unref(dt);
+
+  tt->year = year;
+  tt->n_spans = 1;
+  tt->spans[0].start = tt->start;
+  tt->spans[0].offset = tz_offset_at(tt->tz, tt->start);
+
+  for (t = tt->start; t < tt->end; t += SECS_PER_DAY) {
+    gint32 cur = tt->spans[tt->n_spans - 1].offset;
+    gint64 lo = t;
+    gint64 hi = MIN(t + SECS_PER_DAY, tt->end - 1);
+
+    if (tz_offset_at(tt->tz, hi) == cur) {
+      continue;
+    }
+
+    while (hi - lo > 1) {
+      gint64 mid = lo + (hi - lo) / 2;
+
+      if (tz_offset_at(tt->tz, mid) == cur) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+
+    if (tt->n_spans == MAX_TZ_SPANS) {
+      g_warning("More than %d UTC offsets in %d, ignoring the rest",
+                MAX_TZ_SPANS, year);
+      break;
+    }
+    tt->spans[tt->n_spans].start = hi;
+    tt->spans[tt->n_spans].offset = tz_offset_at(tt->tz, hi);
+    g_debug("UTC offset %+d seconds from UNIX time %" G_GINT64_FORMAT,
+            tt->spans[tt->n_spans].offset, hi);
+    tt->n_spans++;
+  }
+}
+
+/* Offset table covering the UNIX time t, rebuilt once per year */
+static const struct tz_table *
+tz_table_get(phoscon_client_t *pc, gint64 t)
+{
+  struct tz_table *tt = &pc->tzt;
+
+  if (!tt->year || t < tt->start || t >= tt->end) {
+    GDateTime *dt = g_date_time_new_from_unix_utc(t);
+
+    tz_table_build(tt, g_date_time_get_year(dt));
+    g_date_time_unref(dt);
+  }
+
+  return tt;
+}
+
+static gint32
+tz_table_offset(const struct tz_table *tt, gint64 t)
+{
+  guint i = tt->n_spans - 1;
+
+  while (i > 0 && t < tt->spans[i].start) {
+    i--;
+  }
+
+  return tt->spans[i].offset;
+}
+
+/* Copy a time value of the request to the cached schedule string */
+static void
+commit_time_str(struct schedule_rec *rec, guint pos, guint own, gchar **str)
+{
+  const gchar *val = rec->req + pos;
+
+  if (*str && strlen(*str) == rec->time_len) {
+    memcpy(*str, val, rec->time_len);
+  } else {
+    replace_rec_str(rec, own, str, val, rec->time_len);
+  }
+}
+
+static gboolean
+skip_json_token(const gchar **p, const gchar *token)
+{
+  gsize len = strlen(token);
+
+  while (g_ascii_isspace(**p)) {
+    (*p)++;
+  }
+  if (strncmp(*p, token, len) != 0) {
+    return FALSE;
+  }
+  *p += len;
+
+  return TRUE;
+}
+
+/*
+ * The gateway answers an update with one entry per changed attribute,
+ * [{"success":{...}},...] if all of them were applied. The common case is
+ * recognised without building the DOM, which is only used when "error"
+ * appears somewhere, possibly inside an echoed value. Every entry must then
+ * be a success for the update to count as applied.
+ */
+static gboolean
+check_put_response(GString *buff, GError **err)
+{
+  const gchar *p = buff->str;
+  json_t *jresp = NULL;
+  json_t *jtmp = NULL;
+  json_error_t jerr = { 0, };
+  gboolean ret = FALSE;
+  gsize i;
+
+  g_debug("response buff: %s", buff->str);
+  if (skip_json_token(&p, "[") && skip_json_token(&p, "{") &&
+      skip_json_token(&p, "\"success\"") &&
+      g_strstr_len(p, buff->len - (p - buff->str), "\"error\"") == NULL) {
+    return TRUE;
+  }
+
+  /* Parse the JSON */
+  if ((jresp = json_loads(buff->str, 0, &jerr)) == NULL) {
+    SET_GERROR(err, -1, "could not parse phoscon JSON response");
+    goto out;
+  }
+
+  if (!json_is_array(jresp) || json_array_size(jresp) == 0) {
+    SET_GERROR(err, -1, "unexpected response from server: not an array");
+    goto out;
+  }
+
+  json_array_foreach(jresp, i, jtmp) {
+    const gchar *descr = NULL;
+
+    if (json_object_get(jtmp, "error")) {
+      json_unpack(jtmp, "{s:{s:s}}", "error", "description", &descr);
+      SET_GERROR(err, -1, "gateway error: %s",
+                 descr ? descr : "no description");
+      goto out;
+    } else if (!json_object_get(jtmp, "success")) {
+      SET_GERROR(err, -1, "unexpected response from server: %s",
+                 "missing success string");
+      goto out;
+    }
+  }
+  ret = TRUE;
+
+out:
+  if (jresp) {
+    json_decref(jresp);
+  }
+
+  return ret;
+}
+
+/* The request owns the prebuilt body of the schedule until it is freed */
+static void
+release_schedule_rec(gpointer data)
+{
+  struct schedule_rec *rec = (struct schedule_rec *) data;
+
+  rec->busy = FALSE;
+}
+
+static void
+update_schedule_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  GTask *task = G_TASK(user_data);
+  struct phoscon_req *req = g_task_get_task_data(task);
+  struct schedule_rec *rec = req->priv;
+  GError *err = NULL;
+  gboolean ok;
+
+  ok = util_http_finish(req->handle, res, &err) &&
+       check_put_response(util_get_handle_buffer(req->handle), &err);
+  release_request(req);
+
+  if (!ok) {
+    g_task_return_error(task, err);
+    goto out;
+  }
+
+  /* Only remember the new time once the gateway has it, a failed update
+   * is then retried by the next poll.
+   */
+  commit_time_str(rec, rec->time_pos, REC_OWN_TIMESTR, &rec->ent.timestr);
+  if (rec->ltime_pos) {
+    commit_time_str(rec, rec->ltime_pos, REC_OWN_LOCAL_TIMESTR,
+                    &rec->ent.local_timestr);
+  }
+  rec->digest = schedule_rec_digest(rec);
+  g_task_return_boolean(task, TRUE);
+
+out:
+  g_object_unref(task);
+}
+
+static void
+put_state_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  GTask *task = G_TASK(user_data);
+  struct phoscon_req *req = g_task_get_task_data(task);
+  GError *err = NULL;
+  gboolean ok;
+
+  ok = util_http_finish(req->handle, res, &err) &&
+       check_put_response(util_get_handle_buffer(req->handle), &err);
+  release_request(req);
+
+  if (ok) {
+    g_task_return_boolean(task, TRUE);
+  } else {
+    g_task_return_error(task, err);
+  }
+  g_object_unref(task);
+}
+
+static void
+prewarm_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  GTask *task = G_TASK(user_data);
+  struct phoscon_req *req = g_task_get_task_data(task);
+  GError *err = NULL;
+
+  if (!util_http_finish(req->handle, res, &err)) {
+    g_debug("Pre-warming gateway connection failed: %s", GERROR_MSG(err));
+    g_clear_error(&err);
+  }
+  release_request(req);
+  req->pc->n_own--;
+
+  g_task_return_boolean(task, TRUE);
+  g_object_unref(task);
+}
+
+/* Daylight sensor status codes of the sun events, see the deCONZ
+ * Daylight sensor documentation
+ */
+static const gint daylight_status[SUN_EVENT_COUNT] = {
+  [SUN_EVENT_SUNRISE]       = 140,   /* sunriseStart */
+  [SUN_EVENT_SUNSET]        = 200,   /* sunsetEnd */
+  [SUN_EVENT_SOLAR_NOON]    = 170,   /* solarNoon */
+  [SUN_EVENT_CIVIL_DAWN]    = 130,   /* dawn */
+  [SUN_EVENT_CIVIL_DUSK]    = 210,   /* dusk */
+  [SUN_EVENT_NAUTICAL_DAWN] = 120,   /* nauticalDawn */
+  [SUN_EVENT_NAUTICAL_DUSK] = 220,   /* nauticalDusk */
+  [SUN_EVENT_ASTRO_DAWN]    = 110,   /* nightEnd */
+  [SUN_EVENT_ASTRO_DUSK]    = 230,   /* nightStart */
+};
+
+/* Managed rule as it should be on the gateway */
+struct wanted_rule {
+  gchar *name;
+  enum sun_event ev;
+  gchar *resource;
+  json_t *jbody;
+  json_t *jrule;           /* Built once the Daylight sensor is known */
+  gboolean found;
+};
+
+/* Rule synchronisation in progress */
+struct rule_sync {
+  phoscon_client_t *pc;
+  gchar *prefix;
+  GPtrArray *wanted;
+  struct phoscon_rule_stats stats;
+  guint n_pending;
+  GError *err;             /* First failed write */
+};
+
+/* Rule write in flight, owns the request body */
+struct rule_write {
+  GTask *sync;
+  gchar *name;
+  gchar *body;
+  guint *counter;          /* Bumped in the stats on success */
+};
+
+static void
+free_wanted_rule(gpointer data)
+{
+  struct wanted_rule *w = (struct wanted_rule *) data;
+
+  g_free(w->name);
+  g_free(w->resource);
+  json_decref(w->jbody);
+  if (w->jrule) {
+    json_decref(w->jrule);
+  }
+  g_free(w);
+}
+
+static void
+free_rule_sync(gpointer data)
+{
+  struct rule_sync *rs = (struct rule_sync *) data;
+
+  g_free(rs->prefix);
+  g_ptr_array_unref(rs->wanted);
+  g_clear_error(&rs->err);
+  g_free(rs);
+}
+
+static void
+free_rule_write(gpointer data)
+{
+  struct rule_write *rw = (struct rule_write *) data;
+
+  g_object_unref(rw->sync);
+  g_free(rw->name);
+  g_free(rw->body);
+  g_free(rw);
+}
+
+/* Fire on the status change to the phase of the event, "dx" makes the rule
+ * trigger on the change only rather than on every sensor update
+ */
+static json_t *
+build_rule_json(gint sensor_id, const struct wanted_rule *w)
+{
+  gchar *addr = g_strdup_printf("/sensors/%d/state/status", sensor_id);
+  gchar *res = g_strdup_printf("/%s", w->resource);
+  gchar *status = g_strdup_printf("%d", daylight_status[w->ev]);
+  json_t *jrule;
+
+  jrule = json_pack("{s:s,s:s,s:[{s:s,s:s,s:s},{s:s,s:s}],s:[{s:s,s:s,s:O}]}",
+                    "name", w->name, "status", "enabled",
+                    "conditions",
+                      "address", addr, "operator", "eq", "value", status,
+                      "address", addr, "operator", "dx",
+                    "actions",
+                      "address", res, "method", "PUT", "body", w->jbody);
+  g_free(status);
+  g_free(res);
+  g_free(addr);
+
+  return jrule;
+}
+
+static gboolean
+rule_matches(json_t *jgot, json_t *jwant)
+{
+  return json_equal(json_object_get(jgot, "conditions"),
+                    json_object_get(jwant, "conditions")) &&
+         json_equal(json_object_get(jgot, "actions"),
+                    json_object_get(jwant, "actions")) &&
+         json_equal(json_object_get(jgot, "status"),
+                    json_object_get(jwant, "status"));
+}
+
+static void
+rule_sync_complete(GTask *task)
+{
+  struct rule_sync *rs = g_task_get_task_data(task);
+
+  if (rs->err) {
+    g_task_return_error(task, g_steal_pointer(&rs->err));
+  } else {
+    g_task_return_boolean(task, TRUE);
+  }
+}
+
+static void
+rule_write_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  GTask *task = G_TASK(user_data);
+  struct phoscon_req *req = g_task_get_task_data(task);
+  struct rule_write *rw = req->priv;
+  GTask *sync = g_object_ref(rw->sync);
+  struct rule_sync *rs = g_task_get_task_data(sync);
+  GError *err = NULL;
+
+  if (util_http_finish(req->handle, res, &err) &&
+      check_put_response(util_get_handle_buffer(req->handle), &err)) {
+    (*rw->counter)++;
+  } else if (!rs->err) {
+    g_prefix_error(&err, "rule '%s': ", rw->name);
+    rs->err = g_steal_pointer(&err);
+  }
+  g_clear_error(&err);
+  release_request(req);
+  g_task_return_boolean(task, TRUE);
+  g_object_unref(task);
+
+  if (--rs->n_pending == 0) {
+    rule_sync_complete(sync);
+  }
+  g_object_unref(sync);
+}
+
+/* Issue a rule write, counted as pending until it completes */
+static void
+submit_rule_write(GTask *sync, const gchar *method, gchar *url,
+                  const gchar *name, json_t *jrule, guint *counter)
+{
+  struct rule_sync *rs = g_task_get_task_data(sync);
+  struct rule_write *rw;
+  struct phoscon_req *req;
+  GTask *task;
+
+  rw = g_malloc0(sizeof(*rw));
+  rw->sync = g_object_ref(sync);
+  rw->name = g_strdup(name);
+  rw->body = jrule ? json_dumps(jrule, JSON_COMPACT) : NULL;
+  rw->counter = counter;
+
+  g_message("Rule '%s': %s %s", name, method, url);
+  task = new_request(rs->pc, url, rw->body, rule_write_done,
+                     g_task_get_cancellable(sync), NULL, NULL);
+  req = g_task_get_task_data(task);
+  req->method = method;
+  req->priv = rw;
+  req->priv_free = free_rule_write;
+  rs->n_pending++;
+  submit_request(task);
+}
+
+/* Compare the managed rules on the gateway with the wanted ones and write
+ * only what differs
+ */
+static gboolean
+reconcile_rules(GTask *sync, GString *buff, GError **err)
+{
+  struct rule_sync *rs = g_task_get_task_data(sync);
+  phoscon_client_t *pc = rs->pc;
+  json_error_t jerr = { 0, };
+  json_t *jrules;
+  json_t *jrule;
+  const gchar *id;
+  guint i;
+
+  if ((jrules = json_loads(buff->str, 0, &jerr)) == NULL ||
+      !json_is_object(jrules)) {
+    SET_GERROR(err, -1, "unexpected rule list from gateway");
+    if (jrules) {
+      json_decref(jrules);
+    }
+    return FALSE;
+  }
+
+  for (i = 0; i < rs->wanted->len; i++) {
+    struct wanted_rule *w = g_ptr_array_index(rs->wanted, i);
+
+    w->jrule = build_rule_json(pc->daylight_id, w);
+  }
+
+  json_object_foreach(jrules, id, jrule) {
+    const gchar *name = json_string_value(json_object_get(jrule, "name"));
+    struct wanted_rule *match = NULL;
+
+    if (!name || !g_str_has_prefix(name, rs->prefix)) {
+      continue;
+    }
+
+    for (i = 0; i < rs->wanted->len && !match; i++) {
+      struct wanted_rule *w = g_ptr_array_index(rs->wanted, i);
+
+      if (!w->found && g_strcmp0(w->name, name) == 0) {
+        match = w;
+      }
+    }
+
+    if (!match) {
+      submit_rule_write(sync, "DELETE",
+                        g_strdup_printf("%s/rules/%s", pc->base_url, id),
+                        name, NULL, &rs->stats.deleted);
+    } else if (!rule_matches(jrule, match->jrule)) {
+      match->found = TRUE;
+      submit_rule_write(sync, "PUT",
+                        g_strdup_printf("%s/rules/%s", pc->base_url, id),
+                        name, match->jrule, &rs->stats.updated);
+    } else {
+      match->found = TRUE;
+      rs->stats.unchanged++;
+    }
+  }
+
+  for (i = 0; i < rs->wanted->len; i++) {
+    struct wanted_rule *w = g_ptr_array_index(rs->wanted, i);
+
+    if (!w->found) {
+      submit_rule_write(sync, "POST",
+                        g_strdup_printf("%s/rules", pc->base_url),
+                        w->name, w->jrule, &rs->stats.created);
+    }
+  }
+  json_decref(jrules);
+
+  return TRUE;
+}
+
+static void
+rule_list_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  GTask *task = G_TASK(user_data);
+  struct phoscon_req *req = g_task_get_task_data(task);
+  GTask *sync = g_object_ref(req->priv);
+  struct rule_sync *rs = g_task_get_task_data(sync);
+  GError *err = NULL;
+
+  /* Hold the sync open while the writes are issued */
+  rs->n_pending++;
+  if (!util_http_finish(req->handle, res, &err) ||
+      !reconcile_rules(sync, util_get_handle_buffer(req->handle), &err)) {
+    g_prefix_error(&err, "fetch rules: ");
+    rs->err = g_steal_pointer(&err);
+  }
+  release_request(req);
+  g_task_return_boolean(task, TRUE);
+
+  if (--rs->n_pending == 0) {
+    rule_sync_complete(sync);
+  }
+  g_object_unref(task);
+  g_object_unref(sync);
+}
+
+static void
+fetch_rules(GTask *sync)
+{
+  struct rule_sync *rs = g_task_get_task_data(sync);
+  struct phoscon_req *req;
+  GTask *task;
+
+  task = new_request(rs->pc, g_strdup_printf("%s/rules", rs->pc->base_url),
+                     NULL, rule_list_done, g_task_get_cancellable(sync),
+                     NULL, NULL);
+  req = g_task_get_task_data(task);
+  req->priv = g_object_ref(sync);
+  req->priv_free = g_object_unref;
+  submit_request(task);
+}
+
+static void
+rule_sensors_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  GTask *task = G_TASK(user_data);
+  struct phoscon_req *req = g_task_get_task_data(task);
+  GTask *sync = g_object_ref(req->priv);
+  phoscon_client_t *pc = req->pc;
+  json_error_t jerr = { 0, };
+  json_t *jsensors = NULL;
+  json_t *jsensor = NULL;
+  GError *err = NULL;
+
+  if (util_http_finish(req->handle, res, &err)) {
+    jsensors = json_loads(util_get_handle_buffer(req->handle)->str, 0,
+                          &jerr);
+    if (!jsensors) {
+      SET_GERROR(&err, -1, "could not parse phoscon JSON response");
+    } else if ((pc->daylight_id = find_daylight_sensor(jsensors,
+                                                        &jsensor)) < 0) {
+      SET_GERROR(&err, -1, "gateway has no Daylight sensor");
+    } else {
+      g_message("Using Daylight sensor ID=%d", pc->daylight_id);
+    }
+  }
+  if (jsensors) {
+    json_decref(jsensors);
+  }
+  release_request(req);
+  g_task_return_boolean(task, TRUE);
+  g_object_unref(task);
+
+  if (err) {
+    g_task_return_error(sync, err);
+  } else {
+    fetch_rules(sync);
+  }
+  g_object_unref(sync);
+}
+
+/* Schedule resync in progress */
+struct resync {
+  struct phoscon_resync_stats stats;
+  guint n_pending;
+  GError *err;             /* First failed entry */
+};
+
+/* Fetch of one schedule during a resync */
+struct resync_fetch {
+  GTask *sync;
+  gint id;
+};
+
+static void
+free_resync(gpointer data)
+{
+  struct resync *rs = (struct resync *) data;
+
+  g_clear_error(&rs->err);
+  g_free(rs);
+}
+
+static void
+free_resync_fetch(gpointer data)
+{
+  struct resync_fetch *rf = (struct resync_fetch *) data;
+
+  g_object_unref(rf->sync);
+  g_free(rf);
+}
+
+/* Swap in the schedule if its digest changed, returns FALSE on errors */
+static gboolean
+resync_schedule(phoscon_client_t *pc, gint id, GString *buff,
+                struct phoscon_resync_stats *stats, GError **err)
+{
+  struct schedule_rec *rec;
+  json_error_t jerr = { 0, };
+  json_t *jent;
+  guint64 digest;
+  gboolean ret = FALSE;
+
+  if ((rec = schedule_store_lookup(pc->schedules, id)) == NULL) {
+    SET_GERROR(err, -1, "schedule was not present at startup");
+    return FALSE;
+  } else if ((jent = json_loadb(buff->str, buff->len, 0, &jerr)) == NULL) {
+    SET_GERROR(err, -1, "could not parse phoscon JSON response");
+    return FALSE;
+  }
+
+  if ((digest = schedule_json_digest(jent)) == rec->digest) {
+    stats->skipped++;
+    ret = TRUE;
+  } else if (rec->busy) {
+    /* The update in flight owns the request, retried by the next resync */
+    g_debug("Schedule [%d] changed during an update, deferred", id);
+    stats->deferred++;
+    ret = TRUE;
+  } else if (fill_schedule_rec(pc->schedules, rec, jent, err)) {
+    g_message("Schedule [%d] '%s' was changed on the gateway", id,
+              rec->ent.name);
+    stats->updated++;
+    ret = TRUE;
+  }
+  json_decref(jent);
+
+  return ret;
+}
+
+static void
+resync_schedule_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  GTask *task = G_TASK(user_data);
+  struct phoscon_req *req = g_task_get_task_data(task);
+  struct resync_fetch *rf = req->priv;
+  GTask *sync = g_object_ref(rf->sync);
+  struct resync *rs = g_task_get_task_data(sync);
+  gint id = rf->id;
+  GError *err = NULL;
+
+  if (!util_http_finish(req->handle, res, &err) ||
+      !resync_schedule(req->pc, id, util_get_handle_buffer(req->handle),
+                       &rs->stats, &err)) {
+    rs->stats.failed++;
+    if (!rs->err) {
+      g_prefix_error(&err, "schedule ID=%d: ", id);
+      rs->err = g_steal_pointer(&err);
+    }
+    g_clear_error(&err);
+  }
+  release_request(req);
+  g_task_return_boolean(task, TRUE);
+  g_object_unref(task);
+
+  if (--rs->n_pending == 0) {
+    if (rs->err) {
+      g_task_return_error(sync, g_steal_pointer(&rs->err));
+    } else {
+      g_task_return_boolean(sync, TRUE);
+    }
+  }
+  g_object_unref(sync);
+}
+
+/* Schedule change pushed by the gateway, applied through a resync of the
+ * single entry
+ */
+struct event_patch {
+  phoscon_client_t *pc;
+  gint id;
+  gint64 recv_time;
+};
+
+static void
+event_patch_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  struct event_patch *ep = (struct event_patch *) user_data;
+  phoscon_client_t *pc = ep->pc;
+  struct phoscon_resync_stats stats = { 0, };
+  GError *err = NULL;
+  gint64 latency;
+
+  if (!phoscon_client_resync_schedules_finish(res, &stats, &err)) {
+    if (!g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+      g_warning("Schedule [%d] event not applied: %s", ep->id,
+                GERROR_MSG(err));
+    }
+    g_clear_error(&err);
+  } else if (stats.updated) {
+    latency = g_get_monotonic_time() - ep->recv_time;
+    pc->ev_stats.patched++;
+    pc->ev_stats.latency_sum += latency;
+    pc->ev_stats.latency_max = MAX(pc->ev_stats.latency_max, latency);
+    g_message("Schedule [%d] updated from a gateway event in %.1f ms",
+              ep->id, latency / 1000.0);
+  } else {
+    pc->ev_stats.unchanged++;
+    g_debug("Schedule [%d] event left the entry unchanged", ep->id);
+  }
+  pc->n_own--;
+  g_free(ep);
+}
+
+static void
+handle_schedule_event(phoscon_client_t *pc, const gchar *e, gint id,
+                      gint64 recv_time)
+{
+  struct schedule_rec *rec;
+  struct event_patch *ep;
+
+  if ((rec = schedule_store_lookup(pc->schedules, id)) == NULL) {
+    g_debug("Event '%s' of unknown schedule [%d]", e, id);
+    return;
+  } else if (g_strcmp0(e, "deleted") == 0) {
+    g_warning("Schedule [%d] '%s' was deleted on the gateway", id,
+              rec->ent.name);
+    return;
+  }
+
+  ep = g_malloc0(sizeof(*ep));
+  ep->pc = pc;
+  ep->id = id;
+  ep->recv_time = recv_time;
+  pc->n_own++;
+  phoscon_client_resync_schedules_async(pc, &ep->id, 1, pc->ev_cancellable,
+                                        event_patch_done, ep);
+}
+
+/* Events are {"t":"event","e":"changed","r":"<resource>","id":"<id>",...}.
+ * deCONZ only sends them for groups, lights, scenes and sensors, schedule
+ * events come from stand-ins and other gateways sending them.
+ */
+static void
+handle_gateway_event(const gchar *data, gsize len, gint64 recv_time,
+                     gpointer user_data)
+{
+  phoscon_client_t *pc = (phoscon_client_t *) user_data;
+  json_error_t jerr = { 0, };
+  const gchar *type = NULL;
+  const gchar *e = NULL;
+  const gchar *r = NULL;
+  const gchar *id_str = NULL;
+  json_t *jev;
+  gint status;
+  gint id;
+
+  g_debug("Gateway event: %s", data);
+  if ((jev = json_loadb(data, len, 0, &jerr)) == NULL) {
+    g_debug("Could not parse gateway event (%s)", jerr.text);
+    return;
+  } else if (json_unpack(jev, "{s:s,s:s,s:s,s:s}", "t", &type, "e", &e,
+                         "r", &r, "id", &id_str) != 0 ||
+             g_strcmp0(type, "event") != 0) {
+    goto out;
+  }
+
+  pc->ev_stats.received++;
+  id = g_ascii_strtoll(id_str, NULL, 10);
+  if (g_strcmp0(r, "schedules") == 0) {
+    handle_schedule_event(pc, e, id, recv_time);
+  } else if (g_strcmp0(r, "sensors") == 0 && id == pc->daylight_id &&
+             json_unpack(jev, "{s:{s:i}}", "state", "status", &status) == 0 &&
+             status != pc->ev_stats.daylight_status) {
+    pc->ev_stats.daylight_status = status;
+    g_message("Daylight sensor status is now %d", status);
+    if (pc->daylight_func) {
+      pc->daylight_func(status, pc->daylight_data);
+    }
+  }
+
+out:
+  json_decref(jev);
+}
+
+static void
+start_event_listener(phoscon_client_t *pc, guint port)
+{
+  pc->ws = ws_client_new(pc->cfg.ws_host ? pc->cfg.ws_host : pc->cfg.host,
+                         port, "/", handle_gateway_event, pc);
+  ws_client_start(pc->ws);
+}
 
+/* The websocket port is part of the gateway configuration */
 static void
-free_phoscon_client(phoscon_client_t *pc)
+ws_port_done(GObject *source, GAsyncResult *res, gpointer user_data)
 {
-  g_assert(pc);
+  GTask *task = G_TASK(user_data);
+  struct phoscon_req *req = g_task_get_task_data(task);
+  phoscon_client_t *pc = req->pc;
+  json_error_t jerr = { 0, };
+  json_t *jcfg = NULL;
+  GError *err = NULL;
+  gint port = 0;
+
+  if (!util_http_finish(req->handle, res, &err)) {
+    g_prefix_error(&err, "connection to phoscon failed: ");
+  } else if ((jcfg = json_loads(util_get_handle_buffer(req->handle)->str, 0,
+                                &jerr)) == NULL ||
+             json_unpack(jcfg, "{s:i}", "websocketport", &port) != 0 ||
+             port <= 0 || port > G_MAXUINT16) {
+    SET_GERROR(&err, -1, "gateway reports no websocket port");
+  }
+  if (jcfg) {
+    json_decref(jcfg);
+  }
+  release_request(req);
 
-  g_free(pc->cfg.api_key);
-  g_free(pc->cfg.host);
-  g_free(pc->base_url);
-  g_clear_pointer(&pc->handle, util_cleanup_handle);
-  g_clear_pointer(&pc->schedules, g_hash_table_destroy);
-  g_free(pc);
+  if (err) {
+    if (!g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+      g_warning("Gateway events not available: %s", GERROR_MSG(err));
+    }
+    g_clear_error(&err);
+  } else if (!g_cancellable_is_cancelled(pc->ev_cancellable)) {
+    start_event_listener(pc, port);
+  }
+  pc->n_own--;
+  g_task_return_boolean(task, TRUE);
+  g_object_unref(task);
 }
 
 static void
-free_schedule_entry(gpointer data)
+ev_parent_cancelled(GCancellable *parent, gpointer user_data)
+{
+  g_cancellable_cancel(G_CANCELLABLE(user_data));
+}
+
+/* Set up a client without any schedules */
+static phoscon_client_t *
+new_phoscon_client(const struct phoscon_client_cfg *cfg, GError **err)
 {
-  struct phoscon_schedule_ent *ent = (struct phoscon_schedule_ent *) data;
+  phoscon_client_t *pc;
+
+  util_init_json();
+  pc = g_malloc0(sizeof(*pc));
+  pc->cfg.port = cfg->port > 0 ? cfg->port : DEFAULT_PHOSCON_PORT;
+  pc->cfg.max_parallel = cfg->max_parallel > 0 ? cfg->max_parallel :
+                                                 DEFAULT_MAX_PARALLEL;
+  pc->cfg.api_key = g_strdup(cfg->api_key);
+  pc->cfg.host = g_strdup(cfg->host);
+  pc->cfg.timezone = g_strdup(cfg->timezone);
+  pc->cfg.ws_port = cfg->ws_port;
+  pc->cfg.ws_host = g_strdup(cfg->ws_host);
+  pc->base_url = build_phoscon_base_url(cfg, FALSE);
+  pc->daylight_id = -1;
+  if (!cfg->timezone) {
+    pc->tzt.tz = g_time_zone_new_local();
+  } else if ((pc->tzt.tz = g_time_zone_new_identifier(cfg->timezone)) == NULL) {
+    SET_GERROR(err, -1, "unknown time zone '%s'", cfg->timezone);
+    goto out_fail;
+  }
+  g_queue_init(&pc->idle_handles);
+  g_queue_init(&pc->waiting);
+  pc->cancellable = g_cancellable_new();
+
+  return pc;
+
+out_fail:
+  free_phoscon_client(pc);
 
-  g_free(ent->name);
-  g_free(ent->descr);
-  g_free(ent->status);
-  g_clear_pointer(&ent->created, g_date_time_unref);
-  g_free(ent->timestr);
-  g_free(ent->local_timestr);
-  g_free(ent);
+  return NULL;
 }
 
-static gchar *
-build_phoscon_base_url(const struct phoscon_client_cfg *cfg, gboolean use_https)
+static void
+init_fetch_done(GObject *source, GAsyncResult *res, gpointer user_data)
 {
-  g_assert(cfg);
+  GTask *task = G_TASK(user_data);
+  phoscon_client_t *pc = g_task_get_task_data(task);
+  GError *err = NULL;
+
+  if (!fetch_all_schedules_finish(res, &err)) {
+    g_prefix_error(&err, "fetch initial schedules failed, ");
+    free_phoscon_client(pc);
+    g_task_return_error(task, err);
+  } else {
+    g_message("Phoscon simple client initialised, found %u schedules",
+              pc->schedules->count);
+    g_task_return_pointer(task, pc, (GDestroyNotify) free_phoscon_client);
+  }
 
-  return g_strdup_printf("http%s://%s:%u/api/%s",
-                         use_https ? "s" : "",
-                         cfg->host, cfg->port, cfg->api_key);
+  g_object_unref(task);
 }
 
-static struct phoscon_schedule_ent *
-dup_phoscon_schedule(struct phoscon_schedule_ent *src)
+/**** Exposed functions begin here **************************************/
+
+/*
+ * Create a client and fetch all the schedules, it is returned once this
+ * completed. Only touches its own connection, so other lookups may run
+ * meanwhile. The client belongs to the thread default main context it was
+ * created from and must only be used from there.
+ */
+void
+phoscon_client_new_async(const struct phoscon_client_cfg *cfg,
+                         GCancellable *cancellable,
+                         GAsyncReadyCallback callback, gpointer user_data)
 {
-  struct phoscon_schedule_ent *dst;
+  phoscon_client_t *pc;
+  GError *err = NULL;
+  GTask *task;
+
+  g_return_if_fail(cfg != NULL);
+  g_return_if_fail(cfg->host != NULL);
+  g_return_if_fail(cfg->api_key != NULL);
+
+  task = g_task_new(NULL, cancellable, callback, user_data);
+  if ((pc = new_phoscon_client(cfg, &err)) == NULL) {
+    g_task_return_error(task, err);
+    g_object_unref(task);
+    return;
+  }
 
-  g_assert(src);
-  g_assert(src->created);
+  g_task_set_task_data(task, pc, NULL);
+  fetch_all_schedules_async(pc, cancellable, init_fetch_done, task);
+}
 
-  dst = g_malloc0(sizeof(*dst));
-  dst->id = src->id;
-  dst->name = g_strdup(src->name);
-  dst->descr = g_strdup(src->descr);
-  dst->status = g_strdup(src->status);
-  dst->created = g_date_time_ref(src->created);
-  dst->timestr = g_strdup(src->timestr);
-  dst->local_timestr = g_strdup(src->local_timestr);
+phoscon_client_t *
+phoscon_client_new_finish(GAsyncResult *res, GError **err)
+{
+  g_return_val_if_fail(g_task_is_valid(res, NULL), NULL);
 
-  return dst;
+  return g_task_propagate_pointer(G_TASK(res), err);
 }
 
-static struct phoscon_schedule_ent *
-parse_phoscon_schedule(const gchar *id, json_t *jobj, GError **err)
+phoscon_client_t *
+phoscon_client_new(const struct phoscon_client_cfg *cfg, GError **err)
 {
-  struct phoscon_schedule_ent *nsched = NULL;
-  json_error_t jerr = { 0, };
-  json_t *jdescr = NULL;
-  struct phoscon_schedule_ent sent;
-  const gchar *created_str;
-  gchar *tmp = NULL;
+  GAsyncResult *res = NULL;
+  phoscon_client_t *pc;
 
-  g_assert(jobj);
-  g_assert(id);
+  g_return_val_if_fail(cfg != NULL, NULL);
+  g_return_val_if_fail(cfg->host != NULL, NULL);
+  g_return_val_if_fail(cfg->api_key != NULL, NULL);
 
-  sent.id = g_ascii_strtoll(id, NULL, 10);
+  phoscon_client_new_async(cfg, NULL, util_async_store_result, &res);
+  pc = phoscon_client_new_finish(util_async_wait(&res), err);
+  g_object_unref(res);
 
-  if (sent.id < 0 || !json_is_object(jobj)) {
-    SET_GERROR(err, -1, "invalid phoscon schedule");
+  return pc;
+}
+
+/*
+ * As phoscon_client_new(), but the schedules are taken from a saved copy
+ * instead of being fetched. The caller is expected to resync the ones it
+ * relies on before trusting their times.
+ */
+phoscon_client_t *
+phoscon_client_restore(const struct phoscon_client_cfg *cfg,
+                       const struct phoscon_schedule_ent *ents, guint n_ents,
+                       GError **err)
+{
+  phoscon_client_t *pc;
+  struct schedule_store *store;
+  guint i;
+
+  g_return_val_if_fail(cfg != NULL, NULL);
+  g_return_val_if_fail(cfg->host != NULL, NULL);
+  g_return_val_if_fail(cfg->api_key != NULL, NULL);
+  g_return_val_if_fail(ents != NULL || n_ents == 0, NULL);
+
+  if ((pc = new_phoscon_client(cfg, err)) == NULL) {
     return NULL;
   }
 
-  /* TODO: Add proper parsing of time strings into structs */
-  if (json_unpack_ex(jobj, &jerr, 0, "{s:s,s:s,s:s,s:s,s?:s}",
-                     "created",     &created_str,
-                     "status",      &sent.status,
-                     "name",        &sent.name,
-                     "time",        &sent.timestr,
-                     "localtime",   &sent.local_timestr) != 0) {
-    SET_GERROR(err, -1, "invalid JSON response (%s)", jerr.text);
-    return NULL;
+  /* Add all records first, adding one may move the others */
+  store = schedule_store_new();
+  for (i = 0; i < n_ents; i++) {
+    if (!ents[i].timestr) {
+      SET_GERROR(err, -1, "saved schedule [%d] has no time", ents[i].id);
+      goto out_fail;
+    } else if (!schedule_store_add(store, ents[i].id, err)) {
+      goto out_fail;
+    }
   }
-  /* Try to find the description. It can be NULL, so we can't use the
-   * above unpack_ex code.
-   */
-  if ((jdescr = json_object_get(jobj, "description")) != NULL) {
-    sent.descr = (gchar *) json_string_value(jdescr);
+  for (i = 0; i < n_ents; i++) {
+    const struct phoscon_schedule_ent *ent = &ents[i];
+
+    set_schedule_rec(store, &g_array_index(store->recs, struct schedule_rec,
+                                           ent->id),
+                     ent->name, ent->descr, ent->status, ent->created,
+                     ent->timestr, ent->local_timestr);
   }
+  pc->schedules = store;
 
-  /* Pointless workaround to get the string returned by phoscon to be
-   * accepted by GLibs ISO8601 parsing function
-   */
-  tmp = g_strdup_printf("%sZ", created_str);
-  sent.created = g_date_time_new_from_iso8601(tmp, NULL);
-  g_clear_pointer(&tmp, g_free);
+  g_message("Phoscon simple client restored with %u schedules",
+            store->count);
 
-  if (sent.created == NULL) {
-    SET_GERROR(err, -1, "could not parse creation timestamp");
-    return NULL;
+  return pc;
+
+out_fail:
+  schedule_store_free(store);
+  free_phoscon_client(pc);
+
+  return NULL;
+}
+
+/* Freeing needs the requests the client started itself to be done first,
+ * see phoscon_client_cancel() and phoscon_client_busy()
+ */
+void
+phoscon_client_free(phoscon_client_t *pc)
+{
+  if (pc) {
+    free_phoscon_client(pc);
   }
+}
 
-  nsched = dup_phoscon_schedule(&sent);
-  g_date_time_unref(sent.created);
+/* Cancel the requests the client started itself, e.g. pre-warming or
+ * applying gateway events, and stop listening to the events
+ */
+void
+phoscon_client_cancel(phoscon_client_t *pc)
+{
+  g_return_if_fail(pc != NULL);
 
-  g_message("Schedule [%d] '%s' Created: %s Status: %s Time: %s (Local: %s)",
-            nsched->id, nsched->name,
-            util_dt_format(nsched->created),
-            nsched->status, nsched->timestr,
-            nsched->local_timestr);
+  g_cancellable_cancel(pc->cancellable);
+  if (pc->ev_cancellable) {
+    g_cancellable_cancel(pc->ev_cancellable);
+  }
+  g_clear_pointer(&pc->ws, ws_client_free);
+}
 
-  return nsched;
+/* Requests the client started itself are still in flight */
+gboolean
+phoscon_client_busy(phoscon_client_t *pc)
+{
+  return pc && pc->n_own > 0;
 }
 
-static gboolean
-fetch_all_schedules(phoscon_client_t *pc, GError **err)
+const struct phoscon_schedule_ent *
+phoscon_client_lookup_schedule(phoscon_client_t *pc, gint id)
 {
-  GString *buff;
-  json_t *jobj = NULL;
-  json_error_t jerr = { 0, };
-  json_t *jent = NULL;
-  const gchar *key = NULL;
-  gchar *url;
-  gboolean ret = FALSE;
+  struct schedule_rec *rec;
 
-  g_assert(pc);
-  g_assert(pc->handle);
-  g_assert(pc->base_url);
+  g_return_val_if_fail(pc != NULL, NULL);
 
-  url = g_strdup_printf("%s/schedules", pc->base_url);
-  if (!util_perform_http_get(pc->handle, url, err)) {
-    g_prefix_error(err, "connection to phoscon failed: ");
-    goto out;
-  }
+  rec = schedule_store_lookup(pc->schedules, id);
 
-  buff = util_get_handle_buffer(pc->handle);
-  g_assert(buff);
+  return rec ? &rec->ent : NULL;
+}
 
-  /* Parse the JSON */
-  if ((jobj = json_loads(buff->str, 0, &jerr)) == NULL) {
-    SET_GERROR(err, -1, "could not parse phoscon JSON response");
-    goto out;
-  }
+gint
+phoscon_client_list_all_schedules(phoscon_client_t *pc, GList **results)
+{
+  GList *res = NULL;
+  gint id;
 
-  g_debug("buffer: %s", buff->str);
+  g_return_val_if_fail(pc != NULL, -1);
+
+  if (!results) {
+    /* If the caller just wants the count .. */
+    return pc->schedules->count;
+  }
 
-  json_object_foreach(jobj, key, jent) {
-    struct phoscon_schedule_ent *se = parse_phoscon_schedule(key, jent, err);
+  /* Walk the IDs backwards so the list ends up sorted */
+  for (id = pc->schedules->recs->len - 1; id >= 0; id--) {
+    struct schedule_rec *rec = schedule_store_lookup(pc->schedules, id);
 
-    if (se == NULL) {
-      g_prefix_error(err, "parse schedule '%s': ", key);
-      goto out;
+    if (rec) {
+      res = g_list_prepend(res, &rec->ent);
     }
-    g_hash_table_insert(pc->schedules, &se->id, se);
   }
 
-  ret = TRUE;
+  *results = res;
 
-out:
-  g_free(url);
-  if (jobj) {
-    json_decref(jobj);
+  return pc->schedules->count;
+}
+
+/*
+ * Format the UTC and local time of day a schedule is set to, the result can
+ * be shared by all schedules firing at that instant. The local time uses
+ * the UTC offset in effect at that instant.
+ */
+void
+phoscon_client_format_time(phoscon_client_t *pc, GDateTime *utc,
+                           struct phoscon_sched_time *st)
+{
+  gint64 t;
+
+  g_return_if_fail(pc != NULL);
+  g_return_if_fail(utc != NULL);
+  g_return_if_fail(st != NULL);
+
+  t = g_date_time_to_unix(utc);
+  format_time_of_day(t, 0, st->utc);
+  format_time_of_day(t, tz_table_offset(tz_table_get(pc, t), t), st->local);
+}
+
+/*
+ * Find the first change of the local UTC offset (e.g. a DST switch) after
+ * the UNIX time after, looking at most into the following year. Returns
+ * FALSE if there is none.
+ */
+gboolean
+phoscon_client_next_tz_transition(phoscon_client_t *pc, gint64 after,
+                                  gint64 *when)
+{
+  gint64 t = after;
+  guint i;
+  gint n;
+
+  g_return_val_if_fail(pc != NULL, FALSE);
+  g_return_val_if_fail(when != NULL, FALSE);
+
+  for (n = 0; n < 2; n++) {
+    const struct tz_table *tt = tz_table_get(pc, t);
+
+    for (i = 1; i < tt->n_spans; i++) {
+      if (tt->spans[i].start > after) {
+        *when = tt->spans[i].start;
+        return TRUE;
+      }
+    }
+    t = tt->end;
   }
 
-  return ret;
+  return FALSE;
 }
 
-static gboolean
-update_phoscon_schedule(phoscon_client_t *pc,
-                        struct phoscon_schedule_ent *sent,
-                        GError **err)
+/*
+ * Update the time of a schedule, requests are spread over up to maxParallel
+ * gateway connections so many schedules can be updated at once. The time
+ * is copied into the request before returning.
+ */
+void
+phoscon_client_update_schedule_time_async(phoscon_client_t *pc, gint id,
+                                          const struct phoscon_sched_time *st,
+                                          GCancellable *cancellable,
+                                          GAsyncReadyCallback callback,
+                                          gpointer user_data)
 {
-  GString *buff;
-  json_t *jresp = NULL;
-  json_t *jreq = NULL;
-  gchar *jreq_str = NULL;
-  json_t *jtmp = NULL;
-  json_error_t jerr = { 0, };
-  gboolean ret = FALSE;
+  struct schedule_rec *rec;
+  struct phoscon_req *req;
+  const gchar *val;
   gchar *url;
+  GTask *task;
 
-  g_assert(pc);
-  g_assert(sent);
-
-  url = g_strdup_printf("%s/schedules/%d", pc->base_url, sent->id);
-  /* Only update the time string for now */
-  if ((jreq = json_pack_ex(&jerr, 0, "{s:s,s:s*}",
-                           "time", sent->timestr,
-                           "localtime", sent->local_timestr)) == NULL) {
-    SET_GERROR(err, -1, "could not pack JSON request: %s", jerr.text);
+  g_return_if_fail(pc != NULL);
+  g_return_if_fail(st != NULL);
+
+  url = g_strdup_printf("%s/schedules/%d", pc->base_url, id);
+  task = new_request(pc, url, NULL, update_schedule_done, cancellable,
+                     callback, user_data);
+  req = g_task_get_task_data(task);
+
+  if ((rec = schedule_store_lookup(pc->schedules, id)) == NULL) {
+    g_task_return_new_error(task, error_quark(), -1,
+                            "no schedule matching ID=%d", id);
+    goto out;
+  } else if (rec->busy) {
+    g_task_return_new_error(task, error_quark(), -1,
+                            "update of schedule ID=%d already in progress",
+                            id);
     goto out;
-  } else if ((jreq_str = json_dumps(jreq, JSON_INDENT(2))) == NULL) {
-    SET_GERROR(err, -1, "could not pack get JSON string");
+  } else if (!rec->req) {
+    g_task_return_new_error(task, error_quark(), -1,
+                            "time string '%s' of schedule ID=%d can not be "
+                            "updated", rec->ent.timestr, id);
     goto out;
   }
 
-  /* Update the remote schedule */
-  g_debug("URL: %s\n"
-            "Data: %s", url, jreq_str);
-  if (!util_perform_http_put(pc->handle, url, jreq_str, err)) {
-    goto out;
+  patch_time_of_day(rec, rec->time_pos, st->utc);
+  if (rec->ltime_pos) {
+    patch_time_of_day(rec, rec->ltime_pos, st->local);
   }
-  buff = util_get_handle_buffer(pc->handle);
 
-  g_debug("response buff: %s", buff->str);
-  /* Parse the JSON */
-  if ((jresp = json_loads(buff->str, 0, &jerr)) == NULL) {
-    SET_GERROR(err, -1, "could not parse phoscon JSON response");
+  /* A UTC offset change alters only the local time */
+  if (time_str_unchanged(rec, rec->time_pos, rec->ent.timestr) &&
+      (!rec->ltime_pos ||
+       time_str_unchanged(rec, rec->ltime_pos, rec->ent.local_timestr))) {
+    g_debug("No time update (%s)", rec->ent.timestr);
+    g_message("No update of schedule time for '%s'", rec->ent.name);
+    g_task_return_boolean(task, TRUE);
     goto out;
   }
 
-  /* TODO: Properly parse the JSON jtmp and verify the time matches what
-   * we sent in.
-   */
-  if ((jtmp = json_array_get(jresp, 0)) == NULL ||
-       json_object_get(jtmp, "success") == NULL) {
-    SET_GERROR(err, -1, "unexpected response from server: %s",
-               jtmp ? "missing success string" : "not an array");
-
-    goto out;
+  val = rec->req + rec->time_pos;
+  g_message("Updating UTC time for '%s' from '%s' -> '%.*s'",
+            rec->ent.name, rec->ent.timestr, (gint) rec->time_len, val);
+  if (rec->ltime_pos) {
+    g_message("Updating local time for '%s' from '%s' -> '%.*s'",
+              rec->ent.name, rec->ent.local_timestr, (gint) rec->time_len,
+              rec->req + rec->ltime_pos);
   }
+  g_debug("Data: %s", rec->req);
 
-  ret = TRUE;
+  /* Update the remote schedule straight from the prebuilt request */
+  rec->busy = TRUE;
+  req->priv = rec;
+  req->priv_free = release_schedule_rec;
+  req->data = rec->req;
+  submit_request(task);
+  return;
 
 out:
-  g_free(jreq_str);
-  g_free(url);
-  if (jresp) {
-    json_decref(jresp);
-  }
-  if (jreq) {
-    json_decref(jreq);
-  }
+  g_object_unref(task);
+}
+
+gboolean
+phoscon_client_update_schedule_time_finish(GAsyncResult *res, GError **err)
+{
+  g_return_val_if_fail(g_task_is_valid(res, NULL), FALSE);
+
+  return g_task_propagate_boolean(G_TASK(res), err);
+}
+
+gboolean
+phoscon_client_update_schedule_time(phoscon_client_t *pc, gint id,
+                                    GDateTime *utc, GError **err)
+{
+  struct phoscon_sched_time st;
+  GAsyncResult *res = NULL;
+  gboolean ret;
+
+  phoscon_client_format_time(pc, utc, &st);
+  phoscon_client_update_schedule_time_async(pc, id, &st, NULL,
+                                            util_async_store_result, &res);
+  ret = phoscon_client_update_schedule_time_finish(util_async_wait(&res),
+                                                   err);
+  g_object_unref(res);
 
   return ret;
 }
 
-static gboolean
-update_time_str(struct phoscon_schedule_ent *sent, GDateTime *utc,
-                gboolean *updated, GError **err)
+/*
+ * Set the state of a light or group directly, resource is relative to the
+ * API root (e.g. "lights/3/state" or "groups/1/action") and body the JSON
+ * state. The body is copied.
+ */
+void
+phoscon_client_put_state_async(phoscon_client_t *pc, const gchar *resource,
+                               const gchar *body, GCancellable *cancellable,
+                               GAsyncReadyCallback callback,
+                               gpointer user_data)
 {
-  gchar *tstr;
-  gchar *ntstr = NULL;
-  gboolean upd = FALSE;
+  struct phoscon_req *req;
+  GTask *task;
+
+  g_return_if_fail(pc != NULL);
+  g_return_if_fail(resource != NULL);
+  g_return_if_fail(body != NULL);
+
+  task = new_request(pc, g_strdup_printf("%s/%s", pc->base_url, resource),
+                     NULL, put_state_done, cancellable, callback, user_data);
+  req = g_task_get_task_data(task);
+  req->priv = g_strdup(body);
+  req->priv_free = g_free;
+  req->data = req->priv;
+  submit_request(task);
+}
 
-  g_assert(sent);
-  g_assert(utc);
+gboolean
+phoscon_client_put_state_finish(GAsyncResult *res, GError **err)
+{
+  g_return_val_if_fail(g_task_is_valid(res, NULL), FALSE);
 
-  if ((tstr = g_strstr_len(sent->timestr, -1, "/T")) == NULL) {
-    SET_GERROR(err, -1, "could not find timestamp identifier");
-    return FALSE;
-  }
+  return g_task_propagate_boolean(G_TASK(res), err);
+}
 
-  ntstr = g_strdup_printf("%.*s/T%02d:%02d:%02d",
-                          (gint) (tstr - sent->timestr), sent->timestr,
-                          g_date_time_get_hour(utc),
-                          g_date_time_get_minute(utc),
-                          g_date_time_get_second(utc));
-
-  if (g_strcmp0(sent->timestr, ntstr) != 0) {
-    g_message("Updated UTC time for '%s' from '%s' -> '%s'",
-              sent->name, sent->timestr, ntstr);
-
-    /* Update the local time so it gets updated in phoscon */
-    if (sent->local_timestr) {
-      GDateTime *lt = g_date_time_to_local(utc);
-      gchar *nlstr = g_strdup_printf("%.*s/T%02d:%02d:%02d",
-                                     (gint) (tstr - sent->timestr),
-                                     sent->timestr,
-                                     g_date_time_get_hour(lt),
-                                     g_date_time_get_minute(lt),
-                                     g_date_time_get_second(lt));
-      g_message("Updated local time for '%s' from '%s' -> '%s'",
-                sent->name, sent->local_timestr, nlstr);
-      g_free(sent->local_timestr);
-      sent->local_timestr = nlstr;
-      g_free(sent->timestr);
-      sent->timestr = ntstr;
-      upd = TRUE;
+/*
+ * Make the rules on the gateway whose name starts with prefix match the
+ * given ones: missing rules are created, differing ones updated and the
+ * rest deleted. Nothing is written if they already match, so a periodic
+ * sync costs two reads at most.
+ */
+void
+phoscon_client_sync_rules_async(phoscon_client_t *pc, const gchar *prefix,
+                                const struct phoscon_rule *rules,
+                                guint n_rules, GCancellable *cancellable,
+                                GAsyncReadyCallback callback,
+                                gpointer user_data)
+{
+  struct rule_sync *rs;
+  struct phoscon_req *req;
+  GTask *sync;
+  GTask *task;
+  guint i;
+
+  g_return_if_fail(pc != NULL);
+  g_return_if_fail(prefix != NULL && *prefix);
+  g_return_if_fail(rules != NULL || n_rules == 0);
+
+  rs = g_malloc0(sizeof(*rs));
+  rs->pc = pc;
+  rs->prefix = g_strdup(prefix);
+  rs->wanted = g_ptr_array_new_with_free_func(free_wanted_rule);
+  sync = g_task_new(NULL, cancellable, callback, user_data);
+  g_task_set_task_data(sync, rs, free_rule_sync);
+
+  for (i = 0; i < n_rules; i++) {
+    struct wanted_rule *w;
+    json_error_t jerr;
+    json_t *jbody;
+
+    if (!g_str_has_prefix(rules[i].name, prefix)) {
+      g_task_return_new_error(sync, error_quark(), -1,
+                              "rule '%s' lacks the prefix '%s'",
+                              rules[i].name, prefix);
+      goto out;
+    } else if ((jbody = json_loads(rules[i].body, 0, &jerr)) == NULL) {
+      g_task_return_new_error(sync, error_quark(), -1,
+                              "rule '%s' has an invalid body: %s",
+                              rules[i].name, jerr.text);
+      goto out;
     }
-  } else {
-    g_debug("No time update (%s)", ntstr);
-    g_free(ntstr);
+
+    w = g_malloc0(sizeof(*w));
+    w->name = g_strdup(rules[i].name);
+    w->ev = rules[i].ev;
+    w->resource = g_strdup(rules[i].resource);
+    w->jbody = jbody;
+    g_ptr_array_add(rs->wanted, w);
   }
 
-  if (updated) {
-    *updated = upd;
+  if (pc->daylight_id >= 0) {
+    fetch_rules(sync);
+    goto out;
   }
 
-  return TRUE;
-}
+  /* The rules refer to the Daylight sensor, find it first */
+  task = new_request(pc, g_strdup_printf("%s/sensors", pc->base_url), NULL,
+                     rule_sensors_done, cancellable, NULL, NULL);
+  req = g_task_get_task_data(task);
+  req->priv = g_object_ref(sync);
+  req->priv_free = g_object_unref;
+  submit_request(task);
 
-/**** Exposed functions begin here **************************************/
+out:
+  g_object_unref(sync);
+}
 
 gboolean
-phoscon_client_init(const struct phoscon_client_cfg *cfg, GError **err)
+phoscon_client_sync_rules_finish(GAsyncResult *res,
+                                 struct phoscon_rule_stats *stats,
+                                 GError **err)
 {
-  phoscon_client_t *pc;
+  struct rule_sync *rs;
 
-  g_return_val_if_fail(pclient == NULL, FALSE);
-  g_return_val_if_fail(cfg != NULL, FALSE);
-  g_return_val_if_fail(cfg->host != NULL, FALSE);
-  g_return_val_if_fail(cfg->api_key != NULL, FALSE);
+  g_return_val_if_fail(g_task_is_valid(res, NULL), FALSE);
 
-  /* Use GLib memory allocators */
-  json_set_alloc_funcs(g_malloc, g_free);
-  pc = g_malloc0(sizeof(*pc));
-  pc->cfg.port = cfg->port > 0 ? cfg->port : DEFAULT_PHOSCON_PORT;
-  pc->cfg.api_key = g_strdup(cfg->api_key);
-  pc->cfg.host = g_strdup(cfg->host);
-  pc->base_url = build_phoscon_base_url(cfg, FALSE);
-  if ((pc->handle = util_init_handle(err)) == NULL) {
-    goto out_fail;
+  rs = g_task_get_task_data(G_TASK(res));
+  if (stats) {
+    *stats = rs->stats;
   }
-  pc->schedules = g_hash_table_new_full(g_int_hash, g_int_equal,
-                                        NULL, free_schedule_entry);
 
-  /* Try to fetch all the schedules */
-  if (!fetch_all_schedules(pc, err)) {
-    g_prefix_error(err, "fetch initial schedules failed, ");
-    goto out_fail;
+  return g_task_propagate_boolean(G_TASK(res), err);
+}
+
+/*
+ * Fetch the given schedules again and take over the ones edited on the
+ * gateway since they were last read, e.g. in the Phoscon app. Each entry is
+ * only parsed into the store if the digest of its fields changed.
+ */
+void
+phoscon_client_resync_schedules_async(phoscon_client_t *pc,
+                                      const gint *ids, guint n_ids,
+                                      GCancellable *cancellable,
+                                      GAsyncReadyCallback callback,
+                                      gpointer user_data)
+{
+  struct resync *rs;
+  GTask *sync;
+  guint i;
+
+  g_return_if_fail(pc != NULL);
+  g_return_if_fail(ids != NULL || n_ids == 0);
+
+  rs = g_malloc0(sizeof(*rs));
+  sync = g_task_new(NULL, cancellable, callback, user_data);
+  g_task_set_task_data(sync, rs, free_resync);
+
+  if (n_ids == 0) {
+    g_task_return_boolean(sync, TRUE);
+    g_object_unref(sync);
+    return;
   }
 
-  g_message("Phoscon simple client initialised, found %u schedules",
-            g_hash_table_size(pc->schedules));
+  /* Count them all first, a completion must not finish the resync early */
+  rs->n_pending = n_ids;
+  for (i = 0; i < n_ids; i++) {
+    struct resync_fetch *rf;
+    struct phoscon_req *req;
+    GTask *task;
+
+    rf = g_malloc0(sizeof(*rf));
+    rf->sync = g_object_ref(sync);
+    rf->id = ids[i];
+
+    task = new_request(pc, g_strdup_printf("%s/schedules/%d", pc->base_url,
+                                           ids[i]),
+                       NULL, resync_schedule_done, cancellable, NULL, NULL);
+    req = g_task_get_task_data(task);
+    req->priv = rf;
+    req->priv_free = free_resync_fetch;
+    rs->stats.fetched++;
+    submit_request(task);
+  }
+  g_object_unref(sync);
+}
 
-  pclient = pc;
-  return TRUE;
+gboolean
+phoscon_client_resync_schedules_finish(GAsyncResult *res,
+                                       struct phoscon_resync_stats *stats,
+                                       GError **err)
+{
+  struct resync *rs;
 
-out_fail:
-  free_phoscon_client(pc);
+  g_return_val_if_fail(g_task_is_valid(res, NULL), FALSE);
 
-  return FALSE;
+  rs = g_task_get_task_data(G_TASK(res));
+  if (stats) {
+    *stats = rs->stats;
+  }
+
+  return g_task_propagate_boolean(G_TASK(res), err);
 }
 
+/*
+ * Listen to the change events the gateway pushes over its websocket. Once
+ * the Daylight sensor is known, daylight_func (if set) is called on every
+ * change of its status. Schedule events are applied to the table as they
+ * come, but deCONZ does not send any, so edits made in the Phoscon app are
+ * still only picked up by the periodic resync. Without a configured port
+ * it is read from the gateway configuration.
+ */
 void
-phoscon_client_release(void)
+phoscon_client_listen_events(phoscon_client_t *pc,
+                             phoscon_daylight_func daylight_func,
+                             gpointer user_data, GCancellable *cancellable)
 {
-  g_clear_pointer(&pclient, free_phoscon_client);
+  g_return_if_fail(pc != NULL);
+  g_return_if_fail(pc->ws == NULL && pc->ev_cancellable == NULL);
+
+  if (pc->cfg.ws_port < 0) {
+    g_debug("Gateway events disabled");
+    return;
+  }
+
+  /* Kept apart from the caller's so phoscon_client_cancel() can stop it */
+  pc->ev_cancellable = g_cancellable_new();
+  if (cancellable) {
+    pc->ev_parent = g_object_ref(cancellable);
+    pc->ev_parent_id = g_cancellable_connect(cancellable,
+                                             G_CALLBACK(ev_parent_cancelled),
+                                             pc->ev_cancellable, NULL);
+  }
+  pc->daylight_func = daylight_func;
+  pc->daylight_data = user_data;
+  pc->ev_stats.daylight_status = -1;
+  if (pc->cfg.ws_port > 0) {
+    start_event_listener(pc, pc->cfg.ws_port);
+    return;
+  }
+
+  pc->n_own++;
+  submit_request(new_request(pc, g_strdup_printf("%s/config", pc->base_url),
+                             NULL, ws_port_done, pc->ev_cancellable, NULL,
+                             NULL));
 }
 
-const struct phoscon_schedule_ent *
-phoscon_client_lookup_schedule(gint id)
+void
+phoscon_client_log_event_stats(phoscon_client_t *pc)
 {
-  phoscon_client_t *pc = pclient;
+  g_return_if_fail(pc != NULL);
 
-  g_return_val_if_fail(pc != NULL, NULL);
+  if (!pc->ev_stats.received) {
+    return;
+  }
 
-  return g_hash_table_lookup(pc->schedules, &id);
+  g_message("Gateway events: %u received, %u schedule(s) updated in "
+            "%.1f ms on average (max %.1f ms), %u unchanged",
+            pc->ev_stats.received, pc->ev_stats.patched,
+            pc->ev_stats.patched ? pc->ev_stats.latency_sum / 1000.0 /
+                                   pc->ev_stats.patched : 0.0,
+            pc->ev_stats.latency_max / 1000.0, pc->ev_stats.unchanged);
 }
 
-gint
-phoscon_client_list_all_schedules(GList **results)
+/*
+ * Open up to n_conns connections to the gateway ahead of a planned update,
+ * so the update itself does not wait for connection setup. Best effort,
+ * failures are only logged.
+ */
+void
+phoscon_client_prewarm(phoscon_client_t *pc, guint n_conns)
 {
-  GList *res = NULL;
-  phoscon_client_t *pc = pclient;
-  GHashTableIter iter;
-  gpointer key;
-  gpointer value;
-  gint i;
+  guint i;
 
-  g_return_val_if_fail(pc != NULL, -1);
+  g_return_if_fail(pc != NULL);
 
-  if (!results) {
-    /* If the caller just wants the count .. */
-    return g_hash_table_size(pc->schedules);
+  n_conns = MIN(n_conns, pc->cfg.max_parallel);
+  g_debug("Pre-warming %u gateway connection(s)", n_conns);
+  for (i = 0; i < n_conns; i++) {
+    pc->n_own++;
+    submit_request(new_request(pc, g_strdup_printf("%s/config", pc->base_url),
+                               NULL, prewarm_done, pc->cancellable, NULL,
+                               NULL));
   }
+}
 
-  g_hash_table_iter_init(&iter, pc->schedules);
-  for (i = 0; g_hash_table_iter_next(&iter, &key, &value); i++) {
-    res = g_list_prepend(res, value);
-  }
+/*
+ * Read the sunrise and sunset (UTC) calculated by the gateway itself from
+ * its Daylight virtual sensor, over the existing gateway connection.
+ */
+void
+phoscon_client_get_daylight_async(phoscon_client_t *pc,
+                                  GCancellable *cancellable,
+                                  GAsyncReadyCallback callback,
+                                  gpointer user_data)
+{
+  gchar *url;
+
+  g_return_if_fail(pc != NULL);
 
-  *results = g_list_reverse(res);
+  /* The whole sensor list is only needed to find the Daylight sensor */
+  if (pc->daylight_id < 0) {
+    url = g_strdup_printf("%s/sensors", pc->base_url);
+  } else {
+    url = g_strdup_printf("%s/sensors/%d", pc->base_url, pc->daylight_id);
+  }
 
-  return i;
+  submit_request(new_request(pc, url, NULL, daylight_sensor_done,
+                             cancellable, callback, user_data));
 }
 
 gboolean
-phoscon_client_update_schedule_time(gint id, GDateTime *utc, GError **err)
+phoscon_client_get_daylight_finish(GAsyncResult *res, GDateTime **sunrise,
+                                   GDateTime **sunset, GError **err)
 {
-  phoscon_client_t *pc = pclient;
-  struct phoscon_schedule_ent *sent;
-  gboolean did_update = FALSE;
+  struct daylight_times *times;
 
-  g_return_val_if_fail(pc != NULL, FALSE);
-  g_return_val_if_fail(utc != NULL, FALSE);
+  g_return_val_if_fail(g_task_is_valid(res, NULL), FALSE);
+  g_return_val_if_fail(sunrise != NULL, FALSE);
+  g_return_val_if_fail(sunset != NULL, FALSE);
 
-  if ((sent = g_hash_table_lookup(pc->schedules, &id)) == NULL) {
-    SET_GERROR(err, -1, "no schedule matching ID=%d", id);
+  if ((times = g_task_propagate_pointer(G_TASK(res), err)) == NULL) {
+    g_prefix_error(err, "read Daylight sensor: ");
     return FALSE;
   }
 
-  if (!update_time_str(sent, utc, &did_update, err)) {
-    g_prefix_error(err, "could not update time string: ");
-    return FALSE;
-  }
+  *sunrise = g_steal_pointer(&times->sunrise);
+  *sunset = g_steal_pointer(&times->sunset);
+  free_daylight_times(times);
 
-  if (!did_update) {
-    g_message("No update of schedule time for '%s'", sent->name);
-    return TRUE;
-  }
+  return TRUE;
+}
+
+gboolean
+phoscon_client_get_daylight(phoscon_client_t *pc, GDateTime **sunrise,
+                            GDateTime **sunset, GError **err)
+{
+  GAsyncResult *res = NULL;
+  gboolean ret;
 
-  return update_phoscon_schedule(pc, sent, err);
+  phoscon_client_get_daylight_async(pc, NULL, util_async_store_result, &res);
+  ret = phoscon_client_get_daylight_finish(util_async_wait(&res), sunrise,
+                                           sunset, err);
+  g_object_unref(res);
+
+  return ret;
 }
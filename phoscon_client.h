@@ -4,11 +4,26 @@
 #define PHOSCON_CLIENT_H__
 
 #include <glib.h>
+#include <gio/gio.h>
+
+#include "solar.h"
+
+/* A client belongs to the thread default main context it was created from,
+ * clients on different threads are independent of each other
+ */
+typedef struct phoscon_client phoscon_client_t;
+
+/* Called with the new status when the Daylight sensor reports a change */
+typedef void (*phoscon_daylight_func)(gint status, gpointer user_data);
 
 struct phoscon_client_cfg {
   gchar *host;
   guint port;
   gchar *api_key;
+  guint max_parallel;      /* Concurrent gateway connections */
+  gchar *timezone;         /* IANA zone of the site, NULL for the host's */
+  gint ws_port;            /* Event websocket, 0 asks the gateway, <0 off */
+  gchar *ws_host;          /* Event websocket host, NULL for the gateway */
 };
 
 struct phoscon_schedule_ent {
@@ -16,24 +31,154 @@ struct phoscon_schedule_ent {
   gchar *name;
   gchar *descr;
   gchar *status;
-  GDateTime *created;
+  gint64 created;          /* UNIX time (UTC) */
   gchar *timestr;          /* "time": "W127/T15:30:00" */
   gchar *local_timestr;
 };
 
-gboolean
-phoscon_client_init(const struct phoscon_client_cfg *cfg, GError **err);
+/* Time of day a schedule is set to, formatted once and shared by all
+ * schedules firing at the same instant
+ */
+struct phoscon_sched_time {
+  gchar utc[9];            /* "HH:MM:SS" */
+  gchar local[9];
+};
+
+/* Gateway rule setting a light or group state when the Daylight sensor
+ * reaches the phase of a sun event
+ */
+struct phoscon_rule {
+  gchar *name;             /* Unique, identifies the rule on the gateway */
+  enum sun_event ev;
+  gchar *resource;         /* e.g. "groups/1/action" */
+  gchar *body;             /* JSON state */
+};
+
+struct phoscon_rule_stats {
+  guint unchanged;
+  guint created;
+  guint updated;
+  guint deleted;
+};
+
+/* Outcome of a schedule resync */
+struct phoscon_resync_stats {
+  guint fetched;
+  guint skipped;           /* Unchanged since they were last read */
+  guint updated;           /* Changed on the gateway, parsed again */
+  guint deferred;          /* Changed but being updated, left for later */
+  guint failed;
+};
+
+void
+phoscon_client_new_async(const struct phoscon_client_cfg *cfg,
+                         GCancellable *cancellable,
+                         GAsyncReadyCallback callback, gpointer user_data);
+
+phoscon_client_t *
+phoscon_client_new_finish(GAsyncResult *res, GError **err);
+
+phoscon_client_t *
+phoscon_client_new(const struct phoscon_client_cfg *cfg, GError **err);
+
+phoscon_client_t *
+phoscon_client_restore(const struct phoscon_client_cfg *cfg,
+                       const struct phoscon_schedule_ent *ents, guint n_ents,
+                       GError **err);
 
 void
-phoscon_client_release(void);
+phoscon_client_free(phoscon_client_t *pc);
+
+void
+phoscon_client_cancel(phoscon_client_t *pc);
+
+gboolean
+phoscon_client_busy(phoscon_client_t *pc);
 
 const struct phoscon_schedule_ent *
-phoscon_client_lookup_schedule(gint id);
+phoscon_client_lookup_schedule(phoscon_client_t *pc, gint id);
 
 gint
-phoscon_client_list_all_schedules(GList **results);
+phoscon_client_list_all_schedules(phoscon_client_t *pc, GList **results);
+
+gboolean
+phoscon_client_update_schedule_time(phoscon_client_t *pc, gint id,
+                                    GDateTime *utc, GError **err);
+
+void
+phoscon_client_format_time(phoscon_client_t *pc, GDateTime *utc,
+                           struct phoscon_sched_time *st);
+
+gboolean
+phoscon_client_next_tz_transition(phoscon_client_t *pc, gint64 after,
+                                  gint64 *when);
+
+void
+phoscon_client_update_schedule_time_async(phoscon_client_t *pc, gint id,
+                                          const struct phoscon_sched_time *st,
+                                          GCancellable *cancellable,
+                                          GAsyncReadyCallback callback,
+                                          gpointer user_data);
+
+gboolean
+phoscon_client_update_schedule_time_finish(GAsyncResult *res, GError **err);
+
+void
+phoscon_client_put_state_async(phoscon_client_t *pc, const gchar *resource,
+                               const gchar *body, GCancellable *cancellable,
+                               GAsyncReadyCallback callback,
+                               gpointer user_data);
+
+gboolean
+phoscon_client_put_state_finish(GAsyncResult *res, GError **err);
+
+void
+phoscon_client_prewarm(phoscon_client_t *pc, guint n_conns);
+
+void
+phoscon_client_sync_rules_async(phoscon_client_t *pc, const gchar *prefix,
+                                const struct phoscon_rule *rules,
+                                guint n_rules, GCancellable *cancellable,
+                                GAsyncReadyCallback callback,
+                                gpointer user_data);
+
+gboolean
+phoscon_client_sync_rules_finish(GAsyncResult *res,
+                                 struct phoscon_rule_stats *stats,
+                                 GError **err);
+
+void
+phoscon_client_resync_schedules_async(phoscon_client_t *pc,
+                                      const gint *ids, guint n_ids,
+                                      GCancellable *cancellable,
+                                      GAsyncReadyCallback callback,
+                                      gpointer user_data);
+
+gboolean
+phoscon_client_resync_schedules_finish(GAsyncResult *res,
+                                       struct phoscon_resync_stats *stats,
+                                       GError **err);
+
+void
+phoscon_client_listen_events(phoscon_client_t *pc,
+                             phoscon_daylight_func daylight_func,
+                             gpointer user_data, GCancellable *cancellable);
+
+void
+phoscon_client_log_event_stats(phoscon_client_t *pc);
+
+gboolean
+phoscon_client_get_daylight(phoscon_client_t *pc, GDateTime **sunrise,
+                            GDateTime **sunset, GError **err);
+
+void
+phoscon_client_get_daylight_async(phoscon_client_t *pc,
+                                  GCancellable *cancellable,
+                                  GAsyncReadyCallback callback,
+                                  gpointer user_data);
 
 gboolean
-phoscon_client_update_schedule_time(gint id, GDateTime *utc, GError **err);
+phoscon_client_get_daylight_finish(GAsyncResult *res, GDateTime **sunrise,
+                                   GDateTime **sunset, GError **err);
 
 #endif /* PHOSCON_CLIENT_H__ */
@@ -0,0 +1,322 @@
+/* systemd service manager integration
+ *
+ * Readiness and status are reported with sd_notify(), so Type=notify units
+ * know when the schedules have been updated. The watchdog keepalive is sent
+ * from the main loop, and only when a lowest priority idle callback ran
+ * since the previous one: a loop blocked in a transfer or starved by busy
+ * sources misses the deadline and gets the unit restarted. A socket passed
+ * by socket activation serves line based control commands.
+ */
+
+#include <string.h>
+#include <systemd/sd-daemon.h>
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "service.h"
+#include "debug.h"
+
+#define CONTROL_MAX_LINE     256
+
+struct watchdog {
+  guint src_id;
+  guint idle_id;
+  gboolean alive;          /* Idle callback ran since the last tick */
+  gulong pings;
+};
+
+struct control {
+  GSocketService *service;
+  service_cmd_func func;
+  gpointer user_data;
+  GCancellable *cancellable;
+  guint conns;             /* Open connections */
+  gint64 last_activity;    /* Monotonic time */
+};
+
+/* Input is read into a fixed buffer, a line that does not fit closes the
+ * connection instead of growing it
+ */
+struct control_conn {
+  GSocketConnection *conn;
+  gchar buf[CONTROL_MAX_LINE + 1];  /* Received and not handled yet */
+  gsize len;
+  gchar *reply;
+  gboolean closing;        /* Close once the reply is written */
+};
+
+static struct watchdog wdog;
+static struct control ctl;
+
+DEFINE_GQUARK("service");
+
+static gboolean
+watchdog_idle(gpointer data)
+{
+  wdog.alive = TRUE;
+  wdog.idle_id = 0;
+
+  return FALSE;
+}
+
+static gboolean
+watchdog_tick(gpointer data)
+{
+  if (wdog.alive) {
+    sd_notify(0, "WATCHDOG=1");
+    wdog.pings++;
+  } else {
+    g_warning("Main loop has not been idle for a watchdog period, "
+              "withholding keepalive");
+  }
+
+  wdog.alive = FALSE;
+  if (!wdog.idle_id) {
+    wdog.idle_id = g_idle_add_full(G_PRIORITY_LOW, watchdog_idle, NULL, NULL);
+  }
+
+  return TRUE;
+}
+
+static void
+free_control_conn(struct control_conn *cc)
+{
+  g_io_stream_close(G_IO_STREAM(cc->conn), NULL, NULL);
+  g_object_unref(cc->conn);
+  g_free(cc->reply);
+  g_free(cc);
+
+  ctl.conns--;
+  ctl.last_activity = g_get_monotonic_time();
+}
+
+static void control_next_line(struct control_conn *cc);
+
+static void
+control_write_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  struct control_conn *cc = (struct control_conn *) user_data;
+  GError *err = NULL;
+
+  g_clear_pointer(&cc->reply, g_free);
+  if (!g_output_stream_write_all_finish(G_OUTPUT_STREAM(source), res, NULL,
+                                        &err)) {
+    if (!g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+      g_message("Control connection write failed: %s", GERROR_MSG(err));
+    }
+    g_clear_error(&err);
+    free_control_conn(cc);
+    return;
+  } else if (cc->closing) {
+    free_control_conn(cc);
+    return;
+  }
+
+  control_next_line(cc);
+}
+
+static void
+control_read_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  struct control_conn *cc = (struct control_conn *) user_data;
+  GError *err = NULL;
+  gssize n;
+
+  n = g_input_stream_read_finish(G_INPUT_STREAM(source), res, &err);
+  if (n <= 0) {
+    /* End of stream or error */
+    if (err && !g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+      g_message("Control connection read failed: %s", GERROR_MSG(err));
+    }
+    g_clear_error(&err);
+    free_control_conn(cc);
+    return;
+  }
+
+  cc->len += n;
+  ctl.last_activity = g_get_monotonic_time();
+  control_next_line(cc);
+}
+
+/* Answers the next complete line buffered, reads more if there is none */
+static void
+control_next_line(struct control_conn *cc)
+{
+  GInputStream *in = g_io_stream_get_input_stream(G_IO_STREAM(cc->conn));
+  GOutputStream *out;
+  gchar *nl = memchr(cc->buf, '\n', cc->len);
+
+  if (nl) {
+    gsize used = nl - cc->buf + 1;
+    gchar *reply;
+
+    *nl = '\0';
+    reply = ctl.func(g_strstrip(cc->buf), ctl.user_data);
+    cc->reply = g_strconcat(reply ? reply : "", "\n", NULL);
+    g_free(reply);
+    cc->len -= used;
+    memmove(cc->buf, cc->buf + used, cc->len);
+  } else if (cc->len == sizeof(cc->buf)) {
+    cc->reply = g_strdup("error: line too long\n");
+    cc->closing = TRUE;
+  } else {
+    g_input_stream_read_async(in, cc->buf + cc->len, sizeof(cc->buf) - cc->len,
+                              G_PRIORITY_DEFAULT, ctl.cancellable,
+                              control_read_done, cc);
+    return;
+  }
+
+  out = g_io_stream_get_output_stream(G_IO_STREAM(cc->conn));
+  g_output_stream_write_all_async(out, cc->reply, strlen(cc->reply),
+                                  G_PRIORITY_DEFAULT, ctl.cancellable,
+                                  control_write_done, cc);
+}
+
+static gboolean
+control_incoming(GSocketService *service, GSocketConnection *conn,
+                 GObject *source, gpointer user_data)
+{
+  struct control_conn *cc = g_malloc0(sizeof(*cc));
+
+  cc->conn = g_object_ref(conn);
+  ctl.conns++;
+  ctl.last_activity = g_get_monotonic_time();
+  control_next_line(cc);
+
+  return TRUE;
+}
+
+/**** Exposed functions begin here **************************************/
+
+/* start_time is the monotonic time (usecs) the process started at */
+void
+service_notify_ready(gint64 start_time, const gchar *status)
+{
+  gdouble ms = (g_get_monotonic_time() - start_time) / 1000.0;
+
+  g_message("Ready %.1f ms after start", ms);
+  sd_notifyf(0, "READY=1\nSTATUS=%s", status ? status : "Running");
+}
+
+void
+service_notify_status(const gchar *status)
+{
+  sd_notifyf(0, "STATUS=%s", status);
+}
+
+void
+service_notify_stopping(void)
+{
+  sd_notify(0, "STOPPING=1");
+}
+
+/* Returns FALSE if the unit has no watchdog configured */
+gboolean
+service_watchdog_start(void)
+{
+  guint64 usecs;
+
+  g_return_val_if_fail(wdog.src_id == 0, FALSE);
+
+  if (sd_watchdog_enabled(0, &usecs) <= 0) {
+    return FALSE;
+  }
+
+  /* Tick at half the timeout so one late tick is tolerated */
+  wdog.alive = TRUE;
+  wdog.src_id = g_timeout_add(MAX(usecs / 2000, 1), watchdog_tick, NULL);
+  g_message("Watchdog keepalive every %" G_GUINT64_FORMAT " ms",
+            MAX(usecs / 2000, 1));
+
+  return TRUE;
+}
+
+void
+service_watchdog_stop(void)
+{
+  if (wdog.src_id) {
+    g_source_remove(wdog.src_id);
+    g_message("Watchdog: %lu keepalive(s) sent", wdog.pings);
+  }
+  if (wdog.idle_id) {
+    g_source_remove(wdog.idle_id);
+  }
+  memset(&wdog, 0, sizeof(wdog));
+}
+
+/*
+ * Serve the control socket passed by socket activation, FALSE with no
+ * error set if the process was not socket activated
+ */
+gboolean
+service_control_start(service_cmd_func func, gpointer user_data,
+                      GError **err)
+{
+  GSocket *sock;
+  gint n;
+
+  g_return_val_if_fail(func != NULL, FALSE);
+  g_return_val_if_fail(ctl.service == NULL, FALSE);
+
+  if ((n = sd_listen_fds(TRUE)) < 0) {
+    SET_GERROR(err, -1, "sd_listen_fds failed (%d)", n);
+    return FALSE;
+  } else if (n == 0) {
+    return FALSE;
+  } else if (n > 1) {
+    g_warning("%d sockets passed, only the first is served", n);
+  }
+
+  if ((sock = g_socket_new_from_fd(SD_LISTEN_FDS_START, err)) == NULL) {
+    return FALSE;
+  }
+
+  ctl.service = g_socket_service_new();
+  if (!g_socket_listener_add_socket(G_SOCKET_LISTENER(ctl.service), sock,
+                                    NULL, err)) {
+    g_object_unref(sock);
+    g_clear_object(&ctl.service);
+    return FALSE;
+  }
+  g_object_unref(sock);
+
+  ctl.func = func;
+  ctl.user_data = user_data;
+  ctl.cancellable = g_cancellable_new();
+  ctl.last_activity = g_get_monotonic_time();
+  g_signal_connect(ctl.service, "incoming", G_CALLBACK(control_incoming),
+                   NULL);
+  g_socket_service_start(ctl.service);
+  g_message("Serving the control socket passed by systemd");
+
+  return TRUE;
+}
+
+void
+service_control_stop(void)
+{
+  if (!ctl.service) {
+    return;
+  }
+
+  g_cancellable_cancel(ctl.cancellable);
+  g_socket_service_stop(ctl.service);
+  g_socket_listener_close(G_SOCKET_LISTENER(ctl.service));
+
+  /* Let the cancelled connections unwind */
+  while (ctl.conns) {
+    g_main_context_iteration(NULL, TRUE);
+  }
+
+  g_clear_object(&ctl.service);
+  g_clear_object(&ctl.cancellable);
+}
+
+/* TRUE if the control socket is served and was unused for secs seconds */
+gboolean
+service_control_idle(guint secs)
+{
+  return ctl.service && ctl.conns == 0 &&
+         g_get_monotonic_time() - ctl.last_activity >=
+         (gint64) secs * G_USEC_PER_SEC;
+}
@@ -0,0 +1,39 @@
+/* systemd service manager integration */
+
+#ifndef SERVICE_H__
+#define SERVICE_H__
+
+#include <glib.h>
+#include <gio/gio.h>
+
+/* Handles one control command line, returns the reply (without the final
+ * newline) which is freed by the caller
+ */
+typedef gchar *(*service_cmd_func)(const gchar *cmd, gpointer user_data);
+
+void
+service_notify_ready(gint64 start_time, const gchar *status);
+
+void
+service_notify_status(const gchar *status);
+
+void
+service_notify_stopping(void);
+
+gboolean
+service_watchdog_start(void);
+
+void
+service_watchdog_stop(void);
+
+gboolean
+service_control_start(service_cmd_func func, gpointer user_data,
+                      GError **err);
+
+void
+service_control_stop(void);
+
+gboolean
+service_control_idle(guint secs);
+
+#endif /* SERVICE_H__ */
@@ -0,0 +1,268 @@
+/* Persistent state snapshot
+ *
+ * The schedule table, with the times last written to the gateway, and the
+ * known sun times are saved after every update so a restart does not have
+ * to wait for the gateway or the sun time provider. The file is stored in
+ * host byte order like the sun table: a header, the sun days, the schedule
+ * records, the NUL terminated strings they refer to and a SHA-256 checksum
+ * of everything before it. It is replaced atomically.
+ */
+
+#include <string.h>
+#include <glib.h>
+
+#include "snapshot.h"
+#include "debug.h"
+
+#define SNAPSHOT_MAGIC        "PSNP"
+#define SNAPSHOT_VERSION      1
+#define SNAPSHOT_NO_STR       G_MAXUINT32
+#define SNAPSHOT_SUM_LEN      32     /* SHA-256 */
+#define SNAPSHOT_N_STRS       5
+
+struct snapshot_hdr {
+  gchar magic[4];
+  guint16 version;
+  guint16 n_days;
+  gint64 saved;
+  gdouble lat;
+  gdouble lon;
+  guint32 n_scheds;
+  guint32 strings_len;
+  guint32 gateway;         /* Offset of the gateway string */
+  guint32 reserved;
+};
+
+/* Schedule with its strings as offsets, in the order name, description,
+ * status, time and local time
+ */
+struct snapshot_sched {
+  gint64 created;
+  gint32 id;
+  guint32 strs[SNAPSHOT_N_STRS];
+};
+
+DEFINE_GQUARK("snapshot");
+
+static guint32
+add_string(GByteArray *strings, const gchar *str)
+{
+  guint32 off = strings->len;
+
+  if (!str) {
+    return SNAPSHOT_NO_STR;
+  }
+  g_byte_array_append(strings, (const guint8 *) str, strlen(str) + 1);
+
+  return off;
+}
+
+static gboolean
+get_string(const struct snapshot *snap, guint32 len, guint32 off,
+           gchar **str, GError **err)
+{
+  if (off == SNAPSHOT_NO_STR) {
+    *str = NULL;
+  } else if (off >= len) {
+    SET_GERROR(err, -1, "string offset %u out of range", off);
+    return FALSE;
+  } else {
+    *str = snap->strings + off;
+  }
+
+  return TRUE;
+}
+
+static void
+compute_sum(const guint8 *data, gsize len, guint8 sum[SNAPSHOT_SUM_LEN])
+{
+  GChecksum *cs = g_checksum_new(G_CHECKSUM_SHA256);
+  gsize sum_len = SNAPSHOT_SUM_LEN;
+
+  g_checksum_update(cs, data, len);
+  g_checksum_get_digest(cs, sum, &sum_len);
+  g_checksum_free(cs);
+}
+
+static gboolean
+parse_snapshot(struct snapshot *snap, const guint8 *data, gsize len,
+               GError **err)
+{
+  struct snapshot_hdr hdr;
+  guint8 sum[SNAPSHOT_SUM_LEN];
+  const guint8 *p;
+  guint64 expected;
+  guint i;
+
+  if (len < sizeof(hdr) + SNAPSHOT_SUM_LEN) {
+    SET_GERROR(err, -1, "file too short");
+    return FALSE;
+  }
+
+  memcpy(&hdr, data, sizeof(hdr));
+  if (memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0 ||
+      hdr.version != SNAPSHOT_VERSION) {
+    SET_GERROR(err, -1, "unknown format");
+    return FALSE;
+  }
+
+  expected = sizeof(hdr) + (guint64) hdr.n_days * sizeof(struct sun_day) +
+             (guint64) hdr.n_scheds * sizeof(struct snapshot_sched) +
+             hdr.strings_len + SNAPSHOT_SUM_LEN;
+  if (expected != len) {
+    SET_GERROR(err, -1, "size mismatch");
+    return FALSE;
+  }
+
+  compute_sum(data, len - SNAPSHOT_SUM_LEN, sum);
+  if (memcmp(sum, data + len - SNAPSHOT_SUM_LEN, SNAPSHOT_SUM_LEN) != 0) {
+    SET_GERROR(err, -1, "checksum mismatch");
+    return FALSE;
+  }
+
+  snap->saved = hdr.saved;
+  snap->lat = hdr.lat;
+  snap->lon = hdr.lon;
+
+  p = data + sizeof(hdr);
+  g_array_append_vals(snap->days, p, hdr.n_days);
+  p += hdr.n_days * sizeof(struct sun_day);
+
+  /* All offsets are checked against the strings, which must end in a NUL */
+  snap->strings = g_malloc(hdr.strings_len + 1);
+  memcpy(snap->strings,
+         p + hdr.n_scheds * sizeof(struct snapshot_sched), hdr.strings_len);
+  snap->strings[hdr.strings_len] = '\0';
+  if (hdr.strings_len && snap->strings[hdr.strings_len - 1] != '\0') {
+    SET_GERROR(err, -1, "unterminated strings");
+    return FALSE;
+  } else if (!get_string(snap, hdr.strings_len, hdr.gateway,
+                         (gchar **) &snap->gateway, err)) {
+    return FALSE;
+  }
+
+  for (i = 0; i < hdr.n_scheds; i++) {
+    struct phoscon_schedule_ent ent = { 0, };
+    struct snapshot_sched rec;
+
+    memcpy(&rec, p + i * sizeof(rec), sizeof(rec));
+    ent.id = rec.id;
+    ent.created = rec.created;
+    if (!get_string(snap, hdr.strings_len, rec.strs[0], &ent.name, err) ||
+        !get_string(snap, hdr.strings_len, rec.strs[1], &ent.descr, err) ||
+        !get_string(snap, hdr.strings_len, rec.strs[2], &ent.status, err) ||
+        !get_string(snap, hdr.strings_len, rec.strs[3], &ent.timestr, err) ||
+        !get_string(snap, hdr.strings_len, rec.strs[4], &ent.local_timestr,
+                    err)) {
+      g_prefix_error(err, "schedule [%d]: ", rec.id);
+      return FALSE;
+    }
+    g_array_append_val(snap->scheds, ent);
+  }
+
+  return TRUE;
+}
+
+/**** Exposed functions begin here **************************************/
+
+struct snapshot *
+snapshot_load(const gchar *path, GError **err)
+{
+  struct snapshot *snap;
+  gchar *data;
+  gsize len;
+
+  g_return_val_if_fail(path != NULL, NULL);
+
+  if (!g_file_get_contents(path, &data, &len, err)) {
+    return NULL;
+  }
+
+  snap = g_malloc0(sizeof(*snap));
+  snap->days = g_array_new(FALSE, FALSE, sizeof(struct sun_day));
+  snap->scheds = g_array_new(FALSE, FALSE,
+                             sizeof(struct phoscon_schedule_ent));
+  if (!parse_snapshot(snap, (const guint8 *) data, len, err)) {
+    g_prefix_error(err, "snapshot '%s': ", path);
+    g_clear_pointer(&snap, snapshot_free);
+  }
+  g_free(data);
+
+  return snap;
+}
+
+/* The snapshot is only read, its strings may be owned by anyone */
+gboolean
+snapshot_save(const gchar *path, const struct snapshot *snap, GError **err)
+{
+  struct snapshot_hdr hdr = { 0, };
+  GByteArray *strings;
+  GByteArray *out;
+  guint8 sum[SNAPSHOT_SUM_LEN];
+  gboolean ret;
+  guint i;
+
+  g_return_val_if_fail(path != NULL, FALSE);
+  g_return_val_if_fail(snap != NULL, FALSE);
+
+  if (snap->days->len > G_MAXUINT16) {
+    SET_GERROR(err, -1, "too many sun days (%u)", snap->days->len);
+    return FALSE;
+  }
+
+  strings = g_byte_array_new();
+  memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+  hdr.version = SNAPSHOT_VERSION;
+  hdr.n_days = snap->days->len;
+  hdr.saved = snap->saved;
+  hdr.lat = snap->lat;
+  hdr.lon = snap->lon;
+  hdr.n_scheds = snap->scheds->len;
+  hdr.gateway = add_string(strings, snap->gateway);
+
+  out = g_byte_array_new();
+  g_byte_array_append(out, (const guint8 *) &hdr, sizeof(hdr));
+  g_byte_array_append(out, (const guint8 *) snap->days->data,
+                      snap->days->len * sizeof(struct sun_day));
+  for (i = 0; i < snap->scheds->len; i++) {
+    const struct phoscon_schedule_ent *ent =
+      &g_array_index(snap->scheds, struct phoscon_schedule_ent, i);
+    struct snapshot_sched rec = { 0, };
+
+    rec.id = ent->id;
+    rec.created = ent->created;
+    rec.strs[0] = add_string(strings, ent->name);
+    rec.strs[1] = add_string(strings, ent->descr);
+    rec.strs[2] = add_string(strings, ent->status);
+    rec.strs[3] = add_string(strings, ent->timestr);
+    rec.strs[4] = add_string(strings, ent->local_timestr);
+    g_byte_array_append(out, (const guint8 *) &rec, sizeof(rec));
+  }
+  g_byte_array_append(out, strings->data, strings->len);
+
+  /* The string length is only known now */
+  hdr.strings_len = strings->len;
+  memcpy(out->data, &hdr, sizeof(hdr));
+  compute_sum(out->data, out->len, sum);
+  g_byte_array_append(out, sum, sizeof(sum));
+
+  ret = g_file_set_contents(path, (const gchar *) out->data, out->len, err);
+  g_byte_array_unref(out);
+  g_byte_array_unref(strings);
+
+  return ret;
+}
+
+/* Only for snapshots returned by snapshot_load() */
+void
+snapshot_free(struct snapshot *snap)
+{
+  if (!snap) {
+    return;
+  }
+
+  g_array_unref(snap->days);
+  g_array_unref(snap->scheds);
+  g_free(snap->strings);
+  g_free(snap);
+}
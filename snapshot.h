@@ -0,0 +1,30 @@
+/* Persistent state snapshot for starting up without the network */
+
+#ifndef SNAPSHOT_H__
+#define SNAPSHOT_H__
+
+#include <glib.h>
+
+#include "sun_client.h"
+#include "phoscon_client.h"
+
+struct snapshot {
+  gint64 saved;            /* UNIX time */
+  gdouble lat;
+  gdouble lon;
+  const gchar *gateway;    /* "host:port" the schedules were read from */
+  GArray *days;            /* struct sun_day */
+  GArray *scheds;          /* struct phoscon_schedule_ent */
+  gchar *strings;          /* Strings of a loaded snapshot, NULL if none */
+};
+
+struct snapshot *
+snapshot_load(const gchar *path, GError **err);
+
+gboolean
+snapshot_save(const gchar *path, const struct snapshot *snap, GError **err);
+
+void
+snapshot_free(struct snapshot *snap);
+
+#endif /* SNAPSHOT_H__ */
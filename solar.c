@@ -0,0 +1,248 @@
+/* Local solar position calculations
+ *
+ * Implementation of the NOAA solar calculator equations, see
+ * https://gml.noaa.gov/grad/solcalc/calcdetails.html
+ * Accuracy is within a minute for latitudes between +/- 72 degrees.
+ */
+
+#include <math.h>
+#include <glib.h>
+
+#include "solar.h"
+
+/* Offset between the GLib julian day (0001-01-01 == 1) and the
+ * astronomical julian day at 00:00 UTC
+ */
+#define GDATE_JULIAN_OFFSET    1721424.5
+#define JULIAN_DAY_J2000       2451545.0
+#define DAYS_PER_CENTURY       36525.0
+#define MINUTES_PER_DAY        1440.0
+
+/* Zenith angle and direction of each event, solar noon is special */
+static const struct {
+  gdouble zenith;
+  gboolean rising;
+} sun_event_defs[SUN_EVENT_COUNT] = {
+  [SUN_EVENT_SUNRISE]       = { SOLAR_ZENITH_OFFICIAL,     TRUE  },
+  [SUN_EVENT_SUNSET]        = { SOLAR_ZENITH_OFFICIAL,     FALSE },
+  [SUN_EVENT_SOLAR_NOON]    = { 0.0,                       FALSE },
+  [SUN_EVENT_CIVIL_DAWN]    = { SOLAR_ZENITH_CIVIL,        TRUE  },
+  [SUN_EVENT_CIVIL_DUSK]    = { SOLAR_ZENITH_CIVIL,        FALSE },
+  [SUN_EVENT_NAUTICAL_DAWN] = { SOLAR_ZENITH_NAUTICAL,     TRUE  },
+  [SUN_EVENT_NAUTICAL_DUSK] = { SOLAR_ZENITH_NAUTICAL,     FALSE },
+  [SUN_EVENT_ASTRO_DAWN]    = { SOLAR_ZENITH_ASTRONOMICAL, TRUE  },
+  [SUN_EVENT_ASTRO_DUSK]    = { SOLAR_ZENITH_ASTRONOMICAL, FALSE },
+};
+
+#define DEG_TO_RAD(d)  ((d) * G_PI / 180.0)
+#define RAD_TO_DEG(r)  ((r) * 180.0 / G_PI)
+
+static gdouble
+julian_century(gdouble jd)
+{
+  return (jd - JULIAN_DAY_J2000) / DAYS_PER_CENTURY;
+}
+
+static gdouble
+geom_mean_long_sun(gdouble t)
+{
+  gdouble l0 = 280.46646 + t * (36000.76983 + t * 0.0003032);
+
+  l0 = fmod(l0, 360.0);
+
+  return l0 < 0 ? l0 + 360.0 : l0;
+}
+
+static gdouble
+geom_mean_anomaly_sun(gdouble t)
+{
+  return 357.52911 + t * (35999.05029 - 0.0001537 * t);
+}
+
+static gdouble
+eccentricity_earth_orbit(gdouble t)
+{
+  return 0.016708634 - t * (0.000042037 + 0.0000001267 * t);
+}
+
+static gdouble
+sun_eq_of_centre(gdouble t)
+{
+  gdouble mrad = DEG_TO_RAD(geom_mean_anomaly_sun(t));
+
+  return sin(mrad) * (1.914602 - t * (0.004817 + 0.000014 * t)) +
+         sin(2 * mrad) * (0.019993 - 0.000101 * t) +
+         sin(3 * mrad) * 0.000289;
+}
+
+static gdouble
+sun_apparent_long(gdouble t)
+{
+  gdouble true_long = geom_mean_long_sun(t) + sun_eq_of_centre(t);
+  gdouble omega = 125.04 - 1934.136 * t;
+
+  return true_long - 0.00569 - 0.00478 * sin(DEG_TO_RAD(omega));
+}
+
+static gdouble
+obliquity_correction(gdouble t)
+{
+  gdouble secs = 21.448 - t * (46.8150 + t * (0.00059 - t * 0.001813));
+  gdouble e0 = 23.0 + (26.0 + secs / 60.0) / 60.0;
+  gdouble omega = 125.04 - 1934.136 * t;
+
+  return e0 + 0.00256 * cos(DEG_TO_RAD(omega));
+}
+
+static gdouble
+sun_declination(gdouble t)
+{
+  gdouble e = DEG_TO_RAD(obliquity_correction(t));
+  gdouble lambda = DEG_TO_RAD(sun_apparent_long(t));
+
+  return RAD_TO_DEG(asin(sin(e) * sin(lambda)));
+}
+
+/* Equation of time in minutes */
+static gdouble
+equation_of_time(gdouble t)
+{
+  gdouble eps = DEG_TO_RAD(obliquity_correction(t));
+  gdouble l0 = DEG_TO_RAD(geom_mean_long_sun(t));
+  gdouble e = eccentricity_earth_orbit(t);
+  gdouble m = DEG_TO_RAD(geom_mean_anomaly_sun(t));
+  gdouble y = tan(eps / 2.0);
+  gdouble etime;
+
+  y *= y;
+  etime = y * sin(2.0 * l0) - 2.0 * e * sin(m) +
+          4.0 * e * y * sin(m) * cos(2.0 * l0) -
+          0.5 * y * y * sin(4.0 * l0) - 1.25 * e * e * sin(2.0 * m);
+
+  return RAD_TO_DEG(etime) * 4.0;
+}
+
+static gboolean
+event_utc_minutes(gdouble jd, gdouble lat, gdouble lon, gdouble zenith,
+                  gboolean rising, gdouble *minutes)
+{
+  gdouble t = julian_century(jd);
+  gdouble decl = DEG_TO_RAD(sun_declination(t));
+  gdouble latr = DEG_TO_RAD(lat);
+  gdouble ha_arg;
+  gdouble ha;
+
+  ha_arg = cos(DEG_TO_RAD(zenith)) / (cos(latr) * cos(decl)) -
+           tan(latr) * tan(decl);
+  if (ha_arg < -1.0 || ha_arg > 1.0) {
+    /* The sun never reaches this zenith on this day */
+    return FALSE;
+  }
+
+  ha = RAD_TO_DEG(acos(ha_arg));
+  if (!rising) {
+    ha = -ha;
+  }
+
+  *minutes = 720.0 - 4.0 * (lon + ha) - equation_of_time(t);
+
+  return TRUE;
+}
+
+/**** Exposed functions begin here **************************************/
+
+/*
+ * Calculate the solar declination (degrees) and equation of time
+ * (minutes) at the given fraction of a day past 00:00 UTC of the date.
+ */
+void
+solar_calc_position(const GDate *date, gdouble day_frac,
+                    gdouble *declination, gdouble *eq_of_time)
+{
+  gdouble t;
+
+  g_return_if_fail(date != NULL);
+  g_return_if_fail(g_date_valid(date));
+
+  t = julian_century(g_date_get_julian(date) + GDATE_JULIAN_OFFSET +
+                     day_frac);
+  if (declination) {
+    *declination = sun_declination(t);
+  }
+  if (eq_of_time) {
+    *eq_of_time = equation_of_time(t);
+  }
+}
+
+/*
+ * Calculate the time the sun crosses the given zenith angle on the
+ * specified date, either rising or setting. The result is in minutes
+ * past 00:00 UTC of that date and may fall outside of 0 - 1440 for
+ * locations far from the prime meridian.
+ * Returns FALSE if the event does not occur (polar day or night).
+ */
+gboolean
+solar_calc_event_utc(const GDate *date, gdouble lat, gdouble lon,
+                     gdouble zenith, gboolean rising, gdouble *minutes)
+{
+  gdouble jd;
+  gdouble est;
+
+  g_return_val_if_fail(date != NULL, FALSE);
+  g_return_val_if_fail(g_date_valid(date), FALSE);
+  g_return_val_if_fail(minutes != NULL, FALSE);
+
+  jd = g_date_get_julian(date) + GDATE_JULIAN_OFFSET;
+
+  /* First pass estimates the event time from the sun position at
+   * midnight, the second refines it using the position at that time.
+   */
+  if (!event_utc_minutes(jd, lat, lon, zenith, rising, &est) ||
+      !event_utc_minutes(jd + est / MINUTES_PER_DAY, lat, lon, zenith,
+                         rising, minutes)) {
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/*
+ * Calculate the time of solar noon (sun crossing the meridian) in
+ * minutes past 00:00 UTC of the date.
+ */
+gboolean
+solar_calc_noon_utc(const GDate *date, gdouble lon, gdouble *minutes)
+{
+  gdouble jd;
+  gdouble est;
+
+  g_return_val_if_fail(date != NULL, FALSE);
+  g_return_val_if_fail(g_date_valid(date), FALSE);
+  g_return_val_if_fail(minutes != NULL, FALSE);
+
+  jd = g_date_get_julian(date) + GDATE_JULIAN_OFFSET;
+  est = 720.0 - 4.0 * lon;
+  est -= equation_of_time(julian_century(jd + est / MINUTES_PER_DAY));
+  *minutes = 720.0 - 4.0 * lon -
+             equation_of_time(julian_century(jd + est / MINUTES_PER_DAY));
+
+  return TRUE;
+}
+
+/*
+ * Calculate the time of a named sun event in minutes past 00:00 UTC of
+ * the date. Returns FALSE if the event does not occur on that date.
+ */
+gboolean
+solar_calc_sun_event(const GDate *date, gdouble lat, gdouble lon,
+                     enum sun_event ev, gdouble *minutes)
+{
+  g_return_val_if_fail(ev < SUN_EVENT_COUNT, FALSE);
+
+  if (ev == SUN_EVENT_SOLAR_NOON) {
+    return solar_calc_noon_utc(date, lon, minutes);
+  }
+
+  return solar_calc_event_utc(date, lat, lon, sun_event_defs[ev].zenith,
+                              sun_event_defs[ev].rising, minutes);
+}
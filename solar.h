@@ -0,0 +1,44 @@
+/* Local solar position calculations based on the NOAA solar calculator */
+
+#ifndef SOLAR_H__
+#define SOLAR_H__
+
+#include <glib.h>
+
+/* Zenith angle of the sun centre at sunrise/sunset, accounting for
+ * atmospheric refraction and the radius of the solar disc
+ */
+#define SOLAR_ZENITH_OFFICIAL       90.833
+#define SOLAR_ZENITH_CIVIL          96.0
+#define SOLAR_ZENITH_NAUTICAL       102.0
+#define SOLAR_ZENITH_ASTRONOMICAL   108.0
+
+enum sun_event {
+  SUN_EVENT_SUNRISE = 0,
+  SUN_EVENT_SUNSET,
+  SUN_EVENT_SOLAR_NOON,
+  SUN_EVENT_CIVIL_DAWN,
+  SUN_EVENT_CIVIL_DUSK,
+  SUN_EVENT_NAUTICAL_DAWN,
+  SUN_EVENT_NAUTICAL_DUSK,
+  SUN_EVENT_ASTRO_DAWN,
+  SUN_EVENT_ASTRO_DUSK,
+  SUN_EVENT_COUNT,
+};
+
+void
+solar_calc_position(const GDate *date, gdouble day_frac,
+                    gdouble *declination, gdouble *eq_of_time);
+
+gboolean
+solar_calc_event_utc(const GDate *date, gdouble lat, gdouble lon,
+                     gdouble zenith, gboolean rising, gdouble *minutes);
+
+gboolean
+solar_calc_noon_utc(const GDate *date, gdouble lon, gdouble *minutes);
+
+gboolean
+solar_calc_sun_event(const GDate *date, gdouble lat, gdouble lon,
+                     enum sun_event ev, gdouble *minutes);
+
+#endif /* SOLAR_H__ */
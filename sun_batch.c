@@ -0,0 +1,322 @@
+/* Batch calculation of sunrise/sunset times for many locations
+ *
+ * The solar declination and equation of time only depend on the date, so
+ * they are calculated once per day of the year and interpolated for the
+ * time of each event. The per location work left is then a handful of
+ * polynomial evaluations, which are done on vectors of locations using
+ * SSE2 or AVX2 depending on what the CPU supports.
+ */
+
+#include <math.h>
+#include <glib.h>
+
+#include "sun_batch.h"
+#include "solar.h"
+#include "debug.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SUN_BATCH_X86   1
+#include <immintrin.h>
+#endif
+
+#define DAY_TABLE_LEN      367   /* Days of a leap year, plus one */
+#define MINUTES_PER_DAY    1440.0
+#define ROUND_MAGIC        6755399441055744.0  /* 1.5 * 2^52 */
+#define DEG_TO_RAD         (G_PI / 180.0)
+#define RAD_TO_DEG         (180.0 / G_PI)
+#define COS_ZENITH         -0.014543897651582657  /* cos(90.833 deg) */
+
+struct day_table {
+  gdouble sin_decl[DAY_TABLE_LEN];
+  gdouble cos_decl[DAY_TABLE_LEN];
+  gdouble eq_time[DAY_TABLE_LEN];     /* Minutes */
+};
+
+typedef gsize (*batch_kernel_fn)(const struct day_table *t,
+                                 const struct sun_batch_in *in,
+                                 struct sun_batch_out *out);
+
+DEFINE_GQUARK("sun_batch");
+
+static const gchar *isa_names[SUN_BATCH_ISA_LAST] = {
+  [SUN_BATCH_ISA_AUTO]   = "auto",
+  [SUN_BATCH_ISA_SCALAR] = "scalar",
+  [SUN_BATCH_ISA_SSE2]   = "sse2",
+  [SUN_BATCH_ISA_AVX2]   = "avx2",
+};
+
+#ifdef SUN_BATCH_X86
+
+/* Taylor series coefficients, in powers of x^2 */
+static const gdouble sin_coeffs[] = {
+  1.0, -1.0 / 6.0, 1.0 / 120.0, -1.0 / 5040.0, 1.0 / 362880.0,
+  -1.0 / 39916800.0, 1.0 / 6227020800.0, -1.0 / 1307674368000.0,
+};
+
+static const gdouble cos_coeffs[] = {
+  1.0, -1.0 / 2.0, 1.0 / 24.0, -1.0 / 720.0, 1.0 / 40320.0,
+  -1.0 / 3628800.0, 1.0 / 479001600.0, -1.0 / 87178291200.0,
+  1.0 / 20922789888000.0,
+};
+
+static const gdouble asin_coeffs[] = {
+  1.0, 1.0 / 6.0, 3.0 / 40.0, 5.0 / 112.0, 35.0 / 1152.0, 63.0 / 2816.0,
+  231.0 / 13312.0, 143.0 / 10240.0, 6435.0 / 557056.0, 12155.0 / 1245184.0,
+};
+
+/* SSE2, 2 lanes */
+#define VEC_FN(n)         n##_sse2
+#define VEC_ATTR          __attribute__((target("sse2")))
+#define V_T               __m128d
+#define V_W               2
+#define V_SET1            _mm_set1_pd
+#define V_LOADU           _mm_loadu_pd
+#define V_ADD             _mm_add_pd
+#define V_SUB             _mm_sub_pd
+#define V_MUL             _mm_mul_pd
+#define V_DIV             _mm_div_pd
+#define V_SQRT            _mm_sqrt_pd
+#define V_AND             _mm_and_pd
+#define V_ANDNOT          _mm_andnot_pd
+#define V_OR              _mm_or_pd
+#define V_CMPLT           _mm_cmplt_pd
+#define V_CMPGT           _mm_cmpgt_pd
+#define V_GATHER(t, idx, off) \
+  _mm_set_pd((t)[(idx)[1] + (off)], (t)[(idx)[0] + (off)])
+#define V_STORE_I32(p, v) \
+  _mm_storel_epi64((__m128i *) (p), _mm_cvtpd_epi32(v))
+
+#include "sun_batch_kernel.h"
+
+#undef VEC_FN
+#undef VEC_ATTR
+#undef V_T
+#undef V_W
+#undef V_SET1
+#undef V_LOADU
+#undef V_ADD
+#undef V_SUB
+#undef V_MUL
+#undef V_DIV
+#undef V_SQRT
+#undef V_AND
+#undef V_ANDNOT
+#undef V_OR
+#undef V_CMPLT
+#undef V_CMPGT
+#undef V_GATHER
+#undef V_STORE_I32
+
+/* AVX2, 4 lanes */
+#define VEC_FN(n)         n##_avx2
+#define VEC_ATTR          __attribute__((target("avx2")))
+#define V_T               __m256d
+#define V_W               4
+#define V_SET1            _mm256_set1_pd
+#define V_LOADU           _mm256_loadu_pd
+#define V_ADD             _mm256_add_pd
+#define V_SUB             _mm256_sub_pd
+#define V_MUL             _mm256_mul_pd
+#define V_DIV             _mm256_div_pd
+#define V_SQRT            _mm256_sqrt_pd
+#define V_AND             _mm256_and_pd
+#define V_ANDNOT          _mm256_andnot_pd
+#define V_OR              _mm256_or_pd
+#define V_CMPLT(a, b)     _mm256_cmp_pd(a, b, _CMP_LT_OQ)
+#define V_CMPGT(a, b)     _mm256_cmp_pd(a, b, _CMP_GT_OQ)
+#define V_GATHER(t, idx, off) \
+  _mm256_set_pd((t)[(idx)[3] + (off)], (t)[(idx)[2] + (off)], \
+                (t)[(idx)[1] + (off)], (t)[(idx)[0] + (off)])
+#define V_STORE_I32(p, v) \
+  _mm_storeu_si128((__m128i *) (p), _mm256_cvtpd_epi32(v))
+
+#include "sun_batch_kernel.h"
+
+#endif /* SUN_BATCH_X86 */
+
+static void
+build_day_table(gint year, struct day_table *t)
+{
+  GDate date;
+  guint i;
+
+  g_date_clear(&date, 1);
+  g_date_set_dmy(&date, 1, G_DATE_JANUARY, year);
+
+  for (i = 0; i < DAY_TABLE_LEN; i++) {
+    gdouble decl;
+
+    solar_calc_position(&date, 0.0, &decl, &t->eq_time[i]);
+    t->sin_decl[i] = sin(decl * DEG_TO_RAD);
+    t->cos_decl[i] = cos(decl * DEG_TO_RAD);
+    g_date_add_days(&date, 1);
+  }
+}
+
+static gdouble
+interp_day(const gdouble *tbl, guint idx, gdouble frac)
+{
+  return tbl[idx] + (tbl[idx + 1] - tbl[idx]) * frac;
+}
+
+static gboolean
+event_scalar(const struct day_table *t, guint idx, gdouble frac,
+             gdouble slat, gdouble clat, gdouble lon, gdouble sign,
+             gdouble *mins)
+{
+  gdouble sd = interp_day(t->sin_decl, idx, frac);
+  gdouble cd = interp_day(t->cos_decl, idx, frac);
+  gdouble eq = interp_day(t->eq_time, idx, frac);
+  gdouble arg = (COS_ZENITH - slat * sd) / (clat * cd);
+
+  if (arg < -1.0 || arg > 1.0) {
+    return FALSE;
+  }
+
+  *mins = 720.0 - 4.0 * (lon + sign * acos(arg) * RAD_TO_DEG) - eq;
+
+  return TRUE;
+}
+
+static gint32
+event_secs_scalar(const struct day_table *t, guint idx, gdouble slat,
+                  gdouble clat, gdouble lon, gdouble sign)
+{
+  gdouble noon = (720.0 - 4.0 * lon) / MINUTES_PER_DAY;
+  gdouble est;
+  gdouble mins;
+
+  if (!event_scalar(t, idx, noon, slat, clat, lon, sign, &est) ||
+      !event_scalar(t, idx, est / MINUTES_PER_DAY, slat, clat, lon, sign,
+                    &mins)) {
+    return SUN_BATCH_NO_EVENT;
+  }
+
+  /* Not wrapped, a sunset west of about 90W falls on the next UTC day */
+  return (gint32) nearbyint(mins * 60.0);
+}
+
+static void
+compute_scalar_range(const struct day_table *t, const struct sun_batch_in *in,
+                     struct sun_batch_out *out, gsize start)
+{
+  gsize i;
+
+  for (i = start; i < in->count; i++) {
+    gdouble lat = in->lat[i] * DEG_TO_RAD;
+    gdouble slat = sin(lat);
+    gdouble clat = cos(lat);
+    guint idx = in->doy[i] - 1;
+
+    out->sunrise[i] = event_secs_scalar(t, idx, slat, clat, in->lon[i], 1.0);
+    out->sunset[i] = event_secs_scalar(t, idx, slat, clat, in->lon[i], -1.0);
+  }
+}
+
+static gsize
+compute_scalar(const struct day_table *t, const struct sun_batch_in *in,
+               struct sun_batch_out *out)
+{
+  compute_scalar_range(t, in, out, 0);
+
+  return in->count;
+}
+
+static gboolean
+isa_supported(enum sun_batch_isa isa)
+{
+  switch (isa) {
+    case SUN_BATCH_ISA_SCALAR:
+      return TRUE;
+#ifdef SUN_BATCH_X86
+    case SUN_BATCH_ISA_SSE2:
+      return __builtin_cpu_supports("sse2");
+    case SUN_BATCH_ISA_AVX2:
+      return __builtin_cpu_supports("avx2");
+#endif
+    default:
+      return FALSE;
+  }
+}
+
+static batch_kernel_fn
+isa_kernel(enum sun_batch_isa isa)
+{
+  switch (isa) {
+#ifdef SUN_BATCH_X86
+    case SUN_BATCH_ISA_SSE2:
+      return compute_sse2;
+    case SUN_BATCH_ISA_AVX2:
+      return compute_avx2;
+#endif
+    default:
+      return compute_scalar;
+  }
+}
+
+/**** Exposed functions begin here **************************************/
+
+enum sun_batch_isa
+sun_batch_best_isa(void)
+{
+  if (isa_supported(SUN_BATCH_ISA_AVX2)) {
+    return SUN_BATCH_ISA_AVX2;
+  } else if (isa_supported(SUN_BATCH_ISA_SSE2)) {
+    return SUN_BATCH_ISA_SSE2;
+  }
+
+  return SUN_BATCH_ISA_SCALAR;
+}
+
+const gchar *
+sun_batch_isa_name(enum sun_batch_isa isa)
+{
+  g_return_val_if_fail(isa < SUN_BATCH_ISA_LAST, "<invalid>");
+
+  return isa_names[isa];
+}
+
+/*
+ * Calculate sunrise and sunset for every location and day of year in
+ * the input, using the requested instruction set or the best available
+ * one for SUN_BATCH_ISA_AUTO.
+ */
+gboolean
+sun_batch_compute(enum sun_batch_isa isa, const struct sun_batch_in *in,
+                  struct sun_batch_out *out, GError **err)
+{
+  struct day_table *t;
+  gsize done;
+  gsize i;
+
+  g_return_val_if_fail(isa < SUN_BATCH_ISA_LAST, FALSE);
+  g_return_val_if_fail(in != NULL, FALSE);
+  g_return_val_if_fail(out != NULL, FALSE);
+
+  if (isa == SUN_BATCH_ISA_AUTO) {
+    isa = sun_batch_best_isa();
+  } else if (!isa_supported(isa)) {
+    SET_GERROR(err, -1, "instruction set '%s' not supported",
+               isa_names[isa]);
+    return FALSE;
+  }
+
+  for (i = 0; i < in->count; i++) {
+    if (in->doy[i] < 1 || in->doy[i] > DAY_TABLE_LEN - 1) {
+      SET_GERROR(err, -1, "invalid day of year %u at index %" G_GSIZE_FORMAT,
+                 in->doy[i], i);
+      return FALSE;
+    }
+  }
+
+  t = g_malloc(sizeof(*t));
+  build_day_table(in->year, t);
+
+  /* Vector kernels leave the remainder for the scalar path */
+  done = isa_kernel(isa)(t, in, out);
+  compute_scalar_range(t, in, out, done);
+
+  g_free(t);
+
+  return TRUE;
+}
@@ -0,0 +1,45 @@
+/* Batch calculation of sunrise/sunset times for many locations */
+
+#ifndef SUN_BATCH_H__
+#define SUN_BATCH_H__
+
+#include <glib.h>
+
+#define SUN_BATCH_NO_EVENT   G_MININT32
+
+enum sun_batch_isa {
+  SUN_BATCH_ISA_AUTO = 0,  /* Best available on this CPU */
+  SUN_BATCH_ISA_SCALAR,
+  SUN_BATCH_ISA_SSE2,
+  SUN_BATCH_ISA_AVX2,
+  SUN_BATCH_ISA_LAST,
+};
+
+/* Structure-of-arrays input, all arrays hold count elements */
+struct sun_batch_in {
+  gint year;
+  const gdouble *lat;      /* Degrees, north positive */
+  const gdouble *lon;      /* Degrees, east positive */
+  const guint16 *doy;      /* Day of year, 1 - 366 */
+  gsize count;
+};
+
+/* Results as seconds relative to 00:00 UTC of the day, not wrapped, or
+ * SUN_BATCH_NO_EVENT
+ */
+struct sun_batch_out {
+  gint32 *sunrise;
+  gint32 *sunset;
+};
+
+gboolean
+sun_batch_compute(enum sun_batch_isa isa, const struct sun_batch_in *in,
+                  struct sun_batch_out *out, GError **err);
+
+enum sun_batch_isa
+sun_batch_best_isa(void);
+
+const gchar *
+sun_batch_isa_name(enum sun_batch_isa isa);
+
+#endif /* SUN_BATCH_H__ */
@@ -0,0 +1,162 @@
+/* Vectorised sunrise/sunset kernel
+ *
+ * This file is included by sun_batch.c once for every supported
+ * instruction set, with the following defined beforehand:
+ *
+ * VEC_FN(n)         Function name decoration for the instruction set
+ * VEC_ATTR          Function attributes enabling the instruction set
+ * V_T / V_W         Vector type and number of doubles per vector
+ * V_SET1, V_LOADU   Broadcast and unaligned load
+ * V_ADD, V_SUB, V_MUL, V_DIV, V_SQRT
+ * V_AND, V_ANDNOT, V_OR
+ * V_CMPLT, V_CMPGT            Comparisons returning all-ones lane masks
+ * V_GATHER(t, idx, off)       Load t[idx[lane] + off] into every lane
+ * V_STORE_I32(p, v)           Convert lanes to integers and store them
+ *
+ * No include guard on purpose.
+ */
+
+/* Returns b in lanes where mask is set and a elsewhere */
+VEC_ATTR static V_T
+VEC_FN(v_select)(V_T mask, V_T a, V_T b)
+{
+  return V_OR(V_AND(mask, b), V_ANDNOT(mask, a));
+}
+
+VEC_ATTR static V_T
+VEC_FN(v_poly)(V_T x, const gdouble *coeffs, gint n)
+{
+  V_T p = V_SET1(coeffs[n - 1]);
+  gint i;
+
+  for (i = n - 2; i >= 0; i--) {
+    p = V_ADD(V_MUL(p, x), V_SET1(coeffs[i]));
+  }
+
+  return p;
+}
+
+/* sin(x) and cos(x) for |x| <= pi/2 */
+VEC_ATTR static V_T
+VEC_FN(v_sin)(V_T x)
+{
+  V_T x2 = V_MUL(x, x);
+
+  return V_MUL(x, VEC_FN(v_poly)(x2, sin_coeffs, G_N_ELEMENTS(sin_coeffs)));
+}
+
+VEC_ATTR static V_T
+VEC_FN(v_cos)(V_T x)
+{
+  V_T x2 = V_MUL(x, x);
+
+  return VEC_FN(v_poly)(x2, cos_coeffs, G_N_ELEMENTS(cos_coeffs));
+}
+
+/* acos(x) for |x| <= 1 */
+VEC_ATTR static V_T
+VEC_FN(v_acos)(V_T x)
+{
+  V_T half_pi = V_SET1(G_PI / 2.0);
+  V_T a = V_ANDNOT(V_SET1(-0.0), x);
+  V_T big = V_CMPGT(a, V_SET1(0.5));
+  V_T zb = V_MUL(V_SUB(V_SET1(1.0), a), V_SET1(0.5));
+  V_T z = VEC_FN(v_select)(big, V_MUL(a, a), zb);
+  V_T s = VEC_FN(v_select)(big, a, V_SQRT(zb));
+  V_T p;
+
+  /* asin(|x|), using asin(a) = pi/2 - 2 * asin(sqrt((1 - a) / 2))
+   * to keep the series argument below 0.5
+   */
+  p = V_MUL(s, VEC_FN(v_poly)(z, asin_coeffs, G_N_ELEMENTS(asin_coeffs)));
+  p = VEC_FN(v_select)(big, p, V_SUB(half_pi, V_ADD(p, p)));
+
+  return VEC_FN(v_select)(V_CMPLT(x, V_SET1(0.0)),
+                          V_SUB(half_pi, p), V_ADD(half_pi, p));
+}
+
+/* Minutes past 00:00 UTC of the event with the sun position evaluated
+ * at the given fraction of the day. Lanes where the event does not occur
+ * are flagged in invalid.
+ */
+VEC_ATTR static V_T
+VEC_FN(v_event)(const struct day_table *t, const guint *idx, V_T frac,
+                V_T slat, V_T clat, V_T lon, gdouble sign, V_T *invalid)
+{
+  V_T sd0 = V_GATHER(t->sin_decl, idx, 0);
+  V_T cd0 = V_GATHER(t->cos_decl, idx, 0);
+  V_T eq0 = V_GATHER(t->eq_time, idx, 0);
+  V_T sd = V_ADD(sd0, V_MUL(V_SUB(V_GATHER(t->sin_decl, idx, 1), sd0), frac));
+  V_T cd = V_ADD(cd0, V_MUL(V_SUB(V_GATHER(t->cos_decl, idx, 1), cd0), frac));
+  V_T eq = V_ADD(eq0, V_MUL(V_SUB(V_GATHER(t->eq_time, idx, 1), eq0), frac));
+  V_T arg;
+  V_T inv;
+  V_T ha;
+
+  arg = V_DIV(V_SUB(V_SET1(COS_ZENITH), V_MUL(slat, sd)), V_MUL(clat, cd));
+  inv = V_OR(V_CMPLT(arg, V_SET1(-1.0)), V_CMPGT(arg, V_SET1(1.0)));
+  *invalid = V_OR(*invalid, inv);
+  arg = VEC_FN(v_select)(inv, arg, V_SET1(0.0));
+
+  ha = V_MUL(VEC_FN(v_acos)(arg), V_SET1(sign * RAD_TO_DEG));
+
+  return V_SUB(V_SUB(V_SET1(720.0), V_MUL(V_SET1(4.0), V_ADD(lon, ha))), eq);
+}
+
+/* Not wrapped, a sunset west of about 90W falls on the next UTC day */
+VEC_ATTR static V_T
+VEC_FN(v_to_secs)(V_T mins, V_T invalid)
+{
+  V_T round_magic = V_SET1(ROUND_MAGIC);
+  V_T x;
+
+  x = V_SUB(V_ADD(V_MUL(mins, V_SET1(60.0)), round_magic), round_magic);
+
+  return VEC_FN(v_select)(invalid, x, V_SET1(SUN_BATCH_NO_EVENT));
+}
+
+/* Processes whole vectors and returns the number of elements done */
+VEC_ATTR static gsize
+VEC_FN(compute)(const struct day_table *t, const struct sun_batch_in *in,
+                struct sun_batch_out *out)
+{
+  gsize i;
+
+  for (i = 0; i + V_W <= in->count; i += V_W) {
+    guint idx[V_W];
+    V_T lat;
+    V_T lon;
+    V_T slat;
+    V_T clat;
+    V_T noon;
+    V_T est;
+    V_T mins;
+    V_T inv;
+    gint j;
+
+    for (j = 0; j < V_W; j++) {
+      idx[j] = in->doy[i + j] - 1;
+    }
+
+    lat = V_MUL(V_LOADU(in->lat + i), V_SET1(DEG_TO_RAD));
+    lon = V_LOADU(in->lon + i);
+    slat = VEC_FN(v_sin)(lat);
+    clat = VEC_FN(v_cos)(lat);
+    noon = V_DIV(V_SUB(V_SET1(720.0), V_MUL(V_SET1(4.0), lon)),
+                 V_SET1(MINUTES_PER_DAY));
+
+    inv = V_SET1(0.0);
+    est = VEC_FN(v_event)(t, idx, noon, slat, clat, lon, 1.0, &inv);
+    est = V_DIV(est, V_SET1(MINUTES_PER_DAY));
+    mins = VEC_FN(v_event)(t, idx, est, slat, clat, lon, 1.0, &inv);
+    V_STORE_I32(out->sunrise + i, VEC_FN(v_to_secs)(mins, inv));
+
+    inv = V_SET1(0.0);
+    est = VEC_FN(v_event)(t, idx, noon, slat, clat, lon, -1.0, &inv);
+    est = V_DIV(est, V_SET1(MINUTES_PER_DAY));
+    mins = VEC_FN(v_event)(t, idx, est, slat, clat, lon, -1.0, &inv);
+    V_STORE_I32(out->sunset + i, VEC_FN(v_to_secs)(mins, inv));
+  }
+
+  return i;
+}
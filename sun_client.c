@@ -1,31 +1,135 @@
 /* Client for accessing Sunrise/sunset times */
 
+#include <math.h>
+#include <stdlib.h>
 #include <glib.h>
+#include <gio/gio.h>
 #include <jansson.h>
 
 #include "sun_client.h"
+#include "phoscon_client.h"
+#include "solar.h"
+#include "sun_table.h"
 #include "util.h"
 #include "debug.h"
 
 /* Sunrise/sunset times provided by sunrise-sunset.org */
 #define SUNRISE_SERVER_URL       "https://api.sunrise-sunset.org/json"
 #define DATA_STALE_PERIOD_SECS   120
+#define DEFAULT_PREFETCH_DAYS    1
+#define MAX_PREFETCH_DAYS        31
+#define LOCAL_PROVIDER_NAME      "local"
+#define PROVIDER_STAT_SAMPLES    32
+#define DEFAULT_HEDGE_DELAY_MS   1000
+#define MIN_HEDGE_DELAY_MS       250
+#define MAX_HEDGE_DELAY_MS       5000
+#define TIME_ONLY_LEN            16   /* "HH:MM:SS" */
+#define DURATION_STR_LEN         64
 
-struct sun_client {
-  GDateTime *sunrise;
-  GDateTime *sunset;
+enum sun_source {
+  SUN_SOURCE_REMOTE = 0,   /* sunrise-sunset.org API */
+  SUN_SOURCE_LOCAL,        /* NOAA solar calculator */
+  SUN_SOURCE_TABLE,        /* Precomputed yearly table of the above */
+  SUN_SOURCE_GATEWAY,      /* deCONZ Daylight sensor */
+  SUN_SOURCE_LAST,
+};
+
+static const gchar *sun_source_names[SUN_SOURCE_LAST] = {
+  [SUN_SOURCE_REMOTE]  = "remote",
+  [SUN_SOURCE_LOCAL]   = "local",
+  [SUN_SOURCE_TABLE]   = "table",
+  [SUN_SOURCE_GATEWAY] = "gateway",
+};
+
+static const gchar *sun_event_names[SUN_EVENT_COUNT] = {
+  [SUN_EVENT_SUNRISE]       = "sunrise",
+  [SUN_EVENT_SUNSET]        = "sunset",
+  [SUN_EVENT_SOLAR_NOON]    = "solar noon",
+  [SUN_EVENT_CIVIL_DAWN]    = "civil dawn",
+  [SUN_EVENT_CIVIL_DUSK]    = "civil dusk",
+  [SUN_EVENT_NAUTICAL_DAWN] = "nautical dawn",
+  [SUN_EVENT_NAUTICAL_DUSK] = "nautical dusk",
+  [SUN_EVENT_ASTRO_DAWN]    = "astronomical dawn",
+  [SUN_EVENT_ASTRO_DUSK]    = "astronomical dusk",
+};
+
+/* Keys of the events in the sunrise-sunset.org results object */
+static const gchar *sun_event_json_keys[SUN_EVENT_COUNT] = {
+  [SUN_EVENT_SUNRISE]       = "sunrise",
+  [SUN_EVENT_SUNSET]        = "sunset",
+  [SUN_EVENT_SOLAR_NOON]    = "solar_noon",
+  [SUN_EVENT_CIVIL_DAWN]    = "civil_twilight_begin",
+  [SUN_EVENT_CIVIL_DUSK]    = "civil_twilight_end",
+  [SUN_EVENT_NAUTICAL_DAWN] = "nautical_twilight_begin",
+  [SUN_EVENT_NAUTICAL_DUSK] = "nautical_twilight_end",
+  [SUN_EVENT_ASTRO_DAWN]    = "astronomical_twilight_begin",
+  [SUN_EVENT_ASTRO_DUSK]    = "astronomical_twilight_end",
+};
+
+/* A sunrise-sunset.org compatible API server */
+struct sun_provider {
+  gchar *url;
   conn_handle_t *handle;
+  GTimeSpan samples[PROVIDER_STAT_SAMPLES];   /* Recent latencies */
+  guint n_samples;
+  gulong wins;
+  gulong failures;
+};
+
+struct sun_client {
+  enum sun_source source;
+  phoscon_client_t *gateway;   /* For the "gateway" source, not owned */
+  GDateTime *times[SUN_EVENT_COUNT];
+  sun_table_t *table;
   gdouble lat;
   gdouble lon;
+  GTimeZone *tz;           /* Zone of the day looked up, NULL for UTC */
+  guint32 julian;          /* Day of the current times, 0 if none */
   gchar *req_str;
+  GPtrArray *providers;    /* Ordered by preference */
+  gboolean local_fallback;
+  GTimeSpan hedge_delay;   /* 0 for the p95 latency of the primary */
+  GHashTable *window;      /* Julian day -> struct sun_day */
+  gint prefetch_days;
+  gint prefetch_refresh;
+  gboolean lookup_busy;
   gint64 last_fetch;
   gulong fetch_counter;
+  gulong request_counter;
+};
+
+/* Lookup of today's sun times in progress */
+struct lookup_op {
+  struct sun_client *sc;
+  GDate today;
+  GDate date;              /* Day being fetched into the window */
+  gint day_idx;
+  gint fetched;
 };
 
 DEFINE_GQUARK("sun_client");
 
+static void
+clear_times(struct sun_client *sc)
+{
+  gint i;
+
+  for (i = 0; i < SUN_EVENT_COUNT; i++) {
+    g_clear_pointer(&sc->times[i], g_date_time_unref);
+  }
+}
+
+static void
+free_sun_provider(gpointer data)
+{
+  struct sun_provider *sp = (struct sun_provider *) data;
 
-static struct sun_client *sclient;
+  if (sp->handle) {
+    util_cleanup_handle(sp->handle);
+  }
+  g_free(sp->url);
+  g_free(sp);
+}
 
 static void
 free_sun_client(struct sun_client *sc)
@@ -34,25 +138,23 @@ free_sun_client(struct sun_client *sc)
     return;
   }
 
-  if (sc->handle) {
-    util_cleanup_handle(sc->handle);
-  }
-  g_clear_pointer(&sc->sunrise, g_date_time_unref);
-  g_clear_pointer(&sc->sunset, g_date_time_unref);
+  g_clear_pointer(&sc->providers, g_ptr_array_unref);
+  g_clear_pointer(&sc->table, sun_table_close);
+  g_clear_pointer(&sc->window, g_hash_table_destroy);
+  clear_times(sc);
+  g_clear_pointer(&sc->tz, g_time_zone_unref);
   g_free(sc->req_str);
   g_free(sc);
 }
 
 static const gchar *
-print_time_only(GDateTime *dt)
+print_time_only(GDateTime *dt, gchar buf[TIME_ONLY_LEN])
 {
-  static gchar buf[32];
-
   if (!dt) {
     return "<invalid>";
   }
 
-  g_snprintf(buf, sizeof(buf), "%02d:%02d:%02d",
+  g_snprintf(buf, TIME_ONLY_LEN, "%02d:%02d:%02d",
              g_date_time_get_hour(dt),
              g_date_time_get_minute(dt),
              g_date_time_get_second(dt));
@@ -60,10 +162,9 @@ print_time_only(GDateTime *dt)
   return buf;
 }
 
-static gchar *
-format_duration_str(GTimeSpan tdiff)
+static const gchar *
+format_duration_str(GTimeSpan tdiff, gchar *buf, gsize len)
 {
-  static gchar buf[256];
   const gchar *tstr = NULL;
   glong ltdf = labs(tdiff);
   guint disp = 0;
@@ -80,7 +181,7 @@ format_duration_str(GTimeSpan tdiff)
     disp = ltdf / G_TIME_SPAN_HOUR;
   }
 
-  g_snprintf(buf, sizeof(buf),
+  g_snprintf(buf, len,
              "%u %s%s %s",
              disp, tstr, disp == 1 ? "" : "s",
              before ? "earlier" : "later");
@@ -89,29 +190,364 @@ format_duration_str(GTimeSpan tdiff)
 }
 
 static gboolean
-sclient_lookup_internal(struct sun_client *sc, GError **err)
+parse_sun_source(const gchar *str, enum sun_source *source, GError **err)
+{
+  gint i;
+
+  if (!str) {
+    *source = SUN_SOURCE_REMOTE;
+    return TRUE;
+  }
+
+  for (i = 0; i < SUN_SOURCE_LAST; i++) {
+    if (g_ascii_strcasecmp(str, sun_source_names[i]) == 0) {
+      *source = i;
+      return TRUE;
+    }
+  }
+
+  SET_GERROR(err, -1, "unknown sun time source '%s'", str);
+
+  return FALSE;
+}
+
+/* Set up the providers from a list of API server URLs separated by ';'.
+ * The "local" entry enables falling back to the local calculator once
+ * all servers have had their chance to answer.
+ */
+static gboolean
+sclient_setup_providers(struct sun_client *sc, const gchar *list,
+                        GError **err)
+{
+  gboolean ret = FALSE;
+  gchar **names;
+  guint i;
+
+  sc->providers = g_ptr_array_new_with_free_func(free_sun_provider);
+  names = g_strsplit(list ? list : SUNRISE_SERVER_URL, ";", -1);
+  for (i = 0; names[i]; i++) {
+    struct sun_provider *sp;
+    gchar *name = g_strstrip(names[i]);
+
+    if (*name == '\0') {
+      continue;
+    } else if (g_ascii_strcasecmp(name, LOCAL_PROVIDER_NAME) == 0) {
+      sc->local_fallback = TRUE;
+      continue;
+    }
+
+    sp = g_malloc0(sizeof(*sp));
+    sp->url = g_strdup(name);
+    g_ptr_array_add(sc->providers, sp);
+    if ((sp->handle = util_init_handle(err)) == NULL) {
+      g_prefix_error(err, "setup handle for '%s': ", name);
+      goto out;
+    }
+  }
+
+  if (sc->providers->len == 0) {
+    SET_GERROR(err, -1, "no sun provider server configured");
+    goto out;
+  }
+
+  ret = TRUE;
+
+out:
+  g_strfreev(names);
+
+  return ret;
+}
+
+/* Today in the zone of the site, so a poll planned just after its local
+ * midnight looks up the day that just began there
+ */
+static void
+get_today(struct sun_client *sc, GDate *date)
+{
+  GDateTime *now = sc->tz ? g_date_time_new_now(sc->tz) :
+                            g_date_time_new_now_utc();
+
+  g_date_clear(date, 1);
+  g_date_set_dmy(date, g_date_time_get_day_of_month(now),
+                 g_date_time_get_month(now), g_date_time_get_year(now));
+  g_date_time_unref(now);
+}
+
+static GDateTime *
+utc_secs_to_dt(const GDate *date, gdouble secs)
+{
+  GDateTime *midnight;
+  GDateTime *dt;
+
+  midnight = g_date_time_new_utc(g_date_get_year(date),
+                                 g_date_get_month(date),
+                                 g_date_get_day(date), 0, 0, 0);
+  dt = g_date_time_add_seconds(midnight, secs);
+  g_date_time_unref(midnight);
+
+  return dt;
+}
+
+static void
+sclient_calc_local(struct sun_client *sc, const GDate *date,
+                   struct sun_day *day)
+{
+  gint i;
+
+  g_assert(sc);
+
+  day->julian = g_date_get_julian(date);
+  for (i = 0; i < SUN_EVENT_COUNT; i++) {
+    gdouble mins;
+
+    day->secs[i] = SUN_DAY_NO_EVENT;
+    if (solar_calc_sun_event(date, sc->lat, sc->lon, i, &mins)) {
+      day->secs[i] = round(mins * 60.0);
+    }
+  }
+}
+
+/* Make the times of the day the current ones */
+static void
+sclient_apply_day(struct sun_client *sc, const GDate *date,
+                  const struct sun_day *day)
+{
+  gint i;
+
+  clear_times(sc);
+  for (i = 0; i < SUN_EVENT_COUNT; i++) {
+    if (day->secs[i] != SUN_DAY_NO_EVENT) {
+      sc->times[i] = utc_secs_to_dt(date, day->secs[i]);
+    }
+  }
+  sc->julian = g_date_get_julian(date);
+  sc->last_fetch = g_get_monotonic_time();
+  sc->fetch_counter++;
+}
+
+static void
+sclient_compare_local(struct sun_client *sc, const GDate *date,
+                      const struct sun_day *day)
+{
+  struct sun_day local;
+  gint i;
+
+  sclient_calc_local(sc, date, &local);
+  for (i = 0; i < SUN_EVENT_COUNT; i++) {
+    if (day->secs[i] == SUN_DAY_NO_EVENT ||
+        local.secs[i] == SUN_DAY_NO_EVENT) {
+      continue;
+    }
+    g_debug("Local %s calculation deviates from %s by %+d secs",
+            sun_event_names[i], sun_source_names[sc->source],
+            local.secs[i] - day->secs[i]);
+  }
+}
+
+static void
+sclient_lookup_local(struct sun_client *sc, const GDate *date)
+{
+  struct sun_day day;
+
+  g_assert(sc);
+
+  sclient_calc_local(sc, date, &day);
+  sclient_apply_day(sc, date, &day);
+}
+
+static void
+sclient_lookup_table(struct sun_client *sc, const GDate *date)
+{
+  struct sun_day day;
+  gint i;
+
+  g_assert(sc);
+  g_assert(sc->table);
+
+  day.julian = g_date_get_julian(date);
+  sun_table_lookup(sc->table, date, day.secs);
+  for (i = 0; i < SUN_EVENT_COUNT; i++) {
+    if (day.secs[i] == SUN_TABLE_NO_EVENT) {
+      day.secs[i] = SUN_DAY_NO_EVENT;
+    }
+  }
+  sclient_apply_day(sc, date, &day);
+}
+
+static gint32
+dt_to_day_secs(const GDate *date, GDateTime *dt)
+{
+  GDateTime *midnight;
+  GTimeSpan ts;
+
+  midnight = g_date_time_new_utc(g_date_get_year(date),
+                                 g_date_get_month(date),
+                                 g_date_get_day(date), 0, 0, 0);
+  ts = g_date_time_difference(dt, midnight);
+  g_date_time_unref(midnight);
+
+  return ts / G_TIME_SPAN_SECOND;
+}
+
+static gint
+compare_timespan(const void *a, const void *b)
+{
+  GTimeSpan ta = *(const GTimeSpan *) a;
+  GTimeSpan tb = *(const GTimeSpan *) b;
+
+  return (ta > tb) - (ta < tb);
+}
+
+/* 95th percentile of the recent latencies, 0 if nothing is known yet */
+static GTimeSpan
+provider_p95(const struct sun_provider *sp)
+{
+  GTimeSpan sorted[PROVIDER_STAT_SAMPLES];
+  guint n = MIN(sp->n_samples, PROVIDER_STAT_SAMPLES);
+
+  if (n == 0) {
+    return 0;
+  }
+
+  memcpy(sorted, sp->samples, n * sizeof(*sorted));
+  qsort(sorted, n, sizeof(*sorted), compare_timespan);
+
+  return sorted[(n * 95 - 1) / 100];
+}
+
+static gint
+compare_provider_p95(gconstpointer a, gconstpointer b)
+{
+  GTimeSpan ta = provider_p95(*(const struct sun_provider **) a);
+  GTimeSpan tb = provider_p95(*(const struct sun_provider **) b);
+
+  return (ta > tb) - (ta < tb);
+}
+
+static GTimeSpan
+sclient_hedge_delay(struct sun_client *sc)
+{
+  GTimeSpan p95;
+
+  if (sc->hedge_delay > 0) {
+    return sc->hedge_delay;
+  }
+
+  if ((p95 = provider_p95(g_ptr_array_index(sc->providers, 0))) == 0) {
+    return DEFAULT_HEDGE_DELAY_MS * G_TIME_SPAN_MILLISECOND;
+  }
+
+  return CLAMP(p95, MIN_HEDGE_DELAY_MS * G_TIME_SPAN_MILLISECOND,
+               MAX_HEDGE_DELAY_MS * G_TIME_SPAN_MILLISECOND);
+}
+
+/* Record the outcome of a hedged request and move the providers with the
+ * lowest tail latency to the front. Requests abandoned in favour of a
+ * faster provider count with the time they were given, failures with the
+ * longest hedge delay.
+ */
+static void
+sclient_update_providers(struct sun_client *sc, const GTimeSpan *latencies,
+                         gint winner)
+{
+  struct sun_provider *primary = g_ptr_array_index(sc->providers, 0);
+  guint i;
+
+  for (i = 0; i < sc->providers->len; i++) {
+    struct sun_provider *sp = g_ptr_array_index(sc->providers, i);
+    GTimeSpan lat = latencies[i];
+
+    if (lat == 0) {
+      continue;
+    } else if (lat < 0) {
+      lat = MAX_HEDGE_DELAY_MS * G_TIME_SPAN_MILLISECOND;
+      sp->failures++;
+    } else if ((gint) i == winner) {
+      sp->wins++;
+    }
+    sp->samples[sp->n_samples++ % PROVIDER_STAT_SAMPLES] = lat;
+    sc->request_counter++;
+  }
+
+  g_ptr_array_sort(sc->providers, compare_provider_p95);
+  if (g_ptr_array_index(sc->providers, 0) != primary) {
+    primary = g_ptr_array_index(sc->providers, 0);
+    g_message("Primary sun provider is now %s (p95 latency %ld ms)",
+              primary->url, (glong) (provider_p95(primary) / 1000));
+  }
+}
+
+/* Request the sun times of a day from the providers in order of
+ * preference, hedging to the next one when the current one is slow
+ */
+static void
+sclient_request_day_async(struct sun_client *sc, const GDate *date,
+                          GCancellable *cancellable,
+                          GAsyncReadyCallback callback, gpointer user_data)
+{
+  conn_handle_t **handles;
+  gchar **urls;
+  guint n = sc->providers->len;
+  guint i;
+
+  handles = g_new0(conn_handle_t *, n);
+  urls = g_new0(gchar *, n + 1);
+  for (i = 0; i < n; i++) {
+    struct sun_provider *sp = g_ptr_array_index(sc->providers, i);
+
+    handles[i] = sp->handle;
+    urls[i] = g_strdup_printf("%s?%s&date=%04u-%02u-%02u", sp->url,
+                              sc->req_str, g_date_get_year(date),
+                              g_date_get_month(date), g_date_get_day(date));
+  }
+
+  g_debug("req: %s", urls[0]);
+  util_http_get_hedged_async(handles, (const gchar **) urls, n,
+                             sclient_hedge_delay(sc), sc->local_fallback,
+                             cancellable, callback, user_data);
+
+  g_strfreev(urls);
+  g_free(handles);
+}
+
+/* Returns the buffer holding the first successful response */
+static GString *
+sclient_request_day_finish(struct sun_client *sc, GAsyncResult *res,
+                           GError **err)
+{
+  GTimeSpan *latencies;
+  GString *buff = NULL;
+  gint winner;
+
+  latencies = g_new0(GTimeSpan, sc->providers->len);
+  winner = util_http_get_hedged_finish(res, latencies, err);
+  if (winner >= 0) {
+    struct sun_provider *sp = g_ptr_array_index(sc->providers, winner);
+
+    buff = util_get_handle_buffer(sp->handle);
+  }
+  sclient_update_providers(sc, latencies, winner);
+  g_free(latencies);
+
+  return buff;
+}
+
+static gboolean
+sclient_parse_remote_day(struct sun_client *sc, const GDate *date,
+                         GString *buff, struct sun_day *day, GError **err)
 {
-  GString *buff;
-  GDateTime *tmp1 = NULL;
-  GDateTime *tmp2 = NULL;
   gboolean ret = FALSE;
   json_t *jobj = NULL;
   json_t *jents = NULL;
   json_error_t jerr = { 0, };
-  const gchar *srise_time = NULL;
-  const gchar *sset_time = NULL;
   const gchar *status_str = NULL;
+  gint i;
 
-  g_return_val_if_fail(sc != NULL, FALSE);
-
-
-  g_debug("req: %s", sc->req_str);
-  if (!util_perform_http_get(sc->handle, sc->req_str, err)) {
-    g_prefix_error(err, "lookup failed: ");
-    return FALSE;
-  }
+  g_assert(sc);
+  g_assert(date);
+  g_assert(buff);
+  g_assert(day);
 
-  buff = util_get_handle_buffer(sc->handle);
   g_debug("result buffer: %s", buff->str);
 
   if ((jobj = json_loads(buff->str, 0, &jerr)) == NULL) {
@@ -132,136 +568,690 @@ sclient_lookup_internal(struct sun_client *sc, GError **err)
     goto out;
   }
 
-  if (json_unpack_ex(jents, &jerr, 0, "{s:s,s:s}",
-                     "sunrise", &srise_time,
-                     "sunset",  &sset_time) != 0) {
-    SET_GERROR(err, -1, "unexpected JSON response: %s", jerr.text);
-    goto out;
-  }
+  /* Pick up every event from the response in one pass */
+  day->julian = g_date_get_julian(date);
+  for (i = 0; i < SUN_EVENT_COUNT; i++) {
+    json_t *jtime = json_object_get(jents, sun_event_json_keys[i]);
+    const gchar *tstr = json_string_value(jtime);
+    GDateTime *dt;
 
-  if ((tmp1 = g_date_time_new_from_iso8601(srise_time, NULL)) == NULL) {
-    SET_GERROR(err, -1, "could not parse sunrise time string '%s'",
-               srise_time);
-    goto out;
-  }
+    if (!tstr) {
+      SET_GERROR(err, -1, "unexpected JSON response: missing '%s'",
+                 sun_event_json_keys[i]);
+      goto out;
+    } else if ((dt = g_date_time_new_from_iso8601(tstr, NULL)) == NULL) {
+      SET_GERROR(err, -1, "could not parse %s time string '%s'",
+                 sun_event_names[i], tstr);
+      goto out;
+    }
 
-  if ((tmp2 = g_date_time_new_from_iso8601(sset_time, NULL)) == NULL) {
-    SET_GERROR(err, -1, "could not parse sunset time string '%s'",
-               sset_time);
-    goto out;
+    /* Events that do not occur are reported at the epoch */
+    day->secs[i] = g_date_time_get_year(dt) <= 1970 ? SUN_DAY_NO_EVENT :
+                                                      dt_to_day_secs(date, dt);
+    g_date_time_unref(dt);
   }
 
-  g_clear_pointer(&sc->sunrise, g_date_time_unref);
-  g_clear_pointer(&sc->sunset, g_date_time_unref);
-  sc->last_fetch = g_get_monotonic_time();
-  sc->sunrise = g_date_time_ref(tmp1);
-  sc->sunset = g_date_time_ref(tmp2);
-  sc->fetch_counter++;
-
   ret = TRUE;
 
 out:
   if (jobj) {
     json_decref(jobj);
   }
-  g_clear_pointer(&tmp1, g_date_time_unref);
-  g_clear_pointer(&tmp2, g_date_time_unref);
 
   return ret;
 }
 
-/**** Exposed functions begin here **************************************/
+static gboolean
+window_day_expired(gpointer key, gpointer value, gpointer user_data)
+{
+  return GPOINTER_TO_UINT(key) < GPOINTER_TO_UINT(user_data);
+}
 
-gboolean
-sun_client_init(gdouble lat, gdouble lon, GError **err)
+static gint
+window_days_ahead(struct sun_client *sc, const GDate *today)
 {
-  struct sun_client *sc;
+  guint32 julian = g_date_get_julian(today);
+  gint i;
 
-  g_return_val_if_fail(sclient == NULL, FALSE);
+  for (i = 0; i < sc->prefetch_days; i++) {
+    if (!g_hash_table_contains(sc->window, GUINT_TO_POINTER(julian + i))) {
+      break;
+    }
+  }
 
-  /* Use GLib memory allocators */
-  json_set_alloc_funcs(g_malloc, g_free);
-  sc = g_malloc0(sizeof(*sc));
-  if ((sc->handle = util_init_handle(err)) == NULL) {
-    g_prefix_error(err, "setup handle: ");
-    goto out_fail;
+  return i;
+}
+
+static void
+sclient_lookup_return(GTask *task, GError *err)
+{
+  struct lookup_op *op = g_task_get_task_data(task);
+
+  op->sc->lookup_busy = FALSE;
+  if (err) {
+    g_task_return_error(task, err);
+  } else {
+    g_task_return_boolean(task, TRUE);
   }
+}
+
+/* Make today's day in the window the current one */
+static void
+sclient_remote_done(GTask *task)
+{
+  struct lookup_op *op = g_task_get_task_data(task);
+  struct sun_client *sc = op->sc;
+  struct sun_day *day;
+
+  day = g_hash_table_lookup(sc->window,
+                            GUINT_TO_POINTER(g_date_get_julian(&op->today)));
+  g_assert(day);
+
+  sclient_apply_day(sc, &op->today, day);
 
-  sc->lat = lat;
-  sc->lon = lon;
-  sc->req_str = g_strdup_printf("%s?lat=%.7f&lng=%.7f&formatted=0",
-                                SUNRISE_SERVER_URL,
-                                sc->lat, sc->lon);
+  /* Keep an eye on how well the local engine tracks the provider */
+  sclient_compare_local(sc, &op->today, day);
 
-  if (!sclient_lookup_internal(sc, err)) {
-    g_prefix_error(err, "fetch initial times failed: ");
+  sclient_lookup_return(task, NULL);
+}
+
+static void sclient_window_next(GTask *task);
+
+static void
+sclient_window_day_done(GObject *source, GAsyncResult *res,
+                        gpointer user_data)
+{
+  GTask *task = G_TASK(user_data);
+  struct lookup_op *op = g_task_get_task_data(task);
+  struct sun_client *sc = op->sc;
+  struct sun_day *day;
+  GError *err = NULL;
+  GString *buff;
+
+  day = g_malloc0(sizeof(*day));
+  if ((buff = sclient_request_day_finish(sc, res, &err)) != NULL) {
+    sclient_parse_remote_day(sc, &op->date, buff, day, &err);
+  } else if (sc->local_fallback &&
+             !g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+    g_message("No sun provider answered in time (%s), calculating locally",
+              GERROR_MSG(err));
+    g_clear_error(&err);
+    sclient_calc_local(sc, &op->date, day);
+  } else {
+    g_prefix_error(&err, "lookup failed: ");
+  }
+
+  if (err) {
+    g_free(day);
+    if (op->day_idx == 0 ||
+        g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+      sclient_lookup_return(task, err);
+      goto out;
+    }
+    /* Today is available, so try the rest again on the next lookup */
+    g_warning("Prefetch of day %d/%d failed: %s", op->day_idx + 1,
+              sc->prefetch_days, GERROR_MSG(err));
+    g_clear_error(&err);
+    op->day_idx = sc->prefetch_days;
+  } else {
+    g_hash_table_insert(sc->window, GUINT_TO_POINTER(day->julian), day);
+    op->fetched++;
+  }
+
+  sclient_window_next(task);
+
+out:
+  g_object_unref(task);
+}
+
+/* Fetch the days missing from the window one after another */
+static void
+sclient_window_next(GTask *task)
+{
+  struct lookup_op *op = g_task_get_task_data(task);
+  struct sun_client *sc = op->sc;
+  gpointer key = GUINT_TO_POINTER(g_date_get_julian(&op->date));
+
+  while (op->day_idx < sc->prefetch_days &&
+         g_hash_table_contains(sc->window, key)) {
+    op->day_idx++;
+    g_date_add_days(&op->date, 1);
+    key = GUINT_TO_POINTER(g_date_get_julian(&op->date));
+  }
+
+  if (op->day_idx < sc->prefetch_days) {
+    sclient_request_day_async(sc, &op->date, g_task_get_cancellable(task),
+                              sclient_window_day_done, g_object_ref(task));
+    return;
+  }
+
+  g_debug("Sun time window refreshed, fetched %d day(s), %u cached",
+          op->fetched, g_hash_table_size(sc->window));
+  sclient_remote_done(task);
+}
+
+static void
+sclient_lookup_remote(GTask *task)
+{
+  struct lookup_op *op = g_task_get_task_data(task);
+  struct sun_client *sc = op->sc;
+  gint ahead;
+
+  ahead = window_days_ahead(sc, &op->today);
+  if (ahead > sc->prefetch_refresh) {
+    sclient_remote_done(task);
+    return;
+  }
+
+  /* Fetch all days missing from the window in one burst of requests */
+  g_debug("Sun time window has %d day(s) ahead, refreshing", ahead);
+  g_hash_table_foreach_remove(sc->window, window_day_expired,
+                              GUINT_TO_POINTER(g_date_get_julian(&op->today)));
+  op->date = op->today;
+  sclient_window_next(task);
+}
+
+/* The gateway already tracks sunrise and sunset for its configured
+ * location, the remaining events are filled in by the local calculator.
+ */
+static void
+sclient_gateway_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  GTask *task = G_TASK(user_data);
+  struct lookup_op *op = g_task_get_task_data(task);
+  struct sun_client *sc = op->sc;
+  GDateTime *sunrise = NULL;
+  GDateTime *sunset = NULL;
+  struct sun_day day;
+  GError *err = NULL;
+
+  if (!phoscon_client_get_daylight_finish(res, &sunrise, &sunset, &err)) {
+    sclient_lookup_return(task, err);
+    goto out;
+  }
+  sc->request_counter++;
+
+  sclient_calc_local(sc, &op->today, &day);
+  day.secs[SUN_EVENT_SUNRISE] = dt_to_day_secs(&op->today, sunrise);
+  day.secs[SUN_EVENT_SUNSET] = dt_to_day_secs(&op->today, sunset);
+  g_date_time_unref(sunrise);
+  g_date_time_unref(sunset);
+
+  sclient_compare_local(sc, &op->today, &day);
+  sclient_apply_day(sc, &op->today, &day);
+  sclient_lookup_return(task, NULL);
+
+out:
+  g_object_unref(task);
+}
+
+static void
+sclient_lookup_async(struct sun_client *sc, GCancellable *cancellable,
+                     GAsyncReadyCallback callback, gpointer user_data)
+{
+  struct lookup_op *op;
+  GTask *task;
+
+  g_assert(sc);
+
+  task = g_task_new(NULL, cancellable, callback, user_data);
+  if (sc->lookup_busy) {
+    g_task_return_new_error(task, error_quark(), -1,
+                            "sun time lookup already in progress");
+    g_object_unref(task);
+    return;
+  }
+
+  op = g_malloc0(sizeof(*op));
+  op->sc = sc;
+  get_today(sc, &op->today);
+  g_task_set_task_data(task, op, g_free);
+  sc->lookup_busy = TRUE;
+
+  switch (sc->source) {
+    case SUN_SOURCE_REMOTE:
+      sclient_lookup_remote(task);
+      break;
+    case SUN_SOURCE_LOCAL:
+      sclient_lookup_local(sc, &op->today);
+      sclient_lookup_return(task, NULL);
+      break;
+    case SUN_SOURCE_TABLE:
+      sclient_lookup_table(sc, &op->today);
+      sclient_lookup_return(task, NULL);
+      break;
+    case SUN_SOURCE_GATEWAY:
+      phoscon_client_get_daylight_async(sc->gateway, cancellable,
+                                        sclient_gateway_done,
+                                        g_object_ref(task));
+      break;
+    default:
+      g_assert_not_reached();
+  }
+
+  g_object_unref(task);
+}
+
+static gboolean
+sclient_lookup_finish(GAsyncResult *res, GError **err)
+{
+  g_return_val_if_fail(g_task_is_valid(res, NULL), FALSE);
+
+  return g_task_propagate_boolean(G_TASK(res), err);
+}
+
+/* Set up a client without looking up any times yet */
+static struct sun_client *
+sclient_new(const struct sun_client_cfg *cfg, GError **err)
+{
+  struct sun_client *sc;
+
+  util_init_json();
+  sc = g_malloc0(sizeof(*sc));
+  if (!parse_sun_source(cfg->source, &sc->source, err)) {
+    goto out_fail;
+  } else if (sc->source == SUN_SOURCE_GATEWAY && !cfg->gateway) {
+    SET_GERROR(err, -1, "the gateway source needs a phoscon client");
     goto out_fail;
   }
+  sc->gateway = cfg->gateway;
 
-  g_message("Sunrise/Sunset client initialised with location lat=%.6f long=%.6f",
-            lat, lon);
-  g_message("Attribution of API to sunrise-sunset.org");
-  g_message("Initial sunrise time (UTC): %s", print_time_only(sc->sunrise));
-  g_message("Initial sunset time (UTC) : %s", print_time_only(sc->sunset));
-  sclient = sc;
+  sc->lat = cfg->lat;
+  sc->lon = cfg->lon;
+  sc->tz = cfg->tz ? g_time_zone_ref(cfg->tz) : NULL;
 
-  return TRUE;
+  if (sc->source == SUN_SOURCE_REMOTE) {
+    if (!sclient_setup_providers(sc, cfg->providers, err)) {
+      g_prefix_error(err, "sun providers: ");
+      goto out_fail;
+    }
+    sc->hedge_delay = MAX(cfg->hedge_delay_ms, 0) * G_TIME_SPAN_MILLISECOND;
+    sc->req_str = g_strdup_printf("lat=%.7f&lng=%.7f&formatted=0",
+                                  sc->lat, sc->lon);
+    sc->window = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                       NULL, g_free);
+    sc->prefetch_days = cfg->prefetch_days > 0 ? cfg->prefetch_days :
+                                                 DEFAULT_PREFETCH_DAYS;
+    if (sc->prefetch_days > MAX_PREFETCH_DAYS) {
+      g_warning("Prefetch of %d days too large, limiting to %d",
+                sc->prefetch_days, MAX_PREFETCH_DAYS);
+      sc->prefetch_days = MAX_PREFETCH_DAYS;
+    }
+    sc->prefetch_refresh = CLAMP(cfg->prefetch_refresh, 0,
+                                 sc->prefetch_days - 1);
+  } else if (sc->source == SUN_SOURCE_TABLE) {
+    if (!cfg->table_file) {
+      SET_GERROR(err, -1, "table source requires a sun table file");
+      goto out_fail;
+    } else if ((sc->table = sun_table_open(cfg->table_file, sc->lat, sc->lon,
+                                           err)) == NULL) {
+      g_prefix_error(err, "sun table: ");
+      goto out_fail;
+    }
+  }
+
+  return sc;
 
 out_fail:
   free_sun_client(sc);
 
-  return FALSE;
+  return NULL;
+}
+
+/*
+ * Take over saved days, today's times become the current ones and the
+ * remote source keeps the days ahead in its window. Returns FALSE if today
+ * is not among them.
+ */
+static gboolean
+sclient_seed(struct sun_client *sc, const struct sun_day *days,
+             guint n_days)
+{
+  const struct sun_day *today_day = NULL;
+  GDate today;
+  guint32 julian;
+  guint i;
+
+  get_today(sc, &today);
+  julian = g_date_get_julian(&today);
+  for (i = 0; i < n_days; i++) {
+    if (days[i].julian == julian) {
+      today_day = &days[i];
+    }
+    if (sc->window && days[i].julian >= julian) {
+      g_hash_table_insert(sc->window, GUINT_TO_POINTER(days[i].julian),
+                          g_memdup2(&days[i], sizeof(days[i])));
+    }
+  }
+
+  if (!today_day) {
+    return FALSE;
+  }
+  sclient_apply_day(sc, &today, today_day);
+
+  return TRUE;
+}
+
+static void
+sclient_log_init(struct sun_client *sc)
+{
+  gint i;
+
+  g_message("Sunrise/Sunset client initialised with location lat=%.6f long=%.6f",
+            sc->lat, sc->lon);
+  g_message("Sun times source: %s", sun_source_names[sc->source]);
+  if (sc->source == SUN_SOURCE_REMOTE) {
+    g_message("Attribution of API to sunrise-sunset.org");
+    g_message("Prefetching %d day(s), refreshing with %d day(s) left",
+              sc->prefetch_days, sc->prefetch_refresh);
+    for (i = 0; i < (gint) sc->providers->len; i++) {
+      const struct sun_provider *sp = g_ptr_array_index(sc->providers, i);
+
+      g_message("Sun provider %d: %s", i + 1, sp->url);
+    }
+    if (sc->local_fallback) {
+      g_message("Sun provider %d: local calculation", i + 1);
+    }
+  }
+  for (i = 0; i < SUN_EVENT_COUNT; i++) {
+    gchar buf[TIME_ONLY_LEN];
+
+    g_message("Initial %s time (UTC): %s", sun_event_names[i],
+              print_time_only(sc->times[i], buf));
+  }
+}
+
+/**** Exposed functions begin here **************************************/
+
+sun_client_t *
+sun_client_new(const struct sun_client_cfg *cfg, GError **err)
+{
+  return sun_client_restore(cfg, NULL, 0, err);
+}
+
+static void
+restore_lookup_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  GTask *task = G_TASK(user_data);
+  struct sun_client *sc = g_task_get_task_data(task);
+  GError *err = NULL;
+
+  if (!sclient_lookup_finish(res, &err)) {
+    g_prefix_error(&err, "fetch initial times failed: ");
+    free_sun_client(sc);
+    g_task_return_error(task, err);
+  } else {
+    sclient_log_init(sc);
+    g_task_return_pointer(task, sc, (GDestroyNotify) free_sun_client);
+  }
+
+  g_object_unref(task);
 }
 
+/*
+ * As sun_client_new(), but the initial times are taken from saved days
+ * if today is among them, so no lookup is needed before starting up. The
+ * days are copied before this returns. The client belongs to the thread
+ * default main context it was created from.
+ */
 void
-sun_client_cleanup(void)
+sun_client_restore_async(const struct sun_client_cfg *cfg,
+                         const struct sun_day *days, guint n_days,
+                         GCancellable *cancellable,
+                         GAsyncReadyCallback callback, gpointer user_data)
 {
-  struct sun_client *sc = sclient;
+  struct sun_client *sc;
+  GError *err = NULL;
+  GTask *task;
 
-  if (!sc) {
+  g_return_if_fail(cfg != NULL);
+  g_return_if_fail(days != NULL || n_days == 0);
+
+  task = g_task_new(NULL, cancellable, callback, user_data);
+  if ((sc = sclient_new(cfg, &err)) == NULL) {
+    g_task_return_error(task, err);
+    g_object_unref(task);
+    return;
+  }
+
+  if (sclient_seed(sc, days, n_days)) {
+    g_message("Sun times of today restored from %u saved day(s)", n_days);
+    sclient_log_init(sc);
+    g_task_return_pointer(task, sc, (GDestroyNotify) free_sun_client);
+    g_object_unref(task);
     return;
   }
 
-  g_message("Tearing down sun client, total lookups: %lu", sc->fetch_counter);
-  g_clear_pointer(&sclient, free_sun_client);
+  g_task_set_task_data(task, sc, NULL);
+  sclient_lookup_async(sc, cancellable, restore_lookup_done, task);
+}
+
+sun_client_t *
+sun_client_restore_finish(GAsyncResult *res, GError **err)
+{
+  g_return_val_if_fail(g_task_is_valid(res, NULL), NULL);
+
+  return g_task_propagate_pointer(G_TASK(res), err);
+}
+
+sun_client_t *
+sun_client_restore(const struct sun_client_cfg *cfg,
+                   const struct sun_day *days, guint n_days, GError **err)
+{
+  GAsyncResult *res = NULL;
+  sun_client_t *sc;
+
+  g_return_val_if_fail(cfg != NULL, NULL);
+  g_return_val_if_fail(days != NULL || n_days == 0, NULL);
+
+  sun_client_restore_async(cfg, days, n_days, NULL,
+                           util_async_store_result, &res);
+  sc = sun_client_restore_finish(util_async_wait(&res), err);
+  g_object_unref(res);
+
+  return sc;
 }
 
+/* TRUE if the initial lookup needs an initialised phoscon client */
 gboolean
-sun_client_lookup(GDateTime **sunrise, GDateTime **sunset, GError **err)
+sun_client_needs_gateway(const struct sun_client_cfg *cfg)
 {
-  struct sun_client *sc = sclient;
-  gboolean use_cached = FALSE;
+  enum sun_source source;
 
-  g_return_val_if_fail(sc != NULL, FALSE);
+  return parse_sun_source(cfg->source, &source, NULL) &&
+         source == SUN_SOURCE_GATEWAY;
+}
+
+/*
+ * Days with known times worth saving: the window of the remote source, or
+ * today for the others. Free with g_array_unref().
+ */
+GArray *
+sun_client_get_days(sun_client_t *sc)
+{
+  GHashTableIter iter;
+  struct sun_day day;
+  gpointer value;
+  GArray *days;
+  GDate today;
+  gint i;
+
+  g_return_val_if_fail(sc != NULL, NULL);
+
+  days = g_array_new(FALSE, FALSE, sizeof(struct sun_day));
+  if (sc->window) {
+    g_hash_table_iter_init(&iter, sc->window);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+      g_array_append_vals(days, value, 1);
+    }
+  } else if (sc->last_fetch) {
+    get_today(sc, &today);
+    day.julian = g_date_get_julian(&today);
+    for (i = 0; i < SUN_EVENT_COUNT; i++) {
+      day.secs[i] = sc->times[i] ? dt_to_day_secs(&today, sc->times[i]) :
+                                   SUN_DAY_NO_EVENT;
+    }
+    g_array_append_val(days, day);
+  }
+
+  return days;
+}
+
+void
+sun_client_free(sun_client_t *sc)
+{
+  if (!sc) {
+    return;
+  }
+
+  g_message("Tearing down sun client, total lookups: %lu, requests: %lu",
+            sc->fetch_counter, sc->request_counter);
+  if (sc->providers) {
+    guint i;
+
+    for (i = 0; i < sc->providers->len; i++) {
+      const struct sun_provider *sp = g_ptr_array_index(sc->providers, i);
+
+      g_message("Provider %s: wins: %lu, failures: %lu, p95 latency: %ld ms",
+                sp->url, sp->wins, sp->failures,
+                (glong) (provider_p95(sp) / 1000));
+    }
+  }
+  free_sun_client(sc);
+}
+
+/*
+ * Look up the times of all sun events today without blocking. Recent
+ * times are served from the cache, otherwise they are looked up from the
+ * configured source.
+ */
+void
+sun_client_lookup_events_async(sun_client_t *sc, GCancellable *cancellable,
+                               GAsyncReadyCallback callback,
+                               gpointer user_data)
+{
+  GTask *task;
+
+  g_return_if_fail(sc != NULL);
 
   if (sc->last_fetch) {
     gint64 mt = (g_get_monotonic_time() - sc->last_fetch) / G_TIME_SPAN_SECOND;
-    use_cached = mt < DATA_STALE_PERIOD_SECS;
+    gboolean use_cached;
+    GDate today;
+
+    /* Recent times of the day before are no use after midnight */
+    get_today(sc, &today);
+    use_cached = mt < DATA_STALE_PERIOD_SECS &&
+                 sc->julian == g_date_get_julian(&today);
 
-    g_assert(sc->sunrise);
-    g_assert(sc->sunset);
-    g_debug("Sunrise/sunset data is %ld seconds old, cache use: %s",
+    g_debug("Sun event data is %ld seconds old, cache use: %s",
             mt, use_cached ? "yes" : "no");
+    if (use_cached) {
+      task = g_task_new(NULL, cancellable, callback, user_data);
+      g_task_return_boolean(task, TRUE);
+      g_object_unref(task);
+      return;
+    }
   }
 
-  if (!use_cached && sclient_lookup_internal(sc, err) == FALSE) {
+  sclient_lookup_async(sc, cancellable, callback, user_data);
+}
+
+/*
+ * Events that do not occur today (e.g. twilight during polar summer) are
+ * set to NULL.
+ */
+gboolean
+sun_client_lookup_events_finish(sun_client_t *sc, GAsyncResult *res,
+                                GDateTime *times[SUN_EVENT_COUNT],
+                                GError **err)
+{
+  gint i;
+
+  g_return_val_if_fail(sc != NULL, FALSE);
+  g_return_val_if_fail(times != NULL, FALSE);
+
+  if (!sclient_lookup_finish(res, err)) {
     return FALSE;
   }
 
+  for (i = 0; i < SUN_EVENT_COUNT; i++) {
+    times[i] = sc->times[i] ? g_date_time_ref(sc->times[i]) : NULL;
+  }
+
+  return TRUE;
+}
+
+/*
+ * Look up the times of all sun events today. Events that do not occur
+ * today (e.g. twilight during polar summer) are set to NULL.
+ */
+gboolean
+sun_client_lookup_events(sun_client_t *sc, GDateTime *times[SUN_EVENT_COUNT],
+                         GError **err)
+{
+  GAsyncResult *res = NULL;
+  gboolean ret;
+
+  g_return_val_if_fail(sc != NULL, FALSE);
+  g_return_val_if_fail(times != NULL, FALSE);
+
+  sun_client_lookup_events_async(sc, NULL, util_async_store_result, &res);
+  ret = sun_client_lookup_events_finish(sc, util_async_wait(&res), times,
+                                        err);
+  g_object_unref(res);
+
+  return ret;
+}
+
+gboolean
+sun_client_lookup(sun_client_t *sc, GDateTime **sunrise, GDateTime **sunset,
+                  GError **err)
+{
+  GDateTime *times[SUN_EVENT_COUNT];
+  gboolean ret = FALSE;
+  gint i;
+
+  if (!sun_client_lookup_events(sc, times, err)) {
+    return FALSE;
+  }
+
+  if (!times[SUN_EVENT_SUNRISE] || !times[SUN_EVENT_SUNSET]) {
+    SET_GERROR(err, -1, "the sun does not rise or set today at this location");
+    goto out;
+  }
+
   if (sunset) {
-    *sunset = g_date_time_ref(sc->sunset);
+    *sunset = g_date_time_ref(times[SUN_EVENT_SUNSET]);
   }
   if (sunrise) {
-    *sunrise = g_date_time_ref(sc->sunrise);
+    *sunrise = g_date_time_ref(times[SUN_EVENT_SUNRISE]);
   }
+  ret = TRUE;
 
-  return TRUE;
+out:
+  for (i = 0; i < SUN_EVENT_COUNT; i++) {
+    g_clear_pointer(&times[i], g_date_time_unref);
+  }
+
+  return ret;
+}
+
+const gchar *
+sun_client_event_name(enum sun_event ev)
+{
+  g_return_val_if_fail(ev < SUN_EVENT_COUNT, "<invalid>");
+
+  return sun_event_names[ev];
 }
 
 void
 sun_client_print_tdiff(GDateTime *orig, GDateTime *latest,
                        const gchar *descr)
 {
+  gchar orig_buf[TIME_ONLY_LEN];
+  gchar latest_buf[TIME_ONLY_LEN];
+  gchar dur_buf[DURATION_STR_LEN];
   GTimeSpan ts;
 
   g_return_if_fail(orig != NULL);
@@ -273,10 +1263,12 @@ sun_client_print_tdiff(GDateTime *orig, GDateTime *latest,
 
   ts = util_dt_diff_time_only(latest, orig);
   if (!ts) {
-    g_message("No difference in %s time (%s)", descr, print_time_only(orig));
+    g_message("No difference in %s time (%s)", descr,
+              print_time_only(orig, orig_buf));
     return;
   }
 
   g_message("The %s time is %s (%s)", descr,
-            format_duration_str(ts), print_time_only(latest));
+            format_duration_str(ts, dur_buf, sizeof(dur_buf)),
+            print_time_only(latest, latest_buf));
 }
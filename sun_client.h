@@ -1,18 +1,90 @@
-/* Client for accessing Sunrise/sunset times provided by sunrise-sunset.org */
+/* Client for accessing Sunrise/sunset times provided by sunrise-sunset.org
+ * or calculated locally
+ */
 
 #ifndef SUN_CLIENT_H__
 #define SUN_CLIENT_H__
 
 #include <glib.h>
+#include <gio/gio.h>
+
+#include "solar.h"
+#include "phoscon_client.h"
+
+/* A client belongs to the thread default main context it was created from,
+ * clients on different threads are independent of each other
+ */
+typedef struct sun_client sun_client_t;
+
+struct sun_client_cfg {
+  gdouble lat;
+  gdouble lon;
+  gchar *source;           /* "remote" (default), "local", "table" or
+                               "gateway" */
+  gchar *table_file;       /* Sun table location for the "table" source */
+  gint prefetch_days;      /* Days fetched ahead by the "remote" source */
+  gint prefetch_refresh;   /* Refresh when this many days or less remain */
+  gchar *providers;        /* ';' separated API servers, "local" fallback */
+  gint hedge_delay_ms;     /* Delay before hedging, 0 for the p95 latency */
+  phoscon_client_t *gateway; /* Client of the "gateway" source, not owned */
+  GTimeZone *tz;           /* Zone whose date is today, NULL for UTC */
+};
+
+#define SUN_DAY_NO_EVENT         G_MININT32
+
+/* Event times of a single day, a date in the zone of the client, as
+ * seconds relative to 00:00 UTC of that date, or SUN_DAY_NO_EVENT
+ */
+struct sun_day {
+  guint32 julian;
+  gint32 secs[SUN_EVENT_COUNT];
+};
+
+sun_client_t *
+sun_client_new(const struct sun_client_cfg *cfg, GError **err);
+
+sun_client_t *
+sun_client_restore(const struct sun_client_cfg *cfg,
+                   const struct sun_day *days, guint n_days, GError **err);
+
+void
+sun_client_restore_async(const struct sun_client_cfg *cfg,
+                         const struct sun_day *days, guint n_days,
+                         GCancellable *cancellable,
+                         GAsyncReadyCallback callback, gpointer user_data);
+
+sun_client_t *
+sun_client_restore_finish(GAsyncResult *res, GError **err);
 
 gboolean
-sun_client_init(gdouble lat, gdouble lon, GError **err);
+sun_client_needs_gateway(const struct sun_client_cfg *cfg);
+
+GArray *
+sun_client_get_days(sun_client_t *sc);
 
 void
-sun_client_cleanup(void);
+sun_client_free(sun_client_t *sc);
 
 gboolean
-sun_client_lookup(GDateTime **sunrise, GDateTime **sunset, GError **err);
+sun_client_lookup(sun_client_t *sc, GDateTime **sunrise, GDateTime **sunset,
+                  GError **err);
+
+gboolean
+sun_client_lookup_events(sun_client_t *sc, GDateTime *times[SUN_EVENT_COUNT],
+                         GError **err);
+
+void
+sun_client_lookup_events_async(sun_client_t *sc, GCancellable *cancellable,
+                               GAsyncReadyCallback callback,
+                               gpointer user_data);
+
+gboolean
+sun_client_lookup_events_finish(sun_client_t *sc, GAsyncResult *res,
+                                GDateTime *times[SUN_EVENT_COUNT],
+                                GError **err);
+
+const gchar *
+sun_client_event_name(enum sun_event ev);
 
 void
 sun_client_print_tdiff(GDateTime *orig, GDateTime *latest,
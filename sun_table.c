@@ -0,0 +1,215 @@
+/* Precomputed yearly sun event table
+ *
+ * The table holds one entry per day of a leap year with the time of every
+ * sun event as seconds relative to 00:00 UTC of that day, negative or past
+ * a full day for locations far from the prime meridian, the same as the
+ * local calculation. It is generated once using the local
+ * solar calculator and stored in a small binary file (host byte order)
+ * which is memory mapped on subsequent starts. The file is regenerated
+ * only if the location it was built for differs from the configured one.
+ */
+
+#include <math.h>
+#include <glib.h>
+
+#include "sun_table.h"
+#include "solar.h"
+#include "debug.h"
+
+#define SUN_TABLE_MAGIC       "PSUN"
+#define SUN_TABLE_VERSION     3
+#define SUN_TABLE_DAYS        366
+#define SUN_TABLE_REF_YEAR    2024   /* Leap year used to generate entries */
+#define SUN_TABLE_COORD_EPS   1e-7
+
+struct sun_table_hdr {
+  gchar magic[4];
+  guint16 version;
+  guint16 n_days;
+  gdouble lat;
+  gdouble lon;
+};
+
+struct sun_table_ent {
+  gint32 secs[SUN_EVENT_COUNT];
+};
+
+struct sun_table_file {
+  struct sun_table_hdr hdr;
+  struct sun_table_ent ents[SUN_TABLE_DAYS];
+};
+
+struct sun_table {
+  GMappedFile *mfile;
+  const struct sun_table_file *data;
+};
+
+DEFINE_GQUARK("sun_table");
+
+static gint32
+calc_event_secs(const GDate *date, gdouble lat, gdouble lon,
+                enum sun_event ev)
+{
+  gdouble mins;
+
+  if (!solar_calc_sun_event(date, lat, lon, ev, &mins)) {
+    return SUN_TABLE_NO_EVENT;
+  }
+
+  /* Not wrapped, a sunset west of about 90W falls on the next UTC day */
+  return (gint32) round(mins * 60.0);
+}
+
+static gboolean
+generate_table(const gchar *path, gdouble lat, gdouble lon, GError **err)
+{
+  struct sun_table_file *tf;
+  GDate date;
+  gboolean ret;
+  guint i;
+
+  tf = g_malloc0(sizeof(*tf));
+  memcpy(tf->hdr.magic, SUN_TABLE_MAGIC, sizeof(tf->hdr.magic));
+  tf->hdr.version = SUN_TABLE_VERSION;
+  tf->hdr.n_days = SUN_TABLE_DAYS;
+  tf->hdr.lat = lat;
+  tf->hdr.lon = lon;
+
+  g_date_clear(&date, 1);
+  g_date_set_dmy(&date, 1, G_DATE_JANUARY, SUN_TABLE_REF_YEAR);
+  for (i = 0; i < SUN_TABLE_DAYS; i++) {
+    gint ev;
+
+    for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+      tf->ents[i].secs[ev] = calc_event_secs(&date, lat, lon, ev);
+    }
+    g_date_add_days(&date, 1);
+  }
+
+  ret = g_file_set_contents(path, (const gchar *) tf, sizeof(*tf), err);
+  g_free(tf);
+
+  return ret;
+}
+
+static gboolean
+validate_table(GMappedFile *mfile, gdouble lat, gdouble lon)
+{
+  const struct sun_table_file *tf;
+
+  if (g_mapped_file_get_length(mfile) != sizeof(*tf)) {
+    g_message("Sun table size mismatch, regenerating");
+    return FALSE;
+  }
+
+  tf = (const struct sun_table_file *) g_mapped_file_get_contents(mfile);
+  if (memcmp(tf->hdr.magic, SUN_TABLE_MAGIC, sizeof(tf->hdr.magic)) != 0 ||
+      tf->hdr.version != SUN_TABLE_VERSION ||
+      tf->hdr.n_days != SUN_TABLE_DAYS) {
+    g_message("Sun table has unknown format, regenerating");
+    return FALSE;
+  }
+
+  if (fabs(tf->hdr.lat - lat) > SUN_TABLE_COORD_EPS ||
+      fabs(tf->hdr.lon - lon) > SUN_TABLE_COORD_EPS) {
+    g_message("Sun table built for lat=%.6f long=%.6f, regenerating",
+              tf->hdr.lat, tf->hdr.lon);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static GMappedFile *
+map_table(const gchar *path, gdouble lat, gdouble lon, GError **err)
+{
+  GMappedFile *mfile;
+  GError *lerr = NULL;
+
+  if ((mfile = g_mapped_file_new(path, FALSE, &lerr)) != NULL) {
+    if (validate_table(mfile, lat, lon)) {
+      return mfile;
+    }
+    g_mapped_file_unref(mfile);
+  } else {
+    g_debug("Could not map sun table: %s", GERROR_MSG(lerr));
+    g_clear_error(&lerr);
+  }
+
+  if (!generate_table(path, lat, lon, err)) {
+    g_prefix_error(err, "generate sun table: ");
+    return NULL;
+  }
+  g_message("Generated sun table '%s'", path);
+
+  if ((mfile = g_mapped_file_new(path, FALSE, err)) == NULL) {
+    return NULL;
+  } else if (!validate_table(mfile, lat, lon)) {
+    SET_GERROR(err, -1, "generated sun table failed validation");
+    g_mapped_file_unref(mfile);
+    return NULL;
+  }
+
+  return mfile;
+}
+
+/**** Exposed functions begin here **************************************/
+
+sun_table_t *
+sun_table_open(const gchar *path, gdouble lat, gdouble lon, GError **err)
+{
+  sun_table_t *tbl;
+  GMappedFile *mfile;
+
+  g_return_val_if_fail(path != NULL, NULL);
+
+  if ((mfile = map_table(path, lat, lon, err)) == NULL) {
+    g_prefix_error(err, "open '%s': ", path);
+    return NULL;
+  }
+
+  tbl = g_malloc0(sizeof(*tbl));
+  tbl->mfile = mfile;
+  tbl->data = (const struct sun_table_file *) g_mapped_file_get_contents(mfile);
+
+  return tbl;
+}
+
+void
+sun_table_close(sun_table_t *tbl)
+{
+  if (!tbl) {
+    return;
+  }
+
+  g_mapped_file_unref(tbl->mfile);
+  g_free(tbl);
+}
+
+/*
+ * Look up the time of every sun event on the given date as seconds relative
+ * to 00:00 UTC, events not occurring that day are SUN_TABLE_NO_EVENT.
+ */
+void
+sun_table_lookup(sun_table_t *tbl, const GDate *date,
+                 gint32 secs[SUN_EVENT_COUNT])
+{
+  const struct sun_table_ent *ent;
+  guint idx;
+
+  g_return_if_fail(tbl != NULL);
+  g_return_if_fail(date != NULL);
+  g_return_if_fail(secs != NULL);
+
+  /* Entries are indexed by day of a leap year, so skip the 29th of
+   * February slot for the rest of a common year.
+   */
+  idx = g_date_get_day_of_year(date) - 1;
+  if (!g_date_is_leap_year(g_date_get_year(date)) && idx >= 59) {
+    idx++;
+  }
+  g_assert(idx < SUN_TABLE_DAYS);
+
+  ent = &tbl->data->ents[idx];
+  memcpy(secs, ent->secs, sizeof(ent->secs));
+}
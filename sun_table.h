@@ -0,0 +1,24 @@
+/* Precomputed yearly sun event table for a fixed location */
+
+#ifndef SUN_TABLE_H__
+#define SUN_TABLE_H__
+
+#include <glib.h>
+
+#include "solar.h"
+
+#define SUN_TABLE_NO_EVENT   G_MININT32
+
+typedef struct sun_table sun_table_t;
+
+sun_table_t *
+sun_table_open(const gchar *path, gdouble lat, gdouble lon, GError **err);
+
+void
+sun_table_close(sun_table_t *tbl);
+
+void
+sun_table_lookup(sun_table_t *tbl, const GDate *date,
+                 gint32 secs[SUN_EVENT_COUNT]);
+
+#endif /* SUN_TABLE_H__ */
@@ -0,0 +1,126 @@
+/* Batch sun time calculation benchmark
+ *
+ * Measures the throughput of every instruction set the CPU supports on a
+ * set of random locations and prints it along with the largest deviation
+ * from the scalar path. Usage: bench-sun-batch [locations]
+ */
+
+#include <stdlib.h>
+#include <glib.h>
+
+#include "sun_batch.h"
+
+#define BENCH_LOCATIONS    100000
+#define BENCH_MIN_USECS    (G_TIME_SPAN_SECOND / 2)
+
+/* Results are not wrapped, so a plain difference catches events placed
+ * on the wrong day
+ */
+static gint32
+event_error(gint32 a, gint32 b)
+{
+  return ABS(a - b);
+}
+
+gint
+main(gint argc, gchar **argv)
+{
+  struct sun_batch_in in = { 0, };
+  struct sun_batch_out ref = { 0, };
+  struct sun_batch_out out = { 0, };
+  gdouble scalar_rate = 0;
+  gdouble *lat;
+  gdouble *lon;
+  guint16 *doy;
+  gsize count = BENCH_LOCATIONS;
+  gint isa;
+  gsize i;
+
+  if (argc > 1 && (count = g_ascii_strtoull(argv[1], NULL, 10)) == 0) {
+    g_printerr("Usage: %s [locations]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  lat = g_new(gdouble, count);
+  lon = g_new(gdouble, count);
+  doy = g_new(guint16, count);
+  for (i = 0; i < count; i++) {
+    lat[i] = g_random_double_range(-65.0, 65.0);
+    lon[i] = g_random_double_range(-180.0, 180.0);
+    doy[i] = g_random_int_range(1, 367);
+  }
+
+  in.year = 2024;
+  in.lat = lat;
+  in.lon = lon;
+  in.doy = doy;
+  in.count = count;
+  ref.sunrise = g_new(gint32, count);
+  ref.sunset = g_new(gint32, count);
+  out.sunrise = g_new(gint32, count);
+  out.sunset = g_new(gint32, count);
+
+  sun_batch_compute(SUN_BATCH_ISA_SCALAR, &in, &ref, NULL);
+
+  g_message("Sun batch benchmark, %" G_GSIZE_FORMAT " locations", count);
+  g_print("+--------+----------------+---------+-----------+----------+\n"
+          "| ISA    | Locations/sec  | Speedup | Max error | Mismatch |\n"
+          "+--------+----------------+---------+-----------+----------+\n");
+
+  for (isa = SUN_BATCH_ISA_SCALAR; isa < SUN_BATCH_ISA_LAST; isa++) {
+    gint64 start;
+    gint64 elapsed;
+    gulong runs = 0;
+    gsize mismatch = 0;
+    gint32 max_err = 0;
+    gdouble rate;
+
+    /* Fails for instruction sets this CPU does not have */
+    start = g_get_monotonic_time();
+    if (!sun_batch_compute(isa, &in, &out, NULL)) {
+      continue;
+    }
+    do {
+      sun_batch_compute(isa, &in, &out, NULL);
+      runs++;
+    } while ((elapsed = g_get_monotonic_time() - start) < BENCH_MIN_USECS);
+
+    /* Events found by one path only are counted, not measured */
+    for (i = 0; i < count; i++) {
+      if ((out.sunrise[i] == SUN_BATCH_NO_EVENT) !=
+          (ref.sunrise[i] == SUN_BATCH_NO_EVENT) ||
+          (out.sunset[i] == SUN_BATCH_NO_EVENT) !=
+          (ref.sunset[i] == SUN_BATCH_NO_EVENT)) {
+        mismatch++;
+        continue;
+      }
+      if (ref.sunrise[i] != SUN_BATCH_NO_EVENT) {
+        max_err = MAX(max_err, event_error(out.sunrise[i], ref.sunrise[i]));
+      }
+      if (ref.sunset[i] != SUN_BATCH_NO_EVENT) {
+        max_err = MAX(max_err, event_error(out.sunset[i], ref.sunset[i]));
+      }
+    }
+
+    rate = (gdouble) (runs + 1) * count * G_TIME_SPAN_SECOND / elapsed;
+    if (isa == SUN_BATCH_ISA_SCALAR) {
+      scalar_rate = rate;
+    }
+
+    g_print("| %-6s | %14.0f | %6.2fx | %7d s | %8" G_GSIZE_FORMAT " |\n",
+            sun_batch_isa_name(isa), rate, rate / scalar_rate, max_err,
+            mismatch);
+  }
+
+  g_print("+--------+----------------+---------+-----------+----------+\n");
+
+  g_free(ref.sunrise);
+  g_free(ref.sunset);
+  g_free(out.sunrise);
+  g_free(out.sunset);
+  g_free(lat);
+  g_free(lon);
+  g_free(doy);
+
+  return EXIT_SUCCESS;
+}
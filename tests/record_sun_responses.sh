@@ -0,0 +1,28 @@
+#!/bin/sh
+# Record sunrise-sunset.org responses for the solar calculation test
+#
+# Usage: record_sun_responses.sh > data/sun_responses.json
+# Needs curl and jq. Requests are spaced out to stay well within the
+# API's fair use.
+
+API="https://api.sunrise-sunset.org/json"
+
+# Latitude/longitude pairs: polar circle, high and mid latitudes on both
+# hemispheres, the tropics and sites far from the prime meridian
+SITES="69.6492,18.9553 60.1699,24.9384 52.52,13.405 40.7128,-74.006
+34.0522,-118.2437 21.3069,-157.8583 1.3521,103.8198 -33.8688,151.2093
+-54.8019,-68.303"
+DATES="2024-03-20 2024-06-21 2024-09-22 2024-12-21"
+
+set -e
+
+for site in $SITES; do
+  lat=${site%,*}
+  lng=${site#*,}
+  for date in $DATES; do
+    curl -sf "$API?lat=$lat&lng=$lng&date=$date&formatted=0" |
+      jq -c --argjson lat "$lat" --argjson lng "$lng" --arg date "$date" \
+        '{lat: $lat, lng: $lng, date: $date, response: .}'
+    sleep 1
+  done
+done | jq -s '{source: "api.sunrise-sunset.org", cases: .}'
@@ -0,0 +1,146 @@
+/* Local solar calculation checked against reference sun times
+ *
+ * Every case of data/sun_responses.json is a date and location with the
+ * sun times for it, in the format of a sunrise-sunset.org response. Each
+ * event calculated locally must occur when the reference has it and be
+ * within SUN_TOLERANCE_SECS of it.
+ *
+ * Only a file recorded with record_sun_responses.sh, whose source is
+ * SUN_API_SOURCE, validates against the API. Any other source is a cross
+ * check with another calculation and is reported as such.
+ */
+
+#include <math.h>
+#include <glib.h>
+#include <jansson.h>
+
+#include "solar.h"
+
+/* The NOAA equations are accurate to a minute within +/- 72 degrees */
+#define SUN_TOLERANCE_SECS   60
+#define SUN_API_SOURCE       "api.sunrise-sunset.org"
+
+static const gchar *const event_keys[SUN_EVENT_COUNT] = {
+  [SUN_EVENT_SUNRISE]       = "sunrise",
+  [SUN_EVENT_SUNSET]        = "sunset",
+  [SUN_EVENT_SOLAR_NOON]    = "solar_noon",
+  [SUN_EVENT_CIVIL_DAWN]    = "civil_twilight_begin",
+  [SUN_EVENT_CIVIL_DUSK]    = "civil_twilight_end",
+  [SUN_EVENT_NAUTICAL_DAWN] = "nautical_twilight_begin",
+  [SUN_EVENT_NAUTICAL_DUSK] = "nautical_twilight_end",
+  [SUN_EVENT_ASTRO_DAWN]    = "astronomical_twilight_begin",
+  [SUN_EVENT_ASTRO_DUSK]    = "astronomical_twilight_end",
+};
+
+static void
+test_sun_case(gconstpointer data)
+{
+  json_t *jcase = (json_t *) data;
+  json_t *jres;
+  json_error_t jerr;
+  const gchar *date_str;
+  GDateTime *midnight;
+  GDate date;
+  gdouble lat;
+  gdouble lng;
+  guint failures = 0;
+  gint y, m, d;
+  gint ev;
+
+  if (json_unpack_ex(jcase, &jerr, 0, "{s:F,s:F,s:s,s:{s:o}}",
+                     "lat", &lat, "lng", &lng, "date", &date_str,
+                     "response", "results", &jres) != 0) {
+    g_error("Malformed case: %s", jerr.text);
+  }
+  g_assert_cmpint(sscanf(date_str, "%d-%d-%d", &y, &m, &d), ==, 3);
+
+  g_date_clear(&date, 1);
+  g_date_set_dmy(&date, d, m, y);
+  midnight = g_date_time_new_utc(y, m, d, 0, 0, 0);
+
+  for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+    const gchar *tstr = json_string_value(json_object_get(jres,
+                                                          event_keys[ev]));
+    GDateTime *dt;
+    gboolean occurs;
+    gdouble minutes;
+    gdouble secs;
+
+    g_assert_nonnull(tstr);
+    dt = g_date_time_new_from_iso8601(tstr, NULL);
+    g_assert_nonnull(dt);
+    occurs = solar_calc_sun_event(&date, lat, lng, ev, &minutes);
+
+    /* Events that do not occur are reported at the epoch */
+    if (g_date_time_get_year(dt) <= 1970) {
+      if (occurs) {
+        g_test_message("%s: calculated but not in the response",
+                       event_keys[ev]);
+        failures++;
+      }
+    } else if (!occurs) {
+      g_test_message("%s: in the response but not calculated",
+                     event_keys[ev]);
+      failures++;
+    } else {
+      secs = minutes * 60.0 -
+             g_date_time_difference(dt, midnight) / G_TIME_SPAN_SECOND;
+      if (fabs(secs) > SUN_TOLERANCE_SECS) {
+        g_test_message("%s: calculated %+.0f secs from %s", event_keys[ev],
+                       secs, tstr);
+        failures++;
+      }
+    }
+    g_date_time_unref(dt);
+  }
+  g_date_time_unref(midnight);
+
+  g_assert_cmpuint(failures, ==, 0);
+}
+
+gint
+main(gint argc, gchar **argv)
+{
+  json_t *jroot;
+  json_t *jcases;
+  json_t *jcase;
+  json_error_t jerr;
+  const gchar *source;
+  gchar *path;
+  gsize i;
+  gint ret;
+
+  g_test_init(&argc, &argv, NULL);
+
+  path = g_test_build_filename(G_TEST_DIST, "data", "sun_responses.json",
+                               NULL);
+  if ((jroot = json_load_file(path, 0, &jerr)) == NULL) {
+    g_error("Could not load '%s': %s", path, jerr.text);
+  }
+  g_free(path);
+
+  jcases = json_object_get(jroot, "cases");
+  g_assert_true(json_array_size(jcases) > 0);
+  source = json_string_value(json_object_get(jroot, "source"));
+  if (g_strcmp0(source, SUN_API_SOURCE) == 0) {
+    g_test_message("Reference times recorded from %s", source);
+  } else {
+    g_test_message("Reference times not from %s but '%s', a cross check "
+                   "only", SUN_API_SOURCE, source ? source : "unknown");
+  }
+
+  json_array_foreach(jcases, i, jcase) {
+    gchar *name = g_strdup_printf("/solar/%.4f,%.4f/%s",
+        json_number_value(json_object_get(jcase, "lat")),
+        json_number_value(json_object_get(jcase, "lng")),
+        json_string_value(json_object_get(jcase, "date")));
+
+    g_test_add_data_func(name, jcase, test_sun_case);
+    g_free(name);
+  }
+
+  ret = g_test_run();
+  json_decref(jroot);
+
+  return ret;
+}
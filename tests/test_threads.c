@@ -0,0 +1,588 @@
+/* Clients driven from several threads at once
+ *
+ * Each thread has its own main context and its own sun and phoscon
+ * clients, at a location and time zone of its own. The phoscon clients
+ * fetch, update and resync their schedules over real transfers to a stub
+ * gateway served from another thread on a local port. Every other site
+ * gets its sun times from the same stub, which answers like the
+ * sunrise-sunset.org API. The sun times and their formatting are checked
+ * against a reference the thread works out with the local calculation and
+ * restored schedules, taken again when the day of the site changes. Run
+ * from a -Db_sanitize=thread build to have data races reported.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "sun_client.h"
+#include "phoscon_client.h"
+#include "util.h"
+#include "solar.h"
+
+#define TEST_THREADS         8
+#define TEST_ROUNDS          10
+#define TEST_SCHEDULES       6
+#define TEST_API_KEY         "threads"
+#define TEST_TIME_STR        "W127/T12:00:00"
+
+struct stub {
+  GMainContext *ctx;
+  GMainLoop *loop;
+  GSocketService *service;
+  guint16 port;
+  gint requests;           /* Atomic */
+};
+
+struct site_result {
+  GDateTime *times[SUN_EVENT_COUNT];
+  struct phoscon_sched_time fmts[SUN_EVENT_COUNT];
+};
+
+struct site {
+  guint idx;
+  struct sun_client_cfg scfg;
+  struct phoscon_client_cfg pcfg;
+  struct site_result ref;  /* Of the day last seen */
+  guint updates;
+  guint resynced;
+  guint failures;
+  GError *err;
+};
+
+/* Keys of the events in a sunrise-sunset.org results object */
+static const gchar *const sun_json_keys[SUN_EVENT_COUNT] = {
+  [SUN_EVENT_SUNRISE]       = "sunrise",
+  [SUN_EVENT_SUNSET]        = "sunset",
+  [SUN_EVENT_SOLAR_NOON]    = "solar_noon",
+  [SUN_EVENT_CIVIL_DAWN]    = "civil_twilight_begin",
+  [SUN_EVENT_CIVIL_DUSK]    = "civil_twilight_end",
+  [SUN_EVENT_NAUTICAL_DAWN] = "nautical_twilight_begin",
+  [SUN_EVENT_NAUTICAL_DUSK] = "nautical_twilight_end",
+  [SUN_EVENT_ASTRO_DAWN]    = "astronomical_twilight_begin",
+  [SUN_EVENT_ASTRO_DUSK]    = "astronomical_twilight_end",
+};
+
+static const gchar *const test_zones[] = {
+  "UTC", "Europe/Helsinki", "America/New_York", "Asia/Kolkata",
+  "Australia/Adelaide", "America/Santiago", "Pacific/Auckland"
+};
+
+/**** Stub gateway ******************************************************/
+
+static gchar *
+stub_schedule_json(gint id)
+{
+  return g_strdup_printf("{\"name\":\"schedule %d\",\"description\":\"\","
+                         "\"status\":\"enabled\","
+                         "\"created\":\"2024-01-01T00:00:00\","
+                         "\"time\":\"" TEST_TIME_STR "\","
+                         "\"localtime\":\"" TEST_TIME_STR "\","
+                         "\"command\":{\"method\":\"PUT\"}}", id);
+}
+
+/* Answer to "lat=<lat>&lng=<lon>&formatted=0&date=<YYYY-MM-DD>" like the
+ * sunrise-sunset.org API, with the times of the local calculation
+ */
+static gchar *
+stub_sun_json(const gchar *query, guint *status)
+{
+  gdouble lat = G_MAXDOUBLE;
+  gdouble lon = G_MAXDOUBLE;
+  guint year = 0;
+  guint month = 0;
+  guint day = 0;
+  gchar **params;
+  GDateTime *midnight;
+  GString *gs;
+  GDate date;
+  gint ev;
+  gint i;
+
+  params = g_strsplit(query, "&", -1);
+  for (i = 0; params[i]; i++) {
+    if (g_str_has_prefix(params[i], "lat=")) {
+      lat = g_ascii_strtod(params[i] + 4, NULL);
+    } else if (g_str_has_prefix(params[i], "lng=")) {
+      lon = g_ascii_strtod(params[i] + 4, NULL);
+    } else if (g_str_has_prefix(params[i], "date=")) {
+      sscanf(params[i] + 5, "%u-%u-%u", &year, &month, &day);
+    }
+  }
+  g_strfreev(params);
+
+  if (lat == G_MAXDOUBLE || lon == G_MAXDOUBLE ||
+      !g_date_valid_dmy(day, month, year)) {
+    *status = 400;
+    return g_strdup("{\"results\":\"\",\"status\":\"INVALID_REQUEST\"}");
+  }
+
+  g_date_clear(&date, 1);
+  g_date_set_dmy(&date, day, month, year);
+  midnight = g_date_time_new_utc(year, month, day, 0, 0, 0);
+  gs = g_string_new("{\"results\":{");
+  for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+    GDateTime *dt;
+    gchar *str;
+    gdouble mins;
+
+    if (solar_calc_sun_event(&date, lat, lon, ev, &mins)) {
+      dt = g_date_time_add_seconds(midnight, round(mins * 60.0));
+    } else {
+      /* Events that do not occur are reported at the epoch */
+      dt = g_date_time_new_utc(1970, 1, 1, 0, 0, 1);
+    }
+    str = g_date_time_format(dt, "%FT%T+00:00");
+    g_string_append_printf(gs, "%s\"%s\":\"%s\"", ev > 0 ? "," : "",
+                           sun_json_keys[ev], str);
+    g_free(str);
+    g_date_time_unref(dt);
+  }
+  g_string_append(gs, "},\"status\":\"OK\"}");
+  g_date_time_unref(midnight);
+
+  return g_string_free(gs, FALSE);
+}
+
+/* Body of the answer to a request, status is set for errors */
+static gchar *
+stub_respond(const gchar *method, const gchar *path, guint *status)
+{
+  const gchar *prefix = "/api/" TEST_API_KEY "/";
+  GString *gs;
+  gint id;
+  gint i;
+
+  *status = 200;
+  if (strcmp(method, "GET") == 0 && g_str_has_prefix(path, "/json?")) {
+    return stub_sun_json(path + 6, status);
+  } else if (!g_str_has_prefix(path, prefix)) {
+    *status = 403;
+    return g_strdup("[{\"error\":{\"description\":\"unauthorized\"}}]");
+  }
+  path += strlen(prefix);
+
+  if (strcmp(method, "GET") == 0 && strcmp(path, "schedules") == 0) {
+    gs = g_string_new("{");
+    for (i = 1; i <= TEST_SCHEDULES; i++) {
+      gchar *sched = stub_schedule_json(i);
+
+      g_string_append_printf(gs, "%s\"%d\":%s", i > 1 ? "," : "", i, sched);
+      g_free(sched);
+    }
+    g_string_append_c(gs, '}');
+    return g_string_free(gs, FALSE);
+  } else if (sscanf(path, "schedules/%d", &id) == 1 && id >= 1 &&
+             id <= TEST_SCHEDULES) {
+    /* Updates are not kept, so every resync parses the schedule again */
+    if (strcmp(method, "PUT") == 0) {
+      return g_strdup_printf("[{\"success\":{\"/schedules/%d/time\":\"\"}}]",
+                             id);
+    }
+    return stub_schedule_json(id);
+  } else if (strcmp(method, "GET") == 0 && strcmp(path, "config") == 0) {
+    return g_strdup("{\"websocketport\":443}");
+  }
+
+  *status = 404;
+  return g_strdup("[{\"error\":{\"description\":\"not found\"}}]");
+}
+
+/* Serves the requests of one connection, kept alive until the client
+ * closes it
+ */
+static gboolean
+stub_run_client(GThreadedSocketService *service, GSocketConnection *conn,
+                GObject *source, gpointer user_data)
+{
+  struct stub *stub = (struct stub *) user_data;
+  GOutputStream *os = g_io_stream_get_output_stream(G_IO_STREAM(conn));
+  GDataInputStream *dis;
+  gchar *line;
+
+  dis = g_data_input_stream_new(g_io_stream_get_input_stream(G_IO_STREAM(conn)));
+  g_filter_input_stream_set_close_base_stream(G_FILTER_INPUT_STREAM(dis),
+                                              FALSE);
+
+  while ((line = g_data_input_stream_read_line(dis, NULL, NULL, NULL))) {
+    gchar method[16];
+    gchar path[256];
+    gchar *hdr;
+    gchar *body;
+    gchar *resp;
+    gsize len = 0;
+    guint status;
+
+    if (sscanf(g_strchomp(line), "%15s %255s", method, path) != 2) {
+      g_free(line);
+      break;
+    }
+    g_free(line);
+
+    while ((hdr = g_data_input_stream_read_line(dis, NULL, NULL, NULL))) {
+      g_strchomp(hdr);
+      if (*hdr == '\0') {
+        g_free(hdr);
+        break;
+      } else if (g_ascii_strncasecmp(hdr, "Content-Length:", 15) == 0) {
+        len = g_ascii_strtoull(hdr + 15, NULL, 10);
+      } else if (g_ascii_strcasecmp(hdr, "Expect: 100-continue") == 0) {
+        g_output_stream_write_all(os, "HTTP/1.1 100 Continue\r\n\r\n", 25,
+                                  NULL, NULL, NULL);
+      }
+      g_free(hdr);
+    }
+
+    if (len > 0) {
+      body = g_malloc(len);
+      if (!g_input_stream_read_all(G_INPUT_STREAM(dis), body, len, NULL,
+                                   NULL, NULL)) {
+        g_free(body);
+        break;
+      }
+      g_free(body);
+    }
+
+    body = stub_respond(method, path, &status);
+    resp = g_strdup_printf("HTTP/1.1 %u %s\r\n"
+                           "Content-Type: application/json\r\n"
+                           "Content-Length: %" G_GSIZE_FORMAT "\r\n\r\n%s",
+                           status, status == 200 ? "OK" : "Error",
+                           strlen(body), body);
+    g_free(body);
+    g_atomic_int_inc(&stub->requests);
+    if (!g_output_stream_write_all(os, resp, strlen(resp), NULL, NULL,
+                                   NULL)) {
+      g_free(resp);
+      break;
+    }
+    g_free(resp);
+  }
+  g_object_unref(dis);
+
+  return TRUE;
+}
+
+static gpointer
+stub_thread(gpointer data)
+{
+  struct stub *stub = (struct stub *) data;
+
+  /* Connections are accepted from the context of this thread */
+  g_main_context_push_thread_default(stub->ctx);
+  g_socket_service_start(stub->service);
+  g_main_loop_run(stub->loop);
+  g_socket_service_stop(stub->service);
+  while (g_main_context_iteration(stub->ctx, FALSE)) {
+    continue;
+  }
+  g_main_context_pop_thread_default(stub->ctx);
+
+  return NULL;
+}
+
+static void
+stub_start(struct stub *stub)
+{
+  GError *err = NULL;
+
+  stub->ctx = g_main_context_new();
+  stub->loop = g_main_loop_new(stub->ctx, FALSE);
+  stub->service = g_object_new(G_TYPE_THREADED_SOCKET_SERVICE,
+                               "max-threads", -1, "active", FALSE, NULL);
+  stub->port = g_socket_listener_add_any_inet_port(
+      G_SOCKET_LISTENER(stub->service), NULL, &err);
+  g_assert_no_error(err);
+  g_signal_connect(stub->service, "run", G_CALLBACK(stub_run_client), stub);
+}
+
+static void
+stub_stop(struct stub *stub)
+{
+  g_socket_listener_close(G_SOCKET_LISTENER(stub->service));
+  g_object_unref(stub->service);
+  g_main_loop_unref(stub->loop);
+  g_main_context_unref(stub->ctx);
+}
+
+/**** Client threads ****************************************************/
+
+static void
+clear_result(struct site_result *sr)
+{
+  gint ev;
+
+  for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+    g_clear_pointer(&sr->times[ev], g_date_time_unref);
+  }
+}
+
+static void
+init_site(struct site *site, guint idx, guint16 port)
+{
+  site->idx = idx;
+
+  /* Spread the sites out, away from the polar circles. Whole degrees, so
+   * the stub gets them exactly in the queries of the remote sites.
+   */
+  site->scfg.lat = -50.0 + (idx * 37 % 100);
+  site->scfg.lon = -170.0 + (idx * 73 % 340);
+  site->scfg.tz = g_time_zone_new_identifier(
+      test_zones[idx % G_N_ELEMENTS(test_zones)]);
+  if (idx % 2) {
+    site->scfg.source = "remote";
+    site->scfg.providers = g_strdup_printf("http://127.0.0.1:%u/json", port);
+  } else {
+    site->scfg.source = "local";
+  }
+
+  site->pcfg.host = "127.0.0.1";
+  site->pcfg.port = port;
+  site->pcfg.api_key = TEST_API_KEY;
+  site->pcfg.max_parallel = 1 + idx % 4;
+  site->pcfg.timezone = (gchar *) test_zones[idx % G_N_ELEMENTS(test_zones)];
+  site->pcfg.ws_port = -1;
+}
+
+static void
+clear_site(struct site *site)
+{
+  g_clear_pointer(&site->scfg.tz, g_time_zone_unref);
+  g_clear_pointer(&site->scfg.providers, g_free);
+  clear_result(&site->ref);
+  g_clear_error(&site->err);
+}
+
+static gboolean
+lookup_result(struct site *site, sun_client_t *sc, phoscon_client_t *pc,
+              struct site_result *sr)
+{
+  gint ev;
+
+  if (!sun_client_lookup_events(sc, sr->times, &site->err)) {
+    return FALSE;
+  }
+  for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+    if (sr->times[ev]) {
+      phoscon_client_format_time(pc, sr->times[ev], &sr->fmts[ev]);
+    }
+  }
+
+  return TRUE;
+}
+
+static gboolean
+result_matches(const struct site_result *ref, const struct site_result *sr)
+{
+  gint ev;
+
+  for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+    if (!sr->times[ev] || !ref->times[ev]) {
+      if (sr->times[ev] != ref->times[ev]) {
+        return FALSE;
+      }
+    } else if (!g_date_time_equal(sr->times[ev], ref->times[ev]) ||
+               strcmp(sr->fmts[ev].utc, ref->fmts[ev].utc) != 0 ||
+               strcmp(sr->fmts[ev].local, ref->fmts[ev].local) != 0) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/* The reference is the local calculation with restored schedules, so
+ * needs no transfers
+ */
+static gboolean
+record_site(struct site *site, sun_client_t *ref_sc, phoscon_client_t *ref_pc)
+{
+  clear_result(&site->ref);
+
+  return lookup_result(site, ref_sc, ref_pc, &site->ref);
+}
+
+/* A result differing from the reference is only a failure if it still
+ * differs once the reference is taken again, as the day of the site may
+ * have changed since
+ */
+static gboolean
+check_result(struct site *site, sun_client_t *ref_sc,
+             phoscon_client_t *ref_pc, const struct site_result *sr)
+{
+  if (result_matches(&site->ref, sr)) {
+    return TRUE;
+  } else if (!record_site(site, ref_sc, ref_pc)) {
+    return FALSE;
+  } else if (!result_matches(&site->ref, sr)) {
+    site->failures++;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+run_site(struct site *site)
+{
+  struct phoscon_schedule_ent ent = { 0, };
+  struct sun_client_cfg ref_cfg = site->scfg;
+  struct phoscon_resync_stats stats;
+  gint ids[TEST_SCHEDULES];
+  sun_client_t *sc = NULL;
+  sun_client_t *ref_sc = NULL;
+  phoscon_client_t *pc = NULL;
+  phoscon_client_t *ref_pc = NULL;
+  GAsyncResult *res;
+  gboolean ret = FALSE;
+  guint r;
+  gint i;
+
+  for (i = 0; i < TEST_SCHEDULES; i++) {
+    ids[i] = i + 1;
+  }
+  ent.id = 1;
+  ent.name = "reference";
+  ent.status = "enabled";
+  ent.timestr = TEST_TIME_STR;
+  ent.local_timestr = TEST_TIME_STR;
+  ref_cfg.source = "local";
+  ref_cfg.providers = NULL;
+
+  if ((ref_sc = sun_client_new(&ref_cfg, &site->err)) == NULL ||
+      (ref_pc = phoscon_client_restore(&site->pcfg, &ent, 1,
+                                       &site->err)) == NULL ||
+      !record_site(site, ref_sc, ref_pc)) {
+    goto out;
+  }
+
+  if ((sc = sun_client_new(&site->scfg, &site->err)) == NULL ||
+      (pc = phoscon_client_new(&site->pcfg, &site->err)) == NULL) {
+    goto out;
+  }
+  phoscon_client_prewarm(pc, site->pcfg.max_parallel);
+
+  for (r = 0; r < TEST_ROUNDS; r++) {
+    struct site_result sr = { 0, };
+    GDateTime *t;
+
+    if (!lookup_result(site, sc, pc, &sr) ||
+        !check_result(site, ref_sc, ref_pc, &sr)) {
+      clear_result(&sr);
+      goto out;
+    }
+
+    /* Resyncs set the schedules back, so every round updates them */
+    t = sr.times[SUN_EVENT_SOLAR_NOON];
+    for (i = 0; t && i < TEST_SCHEDULES; i++) {
+      if (!phoscon_client_update_schedule_time(pc, ids[i], t, &site->err)) {
+        clear_result(&sr);
+        goto out;
+      }
+      site->updates++;
+    }
+    clear_result(&sr);
+
+    res = NULL;
+    memset(&stats, 0, sizeof(stats));
+    phoscon_client_resync_schedules_async(pc, ids, TEST_SCHEDULES, NULL,
+                                          util_async_store_result, &res);
+    if (!phoscon_client_resync_schedules_finish(util_async_wait(&res),
+                                                &stats, &site->err)) {
+      g_object_unref(res);
+      goto out;
+    }
+    g_object_unref(res);
+    site->resynced += stats.updated;
+    site->failures += stats.failed;
+  }
+  ret = TRUE;
+
+out:
+  if (pc) {
+    phoscon_client_cancel(pc);
+    while (phoscon_client_busy(pc)) {
+      g_main_context_iteration(NULL, TRUE);
+    }
+    phoscon_client_free(pc);
+  }
+  if (sc) {
+    sun_client_free(sc);
+  }
+  if (ref_pc) {
+    phoscon_client_free(ref_pc);
+  }
+  if (ref_sc) {
+    sun_client_free(ref_sc);
+  }
+
+  return ret;
+}
+
+static gpointer
+site_thread(gpointer data)
+{
+  struct site *site = (struct site *) data;
+  GMainContext *ctx = g_main_context_new();
+
+  g_main_context_push_thread_default(ctx);
+  run_site(site);
+  g_main_context_pop_thread_default(ctx);
+  g_main_context_unref(ctx);
+
+  return NULL;
+}
+
+static void
+test_concurrent_clients(void)
+{
+  struct site sites[TEST_THREADS];
+  GThread *threads[TEST_THREADS];
+  GThread *server;
+  struct stub stub = { 0, };
+  guint i;
+
+  stub_start(&stub);
+  server = g_thread_new("stub", stub_thread, &stub);
+
+  memset(sites, 0, sizeof(sites));
+  for (i = 0; i < TEST_THREADS; i++) {
+    init_site(&sites[i], i, stub.port);
+  }
+
+  for (i = 0; i < TEST_THREADS; i++) {
+    gchar name[16];
+
+    g_snprintf(name, sizeof(name), "site-%u", i);
+    threads[i] = g_thread_new(name, site_thread, &sites[i]);
+  }
+  for (i = 0; i < TEST_THREADS; i++) {
+    g_thread_join(threads[i]);
+    g_test_message("Site %u: %u update(s), %u resynced, %u failure(s)", i,
+                   sites[i].updates, sites[i].resynced, sites[i].failures);
+    g_assert_no_error(sites[i].err);
+    g_assert_cmpuint(sites[i].failures, ==, 0);
+    g_assert_cmpuint(sites[i].updates, ==, TEST_ROUNDS * TEST_SCHEDULES);
+    g_assert_cmpuint(sites[i].resynced, ==, TEST_ROUNDS * TEST_SCHEDULES);
+    clear_site(&sites[i]);
+  }
+  g_test_message("Stub gateway served %d request(s)",
+                 g_atomic_int_get(&stub.requests));
+
+  g_main_loop_quit(stub.loop);
+  g_main_context_wakeup(stub.ctx);
+  g_thread_join(server);
+  stub_stop(&stub);
+}
+
+gint
+main(gint argc, gchar **argv)
+{
+  g_test_init(&argc, &argv, NULL);
+
+  g_test_add_func("/threads/concurrent-clients", test_concurrent_clients);
+
+  return g_test_run();
+}
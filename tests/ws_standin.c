@@ -0,0 +1,259 @@
+/* Websocket stand-in for the gateway event stream
+ *
+ * Sends every line read from stdin as a text message to all clients
+ * connected to the port, until stdin is closed. Allows trying the event
+ * handling without a gateway, with websocketHost and websocketPort
+ * pointing to it. Usage: ws-standin <port>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include <gio/gunixinputstream.h>
+
+#include "debug.h"
+
+#define WS_GUID             "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_OP_TEXT          0x1
+
+struct standin {
+  GMainLoop *loop;
+  GDataInputStream *input;
+  GMutex lock;
+  GPtrArray *clients;      /* Upgraded GSocketConnections */
+};
+
+DEFINE_GQUARK("ws_standin");
+
+/* Sec-WebSocket-Accept value for a Sec-WebSocket-Key */
+static gchar *
+build_accept(const gchar *key)
+{
+  GChecksum *sum = g_checksum_new(G_CHECKSUM_SHA1);
+  guint8 digest[20];
+  gsize len = sizeof(digest);
+
+  g_checksum_update(sum, (const guchar *) key, -1);
+  g_checksum_update(sum, (const guchar *) WS_GUID, -1);
+  g_checksum_get_digest(sum, digest, &len);
+  g_checksum_free(sum);
+
+  return g_base64_encode(digest, len);
+}
+
+/* Server frames are not masked */
+static void
+append_text_frame(GByteArray *out, const gchar *data, gsize len)
+{
+  guint8 hdr[10];
+  gsize hlen = 2;
+  gint i;
+
+  hdr[0] = 0x80 | WS_OP_TEXT;
+  if (len < 126) {
+    hdr[1] = len;
+  } else if (len <= G_MAXUINT16) {
+    hdr[1] = 126;
+    hdr[2] = len >> 8;
+    hdr[3] = len & 0xff;
+    hlen = 4;
+  } else {
+    hdr[1] = 127;
+    for (i = 0; i < 8; i++) {
+      hdr[2 + i] = ((guint64) len >> (56 - 8 * i)) & 0xff;
+    }
+    hlen = 10;
+  }
+  g_byte_array_append(out, hdr, hlen);
+  g_byte_array_append(out, (const guint8 *) data, len);
+}
+
+/* Accepts one client connection */
+static gboolean
+standin_handshake(GSocketConnection *conn, GError **err)
+{
+  GDataInputStream *dis;
+  GOutputStream *os;
+  gchar *key = NULL;
+  gchar *accept;
+  gchar *line;
+  gchar *resp;
+  gboolean ret;
+
+  dis = g_data_input_stream_new(g_io_stream_get_input_stream(G_IO_STREAM(conn)));
+  g_filter_input_stream_set_close_base_stream(G_FILTER_INPUT_STREAM(dis),
+                                              FALSE);
+  while ((line = g_data_input_stream_read_line(dis, NULL, NULL, err))) {
+    g_strchomp(line);
+    if (*line == '\0') {
+      g_free(line);
+      break;
+    } else if (g_ascii_strncasecmp(line, "Sec-WebSocket-Key:", 18) == 0) {
+      g_free(key);
+      key = g_strdup(g_strstrip(line + 18));
+    }
+    g_free(line);
+  }
+  g_object_unref(dis);
+
+  if (!key) {
+    if (err && !*err) {
+      SET_GERROR(err, -1, "no Sec-WebSocket-Key in request");
+    }
+    return FALSE;
+  }
+
+  accept = build_accept(key);
+  resp = g_strdup_printf("HTTP/1.1 101 Switching Protocols\r\n"
+                         "Upgrade: websocket\r\n"
+                         "Connection: Upgrade\r\n"
+                         "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+  os = g_io_stream_get_output_stream(G_IO_STREAM(conn));
+  ret = g_output_stream_write_all(os, resp, strlen(resp), NULL, NULL, err);
+  g_free(resp);
+  g_free(accept);
+  g_free(key);
+
+  return ret;
+}
+
+/* Runs in a service thread for as long as the client stays connected */
+static gboolean
+standin_run_client(GThreadedSocketService *service, GSocketConnection *conn,
+                   GObject *source, gpointer user_data)
+{
+  struct standin *si = (struct standin *) user_data;
+  GInputStream *is = g_io_stream_get_input_stream(G_IO_STREAM(conn));
+  GError *err = NULL;
+  guint8 buf[256];
+
+  if (!standin_handshake(conn, &err)) {
+    g_warning("Stand-in handshake failed: %s", GERROR_MSG(err));
+    g_clear_error(&err);
+    return TRUE;
+  }
+
+  g_message("Stand-in client connected");
+  g_mutex_lock(&si->lock);
+  g_ptr_array_add(si->clients, g_object_ref(conn));
+  g_mutex_unlock(&si->lock);
+
+  /* Client frames are not interpreted, only the disconnect matters */
+  while (g_input_stream_read(is, buf, sizeof(buf), NULL, NULL) > 0) {
+    continue;
+  }
+
+  g_mutex_lock(&si->lock);
+  g_ptr_array_remove(si->clients, conn);
+  g_mutex_unlock(&si->lock);
+  g_message("Stand-in client disconnected");
+
+  return TRUE;
+}
+
+static void
+standin_line_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  struct standin *si = (struct standin *) user_data;
+  GByteArray *frame;
+  gsize len = 0;
+  gchar *line;
+  guint i;
+
+  line = g_data_input_stream_read_line_finish(G_DATA_INPUT_STREAM(source),
+                                              res, &len, NULL);
+  if (!line) {
+    g_main_loop_quit(si->loop);
+    return;
+  }
+
+  frame = g_byte_array_new();
+  append_text_frame(frame, line, len);
+  g_free(line);
+
+  g_mutex_lock(&si->lock);
+  for (i = 0; i < si->clients->len; i++) {
+    GSocketConnection *conn = g_ptr_array_index(si->clients, i);
+    GOutputStream *os = g_io_stream_get_output_stream(G_IO_STREAM(conn));
+
+    g_output_stream_write_all(os, frame->data, frame->len, NULL, NULL, NULL);
+  }
+  g_debug("Sent %u byte event to %u client(s)", frame->len,
+          si->clients->len);
+  g_mutex_unlock(&si->lock);
+  g_byte_array_unref(frame);
+
+  g_data_input_stream_read_line_async(si->input, G_PRIORITY_DEFAULT, NULL,
+                                      standin_line_done, si);
+}
+
+gint
+main(gint argc, gchar **argv)
+{
+  GSocketService *service;
+  GInputStream *in;
+  struct standin si = { 0, };
+  GError *err = NULL;
+  guint port = 0;
+
+  if (argc != 2 || (port = g_ascii_strtoull(argv[1], NULL, 10)) == 0 ||
+      port > G_MAXUINT16) {
+    g_printerr("Usage: %s <port>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  service = g_threaded_socket_service_new(-1);
+  if (!g_socket_listener_add_inet_port(G_SOCKET_LISTENER(service), port,
+                                       NULL, &err)) {
+    g_printerr("Could not listen on port %u: %s\n", port, GERROR_MSG(err));
+    g_clear_error(&err);
+    g_object_unref(service);
+    return EXIT_FAILURE;
+  }
+
+  si.loop = g_main_loop_new(NULL, FALSE);
+  si.clients = g_ptr_array_new_with_free_func(g_object_unref);
+  g_mutex_init(&si.lock);
+  in = g_unix_input_stream_new(STDIN_FILENO, FALSE);
+  si.input = g_data_input_stream_new(in);
+  g_object_unref(in);
+
+  g_signal_connect(service, "run", G_CALLBACK(standin_run_client), &si);
+  g_socket_service_start(service);
+  g_message("Websocket stand-in listening on port %u, sending stdin lines",
+            port);
+
+  g_data_input_stream_read_line_async(si.input, G_PRIORITY_DEFAULT, NULL,
+                                      standin_line_done, &si);
+  g_main_loop_run(si.loop);
+
+  /* Shutting the connections down wakes up the client threads, which
+   * remove themselves
+   */
+  g_socket_service_stop(service);
+  g_socket_listener_close(G_SOCKET_LISTENER(service));
+  g_mutex_lock(&si.lock);
+  while (si.clients->len) {
+    guint i;
+
+    for (i = 0; i < si.clients->len; i++) {
+      GSocketConnection *conn = g_ptr_array_index(si.clients, i);
+
+      g_socket_shutdown(g_socket_connection_get_socket(conn), TRUE, TRUE,
+                        NULL);
+    }
+    g_mutex_unlock(&si.lock);
+    g_usleep(10 * 1000);
+    g_mutex_lock(&si.lock);
+  }
+  g_mutex_unlock(&si.lock);
+  g_object_unref(service);
+  g_object_unref(si.input);
+  g_ptr_array_unref(si.clients);
+  g_mutex_clear(&si.lock);
+  g_main_loop_unref(si.loop);
+
+  return EXIT_SUCCESS;
+}
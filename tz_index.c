@@ -0,0 +1,533 @@
+/* Time zone lookup from coordinates
+ *
+ * The index is a raster of the world with a fixed number of cells per
+ * degree. Each row, from north to south, is run-length encoded as (end
+ * column, zone) pairs, followed by the table of IANA zone names. It is
+ * built offline from a time zone boundary GeoJSON dataset such as the one
+ * released by timezone-boundary-builder and stored in host byte order like
+ * the sun table. At runtime the file is memory mapped and a lookup is a
+ * binary search within a single row.
+ */
+
+#include <math.h>
+#include <glib.h>
+#include <jansson.h>
+
+#include "tz_index.h"
+#include "debug.h"
+
+#define TZ_INDEX_MAGIC      "PSTZ"
+#define TZ_INDEX_VERSION    1
+#define TZ_INDEX_NO_ZONE    0      /* Cells outside any zone (oceans) */
+#define MAX_CELLS_PER_DEG   (G_MAXUINT16 / 360)
+
+struct tz_index_hdr {
+  gchar magic[4];
+  guint16 version;
+  guint16 cells_per_deg;
+  guint32 n_zones;         /* Including TZ_INDEX_NO_ZONE */
+  guint32 n_runs;
+  guint32 names_len;
+};
+
+/* The header is followed by guint32 row_start[n_rows + 1], the runs,
+ * guint32 name_offs[n_zones] and the NUL terminated zone names
+ */
+struct tz_index_run {
+  guint16 end_col;         /* First column after the run */
+  guint16 zone;
+};
+
+struct tz_index {
+  GMappedFile *mfile;
+  guint cells_per_deg;
+  guint n_rows;
+  guint n_cols;
+  guint n_zones;
+  guint n_runs;
+  const guint32 *row_start;
+  const struct tz_index_run *runs;
+  const guint32 *name_offs;
+  const gchar *names;
+};
+
+/* Raster a dataset is drawn into before it is encoded */
+struct tz_raster {
+  guint cells_per_deg;
+  guint n_rows;
+  guint n_cols;
+  guint16 *cells;
+  GPtrArray *names;        /* Zone names by zone number */
+  GHashTable *zones;       /* Zone name -> zone number */
+};
+
+DEFINE_GQUARK("tz_index");
+
+static gboolean
+map_index(tz_index_t *idx, GError **err)
+{
+  const struct tz_index_hdr *hdr;
+  const gchar *data = g_mapped_file_get_contents(idx->mfile);
+  gsize len = g_mapped_file_get_length(idx->mfile);
+  gsize need;
+
+  if (len < sizeof(*hdr)) {
+    SET_GERROR(err, -1, "file too short");
+    return FALSE;
+  }
+
+  hdr = (const struct tz_index_hdr *) data;
+  if (memcmp(hdr->magic, TZ_INDEX_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->version != TZ_INDEX_VERSION) {
+    SET_GERROR(err, -1, "unknown file format");
+    return FALSE;
+  } else if (hdr->cells_per_deg == 0 ||
+             hdr->cells_per_deg > MAX_CELLS_PER_DEG ||
+             hdr->n_zones == 0 || hdr->n_zones > G_MAXUINT16 + 1) {
+    SET_GERROR(err, -1, "invalid header");
+    return FALSE;
+  }
+
+  idx->cells_per_deg = hdr->cells_per_deg;
+  idx->n_rows = 180 * hdr->cells_per_deg;
+  idx->n_cols = 360 * hdr->cells_per_deg;
+  idx->n_zones = hdr->n_zones;
+  idx->n_runs = hdr->n_runs;
+
+  need = sizeof(*hdr) + (idx->n_rows + 1) * sizeof(guint32) +
+         (gsize) idx->n_runs * sizeof(struct tz_index_run) +
+         idx->n_zones * sizeof(guint32) + hdr->names_len;
+  if (len != need) {
+    SET_GERROR(err, -1, "size mismatch, %" G_GSIZE_FORMAT " bytes but "
+               "expected %" G_GSIZE_FORMAT, len, need);
+    return FALSE;
+  }
+
+  idx->row_start = (const guint32 *) (hdr + 1);
+  idx->runs = (const struct tz_index_run *) (idx->row_start + idx->n_rows + 1);
+  idx->name_offs = (const guint32 *) (idx->runs + idx->n_runs);
+  idx->names = (const gchar *) (idx->name_offs + idx->n_zones);
+
+  if (idx->row_start[idx->n_rows] != idx->n_runs ||
+      hdr->names_len == 0 || idx->names[hdr->names_len - 1] != '\0') {
+    SET_GERROR(err, -1, "corrupt run or name table");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static guint
+raster_zone(struct tz_raster *rs, const gchar *name)
+{
+  gpointer val;
+  guint zone;
+
+  if (g_hash_table_lookup_extended(rs->zones, name, NULL, &val)) {
+    return GPOINTER_TO_UINT(val);
+  }
+
+  zone = rs->names->len;
+  g_ptr_array_add(rs->names, g_strdup(name));
+  g_hash_table_insert(rs->zones, g_ptr_array_index(rs->names, zone),
+                      GUINT_TO_POINTER(zone));
+
+  return zone;
+}
+
+static gint
+compare_double(gconstpointer a, gconstpointer b)
+{
+  gdouble da = *(const gdouble *) a;
+  gdouble db = *(const gdouble *) b;
+
+  return da < db ? -1 : da > db ? 1 : 0;
+}
+
+/* Fill the cells of a row whose centres lie between pairs of crossings */
+static void
+raster_fill_row(struct tz_raster *rs, guint row, GArray *xs, guint16 zone)
+{
+  guint16 *cells = rs->cells + (gsize) row * rs->n_cols;
+  guint i;
+
+  g_array_sort(xs, compare_double);
+  for (i = 0; i + 1 < xs->len; i += 2) {
+    gdouble c0 = ceil((g_array_index(xs, gdouble, i) + 180.0) *
+                      rs->cells_per_deg - 0.5);
+    gdouble c1 = ceil((g_array_index(xs, gdouble, i + 1) + 180.0) *
+                      rs->cells_per_deg - 0.5);
+    gint col;
+
+    for (col = MAX((gint) c0, 0); col < MIN((gint) c1, (gint) rs->n_cols);
+         col++) {
+      cells[col] = zone;
+    }
+  }
+}
+
+static gboolean
+json_point(json_t *jpt, gdouble *lon, gdouble *lat)
+{
+  if (!json_is_array(jpt) || json_array_size(jpt) < 2 ||
+      !json_is_number(json_array_get(jpt, 0)) ||
+      !json_is_number(json_array_get(jpt, 1))) {
+    return FALSE;
+  }
+
+  *lon = json_number_value(json_array_get(jpt, 0));
+  *lat = json_number_value(json_array_get(jpt, 1));
+
+  return TRUE;
+}
+
+/*
+ * Draw a polygon (outer ring and holes) with the even-odd rule, sampling
+ * each row at its centre latitude. Row crossings are collected for the
+ * rings together so holes are left out.
+ */
+static gboolean
+raster_polygon(struct tz_raster *rs, json_t *jrings, guint16 zone)
+{
+  GArray **xs;
+  gdouble top = -90.0;
+  gdouble bottom = 90.0;
+  gint r0, r1;
+  gint r;
+  gsize i, j;
+
+  if (!json_is_array(jrings) || json_array_size(jrings) == 0) {
+    return FALSE;
+  }
+
+  /* Rows spanned by the outer ring */
+  for (i = 0; i < json_array_size(json_array_get(jrings, 0)); i++) {
+    gdouble lon, lat;
+
+    if (!json_point(json_array_get(json_array_get(jrings, 0), i),
+                    &lon, &lat)) {
+      return FALSE;
+    }
+    top = MAX(top, lat);
+    bottom = MIN(bottom, lat);
+  }
+  if (top < bottom) {
+    return TRUE;
+  }
+
+  r0 = MAX((gint) floor((90.0 - top) * rs->cells_per_deg - 0.5), 0);
+  r1 = MIN((gint) ceil((90.0 - bottom) * rs->cells_per_deg - 0.5),
+           (gint) rs->n_rows - 1);
+  if (r0 > r1) {
+    return TRUE;
+  }
+  xs = g_new0(GArray *, r1 - r0 + 1);
+
+  for (i = 0; i < json_array_size(jrings); i++) {
+    json_t *jring = json_array_get(jrings, i);
+    gsize n = json_array_size(jring);
+
+    for (j = 0; j < n; j++) {
+      gdouble xa, ya, xb, yb;
+      gdouble ymin, ymax;
+
+      if (!json_point(json_array_get(jring, j), &xa, &ya) ||
+          !json_point(json_array_get(jring, (j + 1) % n), &xb, &yb)) {
+        continue;
+      }
+
+      ymin = MIN(ya, yb);
+      ymax = MAX(ya, yb);
+      if (ymin >= ymax) {
+        continue;
+      }
+      for (r = MAX((gint) floor((90.0 - ymax) * rs->cells_per_deg - 0.5), r0);
+           r <= MIN((gint) ceil((90.0 - ymin) * rs->cells_per_deg - 0.5), r1);
+           r++) {
+        gdouble y = 90.0 - (r + 0.5) / rs->cells_per_deg;
+        gdouble x;
+
+        if (y < ymin || y >= ymax) {
+          continue;
+        }
+
+        x = xa + (y - ya) * (xb - xa) / (yb - ya);
+        if (!xs[r - r0]) {
+          xs[r - r0] = g_array_new(FALSE, FALSE, sizeof(gdouble));
+        }
+        g_array_append_val(xs[r - r0], x);
+      }
+    }
+  }
+
+  for (r = r0; r <= r1; r++) {
+    if (xs[r - r0]) {
+      raster_fill_row(rs, r, xs[r - r0], zone);
+      g_array_unref(xs[r - r0]);
+    }
+  }
+  g_free(xs);
+
+  return TRUE;
+}
+
+static gboolean
+raster_feature(struct tz_raster *rs, json_t *jfeature, GError **err)
+{
+  json_t *jgeom = json_object_get(jfeature, "geometry");
+  json_t *jcoords = json_object_get(jgeom, "coordinates");
+  const gchar *tzid;
+  const gchar *type;
+  guint zone;
+  gsize i;
+
+  tzid = json_string_value(json_object_get(json_object_get(jfeature,
+                                                           "properties"),
+                                           "tzid"));
+  type = json_string_value(json_object_get(jgeom, "type"));
+  if (!tzid || !type || !jcoords) {
+    SET_GERROR(err, -1, "feature without tzid or geometry");
+    return FALSE;
+  }
+
+  if ((zone = raster_zone(rs, tzid)) > G_MAXUINT16) {
+    SET_GERROR(err, -1, "too many zones");
+    return FALSE;
+  }
+
+  if (g_strcmp0(type, "Polygon") == 0) {
+    if (!raster_polygon(rs, jcoords, zone)) {
+      goto out_fail;
+    }
+  } else if (g_strcmp0(type, "MultiPolygon") == 0 && json_is_array(jcoords)) {
+    for (i = 0; i < json_array_size(jcoords); i++) {
+      if (!raster_polygon(rs, json_array_get(jcoords, i), zone)) {
+        goto out_fail;
+      }
+    }
+  } else {
+    SET_GERROR(err, -1, "zone '%s' has unsupported geometry '%s'", tzid,
+               type);
+    return FALSE;
+  }
+
+  return TRUE;
+
+out_fail:
+  SET_GERROR(err, -1, "zone '%s' has malformed coordinates", tzid);
+
+  return FALSE;
+}
+
+/* Run-length encode the raster and append the zone names */
+static GByteArray *
+encode_raster(struct tz_raster *rs)
+{
+  struct tz_index_hdr hdr;
+  GByteArray *runs = g_byte_array_new();
+  GByteArray *names = g_byte_array_new();
+  GByteArray *out = g_byte_array_new();
+  guint32 *row_start;
+  guint32 *name_offs;
+  guint row, col, i;
+
+  row_start = g_new(guint32, rs->n_rows + 1);
+  for (row = 0; row < rs->n_rows; row++) {
+    const guint16 *cells = rs->cells + (gsize) row * rs->n_cols;
+
+    row_start[row] = runs->len / sizeof(struct tz_index_run);
+    for (col = 0; col < rs->n_cols; col++) {
+      struct tz_index_run run;
+
+      if (col + 1 < rs->n_cols && cells[col + 1] == cells[col]) {
+        continue;
+      }
+      run.end_col = col + 1;
+      run.zone = cells[col];
+      g_byte_array_append(runs, (const guint8 *) &run, sizeof(run));
+    }
+  }
+  row_start[rs->n_rows] = runs->len / sizeof(struct tz_index_run);
+
+  name_offs = g_new(guint32, rs->names->len);
+  for (i = 0; i < rs->names->len; i++) {
+    const gchar *name = g_ptr_array_index(rs->names, i);
+
+    name_offs[i] = names->len;
+    g_byte_array_append(names, (const guint8 *) name, strlen(name) + 1);
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, TZ_INDEX_MAGIC, sizeof(hdr.magic));
+  hdr.version = TZ_INDEX_VERSION;
+  hdr.cells_per_deg = rs->cells_per_deg;
+  hdr.n_zones = rs->names->len;
+  hdr.n_runs = row_start[rs->n_rows];
+  hdr.names_len = names->len;
+
+  g_byte_array_append(out, (const guint8 *) &hdr, sizeof(hdr));
+  g_byte_array_append(out, (const guint8 *) row_start,
+                      (rs->n_rows + 1) * sizeof(guint32));
+  g_byte_array_append(out, runs->data, runs->len);
+  g_byte_array_append(out, (const guint8 *) name_offs,
+                      rs->names->len * sizeof(guint32));
+  g_byte_array_append(out, names->data, names->len);
+
+  g_free(name_offs);
+  g_free(row_start);
+  g_byte_array_unref(names);
+  g_byte_array_unref(runs);
+
+  return out;
+}
+
+/**** Exposed functions begin here **************************************/
+
+tz_index_t *
+tz_index_open(const gchar *path, GError **err)
+{
+  tz_index_t *idx;
+
+  g_return_val_if_fail(path != NULL, NULL);
+
+  idx = g_malloc0(sizeof(*idx));
+  if ((idx->mfile = g_mapped_file_new(path, FALSE, err)) == NULL ||
+      !map_index(idx, err)) {
+    g_prefix_error(err, "open '%s': ", path);
+    tz_index_close(idx);
+    return NULL;
+  }
+
+  return idx;
+}
+
+void
+tz_index_close(tz_index_t *idx)
+{
+  if (!idx) {
+    return;
+  }
+
+  g_clear_pointer(&idx->mfile, g_mapped_file_unref);
+  g_free(idx);
+}
+
+/*
+ * Look up the IANA time zone at the given location, NULL if the location
+ * is outside of any zone. The name is valid until the index is closed.
+ */
+const gchar *
+tz_index_lookup(tz_index_t *idx, gdouble lat, gdouble lon)
+{
+  const struct tz_index_run *runs;
+  guint row, col;
+  guint lo, hi;
+
+  g_return_val_if_fail(idx != NULL, NULL);
+
+  lon = fmod(lon + 180.0, 360.0);
+  if (lon < 0.0) {
+    lon += 360.0;
+  }
+  row = MIN((guint) floor(CLAMP(90.0 - lat, 0.0, 180.0) * idx->cells_per_deg),
+            idx->n_rows - 1);
+  col = MIN((guint) floor(lon * idx->cells_per_deg), idx->n_cols - 1);
+
+  lo = idx->row_start[row];
+  hi = idx->row_start[row + 1];
+  if (lo >= hi || hi > idx->n_runs) {
+    return NULL;
+  }
+
+  /* First run ending after the column */
+  runs = idx->runs;
+  while (lo < hi) {
+    guint mid = lo + (hi - lo) / 2;
+
+    if (runs[mid].end_col <= col) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  if (lo == idx->row_start[row + 1] || runs[lo].zone == TZ_INDEX_NO_ZONE ||
+      runs[lo].zone >= idx->n_zones) {
+    return NULL;
+  }
+
+  return idx->names + idx->name_offs[runs[lo].zone];
+}
+
+/*
+ * Build an index from a GeoJSON feature collection with one feature per
+ * zone, named by its "tzid" property. Later features take precedence where
+ * zones overlap.
+ */
+gboolean
+tz_index_build(const gchar *geojson, const gchar *path, guint cells_per_deg,
+               GError **err)
+{
+  struct tz_raster rs = { 0, };
+  json_t *jroot = NULL;
+  json_t *jfeatures;
+  json_error_t jerr;
+  GByteArray *data = NULL;
+  gboolean ret = FALSE;
+  gsize i;
+
+  g_return_val_if_fail(geojson != NULL, FALSE);
+  g_return_val_if_fail(path != NULL, FALSE);
+
+  if (cells_per_deg == 0 || cells_per_deg > MAX_CELLS_PER_DEG) {
+    SET_GERROR(err, -1, "invalid resolution of %u cells per degree",
+               cells_per_deg);
+    return FALSE;
+  }
+
+  if ((jroot = json_load_file(geojson, 0, &jerr)) == NULL) {
+    SET_GERROR(err, -1, "parse '%s' failed at line %d: %s", geojson,
+               jerr.line, jerr.text);
+    return FALSE;
+  }
+
+  jfeatures = json_object_get(jroot, "features");
+  if (!json_is_array(jfeatures)) {
+    SET_GERROR(err, -1, "'%s' is not a GeoJSON feature collection", geojson);
+    goto out;
+  }
+
+  rs.cells_per_deg = cells_per_deg;
+  rs.n_rows = 180 * cells_per_deg;
+  rs.n_cols = 360 * cells_per_deg;
+  rs.cells = g_new0(guint16, (gsize) rs.n_rows * rs.n_cols);
+  rs.names = g_ptr_array_new_with_free_func(g_free);
+  rs.zones = g_hash_table_new(g_str_hash, g_str_equal);
+  raster_zone(&rs, "");    /* TZ_INDEX_NO_ZONE */
+
+  for (i = 0; i < json_array_size(jfeatures); i++) {
+    if (!raster_feature(&rs, json_array_get(jfeatures, i), err)) {
+      g_prefix_error(err, "feature %" G_GSIZE_FORMAT ": ", i);
+      goto out;
+    }
+  }
+
+  data = encode_raster(&rs);
+  if (!g_file_set_contents(path, (const gchar *) data->data, data->len,
+                           err)) {
+    goto out;
+  }
+  g_message("Built time zone index '%s' with %u zones, %u bytes", path,
+            rs.names->len - 1, data->len);
+
+  ret = TRUE;
+  /* fall through */
+out:
+  g_clear_pointer(&data, g_byte_array_unref);
+  g_clear_pointer(&rs.zones, g_hash_table_unref);
+  g_clear_pointer(&rs.names, g_ptr_array_unref);
+  g_free(rs.cells);
+  json_decref(jroot);
+
+  return ret;
+}
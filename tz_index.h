@@ -0,0 +1,25 @@
+/* Time zone lookup from coordinates using a memory mapped index */
+
+#ifndef TZ_INDEX_H__
+#define TZ_INDEX_H__
+
+#include <glib.h>
+
+#define TZ_INDEX_CELLS_PER_DEG   16   /* Index resolution, about 7 km */
+
+typedef struct tz_index tz_index_t;
+
+tz_index_t *
+tz_index_open(const gchar *path, GError **err);
+
+void
+tz_index_close(tz_index_t *idx);
+
+const gchar *
+tz_index_lookup(tz_index_t *idx, gdouble lat, gdouble lon);
+
+gboolean
+tz_index_build(const gchar *geojson, const gchar *path, guint cells_per_deg,
+               GError **err);
+
+#endif /* TZ_INDEX_H__ */
@@ -1,24 +1,82 @@
 #include <glib.h>
+#include <glib-unix.h>
+#include <gio/gio.h>
 #include <curl/curl.h>
+#include <jansson.h>
 
 #include "debug.h"
 #include "util.h"
 
+#define TCP_KEEPALIVE_IDLE_SECS   60
+#define TCP_KEEPALIVE_INTVL_SECS  30
+
 struct conn_handle {
+  struct http_engine *engine;
   CURL *curl;
   GString *buffer;
+  util_write_func sink;    /* Consumes the response instead of buffer */
+  gpointer sink_data;
+  const gchar *upload;     /* Body of a PUT/POST, owned by the caller */
+  gsize upload_len;
+  gsize upload_pos;
   glong http_code;
+  const gchar *method;
+  gboolean custom_method;  /* CURLOPT_CUSTOMREQUEST set for the request */
+  GTask *task;             /* Request in flight, if any */
+  GSource *cancel_src;
+};
+
+/* libcurl multi interface driven by the thread default main context, so
+ * requests never block the main loop. There is one engine per thread, all
+ * handles of a thread share its DNS cache, connection pool and TLS session
+ * cache, and a handle is only used from the thread it was made on.
+ */
+struct http_engine {
+  CURLM *multi;
+  CURLSH *share;
+  GMainContext *ctx;
+  GHashTable *sockets;     /* Socket -> GSource */
+  GSource *timer;
+  struct util_http_stats stats;
+};
+
+/* Hedged GET in progress, see util_http_get_hedged_async() */
+struct hedge_req {
+  conn_handle_t **handles;
+  gchar **urls;
+  guint count;
+  GTimeSpan delay;
+  gboolean give_up;
+  gint64 *started;
+  GTimeSpan *latencies;
+  gboolean *done;
+  guint n_started;
+  guint n_done;
+  gboolean finished;
+  GSource *timer;
+};
+
+struct hedge_leg {
+  GTask *task;
+  guint idx;
 };
 
 DEFINE_GQUARK("util");
 
+static void free_engine(gpointer data);
+
+static GPrivate engine_key = G_PRIVATE_INIT(free_engine);
+
 static size_t
 write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
 {
-  GString *gs = (GString *) userdata;
+  conn_handle_t *handle = (conn_handle_t *) userdata;
   gssize sz = size * nmemb;
 
-  g_string_append_len(gs, ptr, sz);
+  if (handle->sink) {
+    return handle->sink(ptr, sz, handle->sink_data) ? sz : 0;
+  }
+  g_string_append_len(handle->buffer, ptr, sz);
 
   return sz;
 }
@@ -26,10 +84,12 @@ write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
 static size_t
 read_callback(void *ptr, size_t size, size_t nmemb, void *userdata)
 {
-  GString *gs = (GString *) userdata;
-  gssize sz = MIN(gs->len, size * nmemb);
+  conn_handle_t *handle = (conn_handle_t *) userdata;
+  gsize sz = MIN(handle->upload_len - handle->upload_pos, size * nmemb);
+
+  memcpy(ptr, handle->upload + handle->upload_pos, sz);
+  handle->upload_pos += sz;
 
-  memcpy(ptr, gs->str, sz);
   return sz;
 }
 
@@ -59,16 +119,459 @@ check_http_code(conn_handle_t *handle, GError **err)
   return FALSE;
 }
 
+static void
+destroy_source(gpointer data)
+{
+  GSource *src = (GSource *) data;
+
+  g_source_destroy(src);
+  g_source_unref(src);
+}
+
+/* Detach the request from the engine and report its outcome */
+static void
+request_complete(conn_handle_t *handle, GError *err)
+{
+  GTask *task = handle->task;
+
+  g_assert(task);
+
+  handle->task = NULL;
+  curl_multi_remove_handle(handle->engine->multi, handle->curl);
+  g_clear_pointer(&handle->cancel_src, destroy_source);
+  if (handle->upload) {
+    curl_easy_setopt(handle->curl, CURLOPT_UPLOAD, 0L);
+    handle->upload = NULL;
+  }
+  if (handle->custom_method) {
+    curl_easy_setopt(handle->curl, CURLOPT_CUSTOMREQUEST, NULL);
+    handle->custom_method = FALSE;
+  }
+
+  if (err) {
+    g_task_return_error(task, err);
+  } else {
+    g_task_return_boolean(task, TRUE);
+  }
+  g_object_unref(task);
+}
+
+static void
+engine_update_stats(struct http_engine *engine, CURL *curl)
+{
+  glong n_connects = 0;
+
+  if (curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS,
+                        &n_connects) != CURLE_OK) {
+    return;
+  }
+
+  engine->stats.requests++;
+  engine->stats.connects += n_connects;
+  if (n_connects == 0) {
+    engine->stats.reused++;
+  }
+}
+
+static void
+engine_check_done(struct http_engine *engine)
+{
+  struct CURLMsg *msg;
+  gint msgs;
+
+  while ((msg = curl_multi_info_read(engine->multi, &msgs)) != NULL) {
+    conn_handle_t *handle = NULL;
+    CURLcode result = msg->data.result;
+    GError *err = NULL;
+
+    if (msg->msg != CURLMSG_DONE) {
+      continue;
+    }
+    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (gchar **) &handle);
+    g_assert(handle && handle->task);
+    engine_update_stats(engine, msg->easy_handle);
+
+    if (result != CURLE_OK) {
+      SET_GERROR(&err, -1, "%s request failed: %s", handle->method,
+                 curl_easy_strerror(result));
+    } else if (!check_http_code(handle, &err)) {
+      g_prefix_error(&err, "HTTP %s ", handle->method);
+    }
+    request_complete(handle, err);
+  }
+}
+
+static gboolean
+engine_socket_ready(gint fd, GIOCondition cond, gpointer data)
+{
+  struct http_engine *engine = (struct http_engine *) data;
+  gint action = 0;
+  gint running;
+
+  if (cond & G_IO_IN) {
+    action |= CURL_CSELECT_IN;
+  }
+  if (cond & G_IO_OUT) {
+    action |= CURL_CSELECT_OUT;
+  }
+  if (cond & (G_IO_ERR | G_IO_HUP)) {
+    action |= CURL_CSELECT_ERR;
+  }
+
+  curl_multi_socket_action(engine->multi, fd, action, &running);
+  engine_check_done(engine);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+engine_timeout(gpointer data)
+{
+  struct http_engine *engine = (struct http_engine *) data;
+  gint running;
+
+  g_clear_pointer(&engine->timer, g_source_unref);
+  curl_multi_socket_action(engine->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+  engine_check_done(engine);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gint
+engine_socket_cb(CURL *easy, curl_socket_t sock, gint what, void *userp,
+                 void *socketp)
+{
+  struct http_engine *engine = (struct http_engine *) userp;
+  GIOCondition cond = G_IO_ERR | G_IO_HUP;
+  GSource *src;
+
+  g_hash_table_remove(engine->sockets, GINT_TO_POINTER(sock));
+  if (what == CURL_POLL_REMOVE) {
+    return 0;
+  }
+
+  if (what & CURL_POLL_IN) {
+    cond |= G_IO_IN;
+  }
+  if (what & CURL_POLL_OUT) {
+    cond |= G_IO_OUT;
+  }
+
+  src = g_unix_fd_source_new(sock, cond);
+  g_source_set_callback(src, G_SOURCE_FUNC(engine_socket_ready), engine,
+                        NULL);
+  g_source_attach(src, engine->ctx);
+  g_hash_table_insert(engine->sockets, GINT_TO_POINTER(sock), src);
+
+  return 0;
+}
+
+static gint
+engine_timer_cb(CURLM *multi, glong timeout_ms, void *userp)
+{
+  struct http_engine *engine = (struct http_engine *) userp;
+
+  g_clear_pointer(&engine->timer, destroy_source);
+  if (timeout_ms >= 0) {
+    engine->timer = g_timeout_source_new(timeout_ms);
+    g_source_set_callback(engine->timer, engine_timeout, engine, NULL);
+    g_source_attach(engine->timer, engine->ctx);
+  }
+
+  return 0;
+}
+
+static void
+free_engine(gpointer data)
+{
+  struct http_engine *engine = (struct http_engine *) data;
+
+  /* The multi handle may still call back to remove its sockets */
+  g_clear_pointer(&engine->multi, curl_multi_cleanup);
+  g_clear_pointer(&engine->share, curl_share_cleanup);
+  g_clear_pointer(&engine->timer, destroy_source);
+  g_clear_pointer(&engine->sockets, g_hash_table_destroy);
+  g_clear_pointer(&engine->ctx, g_main_context_unref);
+  g_free(engine);
+}
+
+/* Engine of the calling thread, set up on first use */
+static struct http_engine *
+engine_get(GError **err)
+{
+  static gsize curl_initialised;
+  struct http_engine *engine;
+  CURLMcode mret;
+  CURLSHcode sret;
+
+  if ((engine = g_private_get(&engine_key)) != NULL) {
+    return engine;
+  }
+
+  /* Not thread safe in older libcurl, so done once before any handle */
+  if (g_once_init_enter(&curl_initialised)) {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    g_once_init_leave(&curl_initialised, 1);
+  }
+
+  engine = g_malloc0(sizeof(*engine));
+  if ((engine->multi = curl_multi_init()) == NULL ||
+      (engine->share = curl_share_init()) == NULL) {
+    SET_GERROR(err, -1, "unable to setup libCURL multi backend");
+    goto out_fail;
+  }
+
+  mret = curl_multi_setopt(engine->multi, CURLMOPT_SOCKETFUNCTION,
+                           engine_socket_cb);
+  mret |= curl_multi_setopt(engine->multi, CURLMOPT_SOCKETDATA, engine);
+  mret |= curl_multi_setopt(engine->multi, CURLMOPT_TIMERFUNCTION,
+                            engine_timer_cb);
+  mret |= curl_multi_setopt(engine->multi, CURLMOPT_TIMERDATA, engine);
+  if (mret != CURLM_OK) {
+    SET_GERROR(err, -1, "failed to set curl multi options");
+    goto out_fail;
+  }
+
+  /* Only used from this thread, so no locking is needed */
+  sret = curl_share_setopt(engine->share, CURLSHOPT_SHARE,
+                           CURL_LOCK_DATA_DNS);
+  sret |= curl_share_setopt(engine->share, CURLSHOPT_SHARE,
+                            CURL_LOCK_DATA_SSL_SESSION);
+  sret |= curl_share_setopt(engine->share, CURLSHOPT_SHARE,
+                            CURL_LOCK_DATA_CONNECT);
+  if (sret != CURLSHE_OK) {
+    SET_GERROR(err, -1, "failed to set curl share options");
+    goto out_fail;
+  }
+
+  engine->ctx = g_main_context_ref_thread_default();
+  engine->sockets = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                          NULL, destroy_source);
+  g_private_set(&engine_key, engine);
+
+  return engine;
+
+out_fail:
+  free_engine(engine);
+
+  return NULL;
+}
+
+static gboolean
+request_cancelled(GCancellable *cancellable, gpointer data)
+{
+  conn_handle_t *handle = (conn_handle_t *) data;
+  GError *err = NULL;
+
+  g_set_error(&err, G_IO_ERROR, G_IO_ERROR_CANCELLED, "%s request cancelled",
+              handle->method);
+  request_complete(handle, err);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+start_request(conn_handle_t *handle, const gchar *method, const gchar *url,
+              GCancellable *cancellable, GAsyncReadyCallback callback,
+              gpointer user_data)
+{
+  GTask *task;
+  GError *err = NULL;
+  CURLcode cret;
+
+  task = g_task_new(NULL, cancellable, callback, user_data);
+  if (handle->task) {
+    g_task_return_new_error(task, error_quark(), -1,
+                            "%s request already in progress", method);
+    goto out_fail;
+  }
+
+  cret = curl_easy_setopt(handle->curl, CURLOPT_URL, url);
+  cret |= curl_easy_setopt(handle->curl, CURLOPT_PRIVATE, handle);
+  if (cret != CURLE_OK) {
+    g_task_return_new_error(task, error_quark(), -1,
+                            "could not set curl options");
+    goto out_fail;
+  }
+
+  g_string_truncate(handle->buffer, 0);
+  handle->method = method;
+  handle->task = task;
+  if (cancellable) {
+    handle->cancel_src = g_cancellable_source_new(cancellable);
+    g_source_set_callback(handle->cancel_src,
+                          G_SOURCE_FUNC(request_cancelled), handle, NULL);
+    g_source_attach(handle->cancel_src, handle->engine->ctx);
+  }
+
+  if (curl_multi_add_handle(handle->engine->multi, handle->curl) != CURLM_OK) {
+    SET_GERROR(&err, -1, "could not queue %s request", method);
+    request_complete(handle, err);
+  }
+
+  return;
+
+out_fail:
+  g_object_unref(task);
+}
+
+static void
+hedge_req_free(gpointer data)
+{
+  struct hedge_req *hr = (struct hedge_req *) data;
+
+  g_assert(!hr->timer);
+
+  g_strfreev(hr->urls);
+  g_free(hr->handles);
+  g_free(hr->started);
+  g_free(hr->latencies);
+  g_free(hr->done);
+  g_free(hr);
+}
+
+static void hedge_start_next(GTask *task);
+
+static void
+hedge_finish(GTask *task, gint winner, GError *err)
+{
+  struct hedge_req *hr = g_task_get_task_data(task);
+  guint i;
+
+  /* The abandoned requests drop their references right away */
+  g_object_ref(task);
+  hr->finished = TRUE;
+  g_clear_pointer(&hr->timer, destroy_source);
+
+  /* Abandon the requests that are still outstanding */
+  for (i = 0; i < hr->n_started; i++) {
+    if (hr->done[i]) {
+      continue;
+    }
+    hr->latencies[i] = g_get_monotonic_time() - hr->started[i];
+    if (hr->handles[i]->task) {
+      GError *lerr = NULL;
+
+      g_set_error(&lerr, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                  "hedged GET abandoned");
+      request_complete(hr->handles[i], lerr);
+    }
+  }
+
+  if (err) {
+    g_task_return_error(task, err);
+  } else {
+    g_task_return_int(task, winner);
+  }
+  g_object_unref(task);
+}
+
+static gboolean
+hedge_timeout(gpointer data)
+{
+  GTask *task = G_TASK(data);
+  struct hedge_req *hr = g_task_get_task_data(task);
+
+  g_clear_pointer(&hr->timer, g_source_unref);
+  if (hr->n_started < hr->count) {
+    hedge_start_next(task);
+  } else if (hr->give_up) {
+    GError *err = NULL;
+
+    SET_GERROR(&err, -1, "no response within %ld ms",
+               (glong) (hr->delay / 1000));
+    hedge_finish(task, -1, err);
+  }
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+hedge_leg_done(GObject *source, GAsyncResult *res, gpointer data)
+{
+  struct hedge_leg *leg = (struct hedge_leg *) data;
+  GTask *task = leg->task;
+  struct hedge_req *hr = g_task_get_task_data(task);
+  guint idx = leg->idx;
+  GError *err = NULL;
+
+  g_free(leg);
+  if (!util_http_finish(hr->handles[idx], res, &err)) {
+    if (!hr->finished) {
+      g_debug("Hedged GET %s failed: %s", hr->urls[idx], GERROR_MSG(err));
+      /* Being cancelled says nothing about the server */
+      hr->latencies[idx] = g_cancellable_is_cancelled(
+                             g_task_get_cancellable(task)) ? 0 : -1;
+      hr->done[idx] = TRUE;
+      hr->n_done++;
+    }
+    g_clear_error(&err);
+  } else if (!hr->finished) {
+    hr->latencies[idx] = g_get_monotonic_time() - hr->started[idx];
+    hr->done[idx] = TRUE;
+    hr->n_done++;
+    hedge_finish(task, idx, NULL);
+  }
+
+  if (!hr->finished) {
+    if (g_task_return_error_if_cancelled(task)) {
+      hr->finished = TRUE;
+      g_clear_pointer(&hr->timer, destroy_source);
+    } else if (hr->n_done == hr->count) {
+      SET_GERROR(&err, -1, "GET request failed on all %u handle(s)",
+                 hr->count);
+      hedge_finish(task, -1, err);
+    } else if (hr->n_started < hr->count) {
+      /* No point in waiting for the deadline after a failure */
+      hedge_start_next(task);
+    }
+  }
+
+  g_object_unref(task);
+}
+
+static void
+hedge_start_next(GTask *task)
+{
+  struct hedge_req *hr = g_task_get_task_data(task);
+  struct hedge_leg *leg;
+  guint idx = hr->n_started++;
+
+  if (idx > 0) {
+    g_debug("Hedging request to %s after %ld ms", hr->urls[idx],
+            (glong) ((g_get_monotonic_time() - hr->started[idx - 1]) / 1000));
+  }
+
+  leg = g_malloc0(sizeof(*leg));
+  leg->task = g_object_ref(task);
+  leg->idx = idx;
+  hr->started[idx] = g_get_monotonic_time();
+  util_http_get_async(hr->handles[idx], hr->urls[idx],
+                      g_task_get_cancellable(task), hedge_leg_done, leg);
+
+  g_clear_pointer(&hr->timer, destroy_source);
+  if (hr->n_started < hr->count || hr->give_up) {
+    hr->timer = g_timeout_source_new(hr->delay / 1000);
+    g_source_set_callback(hr->timer, hedge_timeout, task, NULL);
+    g_source_attach(hr->timer, hr->handles[0]->engine->ctx);
+  }
+}
 
 /**** Exposed functions begin here **************************************/
 
 conn_handle_t *
 util_init_handle(GError **err)
 {
+  struct http_engine *engine;
   conn_handle_t *handle;
   CURLcode cret;
 
+  if ((engine = engine_get(err)) == NULL) {
+    return NULL;
+  }
+
   handle = g_malloc0(sizeof(*handle));
+  handle->engine = engine;
   handle->buffer = g_string_new(NULL);
 
   if ((handle->curl = curl_easy_init()) == NULL) {
@@ -77,51 +580,184 @@ util_init_handle(GError **err)
   }
 
   cret = curl_easy_setopt(handle->curl, CURLOPT_READFUNCTION, read_callback);
+  cret |= curl_easy_setopt(handle->curl, CURLOPT_READDATA, handle);
   cret |= curl_easy_setopt(handle->curl, CURLOPT_WRITEFUNCTION, write_callback);
-  cret |= curl_easy_setopt(handle->curl, CURLOPT_WRITEDATA, handle->buffer);
+  cret |= curl_easy_setopt(handle->curl, CURLOPT_WRITEDATA, handle);
+  /* Any encoding libcurl can decode, gzip included */
+  cret |= curl_easy_setopt(handle->curl, CURLOPT_ACCEPT_ENCODING, "");
+  cret |= curl_easy_setopt(handle->curl, CURLOPT_SHARE, engine->share);
+  cret |= curl_easy_setopt(handle->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  cret |= curl_easy_setopt(handle->curl, CURLOPT_TCP_KEEPIDLE,
+                           (glong) TCP_KEEPALIVE_IDLE_SECS);
+  cret |= curl_easy_setopt(handle->curl, CURLOPT_TCP_KEEPINTVL,
+                           (glong) TCP_KEEPALIVE_INTVL_SECS);
 
   if (cret != CURLE_OK) {
     SET_GERROR(err, -1, "failed to set curl options");
     goto out_fail;
   }
 
-
   return handle;
 
 out_fail:
-  g_clear_pointer(&handle, curl_easy_cleanup);
+  /* curl_easy_cleanup() takes a NULL handle when curl_easy_init() failed */
+  util_cleanup_handle(handle);
 
-  return FALSE;
+  return NULL;
 }
 
-gboolean
-util_perform_http_get(conn_handle_t *handle, const gchar *url, GError **err)
+/* GAsyncReadyCallback keeping a reference to the result in user_data,
+ * for use with util_async_wait()
+ */
+void
+util_async_store_result(GObject *source, GAsyncResult *res,
+                        gpointer user_data)
 {
-  CURLcode cret;
-  gboolean ret;
+  GAsyncResult **resp = (GAsyncResult **) user_data;
 
-  g_return_val_if_fail(handle != NULL, FALSE);
-  g_return_val_if_fail(url != NULL, FALSE);
+  *resp = g_object_ref(res);
+}
 
-  cret = curl_easy_setopt(handle->curl, CURLOPT_URL, url);
+/*
+ * Run the thread default main context until *res is set by
+ * util_async_store_result(). This is how the blocking calls are made on
+ * top of the asynchronous ones, other sources keep being dispatched while
+ * waiting. The caller owns the returned reference.
+ */
+GAsyncResult *
+util_async_wait(GAsyncResult **res)
+{
+  GMainContext *ctx = g_main_context_ref_thread_default();
 
-  if (cret != CURLE_OK) {
-    SET_GERROR(err, -1, "could not set curl options");
-    goto out;
+  while (*res == NULL) {
+    g_main_context_iteration(ctx, TRUE);
   }
+  g_main_context_unref(ctx);
 
-  g_string_truncate(handle->buffer, 0);
+  return *res;
+}
 
-  if ((cret = curl_easy_perform(handle->curl)) != CURLE_OK) {
-    SET_GERROR(err, -1, "GET request failed: %s", curl_easy_strerror(cret));
-    return FALSE;
+void
+util_http_get_async(conn_handle_t *handle, const gchar *url,
+                    GCancellable *cancellable, GAsyncReadyCallback callback,
+                    gpointer user_data)
+{
+  g_return_if_fail(handle != NULL);
+  g_return_if_fail(url != NULL);
+
+  start_request(handle, "GET", url, cancellable, callback, user_data);
+}
+
+/* Request with a verb other than GET or PUT, data is the body if any */
+static void
+start_custom_request(conn_handle_t *handle, const gchar *method,
+                     const gchar *url, const gchar *data,
+                     GCancellable *cancellable, GAsyncReadyCallback callback,
+                     gpointer user_data)
+{
+  gsize len;
+  CURLcode cret = CURLE_OK;
+
+  if (handle->task) {
+    start_request(handle, method, url, cancellable, callback, user_data);
+    return;
+  }
+
+  if (data) {
+    len = strlen(data);
+    cret |= curl_easy_setopt(handle->curl, CURLOPT_UPLOAD, 1L);
+    cret |= curl_easy_setopt(handle->curl, CURLOPT_INFILESIZE_LARGE,
+                             (curl_off_t) len);
+    handle->upload = data;
+    handle->upload_len = len;
+    handle->upload_pos = 0;
+  }
+  if (g_strcmp0(method, "PUT") != 0) {
+    cret |= curl_easy_setopt(handle->curl, CURLOPT_CUSTOMREQUEST, method);
+    handle->custom_method = TRUE;
   }
 
-  if ((ret = check_http_code(handle, err)) == FALSE) {
-    g_prefix_error(err, "HTTP GET ");
+  if (cret != CURLE_OK) {
+    GTask *task = g_task_new(NULL, cancellable, callback, user_data);
+
+    curl_easy_setopt(handle->curl, CURLOPT_UPLOAD, 0L);
+    curl_easy_setopt(handle->curl, CURLOPT_CUSTOMREQUEST, NULL);
+    handle->upload = NULL;
+    handle->custom_method = FALSE;
+    g_task_return_new_error(task, error_quark(), -1,
+                            "failed to set curl %s options", method);
+    g_object_unref(task);
+    return;
   }
 
-out:
+  start_request(handle, method, url, cancellable, callback, user_data);
+}
+
+/*
+ * The body is sent straight from data, which must stay valid and unchanged
+ * until the request completes.
+ */
+void
+util_http_put_async(conn_handle_t *handle, const gchar *url,
+                    const gchar *data, GCancellable *cancellable,
+                    GAsyncReadyCallback callback, gpointer user_data)
+{
+  g_return_if_fail(handle != NULL);
+  g_return_if_fail(url != NULL);
+  g_return_if_fail(data != NULL);
+
+  start_custom_request(handle, "PUT", url, data, cancellable, callback,
+                       user_data);
+}
+
+/* As util_http_put_async(), data must stay valid until completion */
+void
+util_http_post_async(conn_handle_t *handle, const gchar *url,
+                     const gchar *data, GCancellable *cancellable,
+                     GAsyncReadyCallback callback, gpointer user_data)
+{
+  g_return_if_fail(handle != NULL);
+  g_return_if_fail(url != NULL);
+  g_return_if_fail(data != NULL);
+
+  start_custom_request(handle, "POST", url, data, cancellable, callback,
+                       user_data);
+}
+
+void
+util_http_delete_async(conn_handle_t *handle, const gchar *url,
+                       GCancellable *cancellable,
+                       GAsyncReadyCallback callback, gpointer user_data)
+{
+  g_return_if_fail(handle != NULL);
+  g_return_if_fail(url != NULL);
+
+  start_custom_request(handle, "DELETE", url, NULL, cancellable, callback,
+                       user_data);
+}
+
+gboolean
+util_http_finish(conn_handle_t *handle, GAsyncResult *res, GError **err)
+{
+  g_return_val_if_fail(handle != NULL, FALSE);
+  g_return_val_if_fail(g_task_is_valid(res, NULL), FALSE);
+
+  return g_task_propagate_boolean(G_TASK(res), err);
+}
+
+gboolean
+util_perform_http_get(conn_handle_t *handle, const gchar *url, GError **err)
+{
+  GAsyncResult *res = NULL;
+  gboolean ret;
+
+  g_return_val_if_fail(handle != NULL, FALSE);
+  g_return_val_if_fail(url != NULL, FALSE);
+
+  util_http_get_async(handle, url, NULL, util_async_store_result, &res);
+  ret = util_http_finish(handle, util_async_wait(&res), err);
+  g_object_unref(res);
+
   return ret;
 }
 
@@ -129,43 +765,96 @@ gboolean
 util_perform_http_put(conn_handle_t *handle, const gchar *url,
                       const gchar *data, GError **err)
 {
-  GString *gs;
-  CURLcode cret;
-  gboolean ret = FALSE;
+  GAsyncResult *res = NULL;
+  gboolean ret;
 
   g_return_val_if_fail(handle != NULL, FALSE);
   g_return_val_if_fail(url != NULL, FALSE);
   g_return_val_if_fail(data != NULL, FALSE);
 
-  gs = g_string_new(data);
+  util_http_put_async(handle, url, data, NULL, util_async_store_result, &res);
+  ret = util_http_finish(handle, util_async_wait(&res), err);
+  g_object_unref(res);
 
-  cret = curl_easy_setopt(handle->curl, CURLOPT_UPLOAD, 1L);
-  cret |= curl_easy_setopt(handle->curl, CURLOPT_PUT, 1L);
-  cret |= curl_easy_setopt(handle->curl, CURLOPT_URL, url);
-  cret |= curl_easy_setopt(handle->curl, CURLOPT_READDATA, gs);
-  cret |= curl_easy_setopt(handle->curl, CURLOPT_INFILESIZE_LARGE,
-                           (curl_off_t) gs->len);
-  if (cret != CURLE_OK) {
-    SET_GERROR(err, -1, "failed to set curl upload options");
-    goto out;
+  return ret;
+}
+
+/*
+ * Perform a GET for the same resource on several handles, starting with
+ * the first one. Whenever no request has completed within hedge_delay of
+ * the last one being started, or the last one failed, the next handle is
+ * started as well and the first successful response wins. With give_up
+ * set, the request times out hedge_delay after starting the last handle.
+ */
+void
+util_http_get_hedged_async(conn_handle_t **handles, const gchar **urls,
+                           guint count, GTimeSpan hedge_delay,
+                           gboolean give_up, GCancellable *cancellable,
+                           GAsyncReadyCallback callback, gpointer user_data)
+{
+  struct hedge_req *hr;
+  GTask *task;
+  guint i;
+
+  g_return_if_fail(handles != NULL);
+  g_return_if_fail(urls != NULL);
+  g_return_if_fail(count > 0);
+
+  hr = g_malloc0(sizeof(*hr));
+  hr->handles = g_new0(conn_handle_t *, count);
+  hr->urls = g_new0(gchar *, count + 1);
+  for (i = 0; i < count; i++) {
+    hr->handles[i] = handles[i];
+    hr->urls[i] = g_strdup(urls[i]);
   }
+  hr->count = count;
+  hr->delay = hedge_delay;
+  hr->give_up = give_up;
+  hr->started = g_new0(gint64, count);
+  hr->latencies = g_new0(GTimeSpan, count);
+  hr->done = g_new0(gboolean, count);
+
+  task = g_task_new(NULL, cancellable, callback, user_data);
+  g_task_set_task_data(task, hr, hedge_req_free);
+  hedge_start_next(task);
+  g_object_unref(task);
+}
 
-  g_string_truncate(handle->buffer, 0);
+/*
+ * Returns the index of the handle holding the response, or -1 on failure.
+ * If given, latencies receives the time each request took to complete or
+ * ran until it was abandoned, -1 for requests that failed and 0 for the
+ * ones never started.
+ */
+gint
+util_http_get_hedged_finish(GAsyncResult *res, GTimeSpan *latencies,
+                            GError **err)
+{
+  struct hedge_req *hr;
 
-  if ((cret = curl_easy_perform(handle->curl)) != CURLE_OK) {
-    SET_GERROR(err, -1, "PUT request failed: %s", curl_easy_strerror(cret));
-    goto out;
-  }
+  g_return_val_if_fail(g_task_is_valid(res, NULL), -1);
 
-  if ((ret = check_http_code(handle, err)) == FALSE) {
-    g_prefix_error(err, "HTTP PUT ");
+  hr = g_task_get_task_data(G_TASK(res));
+  if (latencies) {
+    memcpy(latencies, hr->latencies, hr->count * sizeof(*latencies));
   }
 
-  g_string_free(gs, TRUE);
+  return g_task_propagate_int(G_TASK(res), err);
+}
+
+gint
+util_perform_http_get_hedged(conn_handle_t **handles, const gchar **urls,
+                             guint count, GTimeSpan hedge_delay,
+                             gboolean give_up, GTimeSpan *latencies,
+                             GError **err)
+{
+  GAsyncResult *res = NULL;
+  gint ret;
 
-out:
-  curl_easy_setopt(handle->curl, CURLOPT_UPLOAD, 0L);
-  curl_easy_setopt(handle->curl, CURLOPT_PUT, 0L);
+  util_http_get_hedged_async(handles, urls, count, hedge_delay, give_up,
+                             NULL, util_async_store_result, &res);
+  ret = util_http_get_hedged_finish(util_async_wait(&res), latencies, err);
+  g_object_unref(res);
 
   return ret;
 }
@@ -174,12 +863,46 @@ void
 util_cleanup_handle(conn_handle_t *handle)
 {
   g_return_if_fail(handle != NULL);
+  g_return_if_fail(handle->task == NULL);
 
   curl_easy_cleanup(handle->curl);
   g_string_free(handle->buffer, TRUE);
   g_free(handle);
 }
 
+/*
+ * Hand the response body to func as it arrives instead of collecting it in
+ * the handle buffer, func returning FALSE aborts the transfer. Pass a NULL
+ * func to go back to buffering.
+ */
+void
+util_set_handle_sink(conn_handle_t *handle, util_write_func func,
+                     gpointer user_data)
+{
+  g_return_if_fail(handle != NULL);
+  g_return_if_fail(handle->task == NULL);
+
+  handle->sink = func;
+  handle->sink_data = user_data;
+}
+
+/* Counters of all requests completed so far on the calling thread, see
+ * struct util_http_stats
+ */
+void
+util_http_get_stats(struct util_http_stats *stats)
+{
+  struct http_engine *engine = g_private_get(&engine_key);
+
+  g_return_if_fail(stats != NULL);
+
+  if (engine) {
+    *stats = engine->stats;
+  } else {
+    memset(stats, 0, sizeof(*stats));
+  }
+}
+
 GString *
 util_get_handle_buffer(conn_handle_t *handle)
 {
@@ -188,16 +911,15 @@ util_get_handle_buffer(conn_handle_t *handle)
   return handle->buffer;
 }
 
+/* Format into the caller's buffer, which is returned */
 const gchar *
-util_dt_format(GDateTime *dt)
+util_dt_format(GDateTime *dt, gchar buf[UTIL_DT_STR_LEN])
 {
-  static gchar buf[64];
-
   if (!dt) {
     return "<invalid>";
   }
 
-  g_snprintf(buf, sizeof(buf), "%04d-%02d-%02d  %02d:%02d:%02d",
+  g_snprintf(buf, UTIL_DT_STR_LEN, "%04d-%02d-%02d  %02d:%02d:%02d",
              g_date_time_get_year(dt),
              g_date_time_get_month(dt),
              g_date_time_get_day_of_month(dt),
@@ -227,3 +949,14 @@ util_dt_diff_time_only(GDateTime *begin, GDateTime *end)
           (secdiff * G_TIME_SPAN_SECOND));
 }
 
+/* Make jansson use the GLib allocators, once for all threads */
+void
+util_init_json(void)
+{
+  static gsize initialised;
+
+  if (g_once_init_enter(&initialised)) {
+    json_set_alloc_funcs(g_malloc, g_free);
+    g_once_init_leave(&initialised, 1);
+  }
+}
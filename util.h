@@ -4,16 +4,68 @@
 #define UTIL_H__
 
 #include <glib.h>
+#include <gio/gio.h>
 #include <curl/curl.h>
 
+#define UTIL_DT_STR_LEN  32
+
 typedef struct conn_handle conn_handle_t;
 
+typedef gboolean (*util_write_func)(const gchar *data, gsize len,
+                                    gpointer user_data);
+
+struct util_http_stats {
+  guint requests;          /* Completed transfers */
+  guint reused;            /* Transfers done over an existing connection */
+  guint connects;          /* New connections made */
+};
+
 conn_handle_t *
 util_init_handle(GError **err);
 
 void
 util_cleanup_handle(conn_handle_t *handle);
 
+void
+util_async_store_result(GObject *source, GAsyncResult *res,
+                        gpointer user_data);
+
+GAsyncResult *
+util_async_wait(GAsyncResult **res);
+
+void
+util_http_get_async(conn_handle_t *handle, const gchar *url,
+                    GCancellable *cancellable, GAsyncReadyCallback callback,
+                    gpointer user_data);
+
+void
+util_http_put_async(conn_handle_t *handle, const gchar *url,
+                    const gchar *data, GCancellable *cancellable,
+                    GAsyncReadyCallback callback, gpointer user_data);
+
+void
+util_http_post_async(conn_handle_t *handle, const gchar *url,
+                     const gchar *data, GCancellable *cancellable,
+                     GAsyncReadyCallback callback, gpointer user_data);
+
+void
+util_http_delete_async(conn_handle_t *handle, const gchar *url,
+                       GCancellable *cancellable,
+                       GAsyncReadyCallback callback, gpointer user_data);
+
+gboolean
+util_http_finish(conn_handle_t *handle, GAsyncResult *res, GError **err);
+
+void
+util_http_get_hedged_async(conn_handle_t **handles, const gchar **urls,
+                           guint count, GTimeSpan hedge_delay,
+                           gboolean give_up, GCancellable *cancellable,
+                           GAsyncReadyCallback callback, gpointer user_data);
+
+gint
+util_http_get_hedged_finish(GAsyncResult *res, GTimeSpan *latencies,
+                            GError **err);
+
 gboolean
 util_perform_http_get(conn_handle_t *handle, const gchar *url, GError **err);
 
@@ -21,6 +73,19 @@ gboolean
 util_perform_http_put(conn_handle_t *handle, const gchar *url,
                       const gchar *data, GError **err);
 
+gint
+util_perform_http_get_hedged(conn_handle_t **handles, const gchar **urls,
+                             guint count, GTimeSpan hedge_delay,
+                             gboolean give_up, GTimeSpan *latencies,
+                             GError **err);
+
+void
+util_set_handle_sink(conn_handle_t *handle, util_write_func func,
+                     gpointer user_data);
+
+void
+util_http_get_stats(struct util_http_stats *stats);
+
 GString *
 util_get_handle_buffer(conn_handle_t *handle);
 
@@ -28,6 +93,9 @@ GTimeSpan
 util_dt_diff_time_only(GDateTime *start, GDateTime *end);
 
 const gchar *
-util_dt_format(GDateTime *dt);
+util_dt_format(GDateTime *dt, gchar buf[UTIL_DT_STR_LEN]);
+
+void
+util_init_json(void);
 
 #endif /* UTIL_H__ */
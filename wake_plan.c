@@ -0,0 +1,198 @@
+/* Event aligned wake-up planning
+ *
+ * Schedules are set to the time of their sun event on the day of an update
+ * and then drift away from it by the daily change of that event. The change
+ * is large around the equinoxes and close to zero around the solstices, so
+ * rather than polling at a fixed period the next wake-up is placed on the
+ * first day any managed event has moved by more than the accuracy budget.
+ * Wake-ups happen just after local midnight, or earlier if an event is due
+ * shortly after it.
+ */
+
+#include <math.h>
+#include <glib.h>
+
+#include "wake_plan.h"
+
+#define WAKE_AFTER_MIDNIGHT_SECS  (5 * 60)
+#define WAKE_EVENT_LEAD_SECS      (60 * 60)  /* Margin before first event */
+#define WAKE_MIN_DELAY_SECS       60
+#define MINS_PER_DAY              1440.0
+
+/* Managed event times of a day in minutes past 00:00 UTC, NAN for events
+ * not occurring on that day
+ */
+static void
+calc_event_mins(const struct wake_plan_cfg *cfg, const GDate *date,
+                gdouble mins[SUN_EVENT_COUNT])
+{
+  gint ev;
+
+  for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+    mins[ev] = NAN;
+    if (cfg->events[ev] &&
+        !solar_calc_sun_event(date, cfg->lat, cfg->lon, ev, &mins[ev])) {
+      mins[ev] = NAN;
+    }
+  }
+}
+
+/* Largest change in seconds of any managed event, G_MAXUINT if an event
+ * starts or stops occurring
+ */
+static guint
+max_drift_secs(const gdouble ref[SUN_EVENT_COUNT],
+               const gdouble mins[SUN_EVENT_COUNT])
+{
+  gdouble drift = 0.0;
+  gint ev;
+
+  for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+    if (isnan(ref[ev]) != isnan(mins[ev])) {
+      return G_MAXUINT;
+    } else if (!isnan(ref[ev])) {
+      drift = MAX(drift, fabs(remainder(mins[ev] - ref[ev], MINS_PER_DAY)));
+    }
+  }
+
+  return (guint) ceil(drift * 60.0);
+}
+
+/* Move the wake-up ahead of the earliest managed event after midnight */
+static GDateTime *
+adjust_for_events(const struct wake_plan_cfg *cfg, const GDate *date,
+                  GDateTime *midnight, GDateTime *wake)
+{
+  gdouble mins[SUN_EVENT_COUNT];
+  GDateTime *utc_day;
+  GDateTime *ret = g_date_time_ref(wake);
+  gint ev;
+
+  calc_event_mins(cfg, date, mins);
+  utc_day = g_date_time_new_utc(g_date_get_year(date),
+                                g_date_get_month(date),
+                                g_date_get_day(date), 0, 0, 0);
+
+  for (ev = 0; ev < SUN_EVENT_COUNT; ev++) {
+    GDateTime *evt;
+    GDateTime *lead;
+
+    if (isnan(mins[ev])) {
+      continue;
+    }
+
+    evt = g_date_time_add_seconds(utc_day, mins[ev] * 60.0);
+    lead = g_date_time_add_seconds(evt, -WAKE_EVENT_LEAD_SECS);
+    if (g_date_time_compare(evt, midnight) >= 0 &&
+        g_date_time_compare(lead, ret) < 0) {
+      g_date_time_unref(ret);
+      ret = g_date_time_ref(lead);
+    }
+    g_date_time_unref(lead);
+    g_date_time_unref(evt);
+  }
+  g_date_time_unref(utc_day);
+
+  return ret;
+}
+
+/*
+ * Find the next wake-up after from (in the site time zone), on the first day any of
+ * the managed events drifted by more than the accuracy budget but at most
+ * max_days away. The number of days is returned in days, if given.
+ */
+GDateTime *
+wake_plan_next(const struct wake_plan_cfg *cfg, GDateTime *from,
+               guint *days)
+{
+  gdouble ref[SUN_EVENT_COUNT];
+  gdouble mins[SUN_EVENT_COUNT];
+  GDateTime *midnight;
+  GDateTime *wake;
+  GDateTime *earliest;
+  GDateTime *site;
+  GDate date;
+  guint n;
+
+  g_return_val_if_fail(cfg != NULL, NULL);
+  g_return_val_if_fail(from != NULL, NULL);
+
+  site = cfg->tz ? g_date_time_to_timezone(from, cfg->tz) :
+                   g_date_time_to_local(from);
+  g_date_clear(&date, 1);
+  g_date_set_dmy(&date, g_date_time_get_day_of_month(site),
+                 g_date_time_get_month(site), g_date_time_get_year(site));
+  g_date_time_unref(site);
+  calc_event_mins(cfg, &date, ref);
+
+  for (n = 1; ; n++) {
+    g_date_add_days(&date, 1);
+    if (n >= MAX(cfg->max_days, 1)) {
+      break;
+    }
+
+    calc_event_mins(cfg, &date, mins);
+    if (max_drift_secs(ref, mins) > cfg->accuracy_secs) {
+      break;
+    }
+  }
+
+  midnight = cfg->tz ? g_date_time_new(cfg->tz, g_date_get_year(&date),
+                                        g_date_get_month(&date),
+                                        g_date_get_day(&date), 0, 0, 0) :
+                       g_date_time_new_local(g_date_get_year(&date),
+                                             g_date_get_month(&date),
+                                             g_date_get_day(&date), 0, 0, 0);
+  wake = g_date_time_add_seconds(midnight, WAKE_AFTER_MIDNIGHT_SECS);
+  earliest = adjust_for_events(cfg, &date, midnight, wake);
+  g_date_time_unref(wake);
+  g_date_time_unref(midnight);
+
+  /* Never plan a wake-up in the past */
+  if (g_date_time_difference(earliest, from) <
+      WAKE_MIN_DELAY_SECS * G_TIME_SPAN_SECOND) {
+    g_date_time_unref(earliest);
+    earliest = g_date_time_add_seconds(from, WAKE_MIN_DELAY_SECS);
+  }
+
+  if (days) {
+    *days = n;
+  }
+
+  return earliest;
+}
+
+/* Readable list of the next count wake-ups after from */
+gchar *
+wake_plan_timeline(const struct wake_plan_cfg *cfg, GDateTime *from,
+                   guint count)
+{
+  GString *gs;
+  GDateTime *t;
+  guint i;
+
+  g_return_val_if_fail(cfg != NULL, NULL);
+  g_return_val_if_fail(from != NULL, NULL);
+
+  gs = g_string_new(NULL);
+  t = g_date_time_ref(from);
+  for (i = 0; i < count; i++) {
+    GDateTime *next;
+    GDateTime *site;
+    gchar *str;
+    guint days;
+
+    next = wake_plan_next(cfg, t, &days);
+    site = cfg->tz ? g_date_time_to_timezone(next, cfg->tz) :
+                     g_date_time_to_local(next);
+    str = g_date_time_format(site, "%F %R %Z");
+    g_date_time_unref(site);
+    g_string_append_printf(gs, "%s%s (+%ud)", i ? ", " : "", str, days);
+    g_free(str);
+    g_date_time_unref(t);
+    t = next;
+  }
+  g_date_time_unref(t);
+
+  return g_string_free(gs, FALSE);
+}
@@ -0,0 +1,27 @@
+/* Wake-up planning from the rate of change of the sun event times */
+
+#ifndef WAKE_PLAN_H__
+#define WAKE_PLAN_H__
+
+#include <glib.h>
+
+#include "solar.h"
+
+struct wake_plan_cfg {
+  gdouble lat;
+  gdouble lon;
+  guint accuracy_secs;     /* Allowed drift of a schedule from its event */
+  guint max_days;          /* Longest time between two wake-ups */
+  gboolean events[SUN_EVENT_COUNT];   /* Events with managed schedules */
+  GTimeZone *tz;           /* Zone of the site, NULL for the host's */
+};
+
+GDateTime *
+wake_plan_next(const struct wake_plan_cfg *cfg, GDateTime *from,
+               guint *days);
+
+gchar *
+wake_plan_timeline(const struct wake_plan_cfg *cfg, GDateTime *from,
+                   guint count);
+
+#endif /* WAKE_PLAN_H__ */
@@ -0,0 +1,609 @@
+/* Minimal websocket (RFC 6455) client
+ *
+ * Just enough of the protocol for the deCONZ event stream: the upgrade
+ * handshake, text messages, possibly fragmented, and answering pings and
+ * closes. Everything runs from the main context over GIO sockets, and a
+ * dropped connection is set up again with an increasing delay. A quiet
+ * connection is pinged, and dropped if still nothing arrives, so a
+ * half-open one is noticed.
+ */
+
+#include <string.h>
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "ws_client.h"
+#include "debug.h"
+
+#define WS_GUID             "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_READ_SIZE        4096
+#define WS_MAX_HEADER       8192
+#define WS_MAX_MESSAGE      (1024 * 1024)
+#define WS_RETRY_MIN_SECS   2
+#define WS_RETRY_MAX_SECS   120
+#define WS_PING_SECS        30
+#define WS_READ_TIMEOUT_SECS 75
+
+enum ws_opcode {
+  WS_OP_CONT   = 0x0,
+  WS_OP_TEXT   = 0x1,
+  WS_OP_BINARY = 0x2,
+  WS_OP_CLOSE  = 0x8,
+  WS_OP_PING   = 0x9,
+  WS_OP_PONG   = 0xa,
+};
+
+struct ws_client {
+  gchar *host;
+  guint port;
+  gchar *path;
+  ws_message_func func;
+  gpointer user_data;
+  GSocketClient *sock_client;
+  GSocketConnection *conn;
+  GCancellable *cancellable;   /* Of the current connection */
+  gchar *accept;           /* Expected Sec-WebSocket-Accept */
+  gboolean upgraded;
+  GByteArray *in;          /* Received but not parsed yet */
+  GByteArray *msg;         /* Message being assembled from fragments */
+  gint64 read_time;        /* Completion of the last read */
+  GByteArray *rbuf;        /* Read into, lent to each read */
+  GByteArray *out;         /* Frames queued for sending */
+  gboolean writing;        /* A write is in flight */
+  guint retry_secs;
+  guint retry_src_id;
+  guint ping_src_id;
+};
+
+/* An outstanding read or write. It holds on to its buffer until GIO is
+ * done with it, the connection or even the client may be gone by then.
+ */
+struct ws_io {
+  ws_client_t *ws;
+  GByteArray *buf;
+};
+
+DEFINE_GQUARK("ws_client");
+
+static void start_read(ws_client_t *ws);
+static void start_connect(ws_client_t *ws);
+
+/* Sec-WebSocket-Accept value for a Sec-WebSocket-Key */
+static gchar *
+build_accept(const gchar *key)
+{
+  GChecksum *sum = g_checksum_new(G_CHECKSUM_SHA1);
+  guint8 digest[20];
+  gsize len = sizeof(digest);
+
+  g_checksum_update(sum, (const guchar *) key, -1);
+  g_checksum_update(sum, (const guchar *) WS_GUID, -1);
+  g_checksum_get_digest(sum, digest, &len);
+  g_checksum_free(sum);
+
+  return g_base64_encode(digest, len);
+}
+
+/* Frame header, len bytes of payload follow (after the mask key if any) */
+static void
+append_frame_header(GByteArray *out, guint op, guint64 len, gboolean masked)
+{
+  guint8 hdr[10];
+  gsize hlen = 2;
+  gint i;
+
+  hdr[0] = 0x80 | op;
+  if (len < 126) {
+    hdr[1] = len;
+  } else if (len <= G_MAXUINT16) {
+    hdr[1] = 126;
+    hdr[2] = len >> 8;
+    hdr[3] = len & 0xff;
+    hlen = 4;
+  } else {
+    hdr[1] = 127;
+    for (i = 0; i < 8; i++) {
+      hdr[2 + i] = (len >> (56 - 8 * i)) & 0xff;
+    }
+    hlen = 10;
+  }
+  if (masked) {
+    hdr[1] |= 0x80;
+  }
+  g_byte_array_append(out, hdr, hlen);
+}
+
+static struct ws_io *
+new_ws_io(ws_client_t *ws, GByteArray *buf)
+{
+  struct ws_io *io = g_new(struct ws_io, 1);
+
+  io->ws = ws;
+  io->buf = buf;
+
+  return io;
+}
+
+static void
+free_ws_io(struct ws_io *io)
+{
+  g_byte_array_unref(io->buf);
+  g_free(io);
+}
+
+static GByteArray *
+new_read_buffer(void)
+{
+  return g_byte_array_set_size(g_byte_array_sized_new(WS_READ_SIZE),
+                               WS_READ_SIZE);
+}
+
+static void
+reset_connection(ws_client_t *ws)
+{
+  if (ws->cancellable) {
+    g_cancellable_cancel(ws->cancellable);
+    g_clear_object(&ws->cancellable);
+  }
+  if (ws->conn) {
+    g_io_stream_close(G_IO_STREAM(ws->conn), NULL, NULL);
+    g_clear_object(&ws->conn);
+  }
+  if (ws->ping_src_id) {
+    g_source_remove(ws->ping_src_id);
+    ws->ping_src_id = 0;
+  }
+  g_clear_pointer(&ws->accept, g_free);
+
+  /* A cancelled read may still hold the old buffer */
+  g_byte_array_unref(ws->rbuf);
+  ws->rbuf = new_read_buffer();
+  ws->writing = FALSE;
+  g_byte_array_set_size(ws->in, 0);
+  g_byte_array_set_size(ws->msg, 0);
+  g_byte_array_set_size(ws->out, 0);
+  ws->upgraded = FALSE;
+}
+
+static gboolean
+handle_retry_timeout(gpointer data)
+{
+  ws_client_t *ws = (ws_client_t *) data;
+
+  ws->retry_src_id = 0;
+  start_connect(ws);
+
+  return FALSE;
+}
+
+/* Drop the connection and try again later, the delay doubles every time
+ * until a connection is upgraded
+ */
+static void
+connection_failed(ws_client_t *ws, GError *err)
+{
+  if (ws->retry_src_id) {
+    /* Both directions failed, the retry is already armed */
+    g_clear_error(&err);
+    return;
+  }
+
+  g_warning("Websocket %s:%u: %s, reconnecting in %u seconds", ws->host,
+            ws->port, GERROR_MSG(err), ws->retry_secs);
+  g_clear_error(&err);
+  reset_connection(ws);
+
+  ws->retry_src_id = g_timeout_add_seconds(ws->retry_secs,
+                                           handle_retry_timeout, ws);
+  ws->retry_secs = MIN(ws->retry_secs * 2, WS_RETRY_MAX_SECS);
+}
+
+static void start_write(ws_client_t *ws);
+
+static void
+write_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  struct ws_io *io = (struct ws_io *) user_data;
+  ws_client_t *ws = io->ws;
+  GError *err = NULL;
+
+  /* Frees the frames just sent, the client itself is only touched if the
+   * write was not cancelled
+   */
+  if (!g_output_stream_write_all_finish(G_OUTPUT_STREAM(source), res, NULL,
+                                        &err)) {
+    free_ws_io(io);
+    if (!g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+      connection_failed(ws, err);
+    } else {
+      g_clear_error(&err);
+    }
+    return;
+  }
+  free_ws_io(io);
+
+  ws->writing = FALSE;
+  start_write(ws);
+}
+
+static void
+start_write(ws_client_t *ws)
+{
+  GOutputStream *os;
+  struct ws_io *io;
+
+  if (ws->writing || ws->out->len == 0) {
+    return;
+  }
+
+  io = new_ws_io(ws, ws->out);
+  ws->out = g_byte_array_new();
+  ws->writing = TRUE;
+  os = g_io_stream_get_output_stream(G_IO_STREAM(ws->conn));
+  g_output_stream_write_all_async(os, io->buf->data, io->buf->len,
+                                  G_PRIORITY_DEFAULT, ws->cancellable,
+                                  write_done, io);
+}
+
+/* Client frames are always masked */
+static void
+send_frame(ws_client_t *ws, guint op, const guint8 *data, gsize len)
+{
+  guint32 key = g_random_int();
+  guint8 mask[4];
+  gsize pos;
+  gsize i;
+
+  memcpy(mask, &key, sizeof(mask));
+  append_frame_header(ws->out, op, len, TRUE);
+  g_byte_array_append(ws->out, mask, sizeof(mask));
+  pos = ws->out->len;
+  g_byte_array_append(ws->out, data, len);
+  for (i = 0; i < len; i++) {
+    ws->out->data[pos + i] ^= mask[i % 4];
+  }
+
+  start_write(ws);
+}
+
+static gboolean
+handle_frame(ws_client_t *ws, gboolean fin, guint op, const guint8 *data,
+             gsize len, GError **err)
+{
+  switch (op) {
+  case WS_OP_TEXT:
+  case WS_OP_BINARY:
+    g_byte_array_set_size(ws->msg, 0);
+    /* fall through */
+  case WS_OP_CONT:
+    if (ws->msg->len + len > WS_MAX_MESSAGE) {
+      SET_GERROR(err, -1, "message larger than %u bytes", WS_MAX_MESSAGE);
+      return FALSE;
+    }
+    g_byte_array_append(ws->msg, data, len);
+    if (fin) {
+      gsize mlen = ws->msg->len;
+
+      g_byte_array_append(ws->msg, (const guint8 *) "", 1);
+      ws->func((const gchar *) ws->msg->data, mlen, ws->read_time,
+               ws->user_data);
+      g_byte_array_set_size(ws->msg, 0);
+    }
+    return TRUE;
+  case WS_OP_PING:
+    send_frame(ws, WS_OP_PONG, data, len);
+    return TRUE;
+  case WS_OP_PONG:
+    return TRUE;
+  case WS_OP_CLOSE:
+    SET_GERROR(err, -1, "closed by the server");
+    return FALSE;
+  default:
+    SET_GERROR(err, -1, "unknown opcode 0x%x", op);
+    return FALSE;
+  }
+}
+
+/* Handle all complete frames received so far */
+static gboolean
+parse_frames(ws_client_t *ws, GError **err)
+{
+  while (ws->in->len >= 2) {
+    guint8 *p = ws->in->data;
+    gboolean fin = (p[0] & 0x80) != 0;
+    guint op = p[0] & 0x0f;
+    gboolean masked = (p[1] & 0x80) != 0;
+    guint64 len = p[1] & 0x7f;
+    gsize hlen = 2;
+    gsize i;
+
+    if (len == 126) {
+      if (ws->in->len < 4) {
+        break;
+      }
+      len = (p[2] << 8) | p[3];
+      hlen = 4;
+    } else if (len == 127) {
+      if (ws->in->len < 10) {
+        break;
+      }
+      for (len = 0, i = 0; i < 8; i++) {
+        len = (len << 8) | p[2 + i];
+      }
+      hlen = 10;
+    }
+
+    if (len > WS_MAX_MESSAGE) {
+      SET_GERROR(err, -1, "frame larger than %u bytes", WS_MAX_MESSAGE);
+      return FALSE;
+    } else if (ws->in->len < hlen + (masked ? 4 : 0) + len) {
+      break;
+    }
+
+    /* Servers do not mask, but it costs little to accept it */
+    if (masked) {
+      guint8 *mask = p + hlen;
+
+      hlen += 4;
+      for (i = 0; i < len; i++) {
+        p[hlen + i] ^= mask[i % 4];
+      }
+    }
+
+    if (!handle_frame(ws, fin, op, p + hlen, len, err)) {
+      return FALSE;
+    }
+    g_byte_array_remove_range(ws->in, 0, hlen + len);
+  }
+
+  return TRUE;
+}
+
+/* The upgrade response, any bytes after it are frames already */
+static gboolean
+parse_upgrade(ws_client_t *ws, GError **err)
+{
+  const gchar *hdrs = (const gchar *) ws->in->data;
+  const gchar *end;
+  gchar *resp;
+  gchar **lines;
+  gboolean accepted = FALSE;
+  gsize hlen;
+  gsize nlen;
+  gint i;
+
+  end = g_strstr_len(hdrs, ws->in->len, "\r\n\r\n");
+  if (!end) {
+    if (ws->in->len > WS_MAX_HEADER) {
+      SET_GERROR(err, -1, "upgrade response too long");
+      return FALSE;
+    }
+    return TRUE;
+  }
+
+  hlen = end - hdrs + 4;
+  resp = g_strndup(hdrs, end - hdrs);
+  lines = g_strsplit(resp, "\r\n", -1);
+  g_free(resp);
+
+  if (!g_str_has_prefix(lines[0], "HTTP/1.1 101")) {
+    SET_GERROR(err, -1, "upgrade refused (%s)", lines[0]);
+    g_strfreev(lines);
+    return FALSE;
+  }
+
+  for (i = 1; lines[i]; i++) {
+    gchar *colon = strchr(lines[i], ':');
+
+    if (!colon) {
+      continue;
+    }
+    nlen = colon - lines[i];
+    if (nlen == strlen("Sec-WebSocket-Accept") &&
+        g_ascii_strncasecmp(lines[i], "Sec-WebSocket-Accept", nlen) == 0) {
+      accepted = g_strcmp0(g_strstrip(colon + 1), ws->accept) == 0;
+    }
+  }
+  g_strfreev(lines);
+
+  if (!accepted) {
+    SET_GERROR(err, -1, "invalid Sec-WebSocket-Accept");
+    return FALSE;
+  }
+
+  g_byte_array_remove_range(ws->in, 0, hlen);
+  ws->upgraded = TRUE;
+  ws->retry_secs = WS_RETRY_MIN_SECS;
+  g_message("Websocket connected to %s:%u%s", ws->host, ws->port, ws->path);
+
+  return TRUE;
+}
+
+static void
+read_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  struct ws_io *io = (struct ws_io *) user_data;
+  ws_client_t *ws = io->ws;
+  GError *err = NULL;
+  gssize n;
+
+  /* As for writes, the client is only touched if not cancelled */
+  n = g_input_stream_read_finish(G_INPUT_STREAM(source), res, &err);
+  if (n < 0 && g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+    free_ws_io(io);
+    g_clear_error(&err);
+    return;
+  } else if (n <= 0) {
+    free_ws_io(io);
+    if (!err) {
+      SET_GERROR(&err, -1, "connection closed");
+    }
+    connection_failed(ws, err);
+    return;
+  }
+
+  ws->read_time = g_get_monotonic_time();
+  g_byte_array_append(ws->in, io->buf->data, n);
+  free_ws_io(io);
+  if ((!ws->upgraded && !parse_upgrade(ws, &err)) ||
+      (ws->upgraded && !parse_frames(ws, &err))) {
+    connection_failed(ws, err);
+    return;
+  }
+
+  start_read(ws);
+}
+
+static void
+start_read(ws_client_t *ws)
+{
+  GInputStream *is = g_io_stream_get_input_stream(G_IO_STREAM(ws->conn));
+  struct ws_io *io = new_ws_io(ws, g_byte_array_ref(ws->rbuf));
+
+  g_input_stream_read_async(is, io->buf->data, io->buf->len,
+                            G_PRIORITY_DEFAULT, ws->cancellable, read_done,
+                            io);
+}
+
+/* Pongs count as data too, so only a dead connection stays quiet */
+static gboolean
+handle_ping_timeout(gpointer data)
+{
+  ws_client_t *ws = (ws_client_t *) data;
+  gint64 idle = g_get_monotonic_time() - ws->read_time;
+  GError *err = NULL;
+
+  if (idle >= WS_READ_TIMEOUT_SECS * G_TIME_SPAN_SECOND) {
+    ws->ping_src_id = 0;
+    SET_GERROR(&err, -1, "nothing received for %d seconds",
+               WS_READ_TIMEOUT_SECS);
+    connection_failed(ws, err);
+    return FALSE;
+  }
+  if (ws->upgraded && idle >= WS_PING_SECS * G_TIME_SPAN_SECOND) {
+    send_frame(ws, WS_OP_PING, NULL, 0);
+  }
+
+  return TRUE;
+}
+
+static void
+connect_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  ws_client_t *ws = (ws_client_t *) user_data;
+  GSocketConnection *conn;
+  GError *err = NULL;
+  guint8 nonce[16];
+  gchar *key;
+  gchar *req;
+  gint i;
+
+  conn = g_socket_client_connect_to_host_finish(G_SOCKET_CLIENT(source), res,
+                                                &err);
+  if (!conn) {
+    if (!g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+      connection_failed(ws, err);
+    } else {
+      g_clear_error(&err);
+    }
+    return;
+  }
+  ws->conn = conn;
+  g_socket_set_keepalive(g_socket_connection_get_socket(conn), TRUE);
+  ws->read_time = g_get_monotonic_time();
+  ws->ping_src_id = g_timeout_add_seconds(WS_PING_SECS, handle_ping_timeout,
+                                          ws);
+
+  for (i = 0; i < (gint) sizeof(nonce); i++) {
+    nonce[i] = g_random_int_range(0, 256);
+  }
+  key = g_base64_encode(nonce, sizeof(nonce));
+  ws->accept = build_accept(key);
+
+  req = g_strdup_printf("GET %s HTTP/1.1\r\n"
+                        "Host: %s:%u\r\n"
+                        "Upgrade: websocket\r\n"
+                        "Connection: Upgrade\r\n"
+                        "Sec-WebSocket-Key: %s\r\n"
+                        "Sec-WebSocket-Version: 13\r\n\r\n",
+                        ws->path, ws->host, ws->port, key);
+  g_byte_array_append(ws->out, (const guint8 *) req, strlen(req));
+  g_free(req);
+  g_free(key);
+
+  start_write(ws);
+  start_read(ws);
+}
+
+static void
+start_connect(ws_client_t *ws)
+{
+  g_debug("Connecting websocket to %s:%u", ws->host, ws->port);
+  ws->cancellable = g_cancellable_new();
+  g_socket_client_connect_to_host_async(ws->sock_client, ws->host, ws->port,
+                                        ws->cancellable, connect_done, ws);
+}
+
+/**** Exposed functions begin here **************************************/
+
+ws_client_t *
+ws_client_new(const gchar *host, guint port, const gchar *path,
+              ws_message_func func, gpointer user_data)
+{
+  ws_client_t *ws;
+
+  g_return_val_if_fail(host != NULL, NULL);
+  g_return_val_if_fail(func != NULL, NULL);
+
+  ws = g_malloc0(sizeof(*ws));
+  ws->host = g_strdup(host);
+  ws->port = port;
+  ws->path = g_strdup(path ? path : "/");
+  ws->func = func;
+  ws->user_data = user_data;
+  ws->sock_client = g_socket_client_new();
+  ws->in = g_byte_array_new();
+  ws->rbuf = new_read_buffer();
+  ws->msg = g_byte_array_new();
+  ws->out = g_byte_array_new();
+  ws->retry_secs = WS_RETRY_MIN_SECS;
+
+  return ws;
+}
+
+void
+ws_client_start(ws_client_t *ws)
+{
+  g_return_if_fail(ws != NULL);
+  g_return_if_fail(ws->cancellable == NULL && ws->retry_src_id == 0);
+
+  start_connect(ws);
+}
+
+/* Pending operations are cancelled and never touch the client again */
+void
+ws_client_free(ws_client_t *ws)
+{
+  if (!ws) {
+    return;
+  }
+
+  if (ws->retry_src_id) {
+    g_source_remove(ws->retry_src_id);
+  }
+  reset_connection(ws);
+  g_object_unref(ws->sock_client);
+  g_byte_array_unref(ws->in);
+  g_byte_array_unref(ws->rbuf);
+  g_byte_array_unref(ws->msg);
+  g_byte_array_unref(ws->out);
+  g_free(ws->host);
+  g_free(ws->path);
+  g_free(ws);
+}
+
+gboolean
+ws_client_connected(ws_client_t *ws)
+{
+  return ws && ws->upgraded;
+}
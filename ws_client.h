@@ -0,0 +1,30 @@
+/* Minimal websocket client for the gateway event stream */
+
+#ifndef WS_CLIENT_H__
+#define WS_CLIENT_H__
+
+#include <glib.h>
+#include <gio/gio.h>
+
+typedef struct ws_client ws_client_t;
+
+/* Complete message, recv_time is the monotonic time (usecs) the read
+ * holding its last frame completed. data is NUL terminated.
+ */
+typedef void (*ws_message_func)(const gchar *data, gsize len,
+                                gint64 recv_time, gpointer user_data);
+
+ws_client_t *
+ws_client_new(const gchar *host, guint port, const gchar *path,
+              ws_message_func func, gpointer user_data);
+
+void
+ws_client_start(ws_client_t *ws);
+
+void
+ws_client_free(ws_client_t *ws);
+
+gboolean
+ws_client_connected(ws_client_t *ws);
+
+#endif /* WS_CLIENT_H__ */